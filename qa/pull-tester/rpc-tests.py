@@ -75,6 +75,7 @@ BASE_SCRIPTS= [
     'wallet_treestate.py',
     'listtransactions.py',
     'mempool_resurrect_test.py',
+    'mempool_persist.py',
     'txn_doublespend.py',
     'txn_doublespend.py --mineblock',
     'getchaintips.py',
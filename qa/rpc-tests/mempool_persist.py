@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# Copyright (c) 2021 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#
+# Test that the mempool is written to mempool.dat at shutdown and loaded
+# again at startup, unless -persistmempool=0 is given.
+#
+# node0 creates the transactions, so that its wallet would put them back in
+# its mempool anyway. node1 only learns them from node0, and is restarted
+# without connecting to node0, so its mempool can only come from disk.
+#
+# The mempool also holds an explicit chain of transactions, each spending the
+# one before it, which is only reloaded if parents are written before their
+# children.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, start_node, stop_node, \
+    connect_nodes_bi
+
+from decimal import Decimal
+import time
+
+CHAIN_LENGTH = 10
+
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.num_nodes = 2
+        self.setup_clean_chain = False
+
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir))
+        self.nodes.append(start_node(1, self.options.tmpdir))
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def wait_for_mempool_size(self, node, size, timeout=30):
+        for _ in range(timeout * 10):
+            if len(node.getrawmempool()) == size:
+                return
+            time.sleep(0.1)
+        assert_equal(len(node.getrawmempool()), size)
+
+    def restart_node1(self, extra_args=None):
+        stop_node(self.nodes[1], 1)
+        self.nodes[1] = start_node(1, self.options.tmpdir, extra_args)
+
+    def create_chain(self, address, length):
+        node = self.nodes[0]
+        txid = node.sendtoaddress(address, 1)
+        tx = node.getrawtransaction(txid, 1)
+        vout = [o["n"] for o in tx["vout"] if o["value"] == Decimal("1")][0]
+        amount = Decimal("1")
+        txids = [txid]
+        for _ in range(length - 1):
+            amount -= Decimal("0.0001")
+            rawtx = node.createrawtransaction([{"txid": txid, "vout": vout}], {address: amount})
+            signresult = node.signrawtransaction(rawtx)
+            assert_equal(signresult["complete"], True)
+            txid = node.sendrawtransaction(signresult["hex"])
+            vout = 0
+            txids.append(txid)
+        return txids
+
+    def run_test(self):
+        address = self.nodes[0].getnewaddress()
+        txids = [self.nodes[0].sendtoaddress(address, 1) for _ in range(5)]
+        txids += self.create_chain(address, CHAIN_LENGTH)
+        self.sync_all()
+        assert_equal(set(self.nodes[1].getrawmempool()), set(txids))
+
+        print("Restart both nodes, node1 loads its mempool from disk")
+        for i in range(2):
+            stop_node(self.nodes[i], i)
+        self.nodes = [start_node(i, self.options.tmpdir) for i in range(2)]
+        self.wait_for_mempool_size(self.nodes[1], len(txids))
+        assert_equal(set(self.nodes[1].getrawmempool()), set(txids))
+
+        print("Restart node1 with -persistmempool=0, its mempool stays empty")
+        self.restart_node1(["-persistmempool=0"])
+        time.sleep(2)
+        assert_equal(len(self.nodes[1].getrawmempool()), 0)
+
+        print("Restart node1 again, mempool.dat was not overwritten")
+        self.restart_node1()
+        self.wait_for_mempool_size(self.nodes[1], len(txids))
+        assert_equal(set(self.nodes[1].getrawmempool()), set(txids))
+
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
@@ -4,6 +4,7 @@
 
 #include "bench.h"
 
+#include "crypto/blake2b.h"
 #include "crypto/sha256.h"
 #include "fs.h"
 #include "key.h"
@@ -18,6 +19,7 @@ int
 main(int argc, char** argv)
 {
     SHA256AutoDetect();
+    BLAKE2bAutoDetect();
     ECC_Start();
     auto globalVerifyHandle = new ECCVerifyHandle();
     SetupEnvironment();
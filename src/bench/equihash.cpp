@@ -0,0 +1,50 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "bench.h"
+#include "chainparams.h"
+#include "crypto/equihash.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "version.h"
+
+#include <cassert>
+
+// Both benchmarks check the Equihash<192,7> solution of the mainnet genesis
+// block, as CheckEquihashSolution does for every header.
+
+static CDataStream GenesisEquihashInput(const CBlock& genesis)
+{
+    CEquihashInput I{genesis};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I << genesis.nNonce;
+    return ss;
+}
+
+static void EquihashValidateLegacy(benchmark::State& state)
+{
+    const CBlock& genesis = Params(CBaseChainParams::MAIN).GenesisBlock();
+    CDataStream ss = GenesisEquihashInput(genesis);
+    while (state.KeepRunning()) {
+        eh_HashState eh_state;
+        Eh192_7.InitialiseStatePers(eh_state, "ZERO_PoW");
+        eh_state.Update((unsigned char*)&ss[0], ss.size());
+        bool isValid = Eh192_7.IsValidSolution(eh_state, genesis.nSolution);
+        assert(isValid);
+    }
+}
+
+static void EquihashValidateNative(benchmark::State& state)
+{
+    const CBlock& genesis = Params(CBaseChainParams::MAIN).GenesisBlock();
+    CDataStream ss = GenesisEquihashInput(genesis);
+    while (state.KeepRunning()) {
+        bool isValid = EquihashValidator<192,7>::IsValidSolution(
+            "ZERO_PoW", (unsigned char*)&ss[0], ss.size(), genesis.nSolution);
+        assert(isValid);
+    }
+}
+
+BENCHMARK(EquihashValidateLegacy);
+BENCHMARK(EquihashValidateNative);
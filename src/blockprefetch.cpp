@@ -0,0 +1,153 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "blockprefetch.h"
+
+#include "chain.h"
+#include "clientversion.h"
+#include "main.h"
+#include "util.h"
+
+#include <algorithm>
+
+CBlockPrefetcher::CBlockPrefetcher(const Consensus::Params& consensusParamsIn, size_t nWindowIn, unsigned int nThreads, NextFunc fnNextIn) :
+    consensusParams(consensusParamsIn), nWindow(std::max<size_t>(nWindowIn, 1)), fnNext(fnNextIn)
+{
+    for (unsigned int i = 0; i < std::max(nThreads, 1U); i++) {
+        threads.emplace_back([this] { ThreadRead(); });
+    }
+}
+
+CBlockPrefetcher::~CBlockPrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fShutdown = true;
+        condWork.notify_all();
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    LogPrint("bench", "Block prefetch: %u hits, %u misses\n", nHits, nMisses);
+}
+
+void CBlockPrefetcher::Schedule(const CBlockIndex* pindex)
+{
+    if (!pindex) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(std::make_shared<Entry>(pindex));
+    pindexLastScheduled = pindex;
+    condWork.notify_one();
+}
+
+void CBlockPrefetcher::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.clear();
+    pindexLastScheduled = nullptr;
+}
+
+std::shared_ptr<const CBlock> CBlockPrefetcher::Get(const CBlockIndex* pindex)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto it = std::find_if(queue.begin(), queue.end(), [pindex](const std::shared_ptr<Entry>& entry) { return entry->pindex == pindex; });
+
+    if (fnNext) {
+        // The consumer left the schedule (or this is the first request):
+        // restart the read-ahead from the requested block.
+        if (it == queue.end()) {
+            queue.clear();
+            queue.push_back(std::make_shared<Entry>(pindex));
+            pindexLastScheduled = pindex;
+            it = queue.begin();
+        }
+        // Slide the window forward
+        size_t nPos = it - queue.begin();
+        while (pindexLastScheduled && queue.size() - nPos < nWindow) {
+            const CBlockIndex* pindexNext = fnNext(pindexLastScheduled);
+            if (!pindexNext) {
+                break;
+            }
+            queue.push_back(std::make_shared<Entry>(pindexNext));
+            pindexLastScheduled = pindexNext;
+        }
+        it = queue.begin() + nPos;
+        condWork.notify_all();
+    }
+
+    if (it == queue.end()) {
+        lock.unlock();
+        nMisses++;
+        return ReadBlock(pindex, pindex->GetBlockPos());
+    }
+
+    // The consumer has moved past any block scheduled before this one
+    queue.erase(queue.begin(), it);
+    std::shared_ptr<Entry> entry = queue.front();
+    queue.pop_front();
+    condWork.notify_all();
+
+    if (entry->fDone) {
+        nHits++;
+    } else {
+        nMisses++;
+        if (!entry->fStarted) {
+            entry->fStarted = true;
+            lock.unlock();
+            return ReadBlock(pindex, entry->pos);
+        }
+        condDone.wait(lock, [&entry] { return entry->fDone; });
+    }
+    return std::move(entry->pblock);
+}
+
+std::shared_ptr<const CBlock> CBlockPrefetcher::ReadBlock(const CBlockIndex* pindex, const CDiskBlockPos& pos)
+{
+    auto pblock = std::make_shared<CBlock>();
+    if (!ReadBlockFromDisk(*pblock, pos, consensusParams)) {
+        return nullptr;
+    }
+    if (pblock->GetHash() != pindex->GetBlockHash()) {
+        error("CBlockPrefetcher: GetHash() doesn't match index for %s at %s", pindex->ToString(), pos.ToString());
+        return nullptr;
+    }
+    return pblock;
+}
+
+void CBlockPrefetcher::ThreadRead()
+{
+    RenameThread(strprintf("%s-prefetch", COIN_NICKNAME).c_str());
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        std::shared_ptr<Entry> entry;
+        condWork.wait(lock, [this, &entry] {
+            if (fShutdown) {
+                return true;
+            }
+            // Only read within the window ahead of the consumer
+            for (size_t i = 0; i < queue.size() && i < nWindow; i++) {
+                if (!queue[i]->fStarted) {
+                    entry = queue[i];
+                    return true;
+                }
+            }
+            return false;
+        });
+        if (fShutdown) {
+            return;
+        }
+
+        entry->fStarted = true;
+        lock.unlock();
+        std::shared_ptr<const CBlock> pblock = ReadBlock(entry->pindex, entry->pos);
+        lock.lock();
+        entry->pblock = std::move(pblock);
+        entry->fDone = true;
+        condDone.notify_all();
+    }
+}
@@ -0,0 +1,105 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_BLOCKPREFETCH_H
+#define BITCOIN_BLOCKPREFETCH_H
+
+#include "chain.h"
+#include "primitives/block.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Consensus {
+struct Params;
+};
+
+/**
+ * Reads blocks from disk ahead of a consumer that reads them in a known
+ * order, such as a rescan or a walk along the active chain.
+ *
+ * The consumer schedules the blocks it is going to need, in order, and then
+ * takes them with Get(). Worker threads keep up to nWindow blocks decoded
+ * ahead of the consumer, and slide forward as blocks are taken. Blocks are
+ * handed out as shared pointers and are never copied.
+ *
+ * If fnNext is set, Get() extends the schedule by itself, following fnNext
+ * from the last scheduled block. fnNext is only ever called on the
+ * consumer's thread, from Schedule() and Get(), so it may rely on locks held
+ * by the consumer (e.g. cs_main for chainActive.Next).
+ */
+class CBlockPrefetcher
+{
+public:
+    typedef std::function<const CBlockIndex*(const CBlockIndex*)> NextFunc;
+
+    CBlockPrefetcher(const Consensus::Params& consensusParams, size_t nWindow, unsigned int nThreads, NextFunc fnNext = nullptr);
+    ~CBlockPrefetcher();
+
+    CBlockPrefetcher(const CBlockPrefetcher&) = delete;
+    CBlockPrefetcher& operator=(const CBlockPrefetcher&) = delete;
+
+    /**
+     * Appends a block to the read-ahead schedule. The position of the block
+     * on disk is taken here, so that the workers do not need cs_main.
+     */
+    void Schedule(const CBlockIndex* pindex);
+
+    /** Drops every scheduled and prefetched block. */
+    void Clear();
+
+    /**
+     * Returns the block for pindex, or nullptr if it cannot be read. Blocks
+     * scheduled before pindex are dropped. A block that was not scheduled
+     * is read synchronously.
+     */
+    std::shared_ptr<const CBlock> Get(const CBlockIndex* pindex);
+
+    /** Number of blocks that had already been read when they were requested. */
+    uint64_t GetHits() const { return nHits; }
+    /** Number of blocks that were still being read, or were not scheduled, when they were requested. */
+    uint64_t GetMisses() const { return nMisses; }
+
+private:
+    struct Entry
+    {
+        const CBlockIndex* pindex;
+        CDiskBlockPos pos;
+        bool fStarted = false;
+        bool fDone = false;
+        std::shared_ptr<const CBlock> pblock;
+
+        explicit Entry(const CBlockIndex* pindexIn) : pindex(pindexIn), pos(pindexIn->GetBlockPos()) {}
+    };
+
+    const Consensus::Params& consensusParams;
+    const size_t nWindow;
+    const NextFunc fnNext;
+
+    std::mutex mutex;
+    //! Signalled when there is work for the workers, or when shutting down
+    std::condition_variable condWork;
+    //! Signalled when a block has been read
+    std::condition_variable condDone;
+    //! Scheduled blocks, in the order they will be requested
+    std::deque<std::shared_ptr<Entry>> queue;
+    const CBlockIndex* pindexLastScheduled = nullptr;
+    bool fShutdown = false;
+
+    std::atomic<uint64_t> nHits{0};
+    std::atomic<uint64_t> nMisses{0};
+
+    std::vector<std::thread> threads;
+
+    void ThreadRead();
+    std::shared_ptr<const CBlock> ReadBlock(const CBlockIndex* pindex, const CDiskBlockPos& pos);
+};
+
+#endif // BITCOIN_BLOCKPREFETCH_H
@@ -4,6 +4,8 @@
 // file COPYING or https://www.opensource.org/licenses/mit-license.php .
 
 #include "chain.h"
+#include "main.h"
+#include "txdb.h"
 
 /**
  * CChain implementation
@@ -106,3 +108,37 @@ void CBlockIndex::BuildSkip()
     if (pprev)
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
+
+CBlockHeader CBlockIndex::GetBlockHeader() const
+{
+    AssertLockHeld(cs_main);
+
+    CBlockHeader block;
+    block.nVersion       = nVersion;
+    if (pprev)
+        block.hashPrevBlock = pprev->GetBlockHash();
+    block.hashMerkleRoot = hashMerkleRoot;
+    block.hashLightClientRoot = hashLightClientRoot;
+    block.nTime          = nTime;
+    block.nBits          = nBits;
+    block.nNonce         = nNonce;
+    if (HasSolution()) {
+        block.nSolution  = nSolution;
+    } else {
+        CDiskBlockIndex dbindex;
+        if (!pblocktree->ReadDiskBlockIndex(GetBlockHash(), dbindex)) {
+            LogPrintf("%s: failed to read index entry of block %s\n", __func__, GetBlockHash().ToString());
+            throw std::runtime_error("Failed to read block index entry");
+        }
+        block.nSolution  = dbindex.GetSolution();
+    }
+    return block;
+}
+
+void CBlockIndex::TrimSolution()
+{
+    AssertLockHeld(cs_main);
+
+    // Swap rather than clear, so that the allocation is released
+    std::vector<unsigned char>().swap(nSolution);
+}
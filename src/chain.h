@@ -12,6 +12,7 @@
 #include "tinyformat.h"
 #include "uint256.h"
 
+#include <functional>
 #include <optional>
 #include <vector>
 
@@ -278,8 +279,14 @@ public:
     unsigned int nTime;
     unsigned int nBits;
     uint256 nNonce;
+
+protected:
+    //! The Equihash solution, if it is held in memory. It is trimmed once the
+    //! block index entry has been written to the block tree database, and is
+    //! read back from there by GetBlockHeader() when it is needed.
     std::vector<unsigned char> nSolution;
 
+public:
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
@@ -350,21 +357,22 @@ public:
         return ret;
     }
 
-    CBlockHeader GetBlockHeader() const
+    //! Get the block header for this block index, reading the Equihash
+    //! solution from the block tree database if it has been trimmed.
+    //! Requires cs_main. Throws std::runtime_error if the entry can't be read.
+    CBlockHeader GetBlockHeader() const;
+
+    //! Check whether the Equihash solution is held in memory.
+    bool HasSolution() const
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        if (pprev)
-            block.hashPrevBlock = pprev->GetBlockHash();
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.hashLightClientRoot = hashLightClientRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        block.nSolution      = nSolution;
-        return block;
+        return !nSolution.empty();
     }
 
+    //! Release the Equihash solution from memory. Must only be called once
+    //! the block index entry has been written to the block tree database.
+    //! Requires cs_main.
+    void TrimSolution();
+
     uint256 GetBlockHash() const
     {
         return *phashBlock;
@@ -446,8 +454,13 @@ public:
         hashPrev = uint256();
     }
 
-    explicit CDiskBlockIndex(const CBlockIndex* pindex) : CBlockIndex(*pindex) {
+    //! getSolution is called to supply the Equihash solution if it has been
+    //! trimmed from pindex.
+    CDiskBlockIndex(const CBlockIndex* pindex, std::function<std::vector<unsigned char>()> getSolution) : CBlockIndex(*pindex) {
         hashPrev = (pprev ? pprev->GetBlockHash() : uint256());
+        if (!HasSolution()) {
+            nSolution = getSolution();
+        }
     }
 
     ADD_SERIALIZE_METHODS;
@@ -519,6 +532,11 @@ public:
         // them to CBlockTreeDB::LoadBlockIndexGuts() in txdb.cpp :)
     }
 
+    const std::vector<unsigned char>& GetSolution() const
+    {
+        return nSolution;
+    }
+
     uint256 GetBlockHash() const
     {
         CBlockHeader block;
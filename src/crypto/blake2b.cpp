@@ -0,0 +1,279 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "crypto/blake2b.h"
+#include "crypto/common.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#if defined(USE_ASM)
+#include <cpuid.h>
+#endif
+#endif
+
+namespace blake2b_avx2
+{
+void FinalizeWords_4way(unsigned char* out, size_t outlen, const uint64_t* h, uint64_t t, const unsigned char* blocks);
+}
+
+// Internal implementation code.
+namespace
+{
+/// Internal BLAKE2b implementation.
+namespace blake2b
+{
+const uint64_t IV[8] = {
+    0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull, 0xa54ff53a5f1d36f1ull,
+    0x510e527fade682d1ull, 0x9b05688c2b3e6c1full, 0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull,
+};
+
+const uint8_t SIGMA[12][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+};
+
+uint64_t inline Rotr(uint64_t x, int n) { return (x >> n) | (x << (64 - n)); }
+
+/** The BLAKE2b mixing function. */
+void inline G(uint64_t& a, uint64_t& b, uint64_t& c, uint64_t& d, uint64_t x, uint64_t y)
+{
+    a = a + b + x;
+    d = Rotr(d ^ a, 32);
+    c = c + d;
+    b = Rotr(b ^ c, 24);
+    a = a + b + y;
+    d = Rotr(d ^ a, 16);
+    c = c + d;
+    b = Rotr(b ^ c, 63);
+}
+
+/** Compress one 128-byte block, `t` being the number of bytes hashed so far including it. */
+void Compress(uint64_t* h, const unsigned char* block, uint64_t t, bool last)
+{
+    uint64_t m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = ReadLE64(block + 8 * i);
+    }
+
+    uint64_t v[16];
+    for (int i = 0; i < 8; i++) {
+        v[i] = h[i];
+        v[i + 8] = IV[i];
+    }
+    v[12] ^= t;
+    if (last) {
+        v[14] = ~v[14];
+    }
+
+    for (int r = 0; r < 12; r++) {
+        const uint8_t* s = SIGMA[r];
+        G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        h[i] ^= v[i] ^ v[i + 8];
+    }
+}
+
+} // namespace blake2b
+
+typedef void (*FinalizeWords4Fn)(unsigned char*, size_t, const uint64_t*, uint64_t, const unsigned char*);
+
+FinalizeWords4Fn FinalizeWords4 = nullptr;
+
+bool SelfTest()
+{
+    // BLAKE2b-384 personalized for Equihash<192,7>, over 140 zero bytes
+    // followed by each of the words 0 to 3.
+    static const unsigned char result[4][48] = {
+        {0xaf,0xa3,0xca,0xb8,0x42,0x2a,0x24,0x09,0xb6,0x74,0xf3,0x4a,0x45,0x1f,0x26,0xd3,
+         0x69,0xd5,0x4c,0x15,0xee,0xa0,0xdd,0xc7,0xe3,0xf8,0xaa,0x15,0x4a,0x8d,0xad,0xca,
+         0x8b,0x76,0x36,0xc9,0xb5,0x76,0x8a,0x83,0x1f,0xdd,0x95,0x6f,0x5d,0xca,0x5d,0x03},
+        {0xde,0x3e,0x15,0x85,0x06,0x54,0xb5,0xdd,0x83,0xb0,0xa6,0xe4,0xd3,0x18,0xcd,0x37,
+         0x22,0x2a,0x80,0x38,0xfa,0xab,0xfd,0x24,0x82,0x6f,0x6d,0x90,0xb2,0x42,0x72,0xa6,
+         0x3f,0xef,0x7f,0x86,0xff,0xb1,0xda,0x15,0xbc,0x13,0x52,0x04,0xd4,0xe9,0x0c,0x35},
+        {0xba,0x08,0x23,0x4c,0xe4,0xdb,0xd3,0x3c,0x3b,0xef,0xa2,0x08,0x2e,0x32,0x65,0xa6,
+         0x75,0xc3,0xd2,0x9a,0x85,0x08,0xff,0x37,0x3d,0x44,0x89,0x4a,0x98,0xd4,0x82,0x60,
+         0x1a,0x15,0x7d,0x8d,0x3c,0x53,0xf1,0x93,0xa0,0xa8,0xb1,0x13,0xa9,0xaf,0xa5,0x23},
+        {0xc9,0xbd,0x41,0x96,0x75,0x72,0x58,0x11,0x21,0xa3,0xe6,0x8a,0xc1,0x1b,0x4f,0x10,
+         0xdb,0xdf,0x9c,0xb1,0x11,0x13,0xb7,0x2a,0x2b,0x14,0x0d,0x59,0x30,0x35,0x3f,0x52,
+         0x63,0xa2,0x98,0x45,0xed,0x83,0xe3,0xe1,0xc1,0x45,0xb0,0x78,0xea,0xfb,0xcc,0x58},
+    };
+
+    unsigned char personal[CBLAKE2b::PERSONAL_BYTES] = {'Z','c','a','s','h','P','o','W', 192,0,0,0, 7,0,0,0};
+    unsigned char data[140] = {};
+    CBLAKE2b base(48, personal);
+    base.Write(data, sizeof(data));
+
+    // Test the one-way implementation.
+    for (uint32_t i = 0; i < 4; i++) {
+        CBLAKE2b hasher(base);
+        unsigned char word[4];
+        WriteLE32(word, i);
+        unsigned char out[48];
+        hasher.Write(word, sizeof(word)).Finalize(out);
+        if (!std::equal(out, out + 48, result[i])) return false;
+    }
+
+    // Test FinalizeWords, which uses FinalizeWords4 if available.
+    uint32_t words[4] = {0, 1, 2, 3};
+    unsigned char out[4 * 48];
+    base.FinalizeWords(words, 4, out);
+    for (int i = 0; i < 4; i++) {
+        if (!std::equal(out + 48 * i, out + 48 * (i + 1), result[i])) return false;
+    }
+
+    return true;
+}
+
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+// We can't use cpuid.h's __get_cpuid as it does not support subleafs.
+void inline cpuid(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+#ifdef __GNUC__
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+#else
+  __asm__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(leaf), "2"(subleaf));
+#endif
+}
+
+/** Check whether the OS has enabled AVX registers. */
+bool AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+#endif
+} // namespace
+
+
+std::string BLAKE2bAutoDetect()
+{
+    std::string ret = "standard";
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+    bool have_xsave = false;
+    bool have_avx = false;
+    bool have_avx2 = false;
+    bool enabled_avx = false;
+
+    (void)AVXEnabled;
+    (void)have_avx2;
+    (void)enabled_avx;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, eax, ebx, ecx, edx);
+    have_xsave = (ecx >> 27) & 1;
+    have_avx = (ecx >> 28) & 1;
+    if (have_xsave && have_avx) {
+        enabled_avx = AVXEnabled();
+    }
+    cpuid(0, 0, eax, ebx, ecx, edx);
+    if (eax >= 7) {
+        cpuid(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+    }
+
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_avx2 && have_avx && enabled_avx) {
+        FinalizeWords4 = blake2b_avx2::FinalizeWords_4way;
+        ret += ",avx2(4way)";
+    }
+#endif
+#endif
+
+    assert(SelfTest());
+    return ret;
+}
+
+////// BLAKE2b
+
+CBLAKE2b::CBLAKE2b(size_t outlenIn, const unsigned char personal[PERSONAL_BYTES]) : t(0), buflen(0), outlen(outlenIn)
+{
+    assert(outlen > 0 && outlen <= MAX_OUTPUT_SIZE);
+    for (int i = 0; i < 8; i++) {
+        h[i] = blake2b::IV[i];
+    }
+    // Parameter block: digest length, no key, fanout 1, depth 1.
+    h[0] ^= 0x01010000ull ^ outlen;
+    h[6] ^= ReadLE64(personal);
+    h[7] ^= ReadLE64(personal + 8);
+}
+
+CBLAKE2b& CBLAKE2b::Write(const unsigned char* data, size_t len)
+{
+    while (len > 0) {
+        // The last block is only compressed by Finalize, so a full buffer is
+        // kept until we know more input follows it.
+        if (buflen == BLOCK_SIZE) {
+            t += BLOCK_SIZE;
+            blake2b::Compress(h, buf, t, false);
+            buflen = 0;
+        }
+        size_t n = std::min(len, BLOCK_SIZE - buflen);
+        memcpy(buf + buflen, data, n);
+        buflen += n;
+        data += n;
+        len -= n;
+    }
+    return *this;
+}
+
+void CBLAKE2b::Finalize(unsigned char* hash)
+{
+    t += buflen;
+    memset(buf + buflen, 0, BLOCK_SIZE - buflen);
+    blake2b::Compress(h, buf, t, true);
+
+    unsigned char out[MAX_OUTPUT_SIZE];
+    for (int i = 0; i < 8; i++) {
+        WriteLE64(out + 8 * i, h[i]);
+    }
+    memcpy(hash, out, outlen);
+}
+
+void CBLAKE2b::FinalizeWords(const uint32_t* words, size_t count, unsigned char* out) const
+{
+    size_t i = 0;
+    // When the words fit in the buffered block, each copy needs exactly one
+    // more compression, and the copies differ only in four bytes of it.
+    if (FinalizeWords4 && buflen + 4 <= BLOCK_SIZE) {
+        unsigned char blocks[4 * BLOCK_SIZE] = {};
+        for (int lane = 0; lane < 4; lane++) {
+            memcpy(blocks + lane * BLOCK_SIZE, buf, buflen);
+        }
+        for (; i + 4 <= count; i += 4) {
+            for (int lane = 0; lane < 4; lane++) {
+                WriteLE32(blocks + lane * BLOCK_SIZE + buflen, words[i + lane]);
+            }
+            FinalizeWords4(out + i * outlen, outlen, h, t + buflen + 4, blocks);
+        }
+    }
+    for (; i < count; i++) {
+        CBLAKE2b hasher(*this);
+        unsigned char word[4];
+        WriteLE32(word, words[i]);
+        hasher.Write(word, sizeof(word)).Finalize(out + i * outlen);
+    }
+}
@@ -0,0 +1,50 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_CRYPTO_BLAKE2B_H
+#define BITCOIN_CRYPTO_BLAKE2B_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/**
+ * A hasher class for unkeyed, unsalted BLAKE2b with a personalization string.
+ *
+ * Unlike the Rust BLAKE2bState, this is a plain value, so copying a state that
+ * has absorbed a common prefix costs a memcpy rather than an allocation.
+ */
+class CBLAKE2b
+{
+public:
+    static const size_t BLOCK_SIZE = 128;
+    static const size_t MAX_OUTPUT_SIZE = 64;
+    static const size_t PERSONAL_BYTES = 16;
+
+    CBLAKE2b(size_t outlen, const unsigned char personal[PERSONAL_BYTES]);
+    CBLAKE2b& Write(const unsigned char* data, size_t len);
+    void Finalize(unsigned char* hash);
+    size_t OutputLength() const { return outlen; }
+
+    /**
+     * Finalizes `count` copies of this state, the i-th after writing words[i]
+     * as 4 little-endian bytes, and stores OutputLength() bytes for each of
+     * them in `out`. Several copies are hashed at once when the CPU allows it.
+     */
+    void FinalizeWords(const uint32_t* words, size_t count, unsigned char* out) const;
+
+private:
+    uint64_t h[8];
+    uint64_t t;
+    unsigned char buf[BLOCK_SIZE];
+    size_t buflen;
+    size_t outlen;
+};
+
+/** Autodetect the best available BLAKE2b implementation.
+ *  Returns the name of the implementation.
+ */
+std::string BLAKE2bAutoDetect();
+
+#endif // BITCOIN_CRYPTO_BLAKE2B_H
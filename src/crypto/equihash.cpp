@@ -845,6 +845,90 @@ bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, std::vector<
     return X[0].IsZero(hashLen);
 }
 
+template<unsigned int N, unsigned int K>
+bool EquihashValidator<N,K>::IsValidSolution(const char pers[8], const unsigned char* input, size_t inputLen,
+                                             const std::vector<unsigned char>& soln)
+{
+    if (soln.size() != Eh::SolutionWidth) {
+        LogPrint("pow", "Invalid solution length: %d (expected %d)\n",
+                 soln.size(), Eh::SolutionWidth);
+        return false;
+    }
+
+    // Decode the indices. They are distinct across the whole tree exactly
+    // when they are distinct between the two halves of every merge.
+    unsigned char indexBytes[SolutionIndices*sizeof(eh_index)];
+    ExpandArray(soln.data(), soln.size(), indexBytes, sizeof(indexBytes),
+                Eh::CollisionBitLength+1, sizeof(eh_index) - ((Eh::CollisionBitLength+1)+7)/8);
+    eh_index indices[SolutionIndices];
+    uint32_t hashIndices[SolutionIndices];
+    for (size_t i = 0; i < SolutionIndices; i++) {
+        indices[i] = ArrayToEhIndex(indexBytes + i*sizeof(eh_index));
+        hashIndices[i] = indices[i] / Eh::IndicesPerHashOutput;
+    }
+    eh_index sorted[SolutionIndices];
+    std::copy(indices, indices + SolutionIndices, sorted);
+    std::sort(sorted, sorted + SolutionIndices);
+    if (std::adjacent_find(sorted, sorted + SolutionIndices) != sorted + SolutionIndices) {
+        LogPrint("pow", "Invalid solution: duplicate indices\n");
+        return false;
+    }
+
+    uint32_t le_N = htole32(N);
+    uint32_t le_K = htole32(K);
+    unsigned char personalization[CBLAKE2b::PERSONAL_BYTES] = {};
+    memcpy(personalization, pers, 8);
+    memcpy(personalization+8,  &le_N, 4);
+    memcpy(personalization+12, &le_K, 4);
+    CBLAKE2b base_state(Eh::HashOutput, personalization);
+    base_state.Write(input, inputLen);
+
+    unsigned char hashes[SolutionIndices*Eh::HashOutput];
+    base_state.FinalizeWords(hashIndices, SolutionIndices, hashes);
+
+    unsigned char rows[SolutionIndices][Eh::HashLength];
+    for (size_t i = 0; i < SolutionIndices; i++) {
+        const unsigned char* hash = hashes + i*Eh::HashOutput + (indices[i] % Eh::IndicesPerHashOutput)*N/8;
+        if constexpr (Eh::CollisionBitLength % 8 == 0) {
+            memcpy(rows[i], hash, Eh::HashLength);
+        } else {
+            ExpandArray(hash, N/8, rows[i], Eh::HashLength, Eh::CollisionBitLength);
+        }
+    }
+
+    // Merge the tree in place: after round r, rows[i] for i a multiple of
+    // 2^(r+1) holds the XOR of its subtree, of which only the bytes past the
+    // first (r+1) collisions are still used.
+    for (size_t r = 0; r < K; r++) {
+        const size_t step = size_t(1) << r;
+        const size_t start = r*Eh::CollisionByteLength;
+        for (size_t i = 0; i < SolutionIndices; i += 2*step) {
+            unsigned char* a = rows[i];
+            const unsigned char* b = rows[i+step];
+            if (memcmp(a + start, b + start, Eh::CollisionByteLength) != 0) {
+                LogPrint("pow", "Invalid solution: invalid collision length between StepRows\n");
+                return false;
+            }
+            // The index lists of the subtrees are distinct, so their order
+            // is decided by their first indices.
+            if (indices[i+step] < indices[i]) {
+                LogPrint("pow", "Invalid solution: Index tree incorrectly ordered\n");
+                return false;
+            }
+            for (size_t j = start + Eh::CollisionByteLength; j < Eh::HashLength; j++) {
+                a[j] ^= b[j];
+            }
+        }
+    }
+
+    for (size_t j = K*Eh::CollisionByteLength; j < Eh::HashLength; j++) {
+        if (rows[0][j] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
 template void Equihash<96,3>::InitialiseStatePers(eh_HashState& base_state, const char *pers);
 template void Equihash<200,9>::InitialiseStatePers(eh_HashState& base_state, const char *pers);
 template void Equihash<96,5>::InitialiseStatePers(eh_HashState& base_state, const char *pers);
@@ -858,3 +942,10 @@ template bool Equihash<96,5>::IsValidSolution(const eh_HashState& base_state, st
 template bool Equihash<48,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
 template bool Equihash<192,7>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
 template bool Equihash<144,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+
+template class EquihashValidator<96,3>;
+template class EquihashValidator<200,9>;
+template class EquihashValidator<96,5>;
+template class EquihashValidator<48,5>;
+template class EquihashValidator<192,7>;
+template class EquihashValidator<144,5>;
@@ -29,6 +29,7 @@ void EhIndexToArray(const eh_index i, unsigned char* array);
 // Always, because of "old way" equihash verification 
 //#ifdef ENABLE_MINING
 
+#include "crypto/blake2b.h"
 #include "crypto/sha256.h"
 #include "utilstrencodings.h"
 
@@ -223,6 +224,29 @@ public:
     bool IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
 };
 
+/**
+ * Validates Equihash<N,K> solutions without touching the heap: the tree of
+ * rows is a fixed-size array on the stack, merged in place, and the leaves are
+ * hashed with CBLAKE2b, several in parallel when the CPU allows it. Accepts
+ * exactly the solutions that Equihash<N,K>::IsValidSolution accepts.
+ */
+template<unsigned int N, unsigned int K>
+class EquihashValidator
+{
+private:
+    typedef Equihash<N,K> Eh;
+
+public:
+    enum : size_t { SolutionIndices=1 << K };
+
+    /**
+     * Checks `soln` for the input `input`, with the BLAKE2b personalization
+     * `pers` followed by N and K.
+     */
+    static bool IsValidSolution(const char pers[8], const unsigned char* input, size_t inputLen,
+                                const std::vector<unsigned char>& soln);
+};
+
 #include "equihash.tcc"
 
 static Equihash<96,3> Eh96_3;
@@ -340,4 +364,25 @@ inline bool EhOptimisedSolveUncancellable(unsigned int n, unsigned int k, const
         throw std::invalid_argument("Unsupported Equihash parameters"); \
     }
 
+inline bool EhIsValidSolutionNative(unsigned int n, unsigned int k, const char pers[8],
+                                    const unsigned char* input, size_t inputLen,
+                                    const std::vector<unsigned char>& soln)
+{
+    if (n == 96 && k == 3) {
+        return EquihashValidator<96,3>::IsValidSolution(pers, input, inputLen, soln);
+    } else if (n == 200 && k == 9) {
+        return EquihashValidator<200,9>::IsValidSolution(pers, input, inputLen, soln);
+    } else if (n == 96 && k == 5) {
+        return EquihashValidator<96,5>::IsValidSolution(pers, input, inputLen, soln);
+    } else if (n == 48 && k == 5) {
+        return EquihashValidator<48,5>::IsValidSolution(pers, input, inputLen, soln);
+    } else if (n == 192 && k == 7) {
+        return EquihashValidator<192,7>::IsValidSolution(pers, input, inputLen, soln);
+    } else if (n == 144 && k == 5) {
+        return EquihashValidator<144,5>::IsValidSolution(pers, input, inputLen, soln);
+    } else {
+        throw std::invalid_argument("Unsupported Equihash parameters");
+    }
+}
+
 #endif // BITCOIN_EQUIHASH_H
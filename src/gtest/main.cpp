@@ -1,6 +1,7 @@
 #include "gmock/gmock.h"
 #include "key.h"
 #include "pubkey.h"
+#include "script/sigcache.h"
 #include "util.h"
 
 #include "librustzcash.h"
@@ -18,6 +19,7 @@ ECCryptoClosure instance_of_eccryptoclosure;
 int main(int argc, char **argv) {
   assert(sodium_init() != -1);
   ECC_Start();
+  InitSignatureCache();
 
   fs::path sapling_spend = ZC_GetParamsDir() / "sapling-spend.params";
   fs::path sapling_output = ZC_GetParamsDir() / "sapling-output.params";
@@ -31,19 +31,18 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
+        if (outpoint.n != 0) {
+            return false;
+        }
         CTxOut txOut;
         txOut.nValue = 4288035;
-        CCoins newCoins;
-        newCoins.vout.resize(2);
-        newCoins.vout[0] = txOut;
-        newCoins.nHeight = 92045;
-        coins.swap(newCoins);
+        coin = Coin(std::move(txOut), 92045, false);
         return true;
     }
 
-    bool HaveCoins(const uint256 &txid) const {
-        return true;
+    bool HaveCoin(const COutPoint &outpoint) const {
+        return outpoint.n == 0;
     }
 
     uint256 GetBestBlock() const {
@@ -260,3 +259,31 @@ TEST(Mempool, ExpiringSoonTxRejection) {
     // Revert to default
     UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
 }
+
+// A transaction that PreVerifyTransaction has already accepted must still be
+// checked against the rules that depend on the height, such as expiry.
+TEST(Mempool, PreVerifiedTxStillExpires) {
+    SelectParams(CBaseChainParams::REGTEST);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.vJoinSplit.resize(0); // no joinsplits
+    mtx.fOverwintered = true;
+    mtx.nVersion = OVERWINTER_TX_VERSION;
+    mtx.nVersionGroupId = OVERWINTER_VERSION_GROUP_ID;
+    mtx.nExpiryHeight = 10;
+    CTransaction tx(mtx);
+
+    CValidationState state1;
+    EXPECT_TRUE(PreVerifyTransaction(Params(), state1, tx, 5));
+
+    // The proofs are not verified again, but the expiry check still applies
+    CValidationState state2;
+    EXPECT_TRUE(PreVerifyTransaction(Params(), state2, tx, 10));
+    CValidationState state3;
+    EXPECT_FALSE(PreVerifyTransaction(Params(), state3, tx, 11));
+    EXPECT_EQ(state3.GetRejectReason(), "tx-overwinter-expired");
+
+    // Revert to default
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+}
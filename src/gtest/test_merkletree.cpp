@@ -285,3 +285,65 @@ TEST(merkletree, testZeroElements) {
         ASSERT_TRUE(newTree.root() == oldroot);
     }
 }
+
+template<typename Tree, typename Witness>
+void test_witness_sync()
+{
+    const uint64_t nLeaves = 1 << INCREMENTAL_MERKLE_TREE_DEPTH_TESTING;
+
+    for (uint64_t pos = 0; pos < nLeaves; pos++) {
+        Tree tree;
+        for (uint64_t i = 0; i <= pos; i++) {
+            tree.append(uint256S(std::to_string(i + 1)));
+        }
+
+        // Move a witness along the tree a few commitments at a time, the way
+        // the wallet does for each block, and compare it with one that has
+        // every commitment appended.
+        Witness witness = tree.witness();
+        Witness synced = witness;
+        std::vector<Tree> trees {tree};
+        std::vector<Witness> witnesses {witness};
+        uint64_t size = tree.size();
+        while (size < nLeaves) {
+            for (int i = 0; i < 3 && size < nLeaves; i++) {
+                uint256 commitment = uint256S(std::to_string(size + 1));
+                tree.append(commitment);
+                size++;
+                witness.append(commitment);
+                while (synced.next_filled_size() == size) {
+                    synced.fill(tree);
+                }
+            }
+            synced.sync_to(tree);
+
+            ASSERT_EQ(synced.root(), tree.root());
+            ASSERT_EQ(synced.root(), witness.root());
+            ASSERT_EQ(synced.path().authentication_path, witness.path().authentication_path);
+            ASSERT_EQ(synced.path().index, witness.path().index);
+
+            trees.push_back(tree);
+            witnesses.push_back(witness);
+        }
+
+        // Rewinding gives back the witness at each earlier tree
+        for (size_t i = 0; i < trees.size(); i++) {
+            Witness rewound = synced;
+            rewound.sync_to(trees[i]);
+
+            ASSERT_EQ(rewound.root(), witnesses[i].root());
+            ASSERT_EQ(rewound.path().authentication_path, witnesses[i].path().authentication_path);
+        }
+
+        // The tree must contain the witnessed commitment
+        ASSERT_THROW(synced.sync_to(Tree()), std::runtime_error);
+    }
+}
+
+TEST(merkletree, WitnessSync) {
+    test_witness_sync<SproutTestingMerkleTree, SproutTestingWitness>();
+}
+
+TEST(merkletree, WitnessSyncSapling) {
+    test_witness_sync<SaplingTestingMerkleTree, SaplingTestingWitness>();
+}
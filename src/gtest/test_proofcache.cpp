@@ -0,0 +1,31 @@
+#include <gtest/gtest.h>
+
+#include "proofcache.h"
+#include "random.h"
+
+TEST(ProofCache, KeyedByTxidAndBranchId) {
+    CProofCache cache;
+    uint256 txid = GetRandHash();
+
+    EXPECT_FALSE(cache.Contains(txid, 0x76b809bb));
+    cache.Insert(txid, 0x76b809bb);
+    EXPECT_TRUE(cache.Contains(txid, 0x76b809bb));
+    EXPECT_FALSE(cache.Contains(txid, 0x5ba81b19));
+    EXPECT_FALSE(cache.Contains(GetRandHash(), 0x76b809bb));
+
+    cache.Erase(txid, 0x76b809bb);
+    EXPECT_FALSE(cache.Contains(txid, 0x76b809bb));
+}
+
+TEST(ProofCache, EvictsOldestFirst) {
+    CProofCache cache;
+    std::vector<uint256> txids;
+    for (unsigned int i = 0; i < MAX_PROOF_CACHE_ENTRIES + 1; i++) {
+        txids.push_back(GetRandHash());
+        cache.Insert(txids.back(), 0x76b809bb);
+    }
+
+    EXPECT_FALSE(cache.Contains(txids[0], 0x76b809bb));
+    EXPECT_TRUE(cache.Contains(txids[1], 0x76b809bb));
+    EXPECT_TRUE(cache.Contains(txids.back(), 0x76b809bb));
+}
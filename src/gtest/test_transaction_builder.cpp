@@ -6,6 +6,7 @@
 #include "main.h"
 #include "pubkey.h"
 #include "rpc/protocol.h"
+#include "script/interpreter.h"
 #include "transaction_builder.h"
 #include "utiltest.h"
 #include "zcash/Address.hpp"
@@ -38,11 +39,11 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         return false;
     }
 
-    bool HaveCoins(const uint256 &txid) const {
+    bool HaveCoin(const COutPoint &outpoint) const {
         return false;
     }
 
@@ -149,6 +150,148 @@ TEST(TransactionBuilder, SaplingToSapling) {
     RegtestDeactivateSapling();
 }
 
+TEST(TransactionBuilder, SaplingBatchValidation) {
+    auto consensusParams = RegtestActivateSapling();
+
+    auto sk = libzcash::SaplingSpendingKey::random();
+    auto expsk = sk.expanded_spending_key();
+    auto fvk = sk.full_viewing_key();
+    auto pa = sk.default_address();
+
+    std::vector<CTransaction> txs;
+    for (int i = 0; i < 2; i++) {
+        auto testNote = GetTestSaplingNote(pa, 40000);
+        auto builder = TransactionBuilder(consensusParams, 2);
+        builder.AddSaplingSpend(expsk, testNote.note, testNote.tree.root(), testNote.tree.witness());
+        builder.AddSaplingOutput(fvk.ovk, pa, 25000, {});
+        txs.push_back(builder.Build().GetTxOrThrow());
+    }
+
+    // All valid transactions pass as a batch
+    {
+        SaplingBatchValidator batch;
+        for (const CTransaction& tx : txs) {
+            CValidationState state;
+            EXPECT_TRUE(ContextualCheckShieldedInputs(tx, state, Params(), 3, true, IsInitialBlockDownload, &batch));
+        }
+        EXPECT_TRUE(batch.Validate());
+    }
+
+    auto consensusBranchId = CurrentEpochBranchId(3, Params().GetConsensus());
+    uint256 sighash = SignatureHash(CScript(), txs[0], NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId);
+
+    // A batch that only checks signatures does not look at the proofs
+    {
+        CMutableTransaction mtx(txs[0]);
+        mtx.vShieldedSpend[0].zkproof[10] ^= 1;
+        CTransaction txBadProof(mtx);
+
+        SaplingBatchValidator sigs(false);
+        EXPECT_TRUE(sigs.Queue(txBadProof, sighash));
+        EXPECT_TRUE(sigs.Validate());
+
+        SaplingBatchValidator batch;
+        EXPECT_FALSE(batch.Queue(txBadProof, sighash) && batch.Validate());
+    }
+
+    // A transaction that fails to queue leaves nothing behind, here a spend
+    // authorization signature over the wrong data
+    {
+        CMutableTransaction mtx(txs[0]);
+        mtx.valueBalance = MAX_MONEY + 1;
+        CTransaction txBadBalance(mtx);
+
+        SaplingBatchValidator batch;
+        EXPECT_FALSE(batch.Queue(txBadBalance, uint256()));
+        EXPECT_TRUE(batch.Queue(txs[0], sighash));
+        EXPECT_TRUE(batch.Validate());
+    }
+
+    // A single invalid binding signature causes the whole batch to fail,
+    // and is found by checking the transactions individually.
+    CMutableTransaction mtx(txs[1]);
+    mtx.bindingSig[0] ^= 1;
+    txs[1] = CTransaction(mtx);
+    {
+        SaplingBatchValidator batch;
+        for (const CTransaction& tx : txs) {
+            CValidationState state;
+            EXPECT_TRUE(ContextualCheckShieldedInputs(tx, state, Params(), 3, true, IsInitialBlockDownload, &batch));
+        }
+        EXPECT_FALSE(batch.Validate());
+
+        CValidationState state;
+        EXPECT_TRUE(ContextualCheckShieldedInputs(txs[0], state, Params(), 3, true));
+        EXPECT_FALSE(ContextualCheckShieldedInputs(txs[1], state, Params(), 3, true));
+        EXPECT_EQ(state.GetRejectReason(), "bad-txns-sapling-binding-signature-invalid");
+    }
+
+    // Revert to default
+    RegtestDeactivateSapling();
+}
+
+TEST(TransactionBuilder, SaplingParallelProving) {
+    auto consensusParams = RegtestActivateSapling();
+    int nPrevThreads = nSaplingProverThreads;
+    nSaplingProverThreads = 3;
+
+    auto sk = libzcash::SaplingSpendingKey::random();
+    auto expsk = sk.expanded_spending_key();
+    auto fvk = sk.full_viewing_key();
+    auto pa = sk.default_address();
+
+    // Two spends and three outputs (including change) are proved on three
+    // threads, with a binding signature over the merged proving contexts.
+    // Both spent notes are in the same tree, so that they share an anchor.
+    auto testNote1 = GetTestSaplingNote(pa, 40000);
+    auto testNote2 = GetTestSaplingNote(pa, 30000);
+    SaplingMerkleTree tree;
+    tree.append(testNote1.note.cmu().value());
+    auto witness1 = tree.witness();
+    tree.append(testNote2.note.cmu().value());
+    witness1.append(testNote2.note.cmu().value());
+    auto witness2 = tree.witness();
+    auto builder = TransactionBuilder(consensusParams, 2);
+    builder.AddSaplingSpend(expsk, testNote1.note, tree.root(), witness1);
+    builder.AddSaplingSpend(expsk, testNote2.note, tree.root(), witness2);
+    builder.AddSaplingOutput(fvk.ovk, pa, 25000, {});
+    builder.AddSaplingOutput(fvk.ovk, pa, 15000, {});
+    auto tx = builder.Build().GetTxOrThrow();
+
+    EXPECT_EQ(tx.vShieldedSpend.size(), 2);
+    EXPECT_EQ(tx.vShieldedOutput.size(), 3);
+    EXPECT_EQ(tx.valueBalance, 10000);
+
+    CValidationState state;
+    EXPECT_TRUE(ContextualCheckTransaction(tx, state, Params(), 3, true));
+    EXPECT_TRUE(ContextualCheckShieldedInputs(tx, state, Params(), 3, true));
+    EXPECT_EQ(state.GetRejectReason(), "");
+
+    // The descriptions keep the order in which they were added
+    auto builder2 = TransactionBuilder(consensusParams, 2);
+    builder2.AddSaplingSpend(expsk, testNote2.note, testNote2.tree.root(), testNote2.tree.witness());
+    builder2.AddSaplingOutput(fvk.ovk, pa, 5000, {});
+    builder2.AddSaplingOutput(fvk.ovk, pa, 6000, {});
+    builder2.AddSaplingOutput(fvk.ovk, pa, 7000, {});
+    auto tx2 = builder2.Build().GetTxOrThrow();
+    ASSERT_EQ(tx2.vShieldedOutput.size(), 4);
+    CAmount values[] = {5000, 6000, 7000, 2000};
+    for (size_t i = 0; i < 4; i++) {
+        auto decrypted = libzcash::SaplingNotePlaintext::decrypt(
+            consensusParams, 2,
+            tx2.vShieldedOutput[i].encCiphertext, fvk.in_viewing_key(),
+            tx2.vShieldedOutput[i].ephemeralKey, tx2.vShieldedOutput[i].cmu);
+        ASSERT_TRUE(decrypted);
+        EXPECT_EQ(decrypted->value(), values[i]);
+    }
+    EXPECT_TRUE(ContextualCheckShieldedInputs(tx2, state, Params(), 3, true));
+
+    nSaplingProverThreads = nPrevThreads;
+
+    // Revert to default
+    RegtestDeactivateSapling();
+}
+
 TEST(TransactionBuilder, SaplingToSprout) {
     auto consensusParams = RegtestActivateSapling();
 
@@ -44,21 +44,17 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
-        if (coin && txid == coin.value().first.second) {
-            CCoins newCoins;
-            newCoins.vout.resize(2);
-            newCoins.vout[0] = coin.value().second.first;
-            newCoins.nHeight = coin.value().second.second;
-            coins.swap(newCoins);
+    bool GetCoin(const COutPoint &outpoint, Coin &coinOut) const {
+        if (coin && outpoint.hash == coin.value().first.second && outpoint.n == 0) {
+            coinOut = Coin(coin.value().second.first, coin.value().second.second, false);
             return true;
         } else {
             return false;
         }
     }
 
-    bool HaveCoins(const uint256 &txid) const {
-        if (coin && txid == coin.value().first.second) {
+    bool HaveCoin(const COutPoint &outpoint) const {
+        if (coin && outpoint.hash == coin.value().first.second && outpoint.n == 0) {
             return true;
         } else {
             return false;
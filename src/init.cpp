@@ -14,6 +14,7 @@
 #include "compat/sanity.h"
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
+#include "crypto/blake2b.h"
 #include "experimental_features.h"
 #include "fs.h"
 #include "util/tokenpipe.h"
@@ -36,6 +37,7 @@
 #include "scheduler.h"
 #include "txdb.h"
 #include "torcontrol.h"
+#include "transaction_builder.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -194,9 +196,9 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -210,7 +212,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static boost::scoped_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -256,6 +257,9 @@ void Shutdown()
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
 
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
+
     if (fFeeEstimatesInitialized)
     {
         fs::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
@@ -417,8 +421,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-ibdskiptxverification", strprintf(_("Skip transaction verification during initial block download up to the last checkpoint height. Incompatible with flags that disable checkpoints. (default = %u)"), DEFAULT_IBD_SKIP_TX_VERIFICATION));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script and proof verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-saplingproverthreads=<n>", strprintf(_("Set the number of threads used to create the Sapling proofs of a transaction (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        1, MAX_SAPLING_PROVER_THREADS, DEFAULT_SAPLING_PROVER_THREADS));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
@@ -427,7 +434,9 @@ std::string HelpMessage(HelpMessageMode mode)
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-blockprefetch", strprintf(_("Use block prefetch to speed up sequential block reading (default: %u)"), DEFAULT_BLOCK_PREFETCH_ENABLED));
     strUsage += HelpMessageOpt("-prefetchnumthreads=<n>", strprintf(_("How many threads to use for parallel block prefetching (default: %u)"), DEFAULT_PREFETCH_NUM_THREADS));
-    strUsage += HelpMessageOpt("-prefetchnumblocks=<n>", strprintf(_("How many blocks to keep in prefetch cache (default: %u)"), DEFAULT_PREFETCH_NUM_BLOCKS));
+    strUsage += HelpMessageOpt("-prefetchnumblocks=<n>", strprintf(_("How many blocks to read ahead of the block being processed (default: %u)"), DEFAULT_PREFETCH_NUM_BLOCKS));
+    strUsage += HelpMessageOpt("-backgroundflush", strprintf(_("Write the chainstate to disk from a background thread, so that block processing does not wait for it (default: %u)"), DEFAULT_BACKGROUND_FLUSH));
+    strUsage += HelpMessageOpt("-backgroundflushthreshold=<n>", strprintf(_("With -backgroundflush, start writing the chainstate once the coins cache uses this percentage of -dbcache (1 to 100, default: %u)"), DEFAULT_BACKGROUND_FLUSH_THRESHOLD));
     strUsage += HelpMessageOpt("-forcebirthday", strprintf(_("Use alternative \"wallet birthday\" Unix timestamp (default: %u)"), 0));
     strUsage += HelpMessageOpt("-ignorespam", strprintf(_("Ignore txes with more than or equal to -spamoutputsmin Sapling outputs (default: %u)"), DEFAULT_IGNORE_SPAM));
     strUsage += HelpMessageOpt("-spamoutputsmin", strprintf(_("Minimum Sapling outputs count to consider tx a spam (default: %u)"), DEFAULT_SPAM_OUTPUTS_MIN));
@@ -437,6 +446,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txexpirynotify=<cmd>", _("Execute command when transaction expires (%s in cmd is replaced by transaction id)"));
+    strUsage += HelpMessageOpt("-trustblockindex", strprintf(_("On startup, only check the block index entries that were not checked by an earlier startup (default: %u)"), DEFAULT_TRUST_BLOCK_INDEX));
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
@@ -444,6 +454,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-banscore=<n>", strprintf(_("Threshold for disconnecting misbehaving peers (default: %u)"), DEFAULT_BANSCORE_THRESHOLD));
     strUsage += HelpMessageOpt("-bantime=<n>", strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), DEFAULT_MISBEHAVING_BANTIME));
     strUsage += HelpMessageOpt("-bind=<addr>", _("Bind to given address and always listen on it. Use [host]:port notation for IPv6"));
+    strUsage += HelpMessageOpt("-blockdownloadwindow=<n>", strprintf(_("Download blocks at most <n> blocks ahead of the last block connected (default: %u)"), BLOCK_DOWNLOAD_WINDOW));
     strUsage += HelpMessageOpt("-connect=<ip>", _("Connect only to the specified node(s); -noconnect or -connect=0 alone to disable automatic connections"));
     strUsage += HelpMessageOpt("-discover", _("Discover own IP addresses (default: 1 when listening and no -externalip or -proxy)"));
     strUsage += HelpMessageOpt("-dns", _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + strprintf(_("(default: %u)"), DEFAULT_NAME_LOOKUP));
@@ -452,6 +463,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-forcednsseed", strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), DEFAULT_FORCEDNSSEED));
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect/-noconnect)"));
     strUsage += HelpMessageOpt("-listenonion", strprintf(_("Automatically create Tor hidden service (default: %d)"), DEFAULT_LISTEN_ONION));
+    strUsage += HelpMessageOpt("-maxblocksinflight=<n>", strprintf(_("Request at most <n> blocks from a single peer at a time; fewer are requested from slow peers (minimum: %d, default: %d)"), MIN_BLOCKS_IN_TRANSIT_PER_PEER, DEFAULT_MAX_BLOCKS_IN_TRANSIT_PER_PEER));
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), DEFAULT_MAX_PEER_CONNECTIONS));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXRECEIVEBUFFER));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXSENDBUFFER));
@@ -511,7 +523,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-nuparams=hexBranchId:activationHeight", "Use given activation height for specified network upgrade (regtest-only)");
         strUsage += HelpMessageOpt("-nurejectoldversions", strprintf("Reject peers that don't know about the current epoch (regtest-only) (default: %u)", DEFAULT_NU_REJECT_OLD_VERSIONS));
     }
-    std::string debugCategories = "addrman, alert, bench, coindb, db, estimatefee, http, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
+    std::string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, estimatefee, http, libevent, lock, mempool, net, partitioncheck, pow, proxy, prune, "
                              "rand, receiveunsafe, reindex, rpc, selectcoins, tor, zmq, zrpc, zrpcunsafe (implies zrpc)"; // Don't translate these
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
         _("If <category> is not supplied or if <category> = 1, output all debugging information.") + " " + _("<category> can be:") + " " + debugCategories + ". " +
@@ -522,6 +534,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-logtimestamps", strprintf(_("Prepend debug output with timestamp (default: %u)"), DEFAULT_LOGTIMESTAMPS));
     if (showDebug)
     {
+        strUsage += HelpMessageOpt("-limitancestorcount=<n>", strprintf("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)", DEFAULT_ANCESTOR_LIMIT));
+        strUsage += HelpMessageOpt("-limitancestorsize=<n>", strprintf("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)", DEFAULT_ANCESTOR_SIZE_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantcount=<n>", strprintf("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)", DEFAULT_DESCENDANT_LIMIT));
+        strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", DEFAULT_LIMITFREERELAY));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", DEFAULT_RELAYPRIORITY));
         strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
@@ -741,6 +757,10 @@ void ThreadImport(std::vector<fs::path> vImportFiles, const CChainParams& chainp
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool(chainparams);
+    }
 }
 
 /** Sanity checks
@@ -1031,7 +1051,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
     // Trim requested connection counts, to fit into system limitations
-    nMaxConnections = std::max(std::min(nMaxConnections, FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS), 0);
+#ifdef USE_POLL
+    int nFDMax = std::numeric_limits<int>::max() - MIN_CORE_FILEDESCRIPTORS;
+#else
+    int nFDMax = FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS;
+#endif
+    nMaxConnections = std::max(std::min(nMaxConnections, nFDMax), 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -1089,6 +1114,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     mempool.SetMempoolCostLimit(mempoolTotalCostLimit, mempoolEvictionMemorySeconds);
 
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
+    fTrustBlockIndex = GetBoolArg("-trustblockindex", DEFAULT_TRUST_BLOCK_INDEX);
     fIBDSkipTxVerification = GetBoolArg("-ibdskiptxverification", DEFAULT_IBD_SKIP_TX_VERIFICATION);
     fCheckpointsEnabled = GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
 
@@ -1101,6 +1127,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nSaplingProverThreads = GetArg("-saplingproverthreads", DEFAULT_SAPLING_PROVER_THREADS);
+    if (nSaplingProverThreads <= 0)
+        nSaplingProverThreads += GetNumCores();
+    nSaplingProverThreads = std::max(1, std::min(nSaplingProverThreads, MAX_SAPLING_PROVER_THREADS));
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
@@ -1128,6 +1159,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         LogPrintf("number of prefetch threads = %i , number of prefetch blocks = %i\n", nPrefetchNumThreads, nPrefetchNumBlocks);
     }
 
+    fBackgroundFlush = GetBoolArg("-backgroundflush", DEFAULT_BACKGROUND_FLUSH);
+    nBackgroundFlushThreshold = std::min<int64_t>(100, std::max<int64_t>(1, GetArg("-backgroundflushthreshold", DEFAULT_BACKGROUND_FLUSH_THRESHOLD)));
+
+    // block download
+    nMaxBlocksInTransitPerPeer = std::max<int>(GetArg("-maxblocksinflight", DEFAULT_MAX_BLOCKS_IN_TRANSIT_PER_PEER), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    nBlockDownloadWindow = std::max<int64_t>(GetArg("-blockdownloadwindow", BLOCK_DOWNLOAD_WINDOW), nMaxBlocksInTransitPerPeer);
+
     nForceBirthday = GetArg("-forcebirthday", 0);
     if (nForceBirthday && nForceBirthday < Params().GenesisBlock().GetBlockTime())
     {
@@ -1265,8 +1303,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Initialize elliptic curve code
     std::string sha256_algo = SHA256AutoDetect();
     LogPrintf("Using the '%s' SHA256 implementation\n", sha256_algo);
+    std::string blake2b_algo = BLAKE2bAutoDetect();
+    LogPrintf("Using the '%s' BLAKE2b implementation\n", blake2b_algo);
     ECC_Start();
     globalVerifyHandle.reset(new ECCVerifyHandle());
+    InitSignatureCache();
 
     // Sanity check
     if (!InitSanityCheck())
@@ -1304,10 +1345,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
-    LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    LogPrintf("Using %u threads for script and proof verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadTxPreVerify);
     }
 
     // Start the lightweight task scheduler thread
@@ -1616,6 +1659,41 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
+                // A background chainstate write was interrupted. The database
+                // still holds the state it had before that write, so the blocks
+                // it was going to commit are connected again from disk.
+                uint256 hashInterruptedFlush;
+                if (pcoinsdbview->ReadInterruptedFlush(hashInterruptedFlush)) {
+                    LogPrintf("Chainstate write towards %s was interrupted, reconnecting blocks from %s\n",
+                        hashInterruptedFlush.GetHex(), pcoinsdbview->GetBestBlock().GetHex());
+                    {
+                        LOCK(cs_main);
+                        BlockMap::iterator mi = mapBlockIndex.find(hashInterruptedFlush);
+                        CBlockIndex* pindex = mi == mapBlockIndex.end() ? NULL : mi->second;
+                        while (pindex && !chainActive.Contains(pindex) && (pindex->nStatus & BLOCK_HAVE_DATA)) {
+                            pindex = pindex->pprev;
+                        }
+                        if (!pindex || !chainActive.Contains(pindex)) {
+                            strLoadError = _("Interrupted chainstate write cannot be recovered from the block files; you will need to rebuild the database using -reindex");
+                            break;
+                        }
+                    }
+                    if (!pcoinsdbview->EraseInterruptedFlush()) {
+                        strLoadError = _("Error writing to chainstate database");
+                        break;
+                    }
+                }
+
+                // Convert a chainstate stored per transaction to the per-output format
+                if (!pcoinsdbview->Upgrade()) {
+                    if (ShutdownRequested()) {
+                        LogPrintf("Shutdown requested. Exiting.\n");
+                        return false;
+                    }
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 if (!fReindex) {
                     uiInterface.InitMessage(_("Rewinding blocks if needed..."));
                     if (!RewindBlockIndex(chainparams, clearWitnessCaches)) {
@@ -1699,6 +1777,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         pwalletMain = NULL;
         LogPrintf("Wallet disabled!\n");
     } else {
+        if (fAsyncNoteDecryption && nWalletDecryptThreads) {
+            LogPrintf("Using %u threads for Sapling trial decryption\n", nWalletDecryptThreads);
+            for (int i=0; i<nWalletDecryptThreads-1; i++)
+                threadGroup.create_thread(&ThreadSaplingTrialDecryption);
+        }
         CWallet::InitLoadWallet(clearWitnessCaches);
         if (!pwalletMain)
             return false;
@@ -1808,6 +1891,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles, chainparams));
 
+    // Write the mempool to disk now and then, so that little is lost on a crash
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        scheduler.scheduleEvery([] { DumpMempool(); }, MEMPOOL_DUMP_INTERVAL);
+    }
+
     // Wait for genesis block to be processed
     bool fHaveGenesis = false;
     while (!fHaveGenesis && !fRequestShutdown) {
@@ -9,6 +9,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -23,6 +24,7 @@
 #include "net.h"
 #include "policy/policy.h"
 #include "pow.h"
+#include "proofcache.h"
 #include "reverse_iterator.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -77,10 +79,13 @@ bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fCheckBlockIndex = false;
+bool fTrustBlockIndex = DEFAULT_TRUST_BLOCK_INDEX;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 bool fIBDSkipTxVerification = DEFAULT_IBD_SKIP_TX_VERIFICATION;
 bool fCoinbaseEnforcedShieldingEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
+int nMaxBlocksInTransitPerPeer = DEFAULT_MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+unsigned int nBlockDownloadWindow = BLOCK_DOWNLOAD_WINDOW;
 uint64_t nPruneTarget = 0;
 bool fAlerts = DEFAULT_ALERTS;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
@@ -88,10 +93,9 @@ int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 bool fBlockPrefetchEnabled = DEFAULT_BLOCK_PREFETCH_ENABLED;
 unsigned int nPrefetchNumThreads = DEFAULT_PREFETCH_NUM_THREADS;
 unsigned int nPrefetchNumBlocks = DEFAULT_PREFETCH_NUM_BLOCKS;
-std::map<const uint256, const CBlock> mapPrefetchCache;
-std::vector<const CBlockIndex*> vPindexQueue;
-std::mutex mutex_prefetch_queue;
-std::mutex mutex_prefetch_cache;
+
+bool fBackgroundFlush = DEFAULT_BACKGROUND_FLUSH;
+unsigned int nBackgroundFlushThreshold = DEFAULT_BACKGROUND_FLUSH_THRESHOLD;
 
 int64_t nForceBirthday = 0;
 
@@ -260,8 +264,10 @@ namespace {
         int64_t nTime;           //!< Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //!< The timeout for this block request (for disconnecting a slow peer)
+        std::unique_ptr<PartiallyDownloadedBlock> partialBlock; //!< Optional, used for compact blocks.
     };
-    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
+    /** A block may be in flight from more than one peer, see MAX_BLOCK_DOWNLOAD_SOURCES. */
+    multimap<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
     /** Number of blocks in flight with validated headers. */
     int nQueuedValidatedHeaders = 0;
@@ -269,11 +275,43 @@ namespace {
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /**
+     * Peers we have asked to announce new blocks with "cmpctblock", oldest
+     * first, see MAX_CMPCTBLOCK_HB_PEERS. Protected by cs_main.
+     */
+    std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /** A transaction received from a peer, waiting for or done with pre-verification. */
+    struct CTxPreVerification {
+        CTransaction tx;
+        int nHeight = 0;
+        CValidationState state;
+        bool fValid = false;
+        bool fDone = false;
+    };
+
+    /** Protects queueTxPreVerify, mapTxPreVerifyPending and the items in them. */
+    boost::mutex csTxPreVerify;
+    boost::condition_variable condTxPreVerify;
+
+    /** Transactions waiting for a pre-verification thread. */
+    std::deque<std::shared_ptr<CTxPreVerification>> queueTxPreVerify;
+
+    /**
+     * Transactions from each peer that haven't been handed back to the message
+     * handler yet, in the order they were received, see
+     * MAX_TX_PREVERIFY_PER_PEER.
+     */
+    std::map<NodeId, std::deque<std::shared_ptr<CTxPreVerification>>> mapTxPreVerifyPending;
+
+    /** Number of running pre-verification threads. */
+    std::atomic<int> nTxPreVerifyThreads(0);
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -320,11 +358,21 @@ struct CNodeState {
     int64_t nHeadersSyncTimeout;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
+    //! Whether another peer delivered a block first while this peer was stalling block download progress.
+    bool fStallingOutpaced;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! When the last block we requested from this peer arrived (in microseconds), or 0.
+    int64_t nLastBlockReceived;
+    //! Moving average of the time between blocks delivered by this peer (in microseconds), or 0 if not measured yet.
+    int64_t nAvgBlockInterval;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer can give us compact blocks ("sendcmpct" received).
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced with "cmpctblock".
+    bool fPreferHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -336,9 +384,14 @@ struct CNodeState {
         fSyncStarted = false;
         nHeadersSyncTimeout = 0;
         nStallingSince = 0;
+        fStallingOutpaced = false;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nLastBlockReceived = 0;
+        nAvgBlockInterval = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
@@ -369,6 +422,26 @@ void UpdatePreferredDownload(CNode* node, CNodeState* state)
     nPreferredDownload += state->fPreferredDownload;
 }
 
+/**
+ * Number of blocks that may be in flight from a peer at once. Enough blocks
+ * are requested to keep the peer busy for a round trip plus
+ * BLOCK_DOWNLOAD_TARGET_BUFFER at the rate it has been delivering them, so
+ * fast peers get deep pipelines and slow peers cannot hold on to much of the
+ * download window.
+ */
+int GetBlocksInTransitLimit(const CNodeState* state, const CNode* pnode)
+{
+    if (state->nAvgBlockInterval == 0) {
+        return std::min(DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER, nMaxBlocksInTransitPerPeer);
+    }
+    int64_t nRoundTrip = pnode->nMinPingUsecTime;
+    if (nRoundTrip == std::numeric_limits<int64_t>::max()) {
+        nRoundTrip = pnode->nPingUsecTime;
+    }
+    int64_t nLimit = (nRoundTrip + BLOCK_DOWNLOAD_TARGET_BUFFER) / state->nAvgBlockInterval + 1;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(nLimit, nMaxBlocksInTransitPerPeer));
+}
+
 // Returns time at which to timeout block request (nTime in microseconds)
 int64_t GetBlockTimeout(int64_t nTime, int nValidatedQueuedBefore, const Consensus::Params &consensusParams, int nHeight)
 {
@@ -380,6 +453,9 @@ void InitializeNode(NodeId nodeid, const CNode *pnode) {
     CNodeState &state = mapNodeState.insert(std::make_pair(nodeid, CNodeState())).first->second;
     state.name = pnode->GetAddrName();
     state.address = pnode->addr;
+
+    boost::unique_lock<boost::mutex> lock(csTxPreVerify);
+    mapTxPreVerifyPending[nodeid];
 }
 
 void FinalizeNode(NodeId nodeid) {
@@ -393,29 +469,79 @@ void FinalizeNode(NodeId nodeid) {
         AddressCurrentlyConnected(state->address);
     }
 
-    for (const QueuedBlock& entry : state->vBlocksInFlight)
-        mapBlocksInFlight.erase(entry.hash);
+    for (const QueuedBlock& entry : state->vBlocksInFlight) {
+        auto range = mapBlocksInFlight.equal_range(entry.hash);
+        for (auto it = range.first; it != range.second; ) {
+            if (it->second.first == nodeid) {
+                nQueuedValidatedHeaders -= entry.fValidatedHeaders;
+                it = mapBlocksInFlight.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
+
+    boost::unique_lock<boost::mutex> lock(csTxPreVerify);
+    mapTxPreVerifyPending.erase(nodeid);
+}
+
+// Requires cs_main.
+static void RemoveBlockInFlight(multimap<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight) {
+    CNodeState *state = State(itInFlight->second.first);
+    nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
+    state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
+    state->vBlocksInFlight.erase(itInFlight->second.second);
+    state->nBlocksInFlight--;
+    state->nStallingSince = 0;
+    mapBlocksInFlight.erase(itInFlight);
+}
+
+// Requires cs_main.
+// Drops the request for this block from this peer, if there is one.
+static void RemoveBlockInFlight(NodeId nodeid, const uint256& hash) {
+    auto range = mapBlocksInFlight.equal_range(hash);
+    for (auto itInFlight = range.first; itInFlight != range.second; itInFlight++) {
+        if (itInFlight->second.first == nodeid) {
+            RemoveBlockInFlight(itInFlight);
+            break;
+        }
+    }
 }
 
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
-    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
-    if (itInFlight != mapBlocksInFlight.end()) {
-        CNodeState *state = State(itInFlight->second.first);
-        nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
-        state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
-        state->vBlocksInFlight.erase(itInFlight->second.second);
-        state->nBlocksInFlight--;
-        state->nStallingSince = 0;
-        mapBlocksInFlight.erase(itInFlight);
-        return true;
+// Requests for the same block from other peers are dropped. If one of them
+// was stalling the download window, it is disconnected right away rather than
+// after BLOCK_STALLING_TIMEOUT.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1) {
+    auto range = mapBlocksInFlight.equal_range(hash);
+    if (range.first == range.second)
+        return false;
+
+    int64_t nNow = GetTimeMicros();
+    for (auto itInFlight = range.first; itInFlight != range.second; ) {
+        auto itNext = std::next(itInFlight);
+        NodeId nodeid = itInFlight->second.first;
+        CNodeState *state = State(nodeid);
+        if (nodeid == nodeFrom) {
+            // Measure how fast this peer delivers the blocks we ask it for
+            int64_t nInterval = nNow - std::max(itInFlight->second.second->nTime, state->nLastBlockReceived);
+            state->nAvgBlockInterval = state->nAvgBlockInterval == 0 ? nInterval : (state->nAvgBlockInterval * 7 + nInterval) / 8;
+            state->nAvgBlockInterval = std::max<int64_t>(state->nAvgBlockInterval, 1);
+            state->nLastBlockReceived = nNow;
+        } else if (nodeFrom != -1 && state->nStallingSince) {
+            LogPrint("net", "Peer=%d was outpaced by peer=%d on block %s while stalling\n", nodeid, nodeFrom, hash.ToString());
+            state->fStallingOutpaced = true;
+        }
+        RemoveBlockInFlight(itInFlight);
+        itInFlight = itNext;
     }
-    return false;
+    return true;
 }
 
 // Requires cs_main.
@@ -423,17 +549,61 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
-    // Make sure it's not listed somewhere already.
-    MarkBlockAsReceived(hash);
+    // Make sure it's not listed for this peer already.
+    RemoveBlockInFlight(nodeid, hash);
 
     int64_t nNow = GetTimeMicros();
     int nHeight = pindex != NULL ? pindex->nHeight : chainActive.Height(); // Help block timeout computation
     QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams, nHeight)};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
-    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), std::move(newentry));
+    mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it)));
+}
+
+// Requires cs_main.
+// Returns the request for this block from this peer, or NULL if there is none.
+static QueuedBlock* GetBlockInFlight(NodeId nodeid, const uint256& hash) {
+    auto range = mapBlocksInFlight.equal_range(hash);
+    for (auto itInFlight = range.first; itInFlight != range.second; itInFlight++) {
+        if (itInFlight->second.first == nodeid)
+            return &*itInFlight->second.second;
+    }
+    return NULL;
+}
+
+// Requires cs_main.
+// Asks pfrom to announce new blocks with "cmpctblock" from now on, as it has
+// just given us a new tip. Only the last MAX_CMPCTBLOCK_HB_PEERS peers to do
+// so are asked; the oldest one goes back to announcing with "inv".
+static void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    for (NodeId nodeid : lNodesAnnouncingHeaderAndIDs) {
+        if (nodeid == pfrom->GetId())
+            return;
+    }
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        NodeId nodeStop = lNodesAnnouncingHeaderAndIDs.front();
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            if (pnode->GetId() == nodeStop) {
+                pnode->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
+// Requires cs_main.
+// Whether we are close enough to the network's tip to fetch announced blocks
+// directly, rather than leave them to the parallel block download.
+static bool CanDirectFetch(const Consensus::Params& consensusParams) {
+    return chainActive.Tip()->GetBlockTime() > GetTime() - consensusParams.PoWTargetSpacing(pindexBestHeader->nHeight) * 20;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -489,8 +659,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. If nothing can be fetched because the download window is blocked by another
+ *  peer, that peer is returned in nodeStaller and the block it is holding up in pindexStalled. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexStalled) {
     if (count == 0)
         return;
 
@@ -520,12 +691,13 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 
     std::vector<CBlockIndex*> vToFetch;
     CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
-    // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
+    // Never fetch further than the best block we know the peer has, or more than nBlockDownloadWindow + 1 beyond the last
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
     // download that next block if the window were 1 larger.
-    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + nBlockDownloadWindow;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    CBlockIndex* pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -557,6 +729,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -566,7 +739,8 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 }
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
-                waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                waitingfor = mapBlocksInFlight.find(pindex->GetBlockHash())->second.first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -627,6 +801,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -816,7 +991,8 @@ bool ContextualCheckTransaction(
         const CChainParams& chainparams,
         const int nHeight,
         const bool isMined,
-        bool (*isInitBlockDownload)(const Consensus::Params&))
+        bool (*isInitBlockDownload)(const Consensus::Params&),
+        bool fCheckShieldedInputs)
 {
     const int DOS_LEVEL_BLOCK = 100;
     // DoS level set to 10 to be more forgiving.
@@ -1049,6 +1225,37 @@ bool ContextualCheckTransaction(
         // Rules that apply generally before the next release epoch
     }
 
+    if (!fCheckShieldedInputs) {
+        return true;
+    }
+
+    return ContextualCheckShieldedInputs(tx, state, chainparams, nHeight, isMined, isInitBlockDownload);
+}
+
+/**
+ * Check the JoinSplit signature and the Sapling proofs and signatures of a
+ * transaction, against the consensus branch ID in effect at nHeight.
+ *
+ * If saplingBatch is non-NULL, the Sapling proofs and signatures are queued
+ * on it instead of being verified here, and the caller is responsible for
+ * calling SaplingBatchValidator::Validate().
+ */
+bool ContextualCheckShieldedInputs(
+        const CTransaction& tx,
+        CValidationState &state,
+        const CChainParams& chainparams,
+        const int nHeight,
+        const bool isMined,
+        bool (*isInitBlockDownload)(const Consensus::Params&),
+        SaplingBatchValidator* saplingBatch)
+{
+    const int DOS_LEVEL_BLOCK = 100;
+    const int DOS_LEVEL_MEMPOOL = 10;
+
+    auto dosLevelPotentiallyRelaxing = isMined ? DOS_LEVEL_BLOCK : (
+        isInitBlockDownload(chainparams.GetConsensus()) ? 0 : DOS_LEVEL_MEMPOOL);
+
+    auto consensus = chainparams.GetConsensus();
     auto consensusBranchId = CurrentEpochBranchId(nHeight, consensus);
     auto prevConsensusBranchId = PrevEpochBranchId(consensusBranchId, consensus);
     uint256 dataToBeSigned;
@@ -1098,6 +1305,13 @@ bool ContextualCheckTransaction(
     if (!tx.vShieldedSpend.empty() ||
         !tx.vShieldedOutput.empty())
     {
+        // If the descriptions can be queued, they are verified later as part
+        // of the batch. Otherwise fall through to the individual checks below,
+        // which determine the precise reason for rejection.
+        if (saplingBatch && saplingBatch->Queue(tx, dataToBeSigned)) {
+            return true;
+        }
+
         auto ctx = librustzcash_sapling_verification_ctx_init();
 
         for (const SpendDescription &spend : tx.vShieldedSpend) {
@@ -1454,10 +1668,37 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+bool PreVerifyTransaction(
+        const CChainParams& chainparams, CValidationState &state,
+        const CTransaction &tx, int nHeight)
+{
+    auto consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
+
+    if (proofCache.Contains(tx.GetHash(), consensusBranchId)) {
+        // Only the checks that depend on the height itself need repeating
+        if (!ContextualCheckTransaction(tx, state, chainparams, nHeight, false, IsInitialBlockDownload, false)) {
+            return error("%s: ContextualCheckTransaction failed", __func__);
+        }
+        return true;
+    }
+
+    auto verifier = ProofVerifier::Strict();
+    if (!CheckTransaction(tx, state, verifier))
+        return error("%s: CheckTransaction failed", __func__);
+
+    // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
+    if (!ContextualCheckTransaction(tx, state, chainparams, nHeight, false)) {
+        return error("%s: ContextualCheckTransaction failed", __func__);
+    }
+
+    proofCache.Insert(tx.GetHash(), consensusBranchId);
+    return true;
+}
+
 bool AcceptToMemoryPool(
         const CChainParams& chainparams,
         CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-        bool* pfMissingInputs, bool fRejectAbsurdFee)
+        bool* pfMissingInputs, bool fRejectAbsurdFee, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     LOCK(pool.cs); // mempool "read lock" (held through pool.addUnchecked())
@@ -1475,14 +1716,10 @@ bool AcceptToMemoryPool(
         return false;
     }
 
-    auto verifier = ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
-        return error("AcceptToMemoryPool: CheckTransaction failed");
-
-    // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
-    if (!ContextualCheckTransaction(tx, state, chainparams, nextBlockHeight, false)) {
-        return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
-    }
+    // The proofs and signatures have usually been verified already, by a call
+    // to PreVerifyTransaction made before cs_main was taken.
+    if (!PreVerifyTransaction(chainparams, state, tx, nextBlockHeight))
+        return error("AcceptToMemoryPool: PreVerifyTransaction failed");
 
     // DoS mitigation: reject transactions expiring soon
     // Note that if a valid transaction belonging to the wallet is in the mempool and the node is shutdown,
@@ -1545,15 +1782,16 @@ bool AcceptToMemoryPool(
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         for (const CTxIn txin : tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                        return false;
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
@@ -1610,8 +1848,8 @@ bool AcceptToMemoryPool(
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         for (const CTxIn &txin : tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1620,7 +1858,7 @@ bool AcceptToMemoryPool(
         // We don't yet know if the transaction commits to consensusBranchId,
         // but if the entry gets added to the mempool, then it has passed
         // ContextualCheckInputs and therefore this is correct.
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
         unsigned int nSize = entry.GetTxSize();
 
         // Before zcashd 4.2.0, we had a condition here to always accept a tx if it contained
@@ -1672,6 +1910,21 @@ bool AcceptToMemoryPool(
             return state.Error("AcceptToMemoryPool: " + errmsg);
         }
 
+        // Keep the packages tracked for block assembly small, so that
+        // updating them on add and remove stays cheap.
+        {
+            CTxMemPool::setEntries setAncestors;
+            size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+            size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+            size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+            size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+            std::string errString;
+            if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+                return state.DoS(0, error("AcceptToMemoryPool: %s: %s", hash.ToString(), errString),
+                                 REJECT_NONSTANDARD, "too-long-mempool-chain");
+            }
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
@@ -1824,10 +2077,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, const Consensus::P
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
             int nHeight = -1;
             {
-                CCoinsViewCache &view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
+                const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+                if (!coin.IsSpent())
+                    nHeight = coin.nHeight;
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
@@ -1911,87 +2163,12 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
-static bool PrefetchWorker(const Consensus::Params& consensusParams)
-{
-    const CBlockIndex* pblockindex;
-    CBlock nextBlock;
-    int nQueueSize;
-
-    while (true)
-    {
-        mutex_prefetch_queue.lock();
-
-        if (vPindexQueue.size())
-        {
-            pblockindex = *vPindexQueue.begin();
-            vPindexQueue.erase(vPindexQueue.begin());
-            mutex_prefetch_queue.unlock();
-
-            if (ReadBlockFromDisk(nextBlock, pblockindex, consensusParams))
-            {
-                mutex_prefetch_cache.lock();
-                mapPrefetchCache.emplace(std::pair(pblockindex->GetBlockHash(), nextBlock));
-                mutex_prefetch_cache.unlock();
-            }
-        }
-        else
-        {
-            mutex_prefetch_queue.unlock();
-            break;
-        }
-    }
-
-    return true;
-}
-
-void ClearBlockPrefetch()
-{
-    mapPrefetchCache.clear();
-    vPindexQueue.resize(0);
-}
-
-bool ReadBlockFromPrefetch(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+std::unique_ptr<CBlockPrefetcher> MakeBlockPrefetcher(const Consensus::Params& consensusParams, CBlockPrefetcher::NextFunc fnNext)
 {
-    bool block_result = false;
-    const uint256 hash = pindex->GetBlockHash();
-    const int height = pindex->nHeight;
-
-    if (mapPrefetchCache.find(hash) != mapPrefetchCache.end()) {
-        block = mapPrefetchCache.at(hash);
-        block_result = true;
+    if (!fBlockPrefetchEnabled) {
+        return nullptr;
     }
-
-    if (height % nPrefetchNumBlocks == 0)
-    {
-        ClearBlockPrefetch();
-        vPindexQueue.reserve(nPrefetchNumBlocks);
-        std::vector<std::future<bool>> vPrefetchFutures;
-        CBlockIndex *pindex_next = chainActive.Next(pindex);
-        int j = 0;
-
-        while (pindex_next && j < nPrefetchNumBlocks) {
-            vPindexQueue.emplace_back(pindex_next);
-            pindex_next = chainActive.Next(pindex_next);
-            j++;
-        }
-
-        for (int b = 0; b < nPrefetchNumThreads; b++)
-        {
-            vPrefetchFutures.emplace_back(std::async(std::launch::async, PrefetchWorker, consensusParams));
-        }
-
-        for (auto &one_future : vPrefetchFutures) {
-            one_future.get();
-        }
-
-        vPrefetchFutures.resize(0);
-    }
-
-    if (!block_result) {
-        block_result = ReadBlockFromDisk(block, pindex, consensusParams);
-    }
-
-    return block_result;
+    return std::make_unique<CBlockPrefetcher>(consensusParams, nPrefetchNumBlocks, nPrefetchNumThreads, fnNext);
 }
 
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
@@ -2217,20 +2394,9 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         for (const CTxIn &txin : tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
-            // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.emplace_back();
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
 
@@ -2238,7 +2404,7 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     inputs.SetNullifiers(tx, true);
 
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -2288,14 +2454,14 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
-            if (coins->IsCoinBase()) {
+            if (coin.IsCoinBase()) {
                 // Ensure that coinbases are matured
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY) {
                     return state.Invalid(
-                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
+                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
                 }
 
@@ -2311,8 +2477,8 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs(): txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -2372,11 +2538,11 @@ bool ContextualCheckInputs(
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, consensusBranchId, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, consensusBranchId, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2389,7 +2555,7 @@ bool ContextualCheckInputs(
                     // notice their transactions failing before a second network
                     // upgrade occurs.
                     auto prevConsensusBranchId = PrevEpochBranchId(consensusBranchId, consensusParams);
-                    CScriptCheck checkPrev(*coins, tx, i, flags, cacheStore, prevConsensusBranchId, &txdata);
+                    CScriptCheck checkPrev(coin.out, tx, i, flags, cacheStore, prevConsensusBranchId, &txdata);
                     if (checkPrev()) {
                         return state.DoS(
                             10, false, REJECT_INVALID, strprintf(
@@ -2404,7 +2570,7 @@ bool ContextualCheckInputs(
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, consensusBranchId, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2479,45 +2645,48 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
 
 } // anon namespace
 
+enum DisconnectResult
+{
+    DISCONNECT_OK,      // All good.
+    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
+    DISCONNECT_FAILED   // Something else went wrong.
+};
+
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
- * @return True on success.
+ * @return A DisconnectResult as an int
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static DisconnectResult ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
 
-    return fClean;
-}
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+        } else {
+            error("%s: undo data adding output to missing transaction", __func__);
+            return DISCONNECT_FAILED;
+        }
+    }
+    // The potential_overwrite parameter to AddCoin is only allowed to be false if we know for
+    // sure that the coin did not already exist in the cache. As we have queried for that above
+    // using HaveCoin, we don't need to guess. When fClean is false, a coin already existed and
+    // it is an overwrite.
+    view.AddCoin(out, std::move(undo), !fClean);
 
-enum DisconnectResult
-{
-    DISCONNECT_OK,      // All good.
-    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
-    DISCONNECT_FAILED   // Something else went wrong.
-};
+    return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
+}
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  When UNCLEAN or FAILED is returned, view is left in an indeterminate state.
@@ -2579,21 +2748,16 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        bool is_coinbase = tx.IsCoinBase();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != coin.nHeight || is_coinbase != coin.fCoinBase) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+            }
         }
 
         // unspend nullifiers
@@ -2601,16 +2765,17 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size()) {
                 error("DisconnectBlock(): transaction and undo data inconsistent");
                 return DISCONNECT_FAILED;
             }
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
-                    fClean = false;
+                DisconnectResult res = ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out);
+                if (res == DISCONNECT_FAILED)
+                    return DISCONNECT_FAILED;
+                fClean = fClean && res != DISCONNECT_UNCLEAN;
 
                 // insightexplorer
                 // https://github.com/bitpay/bitcoin/commit/017f548ea6d89423ef568117447e61dd5707ec42#diff-7ec3c68a81efff79b6ca22ac1f1eabbaR2304
@@ -2629,7 +2794,7 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
                         // restore unspent index
                         addressUnspentIndex.push_back(make_pair(
                             CAddressUnspentKey(scriptType, addrHash, input.prevout.hash, input.prevout.n),
-                            CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+                            CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, view.AccessCoin(input.prevout).nHeight)));
                     }
                 }
                 // insightexplorer
@@ -2714,13 +2879,238 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/**
+ * Closure representing the verification of the JoinSplit proofs of a single
+ * transaction.
+ */
+class CSproutProofCheck
+{
+private:
+    const CTransaction *ptx;
+
+public:
+    CSproutProofCheck(): ptx(0) {}
+    CSproutProofCheck(const CTransaction& txIn) : ptx(&txIn) {}
+
+    bool operator()() {
+        auto verifier = ProofVerifier::Strict();
+        for (const JSDescription &joinsplit : ptx->vJoinSplit) {
+            if (!verifier.VerifySprout(joinsplit, ptx->joinSplitPubKey)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void swap(CSproutProofCheck &check) {
+        std::swap(ptx, check.ptx);
+    }
+};
+
+/** A group of transactions whose Sapling descriptions are verified together. */
+struct CSaplingBatch
+{
+    SaplingBatchValidator validator;
+    std::vector<const CTransaction*> vtx;
+    size_t nDescriptions = 0;
+    bool fValid = true;
+};
+
+/**
+ * Closure representing the verification of a CSaplingBatch. The result is
+ * recorded in the batch instead of being returned, so that the caller can
+ * tell a failed batch (which it re-checks transaction by transaction) apart
+ * from a failed script or JoinSplit proof.
+ */
+class CSaplingBatchCheck
+{
+private:
+    CSaplingBatch *pbatch;
+
+public:
+    CSaplingBatchCheck(): pbatch(0) {}
+    CSaplingBatchCheck(CSaplingBatch& batchIn) : pbatch(&batchIn) {}
+
+    bool operator()() {
+        pbatch->fValid = pbatch->validator.Validate();
+        return true;
+    }
+
+    void swap(CSaplingBatchCheck &check) {
+        std::swap(pbatch, check.pbatch);
+    }
+};
+
+/**
+ * Closure representing the check of the Equihash solution and proof of work
+ * of a block header. Like CSaplingBatchCheck, the result is recorded rather
+ * than returned, so that one invalid header doesn't stop the others from
+ * being checked.
+ */
+class CHeaderPowCheck
+{
+private:
+    const CBlockHeader *pheader;
+    const Consensus::Params *pparams;
+    unsigned char *pfValid;
+
+public:
+    CHeaderPowCheck(): pheader(NULL), pparams(NULL), pfValid(NULL) {}
+    CHeaderPowCheck(const CBlockHeader& headerIn, const Consensus::Params& paramsIn, unsigned char& fValidIn) :
+        pheader(&headerIn), pparams(&paramsIn), pfValid(&fValidIn) {}
+
+    bool operator()() {
+        *pfValid = CheckEquihashSolution(pheader, *pparams) &&
+                   CheckProofOfWork(pheader->GetHash(), pheader->nBits, *pparams);
+        return true;
+    }
+
+    void swap(CHeaderPowCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(pparams, check.pparams);
+        std::swap(pfValid, check.pfValid);
+    }
+};
+
+/** Any of the checks that are handed to the script check threads. */
+class CValidationCheck
+{
+private:
+    std::variant<CScriptCheck, CSproutProofCheck, CSaplingBatchCheck, CHeaderPowCheck> check;
+
+public:
+    CValidationCheck() {}
+    CValidationCheck(CScriptCheck&& checkIn) : check(std::move(checkIn)) {}
+    CValidationCheck(CSproutProofCheck&& checkIn) : check(std::move(checkIn)) {}
+    CValidationCheck(CSaplingBatchCheck&& checkIn) : check(std::move(checkIn)) {}
+    CValidationCheck(CHeaderPowCheck&& checkIn) : check(std::move(checkIn)) {}
+
+    bool operator()() {
+        return std::visit([](auto& c) { return c(); }, check);
+    }
+
+    void swap(CValidationCheck &other) {
+        check.swap(other.check);
+    }
+};
+
+static CCheckQueue<CValidationCheck> scriptcheckqueue(128);
 
 void ThreadScriptCheck() {
     RenameThread(strprintf("%s-scriptch", COIN_NICKNAME).c_str());
     scriptcheckqueue.Thread();
 }
 
+void ThreadTxPreVerify() {
+    RenameThread(strprintf("%s-txverify", COIN_NICKNAME).c_str());
+    const CChainParams& chainparams = Params();
+    nTxPreVerifyThreads++;
+
+    while (true) {
+        std::shared_ptr<CTxPreVerification> item;
+        {
+            boost::unique_lock<boost::mutex> lock(csTxPreVerify);
+            while (queueTxPreVerify.empty())
+                condTxPreVerify.wait(lock);
+            item = queueTxPreVerify.front();
+            queueTxPreVerify.pop_front();
+        }
+
+        CValidationState state;
+        bool fValid = PreVerifyTransaction(chainparams, state, item->tx, item->nHeight);
+        {
+            boost::unique_lock<boost::mutex> lock(csTxPreVerify);
+            item->state = state;
+            item->fValid = fValid;
+            item->fDone = true;
+        }
+        WakeMessageHandler();
+    }
+}
+
+/**
+ * Hands a shielded transaction from a peer to the pre-verification threads.
+ * Once a peer has transactions waiting, its later ones wait behind them too,
+ * so that they reach the mempool in the order they were sent; a peer that
+ * has MAX_TX_PREVERIFY_PER_PEER waiting has its next ones verified right
+ * away instead. Returns false if the caller should verify and process the
+ * transaction itself.
+ */
+static bool QueueTxPreVerification(const CChainParams& chainparams, NodeId nodeid, const CTransaction& tx, int nHeight)
+{
+    if (nTxPreVerifyThreads == 0)
+        return false;
+
+    auto item = std::make_shared<CTxPreVerification>();
+    {
+        boost::unique_lock<boost::mutex> lock(csTxPreVerify);
+        auto it = mapTxPreVerifyPending.find(nodeid);
+        if (it == mapTxPreVerifyPending.end())
+            return false;
+        bool fShielded = !tx.vJoinSplit.empty() || !tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty();
+        if (it->second.empty() && !fShielded)
+            return false;
+
+        item->tx = tx;
+        item->nHeight = nHeight;
+        if (it->second.size() < MAX_TX_PREVERIFY_PER_PEER) {
+            it->second.push_back(item);
+            queueTxPreVerify.push_back(item);
+            condTxPreVerify.notify_one();
+            return true;
+        }
+    }
+
+    CValidationState state;
+    bool fValid = PreVerifyTransaction(chainparams, state, tx, nHeight);
+    boost::unique_lock<boost::mutex> lock(csTxPreVerify);
+    auto it = mapTxPreVerifyPending.find(nodeid);
+    if (it != mapTxPreVerifyPending.end()) {
+        item->state = state;
+        item->fValid = fValid;
+        item->fDone = true;
+        it->second.push_back(item);
+    }
+    return true;
+}
+
+/**
+ * Checks the Equihash solutions and proof of work of the headers that are not
+ * already in the block index, on the script check threads. vPowValid[i] is
+ * set if headers[i] passed, so that AcceptBlockHeader can skip those checks.
+ * This is meant to be called without cs_main, which is only taken briefly.
+ */
+static void CheckHeadersPow(const std::vector<CBlockHeader>& headers, std::vector<unsigned char>& vPowValid, const Consensus::Params& params)
+{
+    vPowValid.assign(headers.size(), false);
+
+    std::vector<uint256> vHashes;
+    vHashes.reserve(headers.size());
+    for (const CBlockHeader& header : headers) {
+        vHashes.push_back(header.GetHash());
+    }
+
+    std::vector<CValidationCheck> vChecks;
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < headers.size(); i++) {
+            if (mapBlockIndex.count(vHashes[i]) == 0) {
+                vChecks.emplace_back(CHeaderPowCheck(headers[i], params, vPowValid[i]));
+            }
+        }
+    }
+
+    if (nScriptCheckThreads && vChecks.size() > 1) {
+        CCheckQueueControl<CValidationCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        for (CValidationCheck& check : vChecks) {
+            check();
+        }
+    }
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -2754,14 +3144,14 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         fExpensiveChecks = false;
     }
 
-    // proof verification is expensive, disable if possible
-    auto verifier = fExpensiveChecks ? ProofVerifier::Strict() : ProofVerifier::Disabled();
+    // JoinSplit proofs are verified below, on the script check threads.
+    auto verifier = ProofVerifier::Disabled();
 
     // If in initial block download, and this block is an ancestor of a checkpoint,
     // and -ibdskiptxverification is set, disable all transaction checks.
     bool fCheckTransactions = ShouldCheckTransactions(chainparams, pindex);
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
+    // Check it again in case a previous version let a bad block in
     if (!CheckBlock(block, state, chainparams, verifier, !fJustCheck, !fJustCheck, fCheckTransactions))
         return false;
 
@@ -2815,10 +3205,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     for (const CTransaction& tx : block.vtx) {
-        const CCoins* coins = view.AccessCoins(tx.GetHash());
-        if (coins && !coins->IsPruned())
-            return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                             REJECT_INVALID, "bad-txns-BIP30");
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (view.HaveCoin(COutPoint(tx.GetHash(), o))) {
+                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                 REJECT_INVALID, "bad-txns-BIP30");
+            }
+        }
     }
 
     unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
@@ -2827,7 +3219,42 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    // The Sapling proofs and signatures of the block's transactions are
+    // verified in batches, split so that each script check thread gets a
+    // roughly equal share. The batches are declared before the check queue
+    // control, so that on an early return the control's destructor waits for
+    // the queued batch checks before the batches are destroyed.
+    size_t nSaplingDescriptions = 0;
+    if (fCheckTransactions) {
+        for (const CTransaction& tx : block.vtx) {
+            nSaplingDescriptions += tx.vShieldedSpend.size() + tx.vShieldedOutput.size();
+        }
+    }
+    const size_t nSaplingBatchTarget = std::max<size_t>(1, nSaplingDescriptions / std::max(1, nScriptCheckThreads));
+    std::vector<std::unique_ptr<CSaplingBatch>> vSaplingBatches;
+    vSaplingBatches.emplace_back(new CSaplingBatch());
+
+    // The queued script checks point into this, so it too must outlive the
+    // check queue control.
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
+
+    // Script checks are only queued when fExpensiveChecks is set, but
+    // Sapling proofs are also checked when only fCheckTransactions is set.
+    CCheckQueueControl<CValidationCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
+    // Shielded proofs are verified on the script check threads, or inline
+    // if there are none. A failed JoinSplit proof fails the queue in the
+    // same way as a failed script.
+    std::vector<CValidationCheck> vShieldedChecks;
+    auto checkShielded = [&](CValidationCheck&& check) {
+        if (!nScriptCheckThreads)
+            return check();
+        vShieldedChecks.clear();
+        vShieldedChecks.push_back(std::move(check));
+        control.Add(vShieldedChecks);
+        return true;
+    };
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
@@ -2868,8 +3295,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     size_t total_sapling_tx = 0;
 
-    std::vector<PrecomputedTransactionData> txdata;
-    txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
@@ -2943,6 +3368,41 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
         txdata.emplace_back(tx);
 
+        // Skip the shielded proofs and signatures if they were verified when
+        // the transaction was accepted into the mempool.
+        bool fShieldedVerified = false;
+        if (fCheckTransactions && proofCache.Contains(hash, consensusBranchId)) {
+            fShieldedVerified = true;
+            if (!fJustCheck) {
+                // The entry won't be needed again unless there is a reorg
+                proofCache.Erase(hash, consensusBranchId);
+            }
+        }
+
+        // ContextualCheckBlock only checks the signatures, so that the proofs
+        // can be batched here. The signatures are checked again in the batch.
+        if (fCheckTransactions && !fShieldedVerified) {
+            CSaplingBatch& batch = *vSaplingBatches.back();
+            if (!ContextualCheckShieldedInputs(tx, state, chainparams, pindex->nHeight, true, IsInitialBlockDownload, &batch.validator)) {
+                return false;
+            }
+            if (!(tx.vShieldedSpend.empty() && tx.vShieldedOutput.empty())) {
+                batch.vtx.push_back(&tx);
+                batch.nDescriptions += tx.vShieldedSpend.size() + tx.vShieldedOutput.size();
+                if (batch.nDescriptions >= nSaplingBatchTarget) {
+                    checkShielded(CSaplingBatchCheck(batch));
+                    vSaplingBatches.emplace_back(new CSaplingBatch());
+                }
+            }
+        }
+
+        if (fExpensiveChecks && !fShieldedVerified && !tx.vJoinSplit.empty()) {
+            if (!checkShielded(CSproutProofCheck(tx))) {
+                return state.DoS(100, error("ConnectBlock(): joinsplit does not verify"),
+                                 REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+            }
+        }
+
         if (!tx.IsCoinBase())
         {
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
@@ -2951,7 +3411,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
             if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks, flags, fCacheResults, txdata[i], chainparams.GetConsensus(), consensusBranchId, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
-            control.Add(vChecks);
+            std::vector<CValidationCheck> vValidationChecks;
+            vValidationChecks.reserve(vChecks.size());
+            for (CScriptCheck& check : vChecks) {
+                vValidationChecks.emplace_back(std::move(check));
+            }
+            control.Add(vValidationChecks);
         }
 
         // insightexplorer
@@ -3076,8 +3541,36 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                                block.vtx[0].GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 
-    if (!control.Wait())
+    if (!vSaplingBatches.back()->vtx.empty()) {
+        checkShielded(CSaplingBatchCheck(*vSaplingBatches.back()));
+    }
+
+    bool fChecksValid = control.Wait();
+
+    for (const auto& batch : vSaplingBatches) {
+        if (batch->fValid)
+            continue;
+        // The batch does not tell us which transaction is invalid, so check
+        // them individually to find it and report the precise reason.
+        for (const CTransaction* ptx : batch->vtx) {
+            if (!ContextualCheckShieldedInputs(*ptx, state, chainparams, pindex->nHeight, true))
+                return false;
+        }
+        LogPrintf("%s: Sapling batch validation failed, but all transactions in the batch are valid (block %s)\n",
+                  __func__, block.GetHash().ToString());
+    }
+
+    if (!fChecksValid) {
+        // Report an invalid JoinSplit proof precisely; script failures are
+        // reported without a reason, as before.
+        for (const CTransaction& tx : block.vtx) {
+            if (fExpensiveChecks && !tx.vJoinSplit.empty() && !CSproutProofCheck(tx)()) {
+                return state.DoS(100, error("ConnectBlock(): joinsplit does not verify"),
+                                 REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+            }
+        }
         return state.DoS(100, false);
+    }
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
@@ -3213,17 +3706,21 @@ bool static FlushStateToDisk(
     if (nLastFlush == 0) {
         nLastFlush = nNow;
     }
-    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // A snapshot that is still being written in the background holds on to its memory.
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage() + pcoinsdbview->PendingMemoryUsage();
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
     // The cache is over the limit, we have to write now.
     bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    // Writing in the background, start a little early so that the writer is idle by the time the cache fills up.
+    bool fCacheNearlyFull = fBackgroundFlush && mode == FLUSH_STATE_IF_NEEDED && pcoinsdbview->PendingMemoryUsage() == 0 &&
+        pcoinsTip->DynamicMemoryUsage() * 100 > (uint64_t)nCoinCacheUsage * nBackgroundFlushThreshold;
     // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
     bool fPeriodicFlush = mode == FLUSH_STATE_PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000;
     // Combine all conditions that result in a full cache flush.
-    bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune;
+    bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fCacheNearlyFull || fPeriodicFlush || fFlushForPrune;
     // Write blocks and block index to disk.
     if (fDoFullFlush || fPeriodicWrite) {
         // Depend on nMinDiskSpace to ensure we can write block index
@@ -3240,32 +3737,49 @@ bool static FlushStateToDisk(
                 it = setDirtyFileInfo.erase(it);
             }
             std::vector<const CBlockIndex*> vBlocks;
+            std::vector<CBlockIndex*> vTrimmedBlocks;
             vBlocks.reserve(setDirtyBlockIndex.size());
+            vTrimmedBlocks.reserve(setDirtyBlockIndex.size());
             for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
                 vBlocks.push_back(*it);
+                vTrimmedBlocks.push_back(*it);
                 it = setDirtyBlockIndex.erase(it);
             }
             if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
                 return AbortNode(state, "Files to write to block index database");
             }
+            // The written entries hold the Equihash solutions now, so they
+            // no longer need to be kept in memory.
+            for (CBlockIndex* pindex : vTrimmedBlocks) {
+                pindex->TrimSolution();
+            }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
+        // Finally remove any pruned files, once no chainstate write still depends on them
+        if (fFlushForPrune) {
+            if (!pcoinsdbview->WaitForBackgroundWrite())
+                return AbortNode(state, "Failed to write to coin database");
             UnlinkPrunedFiles(setFilesToPrune);
+        }
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // The block index was synced above, so a background write that is
+        // interrupted can be replayed from the block files on startup.
+        if (fBackgroundFlush && mode != FLUSH_STATE_ALWAYS && !fFlushForPrune) {
+            if (!pcoinsdbview->WriteInBackground(pcoinsTip->TakeSnapshot()))
+                return AbortNode(state, "Failed to write to coin database");
+        } else if (!pcoinsTip->Flush()) {
             return AbortNode(state, "Failed to write to coin database");
+        }
         nLastFlush = nNow;
     }
     // Don't flush the wallet witness cache (SetBestChain()) here, see #4301
@@ -3380,7 +3894,7 @@ void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     auto tx = tfm::format("%lu", (unsigned long)chainActive.Tip()->nChainTx);
     auto date = DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime());
     auto progress = tfm::format("%f", Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip()));
-    auto cache = tfm::format("%.1fMiB(%utx)", pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
+    auto cache = tfm::format("%.1fMiB(%utxo)", pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), pcoinsTip->GetCacheSize());
 
     TracingInfo("main", "UpdateTip: new best",
         "hash", hash.c_str(),
@@ -3408,14 +3922,20 @@ void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
  * Disconnect chainActive's tip. You probably want to call mempool.removeForReorg and
  * mempool.removeWithoutBranchId after this, with cs_main held.
  */
-bool static DisconnectTip(CValidationState &state, const CChainParams& chainparams, bool fBare = false)
+bool static DisconnectTip(CValidationState &state, const CChainParams& chainparams, bool fBare = false, CBlockPrefetcher* pprefetcher = NULL)
 {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
-    // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pindexDelete, chainparams.GetConsensus()))
+    // Read block from disk, or use the prefetched copy without copying it.
+    std::shared_ptr<const CBlock> pblock;
+    CBlock blockOnDisk;
+    if (pprefetcher) {
+        pblock = pprefetcher->Get(pindexDelete);
+        if (!pblock)
+            return AbortNode(state, "Failed to read block");
+    } else if (!ReadBlockFromDisk(blockOnDisk, pindexDelete, chainparams.GetConsensus()))
         return AbortNode(state, "Failed to read block");
+    const CBlock& block = pblock ? *pblock : blockOnDisk;
     // Apply the block atomically to the chain state.
     uint256 sproutAnchorBeforeDisconnect = pcoinsTip->GetBestAnchor(SPROUT);
     uint256 saplingAnchorBeforeDisconnect = pcoinsTip->GetBestAnchor(SAPLING);
@@ -3634,7 +4154,7 @@ static void PruneBlockIndexCandidates() {
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
  */
-static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const CBlock* pblock)
+static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const CBlock* pblock, CBlockPrefetcher* pprefetcher)
 {
     AssertLockHeld(cs_main);
     bool fInvalidFound = false;
@@ -3694,9 +4214,15 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
         // Connect new blocks.
         for (CBlockIndex *pindexConnect : reverse_iterate(vpindexToConnect)) {
             const CBlock* pconnectBlock;
+            std::shared_ptr<const CBlock> pprefetchedBlock;
             CBlock block;
             if (pblock && pindexConnect == pindexMostWork) {
                 pconnectBlock = pblock;
+            } else if (pprefetcher) {
+                pprefetchedBlock = pprefetcher->Get(pindexConnect);
+                if (!pprefetchedBlock)
+                    return AbortNode(state, "Failed to read block");
+                pconnectBlock = pprefetchedBlock.get();
             } else {
                 // read the block to be connected from disk
                 if (!ReadBlockFromDisk(block, pindexConnect, chainparams.GetConsensus()))
@@ -3753,6 +4279,19 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
 {
     CBlockIndex *pindexMostWork = NULL;
     CBlockIndex *pindexNewTip = NULL;
+    // When catching up (e.g. during a reindex), the blocks are read ahead of
+    // connecting them by one prefetcher, which is kept across the steps
+    // below. It reads along the chain towards the current pindexMostWork, as
+    // far as the blocks we have.
+    std::unique_ptr<CBlockPrefetcher> prefetcher;
+    auto fnNext = [&pindexMostWork](const CBlockIndex* pprev) -> const CBlockIndex* {
+        if (!pindexMostWork || pindexMostWork->nHeight <= pprev->nHeight)
+            return nullptr;
+        const CBlockIndex* pindexNext = pindexMostWork->GetAncestor(pprev->nHeight + 1);
+        if (pindexNext->pprev != pprev || !(pindexNext->nStatus & BLOCK_HAVE_DATA))
+            return nullptr;
+        return pindexNext;
+    };
     do {
         boost::this_thread::interruption_point();
 
@@ -3766,7 +4305,10 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
             if (pindexMostWork == NULL || pindexMostWork == chainActive.Tip())
                 return true;
 
-            if (!ActivateBestChainStep(state, chainparams, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : NULL))
+            if (!prefetcher && pindexMostWork->nHeight - chainActive.Height() >= MIN_BLOCK_PREFETCH_SPAN)
+                prefetcher = MakeBlockPrefetcher(chainparams.GetConsensus(), fnNext);
+
+            if (!ActivateBestChainStep(state, chainparams, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : NULL, prefetcher.get()))
                 return false;
 
             pindexNewTip = chainActive.Tip();
@@ -3784,11 +4326,30 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
             int nBlockEstimate = 0;
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints());
+            // Peers that asked for it get the block itself as a compact
+            // block, saving them the round trip of a "getdata".
+            std::unique_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+            if (pblock && pblock->GetHash() == hashNewTip && pblock->vtx.size() <= MAX_CMPCTBLOCK_TXS)
+                pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
             {
-                LOCK(cs_vNodes);
-                for (CNode* pnode : vNodes)
-                    if (nNewHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                LOCK2(cs_main, cs_vNodes);
+                for (CNode* pnode : vNodes) {
+                    if (nNewHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        CNodeState *state = State(pnode->GetId());
+                        bool fSendCompact = pcmpctblock && state && state->fPreferHeaderAndIDs;
+                        if (fSendCompact) {
+                            // Not to the peer that gave us the block
+                            LOCK(pnode->cs_inventory);
+                            fSendCompact = !pnode->filterInventoryKnown.contains(hashNewTip);
+                        }
+                        if (fSendCompact) {
+                            pnode->AddInventoryKnown(CInv(MSG_BLOCK, hashNewTip));
+                            pnode->PushMessage("cmpctblock", *pcmpctblock);
+                        } else {
+                            pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                        }
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -4329,14 +4890,24 @@ bool ContextualCheckBlock(
     const Consensus::Params& consensusParams = chainparams.GetConsensus();
 
     if (fCheckTransactions) {
+        // The Sapling proofs are left to the batch in ConnectBlock, but the
+        // signatures are cheap enough to check here, so that a block with an
+        // invalid signature is neither stored nor relayed.
+        SaplingBatchValidator saplingBatch(false);
+
         // Check that all transactions are finalized
         for (const CTransaction& tx : block.vtx) {
 
             // Check transaction contextually against consensus rules at block height
-            if (!ContextualCheckTransaction(tx, state, chainparams, nHeight, true)) {
+            if (!ContextualCheckTransaction(tx, state, chainparams, nHeight, true, IsInitialBlockDownload, false)) {
                 return false; // Failure reason has been set in validation state object
             }
 
+            // Checks the JoinSplit signature, and queues the Sapling signatures
+            if (!ContextualCheckShieldedInputs(tx, state, chainparams, nHeight, true, IsInitialBlockDownload, &saplingBatch)) {
+                return false;
+            }
+
             int nLockTimeFlags = 0;
             int64_t nLockTimeCutoff = (nLockTimeFlags & LOCKTIME_MEDIAN_TIME_PAST)
                                     ? pindexPrev->GetMedianTimePast()
@@ -4346,6 +4917,17 @@ bool ContextualCheckBlock(
                                  REJECT_INVALID, "bad-txns-nonfinal");
             }
         }
+
+        if (!saplingBatch.Validate()) {
+            // As in ConnectBlock, find the invalid transaction to report the
+            // precise reason.
+            for (const CTransaction& tx : block.vtx) {
+                if (!ContextualCheckShieldedInputs(tx, state, chainparams, nHeight, true))
+                    return false;
+            }
+            LogPrintf("%s: Sapling signature batch validation failed, but all transactions in block %s are valid\n",
+                      __func__, block.GetHash().ToString());
+        }
     }
 
     // Enforce BIP 34 rule that the coinbase starts with serialized block height.
@@ -4365,7 +4947,12 @@ bool ContextualCheckBlock(
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+/**
+ * Adds a block header to the block index. fCheckPOW is only cleared for
+ * headers whose Equihash solution and proof of work were already checked by
+ * CheckHeadersPow.
+ */
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckPOW=true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -4382,7 +4969,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
         return true;
     }
 
-    if (!CheckBlockHeader(block, state, chainparams))
+    if (!CheckBlockHeader(block, state, chainparams, fCheckPOW))
         return false;
 
     // Get prev block index
@@ -4412,9 +4999,10 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
  * Store block on disk.
  * If dbp is non-NULL, the file is known to already reside on disk.
  *
- * JoinSplit proofs are not verified here; the only caller of AcceptBlock
- * (ProcessNewBlock) later invokes ActivateBestChain, which ultimately calls
- * ConnectBlock in a manner that can verify the proofs
+ * JoinSplit and Sapling proofs are not verified here; the only caller of
+ * AcceptBlock (ProcessNewBlock) later invokes ActivateBestChain, which
+ * ultimately calls ConnectBlock in a manner that can verify the proofs.
+ * Their signatures are checked by ContextualCheckBlock.
  */
 static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, CDiskBlockPos* dbp)
 {
@@ -4503,7 +5091,7 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, c
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash()) | fForceProcessing;
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1) | fForceProcessing;
 
         // Store to disk
         CBlockIndex *pindex = NULL;
@@ -4727,7 +5315,7 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
 
 bool static LoadBlockIndexDB(const CChainParams& chainparams)
 {
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex, chainparams))
+    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex, chainparams, std::max(nScriptCheckThreads, 1), fTrustBlockIndex))
         return false;
 
     // Calculate nChainWork
@@ -4739,10 +5327,16 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    for (const std::pair<int, CBlockIndex*>& item : vSortedByHeight)
+    // The work of each block doesn't depend on the others, so it is computed
+    // in parallel; only the sums have to be done in height order.
+    std::vector<arith_uint256> vBlockProof(vSortedByHeight.size());
+    ParallelFor(vSortedByHeight.size(), std::max(nScriptCheckThreads, 1), [&](size_t i) {
+        vBlockProof[i] = GetBlockProof(*vSortedByHeight[i].second);
+    });
+    for (size_t i = 0; i < vSortedByHeight.size(); i++)
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        CBlockIndex* pindex = vSortedByHeight[i].second;
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + vBlockProof[i];
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
         if (pindex->nTx > 0) {
@@ -4936,6 +5530,12 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
     auto verifier = ProofVerifier::Disabled(); // No need to verify JoinSplits twice
     bool fCheckTransactions = true;
 
+    // Read ahead down the chain, as far as the check depth goes
+    int nMinHeight = chainActive.Height() - nCheckDepth;
+    auto prefetcher = MakeBlockPrefetcher(chainparams.GetConsensus(), [nMinHeight](const CBlockIndex* pindex) -> const CBlockIndex* {
+        return pindex->pprev && pindex->pprev->nHeight >= nMinHeight ? pindex->pprev : nullptr;
+    });
+
     for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev)
     {
         boost::this_thread::interruption_point();
@@ -4943,10 +5543,16 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
 
-        CBlock block;
         // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
+        std::shared_ptr<const CBlock> pblock;
+        CBlock blockOnDisk;
+        if (prefetcher) {
+            pblock = prefetcher->Get(pindex);
+            if (!pblock)
+                return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        } else if (!ReadBlockFromDisk(blockOnDisk, pindex, chainparams.GetConsensus()))
             return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        const CBlock& block = pblock ? *pblock : blockOnDisk;
 
         // check level 1: verify block validity
         fCheckTransactions = ShouldCheckTransactions(chainparams, pindex);
@@ -4987,14 +5593,23 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
+        prefetcher = MakeBlockPrefetcher(chainparams.GetConsensus(), [](const CBlockIndex* pindex) -> const CBlockIndex* {
+            return chainActive.Next(pindex);
+        });
         CBlockIndex *pindex = pindexState;
         while (pindex != chainActive.Tip()) {
             boost::this_thread::interruption_point();
             uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))));
             pindex = chainActive.Next(pindex);
-            CBlock block;
-            if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
+            std::shared_ptr<const CBlock> pblock;
+            CBlock blockOnDisk;
+            if (prefetcher) {
+                pblock = prefetcher->Get(pindex);
+                if (!pblock)
+                    return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            } else if (!ReadBlockFromDisk(blockOnDisk, pindex, chainparams.GetConsensus()))
                 return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            const CBlock& block = pblock ? *pblock : blockOnDisk;
             if (!ConnectBlock(block, state, pindex, coins, chainparams))
                 return error("VerifyDB(): *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
         }
@@ -5086,6 +5701,9 @@ bool RewindBlockIndex(const CChainParams& chainparams, bool& clearWitnessCaches)
 
     CValidationState state;
     CBlockIndex* pindex = chainActive.Tip();
+    auto prefetcher = MakeBlockPrefetcher(chainparams.GetConsensus(), [lastValidHeight](const CBlockIndex* pindexIter) -> const CBlockIndex* {
+        return pindexIter->pprev && pindexIter->pprev->nHeight > lastValidHeight ? pindexIter->pprev : nullptr;
+    });
     while (chainActive.Height() > lastValidHeight) {
         if (fPruneMode && !(chainActive.Tip()->nStatus & BLOCK_HAVE_DATA)) {
             // If pruning, don't try rewinding past the HAVE_DATA point;
@@ -5095,7 +5713,7 @@ bool RewindBlockIndex(const CChainParams& chainparams, bool& clearWitnessCaches)
             // of the blockchain).
             break;
         }
-        if (!DisconnectTip(state, chainparams, true)) {
+        if (!DisconnectTip(state, chainparams, true, prefetcher.get())) {
             return error("RewindBlockIndex: unable to disconnect block at height %i", pindex->nHeight);
         }
         // Occasionally flush state to disk.
@@ -5585,7 +6203,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -5614,7 +6233,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -5661,6 +6280,19 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // A peer that is behind gets nothing from our mempool
+                        // being close to its own, so send it the full block.
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH &&
+                            block.vtx.size() <= MAX_CMPCTBLOCK_TXS)
+                        {
+                            CBlockHeaderAndShortTxIDs cmpctblock(block);
+                            pfrom->PushMessage("cmpctblock", cmpctblock);
+                        } else {
+                            pfrom->PushMessage("block", block);
+                        }
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         bool send = false;
@@ -5743,7 +6375,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -5762,6 +6394,163 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+/**
+ * Hands a block received from pfrom, in full or rebuilt from a compact
+ * block, to ProcessNewBlock, and lets the peer know if it was invalid.
+ */
+static void ProcessReceivedBlock(const CChainParams& chainparams, CNode* pfrom, const std::string& strCommand, const CBlock& block, bool fForceProcessing)
+{
+    CValidationState state;
+    ProcessNewBlock(state, chainparams, pfrom, &block, fForceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else {
+        LOCK(cs_main);
+        // This peer gave us a new tip, so it is likely to be the first
+        // to give us the next one too.
+        if (!IsInitialBlockDownload(chainparams.GetConsensus()) && chainActive.Tip()->GetBlockHash() == block.GetHash())
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(State(pfrom->GetId()), pfrom);
+    }
+}
+
+/**
+ * Try to add a transaction received from a peer to the mempool, once its
+ * proofs and signatures have been checked by PreVerifyTransaction, and
+ * resolve any orphans that depended on it.
+ */
+static void ProcessTransaction(const CChainParams& chainparams, CNode* pfrom, const CTransaction& tx, CValidationState& state, bool fPreVerified)
+{
+    LOCK(cs_main);
+
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    CInv inv(MSG_TX, tx.GetHash());
+
+    bool fMissingInputs = false;
+
+    pfrom->setAskFor.erase(inv.hash);
+    mapAlreadyAskedFor.erase(inv);
+
+    if (fPreVerified && !AlreadyHave(inv) && AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        vWorkQueue.push_back(inv.hash);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (set<uint256>::iterator mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
+            {
+                const uint256& orphanHash = *mi;
+                const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(chainparams, mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    vWorkQueue.push_back(orphanHash);
+                    vEraseQueue.push_back(orphanHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                    {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
+                    assert(recentRejects);
+                    recentRejects->insert(orphanHash);
+                }
+                mempool.check(pcoinsTip);
+            }
+        }
+
+        for (uint256 hash : vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
+    else if (fMissingInputs &&
+             tx.vJoinSplit.empty() &&
+             tx.vShieldedSpend.empty() &&
+             tx.vShieldedOutput.empty())
+    {
+        AddOrphanTx(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else {
+        assert(recentRejects);
+        recentRejects->insert(tx.GetHash());
+
+        if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
+                    tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
+            }
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", (string)"tx", state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
 bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -5945,6 +6734,23 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we understand compact blocks, but don't want new
+        // blocks announced that way (yet), see MaybeSetPeerAsAnnouncingHeaderAndIDs.
+        pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -6077,9 +6883,14 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
 
-                    if (chainActive.Tip()->GetBlockTime() > GetTime() - chainparams.GetConsensus().PoWTargetSpacing(pindexBestHeader->nHeight) * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
+                        nodestate->nBlocksInFlight < GetBlocksInTransitLimit(nodestate, pfrom)) {
+                        // A new block is most likely made of transactions
+                        // that are in our mempool already.
+                        if (nodestate->fProvidesHeaderAndIDs)
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -6227,133 +7038,28 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             return true;
         }
 
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv);
-
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs))
-        {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(chainparams, mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            for (uint256 hash : vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
-        else if (fMissingInputs &&
-                 tx.vJoinSplit.empty() &&
-                 tx.vShieldedSpend.empty() &&
-                 tx.vShieldedOutput.empty())
+        // Verify the proofs and signatures without holding cs_main, so that
+        // block validation isn't held up. Shielded transactions go to the
+        // pre-verification threads, so that the message handler can move on
+        // to other peers; ProcessMessages finishes them once they have been
+        // verified. AcceptToMemoryPool reuses the result.
+        bool fSkipPreVerify;
+        int nextBlockHeight;
         {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else {
-            assert(recentRejects);
-            recentRejects->insert(tx.GetHash());
-
-            if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
-                        tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
-                }
-            }
+            LOCK(cs_main);
+            fSkipPreVerify = AlreadyHave(inv) || mempool.IsRecentlyEvicted(inv.hash);
+            nextBlockHeight = chainActive.Height() + 1;
         }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+        if (fSkipPreVerify || !QueueTxPreVerification(chainparams, pfrom->GetId(), tx, nextBlockHeight)) {
+            CValidationState state;
+            bool fPreVerified = fSkipPreVerify || PreVerifyTransaction(chainparams, state, tx, nextBlockHeight);
+            ProcessTransaction(chainparams, pfrom, tx, state, fPreVerified);
         }
     }
 
@@ -6375,6 +7081,12 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // The Equihash checks are the bulk of the work of accepting new
+        // headers, and don't need the chain state, so they are done in
+        // parallel before cs_main is held for the rest.
+        std::vector<unsigned char> vPowValid;
+        CheckHeadersPow(headers, vPowValid, chainparams.GetConsensus());
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -6395,13 +7107,16 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         }
 
         CBlockIndex *pindexLast = NULL;
-        for (const CBlockHeader& header : headers) {
+        for (size_t n = 0; n < headers.size(); n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
+            // Headers that failed CheckHeadersPow are checked again, so that
+            // they are rejected in the usual way.
+            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast, !vPowValid[n])) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -6440,23 +7155,212 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
         // Process all blocks from whitelisted peers, even if not requested,
         // unless we're still syncing with the network.
         // Such an unrequested block may still be processed, subject to the
         // conditions in AcceptBlock().
         bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload(chainparams.GetConsensus());
-        ProcessNewBlock(state, chainparams, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+        ProcessReceivedBlock(chainparams, pfrom, strCommand, block, forceProcessing);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect to anything we know; rather than punish the
+                // peer in AcceptBlockHeader, ask for the headers leading to it.
+                if (!IsInitialBlockDownload(chainparams.GetConsensus()))
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                    return true;
+                }
+            }
+            if (pindex == NULL)
+                return true;
+
+            const uint256 hash = pindex->GetBlockHash();
+            LogPrint("net", "received cmpctblock %s peer=%d\n", hash.ToString(), pfrom->id);
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+            UpdateBlockAvailability(pfrom->GetId(), hash);
+
+            if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+                return true;
+
+            CNodeState *nodestate = State(pfrom->GetId());
+            QueuedBlock *queuedBlock = GetBlockInFlight(pfrom->GetId(), hash);
+
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                    pindex->nTx != 0) { // We had this block at some point, but pruned it
+                if (queuedBlock != NULL) {
+                    // We asked for this block, but our mempool will not be
+                    // much help in rebuilding it, so get it in full.
+                    std::vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            // If we're not close to the tip yet, leave it to the parallel block download
+            if (queuedBlock == NULL && !CanDirectFetch(chainparams.GetConsensus()))
+                return true;
+
+            // Only blocks that could become our tip are worth the lookups below
+            if (pindex->nHeight > chainActive.Height() + 2) {
+                if (queuedBlock != NULL) {
+                    // We asked for this block, so get it in full rather than
+                    // leave it to time out.
+                    std::vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            if (queuedBlock == NULL) {
+                if (nodestate->nBlocksInFlight >= GetBlocksInTransitLimit(nodestate, pfrom) ||
+                        mapBlocksInFlight.count(hash) >= MAX_BLOCK_DOWNLOAD_SOURCES)
+                    return true;
+                MarkBlockAsInFlight(pfrom->GetId(), hash, chainparams.GetConsensus(), pindex);
+                queuedBlock = GetBlockInFlight(pfrom->GetId(), hash);
+            } else if (queuedBlock->partialBlock) {
+                LogPrint("cmpctblock", "Peer %d sent us a duplicate compact block %s\n", pfrom->id, hash.ToString());
+                return true;
+            }
+
+            queuedBlock->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+            PartiallyDownloadedBlock& partialBlock = *queuedBlock->partialBlock;
+            ReadStatus status = partialBlock.InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                RemoveBlockInFlight(pfrom->GetId(), hash); // Let another peer give us the block
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // The short IDs collided, so the block can't be rebuilt;
+                // it is in flight now, so just request it in full.
+                queuedBlock->partialBlock.reset();
+                std::vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock.IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (req.indexes.empty()) {
+                // Our mempool had every transaction
+                status = partialBlock.FillBlock(block, std::vector<CTransaction>());
+                queuedBlock->partialBlock.reset();
+                if (status == READ_STATUS_OK) {
+                    fBlockReconstructed = true;
+                } else {
+                    std::vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+            } else {
+                req.blockhash = hash;
+                pfrom->PushMessage("getblocktxn", req);
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessReceivedBlock(chainparams, pfrom, strCommand, block, true);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Answer requests for older blocks with the full block, as if it
+            // had been asked for with "getdata". That way a peer can't make
+            // us read lots of blocks from disk without downloading them.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indexes\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            QueuedBlock *queuedBlock = GetBlockInFlight(pfrom->GetId(), resp.blockhash);
+            if (queuedBlock == NULL || !queuedBlock->partialBlock) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            ReadStatus status = queuedBlock->partialBlock->FillBlock(block, resp.txn);
+            queuedBlock->partialBlock.reset();
+            if (status == READ_STATUS_INVALID) {
+                RemoveBlockInFlight(pfrom->GetId(), resp.blockhash); // Let another peer give us the block
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // A mempool transaction must have collided with a short ID
+                std::vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+            } else {
+                fBlockReconstructed = true;
             }
         }
 
+        if (fBlockReconstructed)
+            ProcessReceivedBlock(chainparams, pfrom, strCommand, block, true);
     }
 
 
@@ -6734,7 +7638,8 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         // message would be undesirable as we transmit it ourselves.
     }
 
-    else if (!(strCommand == "tx" || strCommand == "block" || strCommand == "headers" || strCommand == "alert")) {
+    else if (!(strCommand == "tx" || strCommand == "block" || strCommand == "headers" || strCommand == "alert" ||
+               strCommand == "cmpctblock" || strCommand == "blocktxn")) {
         // Ignore unknown commands for extensibility
         LogPrint("net", "Unknown command \"%s\" from peer=%d\n", SanitizeString(strCommand), pfrom->id);
     }
@@ -6745,6 +7650,26 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
 }
 
 // requires LOCK(cs_vRecvMsg)
+/** Processes the transactions from pfrom that have been pre-verified, in the order they were received. */
+static void ProcessPreVerifiedTransactions(const CChainParams& chainparams, CNode* pfrom)
+{
+    std::vector<std::shared_ptr<CTxPreVerification>> vDone;
+    {
+        boost::unique_lock<boost::mutex> lock(csTxPreVerify);
+        auto it = mapTxPreVerifyPending.find(pfrom->GetId());
+        if (it == mapTxPreVerifyPending.end())
+            return;
+        while (!it->second.empty() && it->second.front()->fDone) {
+            vDone.push_back(it->second.front());
+            it->second.pop_front();
+        }
+    }
+
+    for (const auto& item : vDone) {
+        ProcessTransaction(chainparams, pfrom, item->tx, item->state, item->fValid);
+    }
+}
+
 bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
 {
     //if (fDebug)
@@ -6760,6 +7685,8 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
     //
     bool fOk = true;
 
+    ProcessPreVerifiedTransactions(chainparams, pfrom);
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom, chainparams.GetConsensus());
 
@@ -7050,10 +7977,11 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
 
         // Detect whether we're stalling
         int64_t nNow = GetTimeMicros();
-        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
+        if (!pto->fDisconnect && (state.fStallingOutpaced || (state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT))) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
-            // should only happen during initial block download.
+            // should only happen during initial block download. A staller whose block at the head of the window
+            // was delivered by another peer first is disconnected without waiting for the timeout.
             LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
             pto->fDisconnect = true;
         }
@@ -7116,10 +8044,12 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload(params)) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nBlocksInTransitLimit = GetBlocksInTransitLimit(&state, pto);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload(params)) && state.nBlocksInFlight < nBlocksInTransitLimit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex* pindexStalled = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nBlocksInTransitLimit - state.nBlocksInFlight, vToDownload, staller, pindexStalled);
             for (CBlockIndex *pindex : vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), params, pindex);
@@ -7132,6 +8062,14 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
                     LogPrint("net", "Stall started peer=%d\n", staller);
                 }
             }
+            // The window is held up by a block in flight from another peer. Ask for it here too, and
+            // keep whichever copy arrives first.
+            if (staller != -1 && pindexStalled && mapBlocksInFlight.count(pindexStalled->GetBlockHash()) < MAX_BLOCK_DOWNLOAD_SOURCES) {
+                vGetData.push_back(CInv(MSG_BLOCK, pindexStalled->GetBlockHash()));
+                MarkBlockAsInFlight(pto->GetId(), pindexStalled->GetBlockHash(), params, pindexStalled);
+                LogPrint("net", "Requesting block %s (%d) peer=%d, also in flight from peer=%d\n", pindexStalled->GetBlockHash().ToString(),
+                    pindexStalled->nHeight, pto->id, staller);
+            }
         }
 
         //
@@ -7168,6 +8106,140 @@ bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle
  }
 
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+// Set once mempool.dat has been read, so that a mempool that is still being
+// loaded, or whose loading was interrupted, does not replace it.
+static std::atomic<bool> fMempoolLoaded(false);
+
+bool LoadMempool(const CChainParams& chainparams)
+{
+    int64_t nStart = GetTimeMillis();
+    fs::path path = GetDataDir() / "mempool.dat";
+    CAutoFile filein(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        LogPrintf("%s: No mempool file at %s, starting with an empty mempool\n", __func__, path.string());
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    int64_t nSuccess = 0, nFailed = 0, nAlreadyThere = 0;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("%s: Unknown mempool file version %d, ignoring it\n", __func__, nVersion);
+            fMempoolLoaded = true;
+            return false;
+        }
+
+        uint64_t nCount;
+        filein >> nCount;
+        while (nCount--) {
+            CTransaction tx;
+            int64_t nTime;
+            double dPriorityDelta;
+            CAmount nFeeDelta;
+            filein >> tx >> nTime >> dPriorityDelta >> nFeeDelta;
+
+            // Restore the prioritisation first, it can decide acceptance
+            if (dPriorityDelta != 0 || nFeeDelta != 0) {
+                mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), dPriorityDelta, nFeeDelta);
+            }
+
+            {
+                LOCK(cs_main);
+                CValidationState state;
+                if (mempool.exists(tx.GetHash())) {
+                    nAlreadyThere++;
+                } else if (AcceptToMemoryPool(chainparams, mempool, state, tx, true, NULL, false, nTime)) {
+                    nSuccess++;
+                } else {
+                    nFailed++;
+                }
+            }
+
+            if (ShutdownRequested())
+                return false;
+        }
+
+        std::map<uint256, std::pair<double, CAmount>> mapDeltas;
+        filein >> mapDeltas;
+        for (const auto& delta : mapDeltas) {
+            mempool.PrioritiseTransaction(delta.first, delta.first.ToString(), delta.second.first, delta.second.second);
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", __func__, e.what());
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %d successes, %d failed, %d already there (%dms)\n",
+              nSuccess, nFailed, nAlreadyThere, GetTimeMillis() - nStart);
+    fMempoolLoaded = true;
+    return true;
+}
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    // Serialize in memory, so that the mempool is not locked while writing
+    // to disk
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    {
+        LOCK(mempool.cs);
+        std::map<uint256, std::pair<double, CAmount>> mapDeltas = mempool.mapDeltas;
+        // A transaction has more in-mempool ancestors than any of its
+        // parents, so this order puts parents first, as LoadMempool needs.
+        std::vector<const CTxMemPoolEntry*> vEntries;
+        vEntries.reserve(mempool.mapTx.size());
+        for (const CTxMemPoolEntry& entry : mempool.mapTx) {
+            vEntries.push_back(&entry);
+        }
+        std::sort(vEntries.begin(), vEntries.end(), [](const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) {
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        });
+
+        ssMempool << MEMPOOL_DUMP_VERSION << (uint64_t)vEntries.size();
+        for (const CTxMemPoolEntry* pentry : vEntries) {
+            const CTxMemPoolEntry& entry = *pentry;
+            const CTransaction& tx = entry.GetTx();
+            double dPriorityDelta = 0;
+            CAmount nFeeDelta = 0;
+            std::map<uint256, std::pair<double, CAmount>>::iterator it = mapDeltas.find(tx.GetHash());
+            if (it != mapDeltas.end()) {
+                dPriorityDelta = it->second.first;
+                nFeeDelta = it->second.second;
+                mapDeltas.erase(it);
+            }
+            ssMempool << tx << entry.GetTime() << dPriorityDelta << nFeeDelta;
+        }
+        // Deltas of transactions that are not in the mempool (yet)
+        ssMempool << mapDeltas;
+    }
+
+    try {
+        fs::path pathTmp = GetDataDir() / "mempool.dat.new";
+        CAutoFile fileout(fsbridge::fopen(pathTmp, "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s: Failed to open %s", __func__, pathTmp.string());
+        fileout.write(&ssMempool[0], ssMempool.size());
+        FileCommit(fileout.Get());
+        fileout.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+            return error("%s: Failed to rename %s", __func__, pathTmp.string());
+    } catch (const std::exception& e) {
+        return error("%s: Failed to dump mempool: %s", __func__, e.what());
+    }
+
+    LogPrint("mempool", "Dumped mempool: %u bytes (%dms)\n", ssMempool.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
 
 static class CMainCleanup
 {
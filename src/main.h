@@ -11,6 +11,7 @@
 #endif
 
 #include "amount.h"
+#include "blockprefetch.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
@@ -90,8 +91,18 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 32;
+/** Maximum number of transactions from one peer waiting for the pre-verification threads */
+static const unsigned int MAX_TX_PREVERIFY_PER_PEER = 100;
+/** Number of blocks that can be requested at any given time from a peer whose throughput is not known yet. */
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Lower bound on the number of blocks in flight from a single peer, however slow it is. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+/** Default for -maxblocksinflight, the upper bound on the number of blocks in flight from a single peer. */
+static const int DEFAULT_MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** How long (in microseconds) the blocks in flight from a peer should keep it busy, on top of its round-trip time. */
+static const int64_t BLOCK_DOWNLOAD_TARGET_BUFFER = 2 * 1000000;
+/** Maximum number of peers a block at the head of the download window is requested from at the same time. */
+static const unsigned int MAX_BLOCK_DOWNLOAD_SOURCES = 2;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Headers download timeout expressed in microseconds
@@ -101,10 +112,10 @@ static constexpr int64_t HEADERS_DOWNLOAD_TIMEOUT_PER_HEADER = 1000; // 1ms/head
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 1000;
-/** Size of the "block download window": how far ahead of our current height do we fetch?
- *  Larger windows tolerate larger download speed differences between peer, but increase the potential
- *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
- *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
+/** Default for -blockdownloadwindow, the size of the "block download window": how far ahead of our current
+ *  height do we fetch? Larger windows tolerate larger download speed differences between peer, but increase
+ *  the potential degree of disordering of blocks on disk (which make reindexing and in the future perhaps
+ *  pruning harder). */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
@@ -126,8 +137,21 @@ static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_IBD_SKIP_TX_VERIFICATION = false;
+static const bool DEFAULT_TRUST_BLOCK_INDEX = false;
 static const bool DEFAULT_TXINDEX = true;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -limitancestorcount, the maximum number of in-mempool ancestors of a transaction, including itself */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, the maximum kilobytes of a transaction and its in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, the maximum number of in-mempool descendants of a transaction, including itself */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, the maximum kilobytes of a transaction and its in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Time to wait (in seconds) between writing the mempool to disk. */
+static const int64_t MEMPOOL_DUMP_INTERVAL = 15 * 60;
 
 /** Default for -nurejectoldversions */
 static const bool DEFAULT_NU_REJECT_OLD_VERSIONS = true;
@@ -138,6 +162,13 @@ static const bool DEFAULT_BLOCK_PREFETCH_ENABLED = false;
 static const unsigned int DEFAULT_PREFETCH_NUM_THREADS = 8;
 /** Default for -prefetchnumblocks */
 static const unsigned int DEFAULT_PREFETCH_NUM_BLOCKS = 2048;
+/** Minimum number of blocks a walk along the chain must span to be worth starting a block prefetcher for */
+static const int MIN_BLOCK_PREFETCH_SPAN = 100;
+
+/** Default for -backgroundflush */
+static const bool DEFAULT_BACKGROUND_FLUSH = false;
+/** Default for -backgroundflushthreshold, in percent of -dbcache */
+static const unsigned int DEFAULT_BACKGROUND_FLUSH_THRESHOLD = 90;
 
 /** Default for -ignorespam */
 static const bool DEFAULT_IGNORE_SPAM = false;
@@ -193,10 +224,15 @@ extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
 extern bool fIBDSkipTxVerification;
+extern bool fTrustBlockIndex;
 // TODO: remove this flag by structuring our code such that
 // it is unneeded for testing
 extern bool fCoinbaseEnforcedShieldingEnabled;
 extern size_t nCoinCacheUsage;
+/** Upper bound on the number of blocks in flight from a single peer */
+extern int nMaxBlocksInTransitPerPeer;
+/** Size of the block download window */
+extern unsigned int nBlockDownloadWindow;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
 /** Absolute maximum transaction fee (in satoshis) used by wallet and mempool (rejects high fee in sendrawtransaction) */
@@ -239,6 +275,11 @@ extern bool fBlockPrefetchEnabled;
 extern unsigned int nPrefetchNumThreads;
 extern unsigned int nPrefetchNumBlocks;
 
+/** Write the chainstate from a background thread when flushing */
+extern bool fBackgroundFlush;
+/** Percentage of the coins cache limit at which a background write starts */
+extern unsigned int nBackgroundFlushThreshold;
+
 extern int64_t nForceBirthday;
 
 extern bool fIgnoreSpam;
@@ -292,6 +333,8 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom);
 bool SendMessages(const Consensus::Params& params, CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread that pre-verifies transactions received from peers */
+void ThreadTxPreVerify();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload(const Consensus::Params& params);
 /** Format a string that describes several potential problems detected by the core */
@@ -335,11 +378,27 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
+/**
+ * Check the parts of a transaction that don't depend on the UTXO set or the
+ * mempool, including its proofs and signatures, against the consensus rules
+ * that apply at nHeight. This doesn't need cs_main. Successes are recorded in
+ * the proof cache, so that neither AcceptToMemoryPool nor ConnectBlock
+ * verifies the proofs again.
+ */
+bool PreVerifyTransaction(
+        const CChainParams& chainparams, CValidationState &state,
+        const CTransaction &tx, int nHeight);
+
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(
         const CChainParams& chainparams,
         CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+        bool* pfMissingInputs, bool fRejectAbsurdFee=false, int64_t nAcceptTime=0);
+
+/** Write the mempool, with its prioritisation deltas, to mempool.dat */
+bool DumpMempool();
+/** Add the transactions in mempool.dat back to the mempool */
+bool LoadMempool(const CChainParams& chainparams);
 
 
 struct CNodeStateStats {
@@ -380,10 +439,25 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
                            const Consensus::Params& consensusParams, uint32_t consensusBranchId,
                            std::vector<CScriptCheck> *pvChecks = NULL);
 
-/** Check a transaction contextually against a set of consensus rules */
+/**
+ * Check a transaction contextually against a set of consensus rules. If
+ * fCheckShieldedInputs is false, the checks done by
+ * ContextualCheckShieldedInputs are skipped, and must be done by the caller.
+ */
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state,
                                 const CChainParams& chainparams, int nHeight, bool isMined,
-                                bool (*isInitBlockDownload)(const Consensus::Params&) = IsInitialBlockDownload);
+                                bool (*isInitBlockDownload)(const Consensus::Params&) = IsInitialBlockDownload,
+                                bool fCheckShieldedInputs = true);
+
+/**
+ * Check the JoinSplit signature and the Sapling proofs and signatures of a
+ * transaction. If saplingBatch is not NULL, Sapling proofs and signatures
+ * are queued on it instead of being verified inline.
+ */
+bool ContextualCheckShieldedInputs(const CTransaction& tx, CValidationState &state,
+                                   const CChainParams& chainparams, int nHeight, bool isMined,
+                                   bool (*isInitBlockDownload)(const Consensus::Params&) = IsInitialBlockDownload,
+                                   SaplingBatchValidator* saplingBatch = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -451,8 +525,8 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), consensusBranchId(0), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), consensusBranchId(consensusBranchIdIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
@@ -485,8 +559,11 @@ bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
-bool ReadBlockFromPrefetch(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
-void ClearBlockPrefetch();
+/**
+ * Returns a block prefetcher sized by -prefetchnumblocks and -prefetchnumthreads,
+ * or null if -blockprefetch is disabled. See CBlockPrefetcher for fnNext.
+ */
+std::unique_ptr<CBlockPrefetcher> MakeBlockPrefetcher(const Consensus::Params& consensusParams, CBlockPrefetcher::NextFunc fnNext = nullptr);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -562,6 +639,9 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the coins database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
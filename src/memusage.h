@@ -5,10 +5,14 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include "prevector.h"
+#include "support/allocators/pool.h"
+
 #include <stdlib.h>
 
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
 #include <boost/unordered_set.hpp>
@@ -93,6 +97,18 @@ static inline size_t DynamicUsage(const std::map<X, Y, C>& m)
     return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
 }
 
+template<typename X, typename Y, typename H, typename P, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+static inline size_t DynamicUsage(const std::unordered_map<X, Y, H, P, PoolAllocator<std::pair<const X, Y>, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> >& m)
+{
+    // Nodes are carved out of the pool's chunks, so measure the chunks instead
+    // of the nodes. The chunks themselves are tracked in a std::list, whose
+    // nodes hold two links and the chunk pointer.
+    auto* resource = m.get_allocator().resource();
+    size_t chunk_list_node = MallocUsage(sizeof(void*) * 3);
+    size_t chunks = (chunk_list_node + MallocUsage(resource->ChunkSizeBytes())) * resource->NumAllocatedChunks();
+    return chunks + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
 // Boost data structures
 
 template<typename X>
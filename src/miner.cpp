@@ -35,6 +35,9 @@
 
 #include <librustzcash.h>
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/ordered_index.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 #ifdef ENABLE_MINING
@@ -99,6 +102,221 @@ public:
     }
 };
 
+// What CreateNewBlock needs to know about a mempool transaction. It only
+// depends on the transaction and the chain tip, so it is worked out once for
+// each tip and shared by all the templates built on it.
+struct CTxCandidate
+{
+    const CTransaction* ptx = nullptr;
+    // Final, unexpired, not a coinbase, and all inputs found
+    bool fEligible = false;
+    // Parents in the mempool
+    set<uint256> setDependsOn;
+    // Priority and input value, without prioritisetransaction deltas
+    double dPriority = 0;
+    CAmount nTotalIn = 0;
+    unsigned int nTxSize = 0;
+    unsigned int nLegacySigOps = 0;
+    unsigned int nP2SHSigOps = 0;
+    // Result of ContextualCheckInputs, once the transaction has been tried
+    std::optional<bool> fInputsValid;
+    // Last mempool pass that saw the transaction
+    uint64_t nSeen = 0;
+};
+
+// The candidates for the current tip, kept up to date with the mempool, and
+// the transactions that were selected from them the last time. Guarded by
+// cs_main.
+class CTemplateCandidates
+{
+public:
+    const CBlockIndex* pindexTip = nullptr;
+    int nTipHeight = -1;
+    int64_t nTipMedianTimePast = 0;
+    unsigned int nTransactionsUpdated = 0;
+    uint64_t nPass = 0;
+    map<uint256, CTxCandidate> mapCandidates;
+
+    // Selection of the last template built from the candidates
+    bool fSelected = false;
+    vector<const CTxCandidate*> vSelected;
+
+    // Drops everything once the tip changes, then adds the transactions that
+    // entered the mempool and forgets the ones that left it. Returns true if
+    // the mempool changed since the last call.
+    bool Update(const CBlockIndex* pindexPrev, const CCoinsViewCache& view);
+
+private:
+    void AddCandidate(CTxCandidate& candidate, const CTransaction& tx, int nHeight,
+                      int64_t nMedianTimePast, const CCoinsViewCache& view);
+};
+
+static CTemplateCandidates templateCandidates;
+
+// A mempool transaction with some of its ancestors already in the block being
+// assembled, and the size and fees of the ones that are not.
+struct CTxModifiedEntry
+{
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+
+    CTxModifiedEntry(CTxMemPool::txiter entry) :
+        iter(entry),
+        nSizeWithAncestors(entry->GetSizeWithAncestors()),
+        nModFeesWithAncestors(entry->GetModFeesWithAncestors()) {}
+
+    const CTransaction& GetTx() const { return iter->GetTx(); }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+};
+
+typedef boost::multi_index_container<
+    CTxModifiedEntry,
+    boost::multi_index::indexed_by<
+        // sorted by mempool entry
+        boost::multi_index::ordered_unique<
+            boost::multi_index::member<CTxModifiedEntry, CTxMemPool::txiter, &CTxModifiedEntry::iter>,
+            CTxMemPool::CompareIteratorByHash
+        >,
+        // sorted by fee rate with the remaining ancestors
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxModifiedEntry>,
+            CompareTxMemPoolEntryByAncestorFee
+        >
+    >
+> indexed_modified_transaction_set;
+
+// Takes the transactions just added to the block out of the packages of
+// their descendants.
+static void UpdatePackagesForAdded(const CTxMemPool::setEntries& setAdded, indexed_modified_transaction_set& mapModifiedTx)
+{
+    for (CTxMemPool::txiter it : setAdded) {
+        CTxMemPool::setEntries setDescendants;
+        mempool.CalculateDescendants(it, setDescendants);
+        for (CTxMemPool::txiter desc : setDescendants) {
+            if (setAdded.count(desc))
+                continue;
+            auto mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                mit = mapModifiedTx.insert(CTxModifiedEntry(desc)).first;
+            }
+            mapModifiedTx.modify(mit, [it](CTxModifiedEntry& entry) {
+                entry.nSizeWithAncestors -= it->GetTxSize();
+                entry.nModFeesWithAncestors -= it->GetModifiedFee();
+            });
+        }
+    }
+}
+
+void CTemplateCandidates::AddCandidate(CTxCandidate& candidate, const CTransaction& tx, int nHeight,
+                                       int64_t nMedianTimePast, const CCoinsViewCache& view)
+{
+    int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                            ? nMedianTimePast
+                            : GetTime();
+
+    if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
+        return;
+
+    double dPriority = 0;
+    CAmount nTotalIn = 0;
+    for (const CTxIn& txin : tx.vin)
+    {
+        // Read prev transaction
+        if (!view.HaveCoin(txin.prevout))
+        {
+            // This should never happen; all transactions in the memory
+            // pool should connect to either transactions in the chain
+            // or other transactions in the memory pool.
+            CTxMemPool::indexed_transaction_set::const_iterator it = mempool.mapTx.find(txin.prevout.hash);
+            if (it == mempool.mapTx.end())
+            {
+                LogPrintf("ERROR: mempool transaction missing input\n");
+                if (fDebug) assert("mempool transaction missing input" == 0);
+                candidate.setDependsOn.clear();
+                return;
+            }
+
+            // Has to wait for dependencies
+            candidate.setDependsOn.insert(txin.prevout.hash);
+            nTotalIn += it->GetTx().vout[txin.prevout.n].nValue;
+            continue;
+        }
+        const Coin& coin = view.AccessCoin(txin.prevout);
+        assert(!coin.IsSpent());
+
+        CAmount nValueIn = coin.out.nValue;
+        nTotalIn += nValueIn;
+
+        int nConf = nHeight - coin.nHeight;
+
+        dPriority += (double)nValueIn * nConf;
+    }
+    nTotalIn += tx.GetShieldedValueIn();
+
+    // Priority is sum(valuein * age) / modified_txsize
+    candidate.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    candidate.dPriority = tx.ComputePriority(dPriority, candidate.nTxSize);
+    candidate.nTotalIn = nTotalIn;
+    candidate.nLegacySigOps = GetLegacySigOpCount(tx);
+    if (candidate.setDependsOn.empty()) {
+        candidate.nP2SHSigOps = GetP2SHSigOpCount(tx, view);
+    } else {
+        // Some of the inputs are in the mempool
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        CCoinsViewCache viewWithParents(&viewMemPool);
+        candidate.nP2SHSigOps = GetP2SHSigOpCount(tx, viewWithParents);
+    }
+    candidate.fEligible = true;
+}
+
+bool CTemplateCandidates::Update(const CBlockIndex* pindexPrev, const CCoinsViewCache& view)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    const int nHeight = pindexPrev->nHeight + 1;
+    const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
+
+    // Finality and expiry depend on the height and median time past
+    if (pindexTip != pindexPrev || nTipHeight != pindexPrev->nHeight || nTipMedianTimePast != nMedianTimePast) {
+        pindexTip = pindexPrev;
+        nTipHeight = pindexPrev->nHeight;
+        nTipMedianTimePast = nMedianTimePast;
+        mapCandidates.clear();
+        fSelected = false;
+    } else if (fSelected && nTransactionsUpdated == mempool.GetTransactionsUpdated()) {
+        return false;
+    }
+    nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    fSelected = false;
+    vSelected.clear();
+
+    nPass++;
+    for (const CTxMemPoolEntry& entry : mempool.mapTx)
+    {
+        const CTransaction& tx = entry.GetTx();
+        auto ret = mapCandidates.emplace(tx.GetHash(), CTxCandidate());
+        CTxCandidate& candidate = ret.first->second;
+        // The entry may have been replaced since it was last seen
+        candidate.ptx = &tx;
+        candidate.nSeen = nPass;
+        if (ret.second) {
+            AddCandidate(candidate, tx, nHeight, nMedianTimePast, view);
+        }
+    }
+    for (auto it = mapCandidates.begin(); it != mapCandidates.end(); ) {
+        if (it->second.nSeen != nPass) {
+            it = mapCandidates.erase(it);
+        } else {
+            it++;
+        }
+    }
+    return true;
+}
+
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     auto medianTimePast = pindexPrev->GetMedianTimePast();
@@ -274,6 +492,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
 
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
+    bool fReused = false;
 
     {
         LOCK2(cs_main, mempool.cs);
@@ -281,92 +500,76 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
         const int nHeight = pindexPrev->nHeight + 1;
         uint32_t consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
         pblock->nTime = GetTime();
-        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
         CCoinsViewCache view(pcoinsTip);
 
         SaplingMerkleTree sapling_tree;
         assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
+        // Collect transactions into block
+        uint64_t nBlockSize = 1000;
+        uint64_t nBlockTx = 0;
+        int nBlockSigOps = 100;
 
         // If we're given a coinbase tx, it's been precomputed, its fees are zero,
         // so we can't include any mempool transactions; this will be an empty block.
-        if (!next_cb_mtx) {
-            for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-                mi != mempool.mapTx.end(); ++mi)
-            {
-                const CTransaction& tx = mi->GetTx();
-
-                int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                        ? nMedianTimePast
-                                        : pblock->GetBlockTime();
+        if (!next_cb_mtx && !templateCandidates.Update(pindexPrev, view)) {
+            // Neither the tip nor the mempool changed since the last template:
+            // the same transactions are selected again, and they have already
+            // passed TestBlockValidity with this tip.
+            fReused = true;
+        }
 
-                if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
+        if (fReused) {
+            for (const CTxCandidate* pcandidate : templateCandidates.vSelected)
+            {
+                const CTransaction& tx = *pcandidate->ptx;
+                CAmount nTxFees = pcandidate->nTotalIn - tx.GetValueOut();
+                unsigned int nTxSigOps = pcandidate->nLegacySigOps + pcandidate->nP2SHSigOps;
+                pblock->vtx.push_back(tx);
+                pblocktemplate->vTxFees.push_back(nTxFees);
+                pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+                nBlockSize += pcandidate->nTxSize;
+                ++nBlockTx;
+                nBlockSigOps += nTxSigOps;
+                nFees += nTxFees;
+            }
+        } else if (!next_cb_mtx) {
+            // Priority order to process transactions
+            list<COrphan> vOrphan; // list memory doesn't move
+            map<uint256, vector<COrphan*> > mapDependers;
+            // Mempool entries already in the block
+            CTxMemPool::setEntries setInBlock;
+            bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
+
+            // This vector will be sorted into a priority queue:
+            vector<TxPriority> vecPriority;
+            vecPriority.reserve(templateCandidates.mapCandidates.size());
+
+            for (const auto& item : templateCandidates.mapCandidates)
+            {
+                const uint256& hash = item.first;
+                const CTxCandidate& candidate = item.second;
+                if (!candidate.fEligible)
                     continue;
 
                 COrphan* porphan = NULL;
-                double dPriority = 0;
-                CAmount nTotalIn = 0;
-                bool fMissingInputs = false;
-                for (const CTxIn& txin : tx.vin)
+                if (!candidate.setDependsOn.empty())
                 {
-                    // Read prev transaction
-                    if (!view.HaveCoins(txin.prevout.hash))
+                    // Has to wait for dependencies
+                    vOrphan.push_back(COrphan(candidate.ptx));
+                    porphan = &vOrphan.back();
+                    for (const uint256& hashParent : candidate.setDependsOn)
                     {
-                        // This should never happen; all transactions in the memory
-                        // pool should connect to either transactions in the chain
-                        // or other transactions in the memory pool.
-                        if (!mempool.mapTx.count(txin.prevout.hash))
-                        {
-                            LogPrintf("ERROR: mempool transaction missing input\n");
-                            if (fDebug) assert("mempool transaction missing input" == 0);
-                            fMissingInputs = true;
-                            if (porphan)
-                                vOrphan.pop_back();
-                            break;
-                        }
-
-                        // Has to wait for dependencies
-                        if (!porphan)
-                        {
-                            // Use list for automatic deletion
-                            vOrphan.push_back(COrphan(&tx));
-                            porphan = &vOrphan.back();
-                        }
-                        mapDependers[txin.prevout.hash].push_back(porphan);
-                        porphan->setDependsOn.insert(txin.prevout.hash);
-                        nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
-                        continue;
+                        mapDependers[hashParent].push_back(porphan);
+                        porphan->setDependsOn.insert(hashParent);
                     }
-                    const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                    assert(coins);
-
-                    CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                    nTotalIn += nValueIn;
-
-                    int nConf = nHeight - coins->nHeight;
-
-                    dPriority += (double)nValueIn * nConf;
                 }
-                nTotalIn += tx.GetShieldedValueIn();
-
-                if (fMissingInputs) continue;
-
-                // Priority is sum(valuein * age) / modified_txsize
-                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-                dPriority = tx.ComputePriority(dPriority, nTxSize);
 
-                uint256 hash = tx.GetHash();
+                double dPriority = candidate.dPriority;
+                CAmount nTotalIn = candidate.nTotalIn;
                 mempool.ApplyDeltas(hash, dPriority, nTotalIn);
 
-                CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+                CFeeRate feeRate(nTotalIn-candidate.ptx->GetValueOut(), candidate.nTxSize);
 
                 if (porphan)
                 {
@@ -374,154 +577,277 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
                     porphan->feeRate = feeRate;
                 }
                 else
-                    vecPriority.push_back(TxPriority(dPriority, feeRate, &(mi->GetTx())));
+                    vecPriority.push_back(TxPriority(dPriority, feeRate, candidate.ptx));
             }
-        }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        // We want to track the value pool, but if the miner gets
-        // invoked on an old block before the hardcoded fallback
-        // is active we don't want to trip up any assertions. So,
-        // we only adhere to the turnstile (as a miner) if we
-        // actually have all of the information necessary to do
-        // so.
-        CAmount sproutValue = 0;
-        CAmount saplingValue = 0;
-        bool monitoring_pool_balances = true;
-        if (chainparams.ZIP209Enabled()) {
-            if (pindexPrev->nChainSproutValue) {
-                sproutValue = *pindexPrev->nChainSproutValue;
-            } else {
-                monitoring_pool_balances = false;
-            }
-            if (pindexPrev->nChainSaplingValue) {
-                saplingValue = *pindexPrev->nChainSaplingValue;
-            } else {
-                monitoring_pool_balances = false;
+            TxPriorityCompare comparer(false);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+            // We want to track the value pool, but if the miner gets
+            // invoked on an old block before the hardcoded fallback
+            // is active we don't want to trip up any assertions. So,
+            // we only adhere to the turnstile (as a miner) if we
+            // actually have all of the information necessary to do
+            // so.
+            CAmount sproutValue = 0;
+            CAmount saplingValue = 0;
+            bool monitoring_pool_balances = true;
+            if (chainparams.ZIP209Enabled()) {
+                if (pindexPrev->nChainSproutValue) {
+                    sproutValue = *pindexPrev->nChainSproutValue;
+                } else {
+                    monitoring_pool_balances = false;
+                }
+                if (pindexPrev->nChainSaplingValue) {
+                    saplingValue = *pindexPrev->nChainSaplingValue;
+                } else {
+                    monitoring_pool_balances = false;
+                }
             }
-        }
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+            // Checks that a transaction can follow the ones already selected,
+            // and if so spends its inputs in viewTx and adds it to the value
+            // pools.
+            auto TestTransaction = [&](CTxCandidate& candidate, CCoinsViewCache& viewTx,
+                                       CAmount& sproutValueTx, CAmount& saplingValueTx) -> bool {
+                const CTransaction& tx = *candidate.ptx;
+                if (!viewTx.HaveInputs(tx))
+                    return false;
+
+                // Note that flags: we don't want to set mempool/IsStandard()
+                // policy here, but we still have to ensure that the block we
+                // create only contains transactions that are valid in new blocks.
+                // This is only done once per tip for each transaction.
+                if (!candidate.fInputsValid) {
+                    CValidationState state;
+                    PrecomputedTransactionData txdata(tx);
+                    candidate.fInputsValid = ContextualCheckInputs(tx, state, viewTx, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId);
+                }
+                if (!*candidate.fInputsValid)
+                    return false;
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+                if (chainparams.ZIP209Enabled() && monitoring_pool_balances) {
+                    // Does this transaction lead to a turnstile violation?
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+                    CAmount sproutValueDummy = sproutValueTx;
+                    CAmount saplingValueDummy = saplingValueTx;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+                    saplingValueDummy += -tx.valueBalance;
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+                    for (auto js : tx.vJoinSplit) {
+                        sproutValueDummy += js.vpub_old;
+                        sproutValueDummy -= js.vpub_new;
+                    }
+
+                    if (sproutValueDummy < 0) {
+                        LogPrintf("CreateNewBlock(): tx %s appears to violate Sprout turnstile\n", tx.GetHash().ToString());
+                        return false;
+                    }
+                    if (saplingValueDummy < 0) {
+                        LogPrintf("CreateNewBlock(): tx %s appears to violate Sapling turnstile\n", tx.GetHash().ToString());
+                        return false;
+                    }
+
+                    sproutValueTx = sproutValueDummy;
+                    saplingValueTx = saplingValueDummy;
+                }
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+                UpdateCoins(tx, viewTx, nHeight);
+                return true;
+            };
+
+            auto AddToBlock = [&](CTxCandidate& candidate) {
+                const CTransaction& tx = *candidate.ptx;
+                CAmount nTxFees = candidate.nTotalIn - tx.GetValueOut();
+                unsigned int nTxSigOps = candidate.nLegacySigOps + candidate.nP2SHSigOps;
+                pblock->vtx.push_back(tx);
+                pblocktemplate->vTxFees.push_back(nTxFees);
+                pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+                templateCandidates.vSelected.push_back(&candidate);
+                nBlockSize += candidate.nTxSize;
+                ++nBlockTx;
+                nBlockSigOps += nTxSigOps;
+                nFees += nTxFees;
+                setInBlock.insert(mempool.mapTx.find(tx.GetHash()));
+            };
+
+            // First fill the priority area of the block, in order of priority
+            while (nBlockPrioritySize > 0 && !vecPriority.empty())
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+                // Take highest priority transaction off the priority queue:
+                double dPriority = vecPriority.front().get<0>();
+                CFeeRate feeRate = vecPriority.front().get<1>();
+                const CTransaction& tx = *(vecPriority.front().get<2>());
 
-            if (!view.HaveInputs(tx))
-                continue;
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+                const uint256& hash = tx.GetHash();
+                CTxCandidate& candidate = templateCandidates.mapCandidates.at(hash);
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+                // Size limits
+                unsigned int nTxSize = candidate.nTxSize;
+                if (nBlockSize + nTxSize >= nBlockMaxSize)
+                    continue;
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            PrecomputedTransactionData txdata(tx);
-            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata, chainparams.GetConsensus(), consensusBranchId))
-                continue;
+                // Legacy limits on sigOps:
+                unsigned int nTxSigOps = candidate.nLegacySigOps;
+                if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+                    continue;
 
-            if (chainparams.ZIP209Enabled() && monitoring_pool_balances) {
-                // Does this transaction lead to a turnstile violation?
+                // Select by fee once past the priority size or we run out of
+                // high-priority transactions. This one is considered again
+                // there.
+                if ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))
+                    break;
 
-                CAmount sproutValueDummy = sproutValue;
-                CAmount saplingValueDummy = saplingValue;
+                nTxSigOps += candidate.nP2SHSigOps;
+                if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+                    continue;
 
-                saplingValueDummy += -tx.valueBalance;
+                if (!TestTransaction(candidate, view, sproutValue, saplingValue))
+                    continue;
 
-                for (auto js : tx.vJoinSplit) {
-                    sproutValueDummy += js.vpub_old;
-                    sproutValueDummy -= js.vpub_new;
+                // Added
+                AddToBlock(candidate);
+
+                if (fPrintPriority)
+                {
+                    LogPrintf("priority %.1f fee %s txid %s\n",
+                        dPriority, feeRate.ToString(), tx.GetHash().ToString());
                 }
 
-                if (sproutValueDummy < 0) {
-                    LogPrintf("CreateNewBlock(): tx %s appears to violate Sprout turnstile\n", tx.GetHash().ToString());
-                    continue;
+                // Add transactions that depend on this one to the priority queue
+                if (mapDependers.count(hash))
+                {
+                    for (COrphan* porphan : mapDependers[hash])
+                    {
+                        if (!porphan->setDependsOn.empty())
+                        {
+                            porphan->setDependsOn.erase(hash);
+                            if (porphan->setDependsOn.empty())
+                            {
+                                vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
+                                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                            }
+                        }
+                    }
                 }
-                if (saplingValueDummy < 0) {
-                    LogPrintf("CreateNewBlock(): tx %s appears to violate Sapling turnstile\n", tx.GetHash().ToString());
-                    continue;
+            }
+
+            // Then fill the rest of the block by the fee rate of each
+            // transaction together with its ancestors that are not in the
+            // block yet, so that a child paying a high fee brings in its
+            // low-fee parents. mapModifiedTx holds the transactions whose
+            // ancestors are partly in the block, with their remaining package;
+            // all the others are read from the mempool's ancestor fee index.
+            indexed_modified_transaction_set mapModifiedTx;
+            CTxMemPool::setEntries setFailedTx;
+            UpdatePackagesForAdded(setInBlock, mapModifiedTx);
+
+            auto mi = mempool.mapTx.get<ancestor_score>().begin();
+            auto miEnd = mempool.mapTx.get<ancestor_score>().end();
+            while (mi != miEnd || !mapModifiedTx.empty())
+            {
+                if (mi != miEnd) {
+                    CTxMemPool::txiter it = mempool.mapTx.project<0>(mi);
+                    if (setInBlock.count(it) || setFailedTx.count(it) || mapModifiedTx.count(it)) {
+                        ++mi;
+                        continue;
+                    }
                 }
 
-                sproutValue = sproutValueDummy;
-                saplingValue = saplingValueDummy;
-            }
+                // Take the best package, from either the mempool or mapModifiedTx
+                auto modit = mapModifiedTx.get<ancestor_score>().begin();
+                CTxMemPool::txiter iter;
+                uint64_t nPackageSize;
+                CAmount nPackageFees;
+                if (mi == miEnd || (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                        CompareTxMemPoolEntryByAncestorFee()(*modit, CTxModifiedEntry(mempool.mapTx.project<0>(mi))))) {
+                    iter = modit->iter;
+                    nPackageSize = modit->nSizeWithAncestors;
+                    nPackageFees = modit->nModFeesWithAncestors;
+                    mapModifiedTx.get<ancestor_score>().erase(modit);
+                } else {
+                    iter = mempool.mapTx.project<0>(mi);
+                    nPackageSize = iter->GetSizeWithAncestors();
+                    nPackageFees = iter->GetModFeesWithAncestors();
+                    ++mi;
+                }
 
-            UpdateCoins(tx, view, nHeight);
+                // Size limits
+                if (nBlockSize + nPackageSize >= nBlockMaxSize) {
+                    setFailedTx.insert(iter);
+                    continue;
+                }
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+                // Skip free transactions if we're past the minimum block size:
+                const uint256& hash = iter->GetTx().GetHash();
+                CFeeRate packageFeeRate(nPackageFees, nPackageSize);
+                double dPriorityDelta = 0;
+                CAmount nFeeDelta = 0;
+                mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+                if ((dPriorityDelta <= 0) && (nFeeDelta <= 0) && (packageFeeRate < ::minRelayTxFee) && (nBlockSize + nPackageSize >= nBlockMinSize)) {
+                    setFailedTx.insert(iter);
+                    continue;
+                }
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+                // The package is the transaction and its ancestors that are
+                // not in the block, parents first
+                CTxMemPool::setEntries setPackage;
+                mempool.CalculateMemPoolAncestors(*iter, setPackage);
+                for (auto pit = setPackage.begin(); pit != setPackage.end(); ) {
+                    if (setInBlock.count(*pit)) {
+                        pit = setPackage.erase(pit);
+                    } else {
+                        pit++;
+                    }
+                }
+                setPackage.insert(iter);
+                vector<CTxMemPool::txiter> vPackage(setPackage.begin(), setPackage.end());
+                std::sort(vPackage.begin(), vPackage.end(), [](CTxMemPool::txiter a, CTxMemPool::txiter b) {
+                    return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+                });
+
+                // All of the package goes in, or none of it
+                CCoinsViewCache viewPackage(&view);
+                CAmount sproutValuePackage = sproutValue;
+                CAmount saplingValuePackage = saplingValue;
+                unsigned int nPackageSigOps = 0;
+                vector<CTxCandidate*> vCandidates;
+                for (CTxMemPool::txiter pit : vPackage) {
+                    auto cit = templateCandidates.mapCandidates.find(pit->GetTx().GetHash());
+                    if (cit == templateCandidates.mapCandidates.end() || !cit->second.fEligible)
+                        break;
+                    CTxCandidate& candidate = cit->second;
+                    nPackageSigOps += candidate.nLegacySigOps + candidate.nP2SHSigOps;
+                    if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+                        break;
+                    if (!TestTransaction(candidate, viewPackage, sproutValuePackage, saplingValuePackage))
+                        break;
+                    vCandidates.push_back(&candidate);
+                }
+                if (vCandidates.size() != vPackage.size()) {
+                    setFailedTx.insert(iter);
+                    continue;
+                }
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                for (COrphan* porphan : mapDependers[hash])
+                // Added
+                viewPackage.Flush();
+                sproutValue = sproutValuePackage;
+                saplingValue = saplingValuePackage;
+                for (CTxCandidate* pcandidate : vCandidates) {
+                    AddToBlock(*pcandidate);
+                    mapModifiedTx.erase(mempool.mapTx.find(pcandidate->ptx->GetHash()));
+                }
+
+                if (fPrintPriority)
                 {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+                    LogPrintf("fee %s txid %s (package of %u)\n",
+                        packageFeeRate.ToString(), hash.ToString(), vPackage.size());
                 }
+
+                UpdatePackagesForAdded(setPackage, mapModifiedTx);
             }
         }
 
@@ -567,9 +893,13 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const MinerAddre
         pblock->nSolution.clear();
         pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
 
-        CValidationState state;
-        if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false))
-            throw std::runtime_error(std::string("CreateNewBlock(): TestBlockValidity failed: ") + state.GetRejectReason());
+        if (!fReused) {
+            CValidationState state;
+            if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false))
+                throw std::runtime_error(std::string("CreateNewBlock(): TestBlockValidity failed: ") + state.GetRejectReason());
+            // Only reuse the selection once it is known to be valid
+            templateCandidates.fSelected = !next_cb_mtx;
+        }
     }
 
     return pblocktemplate.release();
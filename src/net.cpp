@@ -20,6 +20,7 @@
 #include "hash.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
+#include "socketevents.h"
 #include "ui_interface.h"
 
 #ifdef WIN32
@@ -35,6 +36,12 @@
 // Dump addresses to peers.dat and banlist.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
+// How long the socket handler waits for socket events when other threads can
+// wake it up, and when they cannot (or it is not sure it has seen every send
+// queue). Milliseconds.
+static const int64_t SOCKET_HANDLER_TIMEOUT = 1000;
+static const int64_t SOCKET_HANDLER_POLL_INTERVAL = 50;
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -90,11 +97,23 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
 static boost::condition_variable messageHandlerCondition;
+static std::unique_ptr<CSocketEvents> socketEvents;
 
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+void WakeSocketHandler()
+{
+    if (socketEvents)
+        socketEvents->Wakeup();
+}
+
+void WakeMessageHandler()
+{
+    messageHandlerCondition.notify_one();
+}
+
 void AddOneShot(const std::string& strDest)
 {
     LOCK(cs_vOneShots);
@@ -399,6 +418,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        WakeSocketHandler();
 
         return pnode;
     } else if (!proxyConnectionFailed) {
@@ -1160,23 +1180,13 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+        CSocketEvents& events = *socketEvents;
+        events.Clear();
+        // Whether a node's state could not be inspected, so that it must be looked at again soon
+        bool fContended = false;
 
         for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+            events.Add(hListenSocket.socket, CSocketEvents::EVENT_RECV);
         }
 
         {
@@ -1184,13 +1194,13 @@ void ThreadSocketHandler()
             for (CNode* pnode : vNodes)
             {
                 // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
+                // * If there is data to send, wait for the socket to become writable. As this only
                 //   happens when optimistic write failed, we choose to first drain the
                 //   write buffer in this case before receiving more. This avoids
                 //   needlessly queueing received data, if the remote peer is not themselves
                 //   receiving data. This means properly utilizing TCP flow control signaling.
                 // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
+                //   or there is space left in the buffer, wait for data to be received.
                 // * (if neither of the above applies, there is certainly one message
                 //   in the receiver buffer ready to be processed).
                 // Together, that means that at least one of the following is always possible,
@@ -1198,16 +1208,20 @@ void ThreadSocketHandler()
                 // * We send some data.
                 // * We wait for data to be received (and disconnect after timeout).
                 // * We process a message in the buffer (message handler thread).
+                // Other threads wake us up when they queue data that could not be sent
+                // optimistically, or make room in a full receive buffer.
 
                 bool select_send;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
+                    fContended |= !lockSend;
                     select_send = lockSend && !pnode->vSendMsg.empty();
                 }
 
                 bool select_recv;
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    fContended |= !lockRecv;
                     select_recv = lockRecv && (
                         pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
                         pnode->GetTotalRecvSize() <= ReceiveFloodSize());
@@ -1217,44 +1231,28 @@ void ThreadSocketHandler()
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
 
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
+                int nEvents = CSocketEvents::EVENT_ERR;
                 if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
+                    nEvents |= CSocketEvents::EVENT_SEND;
+                } else if (select_recv) {
+                    nEvents |= CSocketEvents::EVENT_RECV;
                 }
+                events.Add(pnode->hSocket, nEvents, pnode->id);
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+        int64_t nTimeout = (fContended || !events.CanWakeup()) ? SOCKET_HANDLER_POLL_INTERVAL : SOCKET_HANDLER_TIMEOUT;
+        if (!events.Wait(nTimeout)) {
+            MilliSleep(SOCKET_HANDLER_POLL_INTERVAL);
         }
+        boost::this_thread::interruption_point();
 
         //
         // Accept new connections
         //
         for (const ListenSocket& hListenSocket : vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && (events.GetEvents(hListenSocket.socket) & CSocketEvents::EVENT_RECV))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1286,9 +1284,10 @@ void ThreadSocketHandler()
                 LOCK(pnode->cs_hSocket);
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
+                int nEvents = events.GetEvents(pnode->hSocket);
+                recvSet = nEvents & CSocketEvents::EVENT_RECV;
+                sendSet = nEvents & CSocketEvents::EVENT_SEND;
+                errorSet = nEvents & CSocketEvents::EVENT_ERR;
             }
             if (recvSet || errorSet)
             {
@@ -1711,9 +1710,14 @@ void ThreadMessageHandler()
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
+                    bool fFlooded = pnode->GetTotalRecvSize() > ReceiveFloodSize();
                     if (!g_signals.ProcessMessages(chainparams, pnode))
                         pnode->CloseSocketDisconnect();
 
+                    // The socket handler stops receiving from a peer whose receive buffer is full
+                    if (fFlooded && pnode->GetTotalRecvSize() <= ReceiveFloodSize())
+                        WakeSocketHandler();
+
                     if (pnode->nSendSize < SendBufferSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
@@ -1958,6 +1962,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
         threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "dnsseed", &ThreadDNSAddressSeed));
 
     // Send and receive from sockets, accept connections
+    if (!socketEvents) {
+        socketEvents.reset(new CSocketEvents());
+        LogPrintf("Waiting for socket events with %s\n", CSocketEvents::GetBackendName());
+    }
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -2406,7 +2414,13 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     if (it == vSendMsg.begin())
         SocketSendData(this);
 
+    // Whatever is left is sent by the socket handler once the socket is writable
+    bool fWake = !vSendMsg.empty();
+
     LEAVE_CRITICAL_SECTION(cs_vSend);
+
+    if (fWake)
+        WakeSocketHandler();
 }
 
 /* static */ uint64_t CNode::CalculateKeyedNetGroup(const CAddress& ad)
@@ -82,6 +82,10 @@ unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
 
 void AddOneShot(const std::string& strDest);
+/** Makes the socket handler look at every node's send and receive buffers again. */
+void WakeSocketHandler();
+/** Makes the message handler poll every node again without waiting for a new message. */
+void WakeMessageHandler();
 void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
 CNode* FindNode(const CSubNet& subNet);
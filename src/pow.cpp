@@ -108,12 +108,6 @@ bool CheckEquihashSolution(const CBlockHeader *pblock, const Consensus::Params&
     unsigned int n = params.nEquihashN;
     unsigned int k = params.nEquihashK;
 
-    // Hash state
-    eh_HashState state;
-    //EhInitialiseState(n, k, state);
-    EhInitialiseStatePers(n, k, state, "ZERO_PoW");
-    
-
     // I = the block header minus nonce and solution.
     CEquihashInput I{*pblock};
     // I||V
@@ -133,12 +127,7 @@ bool CheckEquihashSolution(const CBlockHeader *pblock, const Consensus::Params&
     ss << pblock->nNonce;
 
     // H(I||V||...
-    state.Update((unsigned char*)&ss[0], ss.size());
-    //crypto_generichash_blake2b_update(&state, (unsigned char*)&ss[0], ss.size());
-
-    bool isValid;
-    EhIsValidSolution(n, k, state, pblock->nSolution, isValid);
-    if (!isValid)
+    if (!EhIsValidSolutionNative(n, k, "ZERO_PoW", (unsigned char*)&ss[0], ss.size(), pblock->nSolution))
     {
         return error("CheckEquihashSolution(): invalid solution");
     }
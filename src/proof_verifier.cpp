@@ -69,3 +69,59 @@ bool ProofVerifier::VerifySprout(
     auto pv = SproutProofVerifier(*this, joinSplitPubKey, jsdesc);
     return std::visit(pv, jsdesc.proof);
 }
+
+SaplingBatchValidator::SaplingBatchValidator(bool fCheckProofs) :
+    ctx(librustzcash_sapling_batch_validator_init(fCheckProofs)) { }
+
+SaplingBatchValidator::~SaplingBatchValidator()
+{
+    librustzcash_sapling_batch_validator_free(ctx);
+}
+
+bool SaplingBatchValidator::Queue(const CTransaction& tx, const uint256& dataToBeSigned)
+{
+    for (const SpendDescription &spend : tx.vShieldedSpend) {
+        if (!librustzcash_sapling_batch_check_spend(
+            ctx,
+            spend.cv.begin(),
+            spend.anchor.begin(),
+            spend.nullifier.begin(),
+            spend.rk.begin(),
+            spend.zkproof.begin(),
+            spend.spendAuthSig.begin(),
+            dataToBeSigned.begin()))
+        {
+            librustzcash_sapling_batch_discard_bundle(ctx);
+            return false;
+        }
+    }
+
+    for (const OutputDescription &output : tx.vShieldedOutput) {
+        if (!librustzcash_sapling_batch_check_output(
+            ctx,
+            output.cv.begin(),
+            output.cmu.begin(),
+            output.ephemeralKey.begin(),
+            output.zkproof.begin()))
+        {
+            librustzcash_sapling_batch_discard_bundle(ctx);
+            return false;
+        }
+    }
+
+    if (!librustzcash_sapling_batch_final_check(
+        ctx,
+        tx.valueBalance,
+        tx.bindingSig.begin(),
+        dataToBeSigned.begin()))
+    {
+        librustzcash_sapling_batch_discard_bundle(ctx);
+        return false;
+    }
+    return true;
+}
+
+bool SaplingBatchValidator::Validate()
+{
+    return librustzcash_sapling_batch_validate(ctx);
+}
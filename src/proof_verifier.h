@@ -39,4 +39,35 @@ public:
     );
 };
 
+/**
+ * Collects the Sapling proofs and signatures of a set of transactions
+ * (typically every transaction in a block) so that they can be verified
+ * together, which is much cheaper than verifying them one at a time.
+ *
+ * A failed batch does not identify the invalid transaction; callers that
+ * need to report it must re-check the transactions individually.
+ */
+class SaplingBatchValidator {
+private:
+    void* ctx;
+
+public:
+    // If fCheckProofs is false, only the signatures are checked, and the
+    // proofs are not even parsed.
+    explicit SaplingBatchValidator(bool fCheckProofs = true);
+    ~SaplingBatchValidator();
+
+    SaplingBatchValidator(const SaplingBatchValidator&) = delete;
+    SaplingBatchValidator& operator=(const SaplingBatchValidator&) = delete;
+
+    // Queues the Sapling Spend and Output descriptions and the binding
+    // signature of tx, signed over dataToBeSigned. Returns false if they
+    // are invalid without needing to verify any proof or signature, in
+    // which case nothing of tx is left queued.
+    bool Queue(const CTransaction& tx, const uint256& dataToBeSigned);
+
+    // Verifies everything queued since construction or the last call.
+    bool Validate();
+};
+
 #endif // ZCASH_PROOF_VERIFIER_H
@@ -0,0 +1,55 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "proofcache.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "random.h"
+
+CProofCache proofCache;
+
+CProofCache::CProofCache()
+{
+    GetRandBytes(nonce.begin(), 32);
+}
+
+uint256 CProofCache::ComputeEntry(const uint256& txid, uint32_t consensusBranchId) const
+{
+    unsigned char branchId[4];
+    WriteLE32(branchId, consensusBranchId);
+
+    uint256 entry;
+    CSHA256().Write(nonce.begin(), 32).Write(txid.begin(), 32).Write(branchId, 4).Finalize(entry.begin());
+    return entry;
+}
+
+bool CProofCache::Contains(const uint256& txid, uint32_t consensusBranchId)
+{
+    uint256 entry = ComputeEntry(txid, consensusBranchId);
+    LOCK(cs);
+    return setValid.count(entry) > 0;
+}
+
+void CProofCache::Insert(const uint256& txid, uint32_t consensusBranchId)
+{
+    uint256 entry = ComputeEntry(txid, consensusBranchId);
+    LOCK(cs);
+    if (!setValid.insert(entry).second) {
+        return;
+    }
+    vOrder.push_back(entry);
+    while (vOrder.size() > MAX_PROOF_CACHE_ENTRIES) {
+        // Erased entries stay queued, and erasing them again is harmless
+        setValid.erase(vOrder.front());
+        vOrder.pop_front();
+    }
+}
+
+void CProofCache::Erase(const uint256& txid, uint32_t consensusBranchId)
+{
+    uint256 entry = ComputeEntry(txid, consensusBranchId);
+    LOCK(cs);
+    setValid.erase(entry);
+}
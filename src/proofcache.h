@@ -0,0 +1,60 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_PROOFCACHE_H
+#define BITCOIN_PROOFCACHE_H
+
+#include "sync.h"
+#include "uint256.h"
+
+#include <deque>
+#include <stdint.h>
+
+#include <boost/unordered_set.hpp>
+
+/** The number of transactions CProofCache remembers (about 2MB). */
+static const unsigned int MAX_PROOF_CACHE_ENTRIES = 20000;
+
+/**
+ * Transactions whose shielded proofs and signatures (JoinSplit proofs and
+ * joinSplitSig, Sapling proofs, spend authorization and binding signatures)
+ * are known to be valid for a consensus branch ID, to avoid verifying them
+ * twice for every transaction: once when it is accepted into the mempool,
+ * and again when it is connected in a block.
+ *
+ * The txid commits to the proofs and signatures, so an entry covers exactly
+ * one transaction. Entries are salted, and once MAX_PROOF_CACHE_ENTRIES are
+ * held the oldest ones are forgotten first.
+ */
+class CProofCache
+{
+private:
+    //! Entries are SHA256(nonce || txid || consensus branch ID)
+    uint256 nonce;
+
+    class CProofCacheHasher
+    {
+    public:
+        size_t operator()(const uint256& key) const {
+            return key.GetCheapHash();
+        }
+    };
+
+    boost::unordered_set<uint256, CProofCacheHasher> setValid;
+    std::deque<uint256> vOrder;
+    CCriticalSection cs;
+
+    uint256 ComputeEntry(const uint256& txid, uint32_t consensusBranchId) const;
+
+public:
+    CProofCache();
+
+    bool Contains(const uint256& txid, uint32_t consensusBranchId);
+    void Insert(const uint256& txid, uint32_t consensusBranchId);
+    void Erase(const uint256& txid, uint32_t consensusBranchId);
+};
+
+extern CProofCache proofCache;
+
+#endif // BITCOIN_PROOFCACHE_H
@@ -117,7 +117,7 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.pushKV("finalsaplingroot", blockindex->hashFinalSaplingRoot.GetHex());
     result.pushKV("time", (int64_t)blockindex->nTime);
     result.pushKV("nonce", blockindex->nNonce.GetHex());
-    result.pushKV("solution", HexStr(blockindex->nSolution));
+    result.pushKV("solution", HexStr(blockindex->GetBlockHeader().nSolution));
     result.pushKV("bits", strprintf("%08x", blockindex->nBits));
     result.pushKV("difficulty", GetDifficulty(blockindex));
     result.pushKV("chainwork", blockindex->nChainWork.GetHex());
@@ -840,7 +840,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,              (numeric) The version\n"
             "  \"coinbase\" : true|false     (boolean) Coinbase or not\n"
             "}\n"
 
@@ -864,33 +863,32 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    COutPoint out(hash, n);
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) { // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
+        }
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin)) {
             return NullUniValue;
+        }
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.pushKV("bestblock", pindex->GetBlockHash().GetHex());
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.pushKV("confirmations", 0);
     else
-        ret.pushKV("confirmations", pindex->nHeight - coins.nHeight + 1);
-    ret.pushKV("value", ValueFromAmount(coins.vout[n].nValue));
+        ret.pushKV("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1));
+    ret.pushKV("value", ValueFromAmount(coin.out.nValue));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.pushKV("scriptPubKey", o);
-    ret.pushKV("version", coins.nVersion);
-    ret.pushKV("coinbase", coins.fCoinBase);
+    ret.pushKV("coinbase", (bool)coin.fCoinBase);
 
     return ret;
 }
@@ -958,32 +956,36 @@ UniValue exportchain(const UniValue& params, bool fHelp)
 
         CBlockIndex* pindex = chainActive.Genesis();
         CBlockIndex* current_tip = chainActive.Tip();
+        auto prefetcher = MakeBlockPrefetcher(chainparams, [current_tip](const CBlockIndex* pprev) -> const CBlockIndex* {
+            return pprev == current_tip ? nullptr : chainActive.Next(pprev);
+        });
 
         while (pindex && pindex != current_tip)
         {
-            CBlock block;
-            bool result;
+            std::shared_ptr<const CBlock> pblock;
 
-            if (fBlockPrefetchEnabled)
+            if (prefetcher)
             {
-                result = ReadBlockFromPrefetch(block, pindex, chainparams);
+                pblock = prefetcher->Get(pindex);
             }
             else
             {
-                result = ReadBlockFromDisk(block, pindex, chainparams);
+                auto pblockRead = std::make_shared<CBlock>();
+                if (ReadBlockFromDisk(*pblockRead, pindex, chainparams))
+                    pblock = pblockRead;
             }
 
-            if (result)
+            if (pblock)
             {
                 // Write index header
-                unsigned int nSize = GetSerializeSize(fileout, block);
+                unsigned int nSize = GetSerializeSize(fileout, *pblock);
                 fileout << FLATDATA(Params().MessageStart()) << nSize;
                 
                 // Write block
                 long fileOutPos = ftell(fileout.Get());
                 if (fileOutPos < 0)
                     return error("WriteBlockToDisk: ftell failed");
-                fileout << block;
+                fileout << *pblock;
 
                 if (pindex->nHeight % 50000 == 0)
                 {
@@ -999,11 +1001,6 @@ UniValue exportchain(const UniValue& params, bool fHelp)
         FileCommit(fileout.Get());
         fileout.fclose();
 
-        if (fBlockPrefetchEnabled)
-        {
-            ClearBlockPrefetch();
-        }
-
         ret.pushKV("result", true);
         ret.pushKV("height", pindex->nHeight);
         ret.pushKV("description", strprintf("%s created", path.generic_string()));
@@ -154,6 +154,11 @@ extern "C" {
     /// `librustzcash_sapling_proving_ctx_init`.
     void librustzcash_sapling_proving_ctx_free(void *);
 
+    /// Adds the value commitments accumulated by the proving context `src`
+    /// to `dst`, so that proofs created with separate contexts can share
+    /// one binding signature. `src` is left unchanged.
+    void librustzcash_sapling_proving_ctx_merge(void *dst, const void *src);
+
     /// Creates a Sapling verification context. Please free this
     /// when you're done.
     void * librustzcash_sapling_verification_ctx_init();
@@ -194,6 +199,60 @@ extern "C" {
     /// `librustzcash_sapling_verification_ctx_init`.
     void librustzcash_sapling_verification_ctx_free(void *);
 
+    /// Creates a Sapling batch validator. Please free this
+    /// when you're done. If checkProofs is false, only the
+    /// signatures are checked, and the proofs are not parsed.
+    void * librustzcash_sapling_batch_validator_init(bool checkProofs);
+
+    /// Queue a Sapling Spend description for batch validation,
+    /// accumulating the value commitment into the validator.
+    /// Returns false if the description is invalid without
+    /// needing to check its proof or signature.
+    bool librustzcash_sapling_batch_check_spend(
+        void *ctx,
+        const unsigned char *cv,
+        const unsigned char *anchor,
+        const unsigned char *nullifier,
+        const unsigned char *rk,
+        const unsigned char *zkproof,
+        const unsigned char *spendAuthSig,
+        const unsigned char *sighashValue
+    );
+
+    /// Queue a Sapling Output description for batch validation,
+    /// accumulating the value commitment into the validator.
+    /// Returns false if the description is invalid without
+    /// needing to check its proof.
+    bool librustzcash_sapling_batch_check_output(
+        void *ctx,
+        const unsigned char *cv,
+        const unsigned char *cm,
+        const unsigned char *ephemeralKey,
+        const unsigned char *zkproof
+    );
+
+    /// Queue the binding signature of the transaction whose
+    /// descriptions were queued since the last call, given
+    /// valueBalance.
+    bool librustzcash_sapling_batch_final_check(
+        void *ctx,
+        int64_t valueBalance,
+        const unsigned char *bindingSig,
+        const unsigned char *sighashValue
+    );
+
+    /// Drop the descriptions queued since the last successful
+    /// `librustzcash_sapling_batch_final_check`.
+    void librustzcash_sapling_batch_discard_bundle(void *ctx);
+
+    /// Check every proof and signature queued in the batch
+    /// validator. The validator is empty afterwards.
+    bool librustzcash_sapling_batch_validate(void *ctx);
+
+    /// Frees a Sapling batch validator returned from
+    /// `librustzcash_sapling_batch_validator_init`.
+    void librustzcash_sapling_batch_validator_free(void *);
+
     /// Compute a Sapling nullifier.
     ///
     /// The `diversifier` parameter must be 11 bytes in length.
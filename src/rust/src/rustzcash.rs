@@ -53,17 +53,20 @@ use zcash_primitives::{
     zip32,
 };
 use zcash_proofs::{
-    circuit::sapling::TREE_DEPTH as SAPLING_TREE_DEPTH,
-    load_parameters,
-    sapling::{SaplingProvingContext, SaplingVerificationContext},
-    sprout,
+    circuit::sapling::TREE_DEPTH as SAPLING_TREE_DEPTH, load_parameters,
+    sapling::SaplingVerificationContext, sprout,
 };
 
 use zcash_history::{Entry as MMREntry, NodeData as MMRNodeData, Tree as MMRTree};
 
+use sapling_batch::BatchValidator;
+use sapling_prover::ProvingContext;
+
 mod blake2b;
 mod ed25519;
 mod metrics_ffi;
+mod sapling_batch;
+mod sapling_prover;
 mod tracing_ffi;
 
 #[cfg(test)]
@@ -643,6 +646,156 @@ pub extern "C" fn librustzcash_sapling_final_check(
     unsafe { &*ctx }.final_check(value_balance, unsafe { &*sighash_value }, binding_sig)
 }
 
+/// Creates a Sapling batch validator.
+#[no_mangle]
+pub extern "C" fn librustzcash_sapling_batch_validator_init(check_proofs: bool) -> *mut BatchValidator {
+    let ctx = Box::new(BatchValidator::new(check_proofs));
+
+    Box::into_raw(ctx)
+}
+
+/// Frees a Sapling batch validator returned from
+/// [`librustzcash_sapling_batch_validator_init`].
+#[no_mangle]
+pub extern "C" fn librustzcash_sapling_batch_validator_free(ctx: *mut BatchValidator) {
+    drop(unsafe { Box::from_raw(ctx) });
+}
+
+/// Queues a Sapling Spend description in the batch validator, accumulating
+/// the value commitment into the current transaction.
+#[no_mangle]
+pub extern "C" fn librustzcash_sapling_batch_check_spend(
+    ctx: *mut BatchValidator,
+    cv: *const [c_uchar; 32],
+    anchor: *const [c_uchar; 32],
+    nullifier: *const [c_uchar; 32],
+    rk: *const [c_uchar; 32],
+    zkproof: *const [c_uchar; GROTH_PROOF_SIZE],
+    spend_auth_sig: *const [c_uchar; 64],
+    sighash_value: *const [c_uchar; 32],
+) -> bool {
+    let cv = match de_ct(jubjub::ExtendedPoint::from_bytes(unsafe { &*cv })) {
+        Some(p) => p,
+        None => return false,
+    };
+
+    let anchor = match de_ct(bls12_381::Scalar::from_bytes(unsafe { &*anchor })) {
+        Some(a) => a,
+        None => return false,
+    };
+
+    let rk = match redjubjub::PublicKey::read(&(unsafe { &*rk })[..]) {
+        Ok(p) => p,
+        Err(_) => return false,
+    };
+
+    let spend_auth_sig = match Signature::read(&(unsafe { &*spend_auth_sig })[..]) {
+        Ok(sig) => sig,
+        Err(_) => return false,
+    };
+
+    let ctx = unsafe { &mut *ctx };
+
+    // Parsing a proof decompresses its curve points, so it is skipped when
+    // the proofs are not checked
+    let zkproof = if ctx.checks_proofs() {
+        match Proof::read(&(unsafe { &*zkproof })[..]) {
+            Ok(p) => Some(p),
+            Err(_) => return false,
+        }
+    } else {
+        None
+    };
+
+    ctx.check_spend(
+        cv,
+        anchor,
+        unsafe { &*nullifier },
+        rk,
+        unsafe { &*sighash_value },
+        spend_auth_sig,
+        zkproof,
+    )
+}
+
+/// Queues a Sapling Output description in the batch validator, accumulating
+/// the value commitment into the current transaction.
+#[no_mangle]
+pub extern "C" fn librustzcash_sapling_batch_check_output(
+    ctx: *mut BatchValidator,
+    cv: *const [c_uchar; 32],
+    cm: *const [c_uchar; 32],
+    epk: *const [c_uchar; 32],
+    zkproof: *const [c_uchar; GROTH_PROOF_SIZE],
+) -> bool {
+    let cv = match de_ct(jubjub::ExtendedPoint::from_bytes(unsafe { &*cv })) {
+        Some(p) => p,
+        None => return false,
+    };
+
+    let cm = match de_ct(bls12_381::Scalar::from_bytes(unsafe { &*cm })) {
+        Some(a) => a,
+        None => return false,
+    };
+
+    let epk = match de_ct(jubjub::ExtendedPoint::from_bytes(unsafe { &*epk })) {
+        Some(p) => p,
+        None => return false,
+    };
+
+    let ctx = unsafe { &mut *ctx };
+
+    let zkproof = if ctx.checks_proofs() {
+        match Proof::read(&(unsafe { &*zkproof })[..]) {
+            Ok(p) => Some(p),
+            Err(_) => return false,
+        }
+    } else {
+        None
+    };
+
+    ctx.check_output(cv, cm, epk, zkproof)
+}
+
+/// Queues the binding signature of the current transaction in the batch
+/// validator, given valueBalance.
+#[no_mangle]
+pub extern "C" fn librustzcash_sapling_batch_final_check(
+    ctx: *mut BatchValidator,
+    value_balance: i64,
+    binding_sig: *const [c_uchar; 64],
+    sighash_value: *const [c_uchar; 32],
+) -> bool {
+    let value_balance = match Amount::from_i64(value_balance) {
+        Ok(vb) => vb,
+        Err(()) => return false,
+    };
+
+    let binding_sig = match Signature::read(&(unsafe { &*binding_sig })[..]) {
+        Ok(sig) => sig,
+        Err(_) => return false,
+    };
+
+    unsafe { &mut *ctx }.final_check(value_balance, unsafe { &*sighash_value }, binding_sig)
+}
+
+/// Drops the descriptions queued in the batch validator since the last
+/// successful [`librustzcash_sapling_batch_final_check`].
+#[no_mangle]
+pub extern "C" fn librustzcash_sapling_batch_discard_bundle(ctx: *mut BatchValidator) {
+    unsafe { &mut *ctx }.discard_bundle()
+}
+
+/// Checks every proof and signature queued in the batch validator.
+#[no_mangle]
+pub extern "C" fn librustzcash_sapling_batch_validate(ctx: *mut BatchValidator) -> bool {
+    unsafe { &mut *ctx }.validate(
+        &mut OsRng,
+        &unsafe { SAPLING_SPEND_PARAMS.as_ref() }.unwrap().vk,
+        &unsafe { SAPLING_OUTPUT_PARAMS.as_ref() }.unwrap().vk,
+    )
+}
+
 /// Sprout JoinSplit proof generation.
 #[no_mangle]
 pub extern "C" fn librustzcash_sprout_prove(
@@ -760,7 +913,7 @@ pub extern "C" fn librustzcash_sprout_verify(
 /// the necessary witness information. It outputs `cv` and the `zkproof`.
 #[no_mangle]
 pub extern "C" fn librustzcash_sapling_output_proof(
-    ctx: *mut SaplingProvingContext,
+    ctx: *mut ProvingContext,
     esk: *const [c_uchar; 32],
     payment_address: *const [c_uchar; 43],
     rcm: *const [c_uchar; 32],
@@ -787,13 +940,16 @@ pub extern "C" fn librustzcash_sapling_output_proof(
     };
 
     // Create proof
-    let (proof, value_commitment) = unsafe { &mut *ctx }.output_proof(
+    let (proof, value_commitment) = match unsafe { &mut *ctx }.output_proof(
         esk,
         payment_address,
         rcm,
         value,
         unsafe { SAPLING_OUTPUT_PARAMS.as_ref() }.unwrap(),
-    );
+    ) {
+        Ok(r) => r,
+        Err(_) => return false,
+    };
 
     // Write the proof out to the caller
     proof
@@ -849,7 +1005,7 @@ pub extern "C" fn librustzcash_sapling_spend_sig(
 /// consistency.
 #[no_mangle]
 pub extern "C" fn librustzcash_sapling_binding_sig(
-    ctx: *const SaplingProvingContext,
+    ctx: *const ProvingContext,
     value_balance: i64,
     sighash: *const [c_uchar; 32],
     result: *mut [c_uchar; 64],
@@ -877,7 +1033,7 @@ pub extern "C" fn librustzcash_sapling_binding_sig(
 /// `rk` (so that you don't have to compute it) along with the proof.
 #[no_mangle]
 pub extern "C" fn librustzcash_sapling_spend_proof(
-    ctx: *mut SaplingProvingContext,
+    ctx: *mut ProvingContext,
     ak: *const [c_uchar; 32],
     nsk: *const [c_uchar; 32],
     diversifier: *const [c_uchar; 11],
@@ -975,8 +1131,8 @@ pub extern "C" fn librustzcash_sapling_spend_proof(
 
 /// Creates a Sapling proving context. Please free this when you're done.
 #[no_mangle]
-pub extern "C" fn librustzcash_sapling_proving_ctx_init() -> *mut SaplingProvingContext {
-    let ctx = Box::new(SaplingProvingContext::new());
+pub extern "C" fn librustzcash_sapling_proving_ctx_init() -> *mut ProvingContext {
+    let ctx = Box::new(ProvingContext::new());
 
     Box::into_raw(ctx)
 }
@@ -984,10 +1140,21 @@ pub extern "C" fn librustzcash_sapling_proving_ctx_init() -> *mut SaplingProving
 /// Frees a Sapling proving context returned from
 /// [`librustzcash_sapling_proving_ctx_init`].
 #[no_mangle]
-pub extern "C" fn librustzcash_sapling_proving_ctx_free(ctx: *mut SaplingProvingContext) {
+pub extern "C" fn librustzcash_sapling_proving_ctx_free(ctx: *mut ProvingContext) {
     drop(unsafe { Box::from_raw(ctx) });
 }
 
+/// Adds the value commitments accumulated by the proving context `src` to
+/// `dst`, so that proofs created with separate contexts (for example on
+/// different threads) can share one binding signature. `src` is unchanged.
+#[no_mangle]
+pub extern "C" fn librustzcash_sapling_proving_ctx_merge(
+    dst: *mut ProvingContext,
+    src: *const ProvingContext,
+) {
+    unsafe { &mut *dst }.merge(unsafe { &*src });
+}
+
 /// Derive the master ExtendedSpendingKey from a seed.
 #[no_mangle]
 pub extern "C" fn librustzcash_zip32_xsk_master(
@@ -0,0 +1,399 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+//! Batch validation of Sapling proofs and signatures.
+//!
+//! A [`BatchValidator`] performs the cheap, per-description checks (point
+//! decoding, small-order checks, value commitment accumulation) eagerly, and
+//! queues the expensive parts: Groth16 proofs, spend authorization signatures
+//! and binding signatures. [`BatchValidator::validate`] then checks every
+//! queued item at once, using a random linear combination so that a single
+//! final exponentiation covers all of the proofs of each kind.
+//!
+//! A failed batch only tells the caller that *something* in it is invalid;
+//! callers that need to identify the offending transaction re-check the
+//! individual transactions with [`SaplingVerificationContext`].
+//!
+//! [`SaplingVerificationContext`]: zcash_proofs::sapling::SaplingVerificationContext
+
+use bellman::{
+    gadgets::multipack,
+    groth16::{Proof, VerifyingKey},
+};
+use bls12_381::{multi_miller_loop, Bls12, G1Affine, G1Projective, G2Prepared, Gt};
+use group::{cofactor::CofactorGroup, GroupEncoding};
+use rand_core::RngCore;
+use std::mem;
+use zcash_primitives::{
+    constants::{
+        SPENDING_KEY_GENERATOR, VALUE_COMMITMENT_RANDOMNESS_GENERATOR,
+        VALUE_COMMITMENT_VALUE_GENERATOR,
+    },
+    redjubjub::{self, PublicKey, Signature},
+    transaction::components::Amount,
+};
+
+/// Returns a uniformly random, non-zero 128-bit scalar for use as a batching
+/// coefficient.
+fn batch_scalar<R: RngCore>(rng: &mut R) -> bls12_381::Scalar {
+    loop {
+        let z = bls12_381::Scalar::from_raw([rng.next_u64(), rng.next_u64(), 0, 0]);
+        if z != bls12_381::Scalar::zero() {
+            return z;
+        }
+    }
+}
+
+/// Computes `value_balance * VALUE_COMMITMENT_VALUE_GENERATOR`.
+pub(crate) fn value_balance_point(value: Amount) -> Option<jubjub::ExtendedPoint> {
+    let abs = match i64::from(value).checked_abs() {
+        Some(a) => a as u64,
+        None => return None,
+    };
+
+    let mut value_balance = VALUE_COMMITMENT_VALUE_GENERATOR * jubjub::Fr::from(abs);
+    if value.is_negative() {
+        value_balance = -value_balance;
+    }
+
+    Some(value_balance.into())
+}
+
+/// Groth16 proofs queued against a single verifying key.
+struct ProofBatch {
+    items: Vec<(Proof<Bls12>, Vec<bls12_381::Scalar>)>,
+}
+
+impl ProofBatch {
+    fn new() -> Self {
+        ProofBatch { items: vec![] }
+    }
+
+    fn queue(&mut self, proof: Proof<Bls12>, inputs: Vec<bls12_381::Scalar>) {
+        self.items.push((proof, inputs));
+    }
+
+    fn len(&self) -> usize {
+        self.items.len()
+    }
+
+    fn truncate(&mut self, len: usize) {
+        self.items.truncate(len);
+    }
+
+    /// Checks every queued proof against `vk`.
+    ///
+    /// For random non-zero `z_i`, this checks that
+    ///
+    ///   prod_i e(z_i A_i, B_i) * e(-sum_i z_i alpha, beta)
+    ///       * e(-sum_i z_i acc_i, gamma) * e(-sum_i z_i C_i, delta) = 1
+    ///
+    /// which holds for valid proofs, and fails with overwhelming probability
+    /// if any single proof is invalid. This costs one Miller loop per proof,
+    /// three shared Miller loops and one final exponentiation, instead of
+    /// three Miller loops and a final exponentiation per proof.
+    fn verify<R: RngCore>(&self, rng: &mut R, vk: &VerifyingKey<Bls12>) -> bool {
+        if self.items.is_empty() {
+            return true;
+        }
+
+        let mut z_sum = bls12_381::Scalar::zero();
+        let mut acc_sum = G1Projective::identity();
+        let mut c_sum = G1Projective::identity();
+        let mut g1_terms = Vec::with_capacity(self.items.len() + 3);
+        let mut g2_terms = Vec::with_capacity(self.items.len() + 3);
+
+        for (proof, inputs) in &self.items {
+            if inputs.len() + 1 != vk.ic.len() {
+                return false;
+            }
+
+            let z = batch_scalar(rng);
+
+            let mut acc = G1Projective::from(vk.ic[0]);
+            for (input, base) in inputs.iter().zip(vk.ic.iter().skip(1)) {
+                acc += base * input;
+            }
+
+            acc_sum += acc * z;
+            c_sum += proof.c * z;
+            z_sum += z;
+
+            g1_terms.push(G1Affine::from(proof.a * z));
+            g2_terms.push(G2Prepared::from(proof.b));
+        }
+
+        g1_terms.push(G1Affine::from(-(vk.alpha_g1 * z_sum)));
+        g2_terms.push(G2Prepared::from(vk.beta_g2));
+        g1_terms.push(G1Affine::from(-acc_sum));
+        g2_terms.push(G2Prepared::from(vk.gamma_g2));
+        g1_terms.push(G1Affine::from(-c_sum));
+        g2_terms.push(G2Prepared::from(vk.delta_g2));
+
+        let terms: Vec<_> = g1_terms.iter().zip(g2_terms.iter()).collect();
+
+        multi_miller_loop(&terms).final_exponentiation() == Gt::identity()
+    }
+}
+
+/// RedJubjub signatures queued against a single generator.
+struct SignatureBatch {
+    items: Vec<(PublicKey, [u8; 64], Signature)>,
+}
+
+impl SignatureBatch {
+    fn new() -> Self {
+        SignatureBatch { items: vec![] }
+    }
+
+    fn queue(&mut self, vk: PublicKey, msg: [u8; 64], sig: Signature) {
+        self.items.push((vk, msg, sig));
+    }
+
+    fn len(&self) -> usize {
+        self.items.len()
+    }
+
+    fn truncate(&mut self, len: usize) {
+        self.items.truncate(len);
+    }
+
+    fn verify<R: RngCore>(&mut self, rng: &mut R, p_g: jubjub::SubgroupPoint) -> bool {
+        let items = mem::replace(&mut self.items, vec![]);
+        if items.is_empty() {
+            return true;
+        }
+        let (keys_and_sigs, msgs): (Vec<_>, Vec<_>) = items
+            .into_iter()
+            .map(|(vk, msg, sig)| ((vk, sig), msg))
+            .unzip();
+
+        let entries: Vec<_> = keys_and_sigs
+            .into_iter()
+            .zip(msgs.iter())
+            .map(|((vk, sig), msg)| redjubjub::BatchEntry {
+                vk,
+                msg: &msg[..],
+                sig,
+            })
+            .collect();
+
+        redjubjub::batch_verify(rng, &entries, p_g)
+    }
+}
+
+/// Accumulates the Sapling descriptions of one or more transactions, and
+/// validates all of them together.
+pub struct BatchValidator {
+    /// Whether proofs are queued, or only signatures.
+    check_proofs: bool,
+    /// Sum of the value commitments of the bundle currently being queued.
+    cv_sum: jubjub::ExtendedPoint,
+    spend_proofs: ProofBatch,
+    output_proofs: ProofBatch,
+    spend_auth_sigs: SignatureBatch,
+    binding_sigs: SignatureBatch,
+    /// Lengths of the spend proof, output proof and spend authorization
+    /// signature batches when the current bundle was started.
+    bundle_start: (usize, usize, usize),
+}
+
+impl BatchValidator {
+    /// Creates a validator. If `check_proofs` is false, only the signatures
+    /// are queued and validated, and the proofs are neither parsed nor
+    /// checked.
+    pub fn new(check_proofs: bool) -> Self {
+        BatchValidator {
+            check_proofs,
+            cv_sum: jubjub::ExtendedPoint::identity(),
+            spend_proofs: ProofBatch::new(),
+            output_proofs: ProofBatch::new(),
+            spend_auth_sigs: SignatureBatch::new(),
+            binding_sigs: SignatureBatch::new(),
+            bundle_start: (0, 0, 0),
+        }
+    }
+
+    /// Whether this validator checks proofs.
+    pub fn checks_proofs(&self) -> bool {
+        self.check_proofs
+    }
+
+    /// Drops everything queued for the current bundle, so that a bundle
+    /// that failed part-way leaves nothing behind.
+    pub fn discard_bundle(&mut self) {
+        let (spend_proofs, output_proofs, spend_auth_sigs) = self.bundle_start;
+        self.spend_proofs.truncate(spend_proofs);
+        self.output_proofs.truncate(output_proofs);
+        self.spend_auth_sigs.truncate(spend_auth_sigs);
+        self.cv_sum = jubjub::ExtendedPoint::identity();
+    }
+
+    /// Queues a Spend description, accumulating the value commitment into
+    /// the current bundle. `zkproof` is ignored unless the validator checks
+    /// proofs. Returns false if the description can be rejected without
+    /// checking its proof or signature.
+    #[allow(clippy::too_many_arguments)]
+    pub fn check_spend(
+        &mut self,
+        cv: jubjub::ExtendedPoint,
+        anchor: bls12_381::Scalar,
+        nullifier: &[u8; 32],
+        rk: PublicKey,
+        sighash_value: &[u8; 32],
+        spend_auth_sig: Signature,
+        zkproof: Option<Proof<Bls12>>,
+    ) -> bool {
+        if bool::from(cv.is_small_order() | rk.0.is_small_order()) {
+            return false;
+        }
+
+        self.cv_sum += cv;
+
+        // Compute the signature's message for rk/spend_auth_sig
+        let mut data_to_be_signed = [0u8; 64];
+        data_to_be_signed[0..32].copy_from_slice(&rk.0.to_bytes());
+        data_to_be_signed[32..64].copy_from_slice(&sighash_value[..]);
+
+        let zkproof = match zkproof {
+            Some(zkproof) if self.check_proofs => zkproof,
+            _ => {
+                self.spend_auth_sigs
+                    .queue(rk, data_to_be_signed, spend_auth_sig);
+                return true;
+            }
+        };
+
+        // Construct public input for circuit
+        let mut public_input = Vec::with_capacity(7);
+        {
+            let affine = jubjub::AffinePoint::from(rk.0);
+            public_input.push(affine.get_u());
+            public_input.push(affine.get_v());
+        }
+        {
+            let affine = jubjub::AffinePoint::from(cv);
+            public_input.push(affine.get_u());
+            public_input.push(affine.get_v());
+        }
+        public_input.push(anchor);
+        {
+            let nullifier = multipack::bytes_to_bits_le(&nullifier[..]);
+            let nullifier: Vec<bls12_381::Scalar> = multipack::compute_multipacking(&nullifier);
+            assert_eq!(nullifier.len(), 2);
+            public_input.extend(nullifier);
+        }
+
+        self.spend_auth_sigs
+            .queue(rk, data_to_be_signed, spend_auth_sig);
+        self.spend_proofs.queue(zkproof, public_input);
+
+        true
+    }
+
+    /// Queues an Output description, accumulating the value commitment into
+    /// the current bundle. `zkproof` is ignored unless the validator checks
+    /// proofs. Returns false if the description can be rejected without
+    /// checking its proof.
+    pub fn check_output(
+        &mut self,
+        cv: jubjub::ExtendedPoint,
+        cmu: bls12_381::Scalar,
+        epk: jubjub::ExtendedPoint,
+        zkproof: Option<Proof<Bls12>>,
+    ) -> bool {
+        if bool::from(cv.is_small_order() | epk.is_small_order()) {
+            return false;
+        }
+
+        self.cv_sum -= cv;
+
+        let zkproof = match zkproof {
+            Some(zkproof) if self.check_proofs => zkproof,
+            _ => return true,
+        };
+
+        // Construct public input for circuit
+        let mut public_input = Vec::with_capacity(5);
+        {
+            let affine = jubjub::AffinePoint::from(cv);
+            public_input.push(affine.get_u());
+            public_input.push(affine.get_v());
+        }
+        {
+            let affine = jubjub::AffinePoint::from(epk);
+            public_input.push(affine.get_u());
+            public_input.push(affine.get_v());
+        }
+        public_input.push(cmu);
+
+        self.output_proofs.queue(zkproof, public_input);
+
+        true
+    }
+
+    /// Closes the current bundle, queueing its binding signature against
+    /// the accumulated value commitments.
+    pub fn final_check(
+        &mut self,
+        value_balance: Amount,
+        sighash_value: &[u8; 32],
+        binding_sig: Signature,
+    ) -> bool {
+        let cv_sum = mem::replace(&mut self.cv_sum, jubjub::ExtendedPoint::identity());
+
+        let value_balance = match value_balance_point(value_balance) {
+            Some(vb) => vb,
+            None => return false,
+        };
+
+        // Compute the binding verification key from the value commitments
+        // and the value balance.
+        let bvk = PublicKey(cv_sum - value_balance);
+
+        // Compute the signature's message for bvk/binding_sig
+        let mut data_to_be_signed = [0u8; 64];
+        data_to_be_signed[0..32].copy_from_slice(&bvk.0.to_bytes());
+        data_to_be_signed[32..64].copy_from_slice(&sighash_value[..]);
+
+        self.binding_sigs.queue(bvk, data_to_be_signed, binding_sig);
+        self.bundle_start = (
+            self.spend_proofs.len(),
+            self.output_proofs.len(),
+            self.spend_auth_sigs.len(),
+        );
+
+        true
+    }
+
+    /// Checks the queued spend authorization and binding signatures, and
+    /// removes them from the validator.
+    fn validate_signatures<R: RngCore>(&mut self, rng: &mut R) -> bool {
+        // Evaluate both batches even if the first fails, so that neither
+        // is left queued.
+        self.spend_auth_sigs.verify(rng, SPENDING_KEY_GENERATOR)
+            & self
+                .binding_sigs
+                .verify(rng, VALUE_COMMITMENT_RANDOMNESS_GENERATOR)
+    }
+
+    /// Checks every queued proof and signature. The validator is left empty
+    /// afterwards.
+    pub fn validate<R: RngCore>(
+        &mut self,
+        rng: &mut R,
+        spend_vk: &VerifyingKey<Bls12>,
+        output_vk: &VerifyingKey<Bls12>,
+    ) -> bool {
+        let spend_proofs = mem::replace(&mut self.spend_proofs, ProofBatch::new());
+        let output_proofs = mem::replace(&mut self.output_proofs, ProofBatch::new());
+
+        // Evaluate every part even if an earlier one fails, so that the
+        // validator is always left empty.
+        let sigs_ok = self.validate_signatures(rng);
+        self.bundle_start = (0, 0, 0);
+
+        sigs_ok && spend_proofs.verify(rng, spend_vk) && output_proofs.verify(rng, output_vk)
+    }
+}
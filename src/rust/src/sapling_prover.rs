@@ -0,0 +1,209 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+//! Creation of Sapling proofs and binding signatures.
+//!
+//! This follows [`SaplingProvingContext`], with one addition: the value
+//! commitment randomness and the value commitments accumulated by a
+//! [`ProvingContext`] can be folded into another one with
+//! [`ProvingContext::merge`]. This lets the proofs of a transaction be created
+//! by several threads, each with its own context, and the binding signature be
+//! made once all of them are done.
+//!
+//! [`SaplingProvingContext`]: zcash_proofs::sapling::SaplingProvingContext
+
+use bellman::{
+    gadgets::multipack,
+    groth16::{create_random_proof, verify_proof, Parameters, PreparedVerifyingKey, Proof},
+};
+use bls12_381::Bls12;
+use group::{ff::Field, GroupEncoding};
+use rand_core::OsRng;
+use zcash_primitives::{
+    constants::{SPENDING_KEY_GENERATOR, VALUE_COMMITMENT_RANDOMNESS_GENERATOR},
+    merkle_tree::MerklePath,
+    primitives::{Diversifier, Note, PaymentAddress, ProofGenerationKey, Rseed, ValueCommitment},
+    redjubjub::{PrivateKey, PublicKey, Signature},
+    sapling::Node,
+    transaction::components::Amount,
+};
+use zcash_proofs::circuit::sapling::{Output, Spend};
+
+use crate::sapling_batch::value_balance_point;
+
+/// Accumulates the value commitments of the Spends and Outputs of a
+/// transaction as their proofs are created.
+pub struct ProvingContext {
+    /// Sum of the Spend value commitment randomness, minus the sum of the
+    /// Output value commitment randomness.
+    bsk: jubjub::Fr,
+    /// Sum of the Spend value commitments, minus the sum of the Output value
+    /// commitments.
+    cv_sum: jubjub::ExtendedPoint,
+}
+
+impl ProvingContext {
+    pub fn new() -> Self {
+        ProvingContext {
+            bsk: jubjub::Fr::zero(),
+            cv_sum: jubjub::ExtendedPoint::identity(),
+        }
+    }
+
+    /// Adds the accumulated state of `other` to this context.
+    pub fn merge(&mut self, other: &ProvingContext) {
+        self.bsk += other.bsk;
+        self.cv_sum += other.cv_sum;
+    }
+
+    /// Creates a Spend proof, and returns it along with the value commitment
+    /// and the re-randomized spend authorization key `rk`. The proof is
+    /// checked against `verifying_key` before it is returned.
+    #[allow(clippy::too_many_arguments)]
+    pub fn spend_proof(
+        &mut self,
+        proof_generation_key: ProofGenerationKey,
+        diversifier: Diversifier,
+        rseed: Rseed,
+        ar: jubjub::Fr,
+        value: u64,
+        anchor: bls12_381::Scalar,
+        merkle_path: MerklePath<Node>,
+        proving_key: &Parameters<Bls12>,
+        verifying_key: &PreparedVerifyingKey<Bls12>,
+    ) -> Result<(Proof<Bls12>, jubjub::ExtendedPoint, PublicKey), ()> {
+        let mut rng = OsRng;
+
+        // Create the randomness of the value commitment
+        let rcv = jubjub::Fr::random(&mut rng);
+        let value_commitment = ValueCommitment {
+            value,
+            randomness: rcv,
+        };
+
+        let viewing_key = proof_generation_key.to_viewing_key();
+        let payment_address = viewing_key.to_payment_address(diversifier).ok_or(())?;
+
+        // Re-randomize ak, so that the caller does not have to
+        let rk = PublicKey(proof_generation_key.ak.into()).randomize(ar, SPENDING_KEY_GENERATOR);
+
+        // Compute the nullifier, which is a public input of the circuit
+        let note = Note {
+            value,
+            g_d: diversifier.g_d().ok_or(())?,
+            pk_d: *payment_address.pk_d(),
+            rseed,
+        };
+        let nullifier = note.nf(&viewing_key, merkle_path.position);
+
+        let instance = Spend {
+            value_commitment: Some(value_commitment.clone()),
+            proof_generation_key: Some(proof_generation_key),
+            payment_address: Some(payment_address),
+            commitment_randomness: Some(note.rcm()),
+            ar: Some(ar),
+            auth_path: merkle_path
+                .auth_path
+                .iter()
+                .map(|(node, b)| Some(((*node).into(), *b)))
+                .collect(),
+            anchor: Some(anchor),
+        };
+
+        let proof = create_random_proof(instance, proving_key, &mut rng).map_err(|_| ())?;
+
+        let cv: jubjub::ExtendedPoint = value_commitment.commitment().into();
+
+        // Check the proof, so that a bad witness is caught here rather than
+        // by the network.
+        let mut public_input = Vec::with_capacity(7);
+        {
+            let affine = jubjub::AffinePoint::from(rk.0);
+            public_input.push(affine.get_u());
+            public_input.push(affine.get_v());
+        }
+        {
+            let affine = jubjub::AffinePoint::from(cv);
+            public_input.push(affine.get_u());
+            public_input.push(affine.get_v());
+        }
+        public_input.push(anchor);
+        {
+            let nullifier = multipack::bytes_to_bits_le(&nullifier[..]);
+            let nullifier: Vec<bls12_381::Scalar> = multipack::compute_multipacking(&nullifier);
+            assert_eq!(nullifier.len(), 2);
+            public_input.extend(nullifier);
+        }
+        verify_proof(verifying_key, &proof, &public_input[..]).map_err(|_| ())?;
+
+        // Only accumulate once the proof is known to be good
+        self.bsk += rcv;
+        self.cv_sum += cv;
+
+        Ok((proof, cv, rk))
+    }
+
+    /// Creates an Output proof, and returns it along with the value
+    /// commitment.
+    pub fn output_proof(
+        &mut self,
+        esk: jubjub::Fr,
+        payment_address: PaymentAddress,
+        rcm: jubjub::Fr,
+        value: u64,
+        proving_key: &Parameters<Bls12>,
+    ) -> Result<(Proof<Bls12>, jubjub::ExtendedPoint), ()> {
+        let mut rng = OsRng;
+
+        // Create the randomness of the value commitment
+        let rcv = jubjub::Fr::random(&mut rng);
+        let value_commitment = ValueCommitment {
+            value,
+            randomness: rcv,
+        };
+
+        let instance = Output {
+            value_commitment: Some(value_commitment.clone()),
+            payment_address: Some(payment_address),
+            commitment_randomness: Some(rcm),
+            esk: Some(esk),
+        };
+
+        let proof = create_random_proof(instance, proving_key, &mut rng).map_err(|_| ())?;
+
+        let cv: jubjub::ExtendedPoint = value_commitment.commitment().into();
+
+        self.bsk -= rcv;
+        self.cv_sum -= cv;
+
+        Ok((proof, cv))
+    }
+
+    /// Creates the binding signature of a transaction whose Spends and
+    /// Outputs have all been accumulated into this context.
+    pub fn binding_sig(&self, value_balance: Amount, sighash: &[u8; 32]) -> Result<Signature, ()> {
+        let mut rng = OsRng;
+
+        let bsk = PrivateKey(self.bsk);
+        let bvk = PublicKey::from_private(&bsk, VALUE_COMMITMENT_RANDOMNESS_GENERATOR);
+
+        // The binding verification key must match the one that verifiers
+        // will compute from the value commitments and valueBalance; if it
+        // does not, some description is missing from this context.
+        let value_balance = value_balance_point(value_balance).ok_or(())?;
+        if bvk.0 != self.cv_sum - value_balance {
+            return Err(());
+        }
+
+        let mut data_to_be_signed = [0u8; 64];
+        data_to_be_signed[0..32].copy_from_slice(&bvk.0.to_bytes());
+        data_to_be_signed[32..64].copy_from_slice(&sighash[..]);
+
+        Ok(bsk.sign(
+            &data_to_be_signed,
+            &mut rng,
+            VALUE_COMMITMENT_RANDOMNESS_GENERATOR,
+        ))
+    }
+}
@@ -5,26 +5,36 @@
 
 #include "sigcache.h"
 
-#include "memusage.h"
+#include "cuckoocache.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
 #include <boost/thread.hpp>
-#include <boost/unordered_set.hpp>
+
+#include <rust/metrics.h>
 
 namespace {
 
 /**
  * We're hashing a nonce into the entries themselves, so we don't need extra
  * blinding in the set hash computation.
+ *
+ * This may exhibit platform endian dependent behavior but because these are
+ * nonced hashes (random) and this state is only ever used locally it is safe.
+ * All that matters is local consistency.
  */
-class CSignatureCacheHasher
+class SignatureCacheHasher
 {
 public:
-    size_t operator()(const uint256& key) const {
-        return key.GetCheapHash();
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        static_assert(hash_select < 8, "SignatureCacheHasher only has 8 hashes available.");
+        uint32_t u;
+        std::memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
     }
 };
 
@@ -32,16 +42,39 @@ public:
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
  * again when accepted into the block chain)
+ *
+ * The cache is split into SIGCACHE_STRIPES cuckoo caches, each behind its own
+ * lock, so that the script check threads rarely wait for each other. Lookups
+ * only take a shared lock, and erasing an entry just marks it for collection
+ * by a later insert.
  */
 class CSignatureCache
 {
 private:
+    static const unsigned int SIGCACHE_STRIPES = 16;
+
+    struct Stripe
+    {
+        CuckooCache::cache<uint256, SignatureCacheHasher> setValid;
+        boost::shared_mutex cs_sigcache;
+    };
+
      //! Entries are SHA256(nonce || signature hash || public key || signature):
     uint256 nonce;
-    typedef boost::unordered_set<uint256, CSignatureCacheHasher> map_type;
-    map_type setValid;
-    boost::shared_mutex cs_sigcache;
+    Stripe stripes[SIGCACHE_STRIPES];
 
+    Stripe& GetStripe(const uint256& entry)
+    {
+        // Every byte of the entry feeds one of the cuckoo hashes, so pick the
+        // stripe from all of them, leaving each hash uniform within a stripe.
+        uint32_t n = 0;
+        for (int i = 0; i < 8; i++) {
+            uint32_t u;
+            std::memcpy(&u, entry.begin() + 4 * i, 4);
+            n ^= u;
+        }
+        return stripes[n % SIGCACHE_STRIPES];
+    }
 
 public:
     CSignatureCache()
@@ -49,6 +82,16 @@ public:
         GetRandBytes(nonce.begin(), 32);
     }
 
+    size_t Setup(size_t nBytes)
+    {
+        size_t nElems = 0;
+        for (Stripe& stripe : stripes) {
+            boost::unique_lock<boost::shared_mutex> lock(stripe.cs_sigcache);
+            nElems += stripe.setValid.setup_bytes(nBytes / SIGCACHE_STRIPES);
+        }
+        return nElems;
+    }
+
     void
     ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey)
     {
@@ -56,52 +99,56 @@ public:
     }
 
     bool
-    Get(const uint256& entry)
+    Get(const uint256& entry, const bool erase)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-        return setValid.count(entry);
-    }
-
-    void Erase(const uint256& entry)
-    {
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        setValid.erase(entry);
+        Stripe& stripe = GetStripe(entry);
+        boost::shared_lock<boost::shared_mutex> lock(stripe.cs_sigcache);
+        return stripe.setValid.contains(entry, erase);
     }
 
     void Set(const uint256& entry)
     {
-        size_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        while (memusage::DynamicUsage(setValid) > nMaxCacheSize)
-        {
-            map_type::size_type s = GetRand(setValid.bucket_count());
-            map_type::local_iterator it = setValid.begin(s);
-            if (it != setValid.end(s)) {
-                setValid.erase(*it);
-            }
-        }
-
-        setValid.insert(entry);
+        Stripe& stripe = GetStripe(entry);
+        boost::unique_lock<boost::shared_mutex> lock(stripe.cs_sigcache);
+        stripe.setValid.insert(entry);
     }
 };
 
+/* In previous versions of this code, signatureCache was a local static variable
+ * in CachingTransactionSignatureChecker::VerifySignature. We initialize
+ * signatureCache outside of VerifySignature to avoid the atomic operation per
+ * call overhead associated with local static variables even though
+ * signatureCache could be made local to VerifySignature.
+*/
+CSignatureCache signatureCache;
+
+bool fSignatureCacheSetup = false;
+
+}
+
+void InitSignatureCache()
+{
+    // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
+    // setup_bytes creates the minimum possible cache (2 elements per stripe).
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE)), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+    size_t nElems = signatureCache.Setup(nMaxCacheSize);
+    fSignatureCacheSetup = true;
+    LogPrintf("Using %zu MiB out of %zu requested for signature cache, able to store %zu elements\n",
+              (nElems*sizeof(uint256)) >>20, nMaxCacheSize>>20, nElems);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    assert(fSignatureCacheSetup);
 
     uint256 entry;
     signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(entry)) {
-        if (!store) {
-            signatureCache.Erase(entry);
-        }
+    if (signatureCache.Get(entry, !store)) {
+        MetricsIncrementCounter("zcash.sigcache.hits");
         return true;
     }
+    MetricsIncrementCounter("zcash.sigcache.misses");
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -0,0 +1,338 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "util.h"
+
+#include <algorithm>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef USE_EPOLL
+static uint32_t ToEpollEvents(int nEvents)
+{
+    uint32_t events = 0;
+    if (nEvents & CSocketEvents::EVENT_RECV)
+        events |= EPOLLIN;
+    if (nEvents & CSocketEvents::EVENT_SEND)
+        events |= EPOLLOUT;
+    // EPOLLERR and EPOLLHUP are always reported
+    return events;
+}
+#endif
+
+CSocketEvents::CSocketEvents()
+{
+#ifdef USE_EPOLL
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) {
+        LogPrintf("%s: epoll_create1 failed: %s\n", __func__, NetworkErrorString(errno));
+    }
+#endif
+#ifndef WIN32
+    if (pipe(wakeupPipe) != 0) {
+        LogPrintf("%s: pipe failed: %s\n", __func__, NetworkErrorString(errno));
+        wakeupPipe[0] = wakeupPipe[1] = -1;
+    } else {
+        for (int fd : wakeupPipe) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#ifdef USE_EPOLL
+        if (epollfd >= 0) {
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = wakeupPipe[0];
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, wakeupPipe[0], &event);
+        }
+#endif
+    }
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (epollfd >= 0)
+        close(epollfd);
+#endif
+#ifndef WIN32
+    for (int fd : wakeupPipe) {
+        if (fd >= 0)
+            close(fd);
+    }
+#endif
+}
+
+const char* CSocketEvents::GetBackendName()
+{
+#ifdef USE_EPOLL
+    return "epoll";
+#elif defined(USE_POLL)
+    return "poll";
+#else
+    return "select";
+#endif
+}
+
+void CSocketEvents::Clear()
+{
+    vWanted.clear();
+}
+
+void CSocketEvents::Add(SOCKET s, int nEvents, int64_t nTag)
+{
+    if (s == INVALID_SOCKET)
+        return;
+    vWanted.emplace_back(s, Interest{nEvents, nTag});
+}
+
+int CSocketEvents::GetEvents(SOCKET s) const
+{
+    auto it = mapReady.find(s);
+    return it == mapReady.end() ? 0 : it->second;
+}
+
+bool CSocketEvents::CanWakeup() const
+{
+#ifdef WIN32
+    return false;
+#else
+    return wakeupPipe[0] >= 0;
+#endif
+}
+
+void CSocketEvents::Wakeup()
+{
+#ifndef WIN32
+    // One pending byte is enough to wake the waiter
+    if (wakeupPipe[1] >= 0 && !fWakeupPending.exchange(true)) {
+        char c = 0;
+        if (write(wakeupPipe[1], &c, 1) != 1) {
+            fWakeupPending = false;
+        }
+    }
+#endif
+}
+
+#ifndef WIN32
+void CSocketEvents::DrainWakeup()
+{
+    char buf[64];
+    while (read(wakeupPipe[0], buf, sizeof(buf)) > 0) {
+    }
+    // Only clear the flag once the pipe is empty. A Wakeup() that lands
+    // between the two then leaves its byte in the pipe, which costs one
+    // spurious wakeup, rather than being swallowed with the flag still set.
+    fWakeupPending = false;
+}
+#endif
+
+#ifdef USE_EPOLL
+
+bool CSocketEvents::Wait(int64_t nTimeout)
+{
+    mapReady.clear();
+    if (epollfd < 0) {
+        MilliSleep(nTimeout);
+        return false;
+    }
+
+    // Bring the kernel's interest list in line with the sockets added,
+    // touching only the ones that changed.
+    nGeneration++;
+    for (const auto& wanted : vWanted) {
+        SOCKET s = wanted.first;
+        const Interest& interest = wanted.second;
+        struct epoll_event event = {};
+        event.events = ToEpollEvents(interest.nEvents);
+        event.data.fd = s;
+
+        auto it = mapRegistered.find(s);
+        int ret = 0;
+        if (it == mapRegistered.end() || it->second.interest.nTag != interest.nTag) {
+            ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, s, &event);
+            if (ret != 0 && errno == EEXIST)
+                ret = epoll_ctl(epollfd, EPOLL_CTL_MOD, s, &event);
+        } else if (it->second.interest.nEvents != interest.nEvents) {
+            ret = epoll_ctl(epollfd, EPOLL_CTL_MOD, s, &event);
+            if (ret != 0 && errno == ENOENT)
+                ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, s, &event);
+        }
+        if (ret != 0) {
+            // The socket was closed under us; it is dropped from the set below
+            LogPrint("net", "%s: epoll_ctl for socket %d failed: %s\n", __func__, s, NetworkErrorString(errno));
+            continue;
+        }
+        Registration& reg = mapRegistered[s];
+        reg.interest = interest;
+        reg.nSeen = nGeneration;
+    }
+    for (auto it = mapRegistered.begin(); it != mapRegistered.end(); ) {
+        if (it->second.nSeen != nGeneration) {
+            // Fails harmlessly if the socket has already been closed
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, it->first, NULL);
+            it = mapRegistered.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    struct epoll_event events[256];
+    int n = epoll_wait(epollfd, events, 256, nTimeout);
+    if (n < 0) {
+        if (errno == EINTR)
+            return true;
+        LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == wakeupPipe[0]) {
+            DrainWakeup();
+            continue;
+        }
+        int nReady = 0;
+        if (events[i].events & EPOLLIN)
+            nReady |= EVENT_RECV;
+        if (events[i].events & EPOLLOUT)
+            nReady |= EVENT_SEND;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            nReady |= EVENT_ERR;
+        mapReady[fd] |= nReady;
+    }
+    return true;
+}
+
+#elif defined(USE_POLL)
+
+bool CSocketEvents::Wait(int64_t nTimeout)
+{
+    mapReady.clear();
+    vPollFds.clear();
+    vPollFds.reserve(vWanted.size() + 1);
+    for (const auto& wanted : vWanted) {
+        struct pollfd pfd = {};
+        pfd.fd = wanted.first;
+        if (wanted.second.nEvents & EVENT_RECV)
+            pfd.events |= POLLIN;
+        if (wanted.second.nEvents & EVENT_SEND)
+            pfd.events |= POLLOUT;
+        vPollFds.push_back(pfd);
+    }
+    if (wakeupPipe[0] >= 0) {
+        struct pollfd pfd = {};
+        pfd.fd = wakeupPipe[0];
+        pfd.events = POLLIN;
+        vPollFds.push_back(pfd);
+    }
+
+    int n = poll(vPollFds.data(), vPollFds.size(), nTimeout);
+    if (n < 0) {
+        if (errno == EINTR)
+            return true;
+        LogPrintf("socket poll error %s\n", NetworkErrorString(errno));
+        return false;
+    }
+    for (const struct pollfd& pfd : vPollFds) {
+        if (pfd.revents == 0)
+            continue;
+        if (pfd.fd == wakeupPipe[0]) {
+            DrainWakeup();
+            continue;
+        }
+        int nReady = 0;
+        if (pfd.revents & POLLIN)
+            nReady |= EVENT_RECV;
+        if (pfd.revents & POLLOUT)
+            nReady |= EVENT_SEND;
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+            nReady |= EVENT_ERR;
+        mapReady[pfd.fd] |= nReady;
+    }
+    return true;
+}
+
+#else
+
+bool CSocketEvents::Wait(int64_t nTimeout)
+{
+    mapReady.clear();
+
+    struct timeval timeout = MillisToTimeval(nTimeout);
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    for (const auto& wanted : vWanted) {
+        SOCKET s = wanted.first;
+        if (!IsSelectableSocket(s))
+            continue;
+        if (wanted.second.nEvents & EVENT_RECV)
+            FD_SET(s, &fdsetRecv);
+        if (wanted.second.nEvents & EVENT_SEND)
+            FD_SET(s, &fdsetSend);
+        if (wanted.second.nEvents & EVENT_ERR)
+            FD_SET(s, &fdsetError);
+        hSocketMax = std::max(hSocketMax, s);
+        have_fds = true;
+    }
+#ifndef WIN32
+    if (wakeupPipe[0] >= 0 && IsSelectableSocket(wakeupPipe[0])) {
+        FD_SET(wakeupPipe[0], &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, (SOCKET)wakeupPipe[0]);
+        have_fds = true;
+    }
+#endif
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR) {
+        if (!have_fds) {
+            MilliSleep(nTimeout);
+            return true;
+        }
+        LogPrintf("socket select error %s\n", NetworkErrorString(WSAGetLastError()));
+        // Try to receive on every socket, so that broken ones get closed
+        for (const auto& wanted : vWanted)
+            mapReady[wanted.first] |= EVENT_RECV;
+        return false;
+    }
+
+#ifndef WIN32
+    if (wakeupPipe[0] >= 0 && IsSelectableSocket(wakeupPipe[0]) && FD_ISSET(wakeupPipe[0], &fdsetRecv))
+        DrainWakeup();
+#endif
+    for (const auto& wanted : vWanted) {
+        SOCKET s = wanted.first;
+        if (!IsSelectableSocket(s))
+            continue;
+        int nReady = 0;
+        if (FD_ISSET(s, &fdsetRecv))
+            nReady |= EVENT_RECV;
+        if (FD_ISSET(s, &fdsetSend))
+            nReady |= EVENT_SEND;
+        if (FD_ISSET(s, &fdsetError))
+            nReady |= EVENT_ERR;
+        if (nReady)
+            mapReady[s] |= nReady;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,104 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#include "compat.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef USE_POLL
+#include <poll.h>
+#endif
+
+/**
+ * Waits for readiness on a set of sockets.
+ *
+ * The sockets to wait on are declared with Add() before each Wait(), and the
+ * events that occurred are read back with GetEvents(). With epoll, the
+ * kernel's interest list is kept across calls and only the sockets whose
+ * interest changed are updated; otherwise poll() or select() is used. Only
+ * select() is limited to sockets below FD_SETSIZE, see IsSelectableSocket().
+ *
+ * Wakeup() may be called from any thread to make a Wait() in progress, or the
+ * next one, return early.
+ */
+class CSocketEvents
+{
+public:
+    static const int EVENT_RECV = 1;
+    static const int EVENT_SEND = 2;
+    static const int EVENT_ERR = 4;
+
+    CSocketEvents();
+    ~CSocketEvents();
+
+    CSocketEvents(const CSocketEvents&) = delete;
+    CSocketEvents& operator=(const CSocketEvents&) = delete;
+
+    /** Forgets the sockets added for the previous Wait(). */
+    void Clear();
+
+    /**
+     * Waits for nEvents on s at the next Wait(). nTag identifies the
+     * connection that owns the socket, so that a socket number reused by a
+     * new connection is registered again.
+     */
+    void Add(SOCKET s, int nEvents, int64_t nTag = -1);
+
+    /**
+     * Waits up to nTimeout milliseconds for an event on one of the added
+     * sockets, or for Wakeup(). Returns false if waiting failed.
+     */
+    bool Wait(int64_t nTimeout);
+
+    /** Returns the events that occurred on s during the last Wait(). */
+    int GetEvents(SOCKET s) const;
+
+    /** Makes Wait() return. */
+    void Wakeup();
+
+    /** Whether Wakeup() works. If not, callers must poll with a short timeout. */
+    bool CanWakeup() const;
+
+    static const char* GetBackendName();
+
+private:
+    struct Interest
+    {
+        int nEvents;
+        int64_t nTag;
+    };
+
+    std::vector<std::pair<SOCKET, Interest>> vWanted;
+    std::unordered_map<SOCKET, int> mapReady;
+
+#ifdef USE_EPOLL
+    struct Registration
+    {
+        Interest interest;
+        uint64_t nSeen;
+    };
+
+    int epollfd;
+    uint64_t nGeneration = 0;
+    std::unordered_map<SOCKET, Registration> mapRegistered;
+#elif defined(USE_POLL)
+    std::vector<struct pollfd> vPollFds;
+#endif
+
+#ifndef WIN32
+    int wakeupPipe[2];
+    std::atomic<bool> fWakeupPending{false};
+
+    void DrainWakeup();
+#endif
+};
+
+#endif // BITCOIN_SOCKETEVENTS_H
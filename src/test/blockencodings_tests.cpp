@@ -0,0 +1,214 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+static CMutableTransaction MakeTx(uint32_t n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), n);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 1000 + n;
+    return tx;
+}
+
+// A block with a coinbase and nTx other transactions
+static CBlock BuildBlock(size_t nTx)
+{
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    coinbase.vout[0].nValue = 50000;
+    block.vtx.push_back(coinbase);
+    for (size_t i = 0; i < nTx; i++)
+        block.vtx.push_back(MakeTx(i));
+
+    block.nVersion = 4;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.nTime = 1600000000;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// Sends the compact block over the wire, as a peer would
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDs result;
+    stream >> result;
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CBlock block = BuildBlock(3);
+
+    CMutableTransaction tx2(block.vtx[2]);
+    pool.addUnchecked(block.vtx[2].GetHash(), entry.FromTx(tx2));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1U);
+
+    // The transaction can leave the mempool before the rest arrive
+    std::list<CTransaction> removed;
+    pool.remove(block.vtx[2], removed, false);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+
+    CBlock block2;
+    {
+        // Too few transactions
+        PartiallyDownloadedBlock tmp = partialBlock;
+        BOOST_CHECK(partialBlock.FillBlock(block2, {block.vtx[1]}) == READ_STATUS_INVALID);
+        partialBlock = tmp;
+    }
+    {
+        // The wrong transaction gives the wrong merkle root
+        PartiallyDownloadedBlock tmp = partialBlock;
+        BOOST_CHECK(partialBlock.FillBlock(block2, {block.vtx[3], block.vtx[1]}) == READ_STATUS_FAILED);
+        partialBlock = tmp;
+    }
+
+    BOOST_CHECK(partialBlock.FillBlock(block2, {block.vtx[1], block.vtx[3]}) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block2.BuildMerkleTree().ToString(), block.hashMerkleRoot.ToString());
+}
+
+BOOST_AUTO_TEST_CASE(ReconstructionHitRateTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CBlock block = BuildBlock(200);
+
+    // Our mempool has most of the block, and transactions that are not in it
+    std::vector<CTransaction> vMissing;
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        if (i % 10 == 0) {
+            vMissing.push_back(block.vtx[i]);
+        } else {
+            CMutableTransaction tx(block.vtx[i]);
+            pool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+        }
+    }
+    for (uint32_t i = 0; i < 100; i++) {
+        CMutableTransaction tx = MakeTx(1000 + i);
+        pool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+    }
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), block.vtx.size() - 1 - vMissing.size());
+
+    // Exactly the transactions we don't have are requested
+    BlockTransactionsRequest req;
+    for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+        if (!partialBlock.IsTxAvailable(i))
+            req.indexes.push_back(i);
+    }
+    BOOST_REQUIRE_EQUAL(req.indexes.size(), vMissing.size());
+    for (size_t i = 0; i < req.indexes.size(); i++)
+        BOOST_CHECK_EQUAL(req.indexes[i], (uint16_t)((i + 1) * 10));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vMissing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(block2.BuildMerkleTree().ToString(), block.hashMerkleRoot.ToString());
+}
+
+BOOST_AUTO_TEST_CASE(CoinbaseOnlyTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block = BuildBlock(0);
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+}
+
+// Gives the tests access to the transactions of a compact block
+struct TestHeaderAndShortTxIDs : public CBlockHeaderAndShortTxIDs
+{
+    explicit TestHeaderAndShortTxIDs(const CBlock& block) : CBlockHeaderAndShortTxIDs(block) {}
+    using CBlockHeaderAndShortTxIDs::prefilledtxn;
+};
+
+BOOST_AUTO_TEST_CASE(PrefilledShieldedOnlyTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block = BuildBlock(1);
+
+    // A fully shielded transaction has no transparent inputs or outputs, so
+    // it is IsNull(), but it is a valid transaction to prefill
+    CMutableTransaction mtx;
+    mtx.fOverwintered = true;
+    mtx.nVersion = SAPLING_TX_VERSION;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    mtx.vShieldedOutput.resize(1);
+    CTransaction tx(mtx);
+    BOOST_CHECK(tx.IsNull());
+
+    TestHeaderAndShortTxIDs testblock(block);
+    testblock.prefilledtxn.push_back(PrefilledTransaction{0, tx});
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(testblock);
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes = {0, 1, 3, 4, 65535};
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK(req1.indexes == req2.indexes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
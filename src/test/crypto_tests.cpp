@@ -3,7 +3,9 @@
 // file COPYING or https://www.opensource.org/licenses/mit-license.php .
 
 #include "crypto/aes.h"
+#include "crypto/blake2b.h"
 #include "crypto/chacha20.h"
+#include "crypto/common.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
@@ -55,6 +57,24 @@ void TestSHA256(const std::string &in, const std::string &hexout) { TestVector(C
 void TestSHA512(const std::string &in, const std::string &hexout) { TestVector(CSHA512(), in, ParseHex(hexout));}
 void TestRIPEMD160(const std::string &in, const std::string &hexout) { TestVector(CRIPEMD160(), in, ParseHex(hexout));}
 
+void TestBLAKE2b(unsigned int n, unsigned int k, const std::string &in, const std::string &hexout) {
+    unsigned char personal[CBLAKE2b::PERSONAL_BYTES] = {'Z','c','a','s','h','P','o','W'};
+    WriteLE32(personal + 8, n);
+    WriteLE32(personal + 12, k);
+    std::vector<unsigned char> out = ParseHex(hexout);
+    std::vector<unsigned char> hash(out.size());
+    // Test that writing the whole input string at once works.
+    CBLAKE2b(out.size(), personal).Write((const unsigned char*)in.data(), in.size()).Finalize(hash.data());
+    BOOST_CHECK(hash == out);
+    // Test that writing it byte by byte works.
+    CBLAKE2b hasher(out.size(), personal);
+    for (char c : in) {
+        hasher.Write((const unsigned char*)&c, 1);
+    }
+    hasher.Finalize(hash.data());
+    BOOST_CHECK(hash == out);
+}
+
 void TestHMACSHA256(const std::string &hexkey, const std::string &hexin, const std::string &hexout) {
     std::vector<unsigned char> key = ParseHex(hexkey);
     TestVector(CHMAC_SHA256(&key[0], key.size()), ParseHex(hexin), ParseHex(hexout));
@@ -304,6 +324,47 @@ BOOST_AUTO_TEST_CASE(sha512_testvectors) {
                "37de8c3ef5459d76a52cedc02dc499a3c9ed9dedbfb3281afd9653b8a112fafc");
 }
 
+BOOST_AUTO_TEST_CASE(blake2b_testvectors) {
+    TestBLAKE2b(192, 7, "",
+                "6d3de6079492a6e418b3e9f6f1f362864f10db733a1b3a446b02d4bb322aee81578f01b6d4357b8241dc1d98d36af9c1");
+    TestBLAKE2b(192, 7, "abc",
+                "d936b5ac0dab75f94b06dc76b438ea4abd78202206812a1d9289039c3f37c08c87e86de2593095442ec9fa635a0939d2");
+    TestBLAKE2b(192, 7, std::string(127, 'a'),
+                "09565549a84759840edc75d1254eb48ee3023050c85cb2f6c5085cf6cd00a0b4acdde824ed2803fe385bdc992cefc245");
+    TestBLAKE2b(192, 7, std::string(128, 'a'),
+                "6ec91d0b5fb2351376dbaf4d4a298f2da3d6ce1b46f7b6db8fd6661f91a20d3310d140bbf1289856d9b8c2f0e0554191");
+    TestBLAKE2b(192, 7, std::string(129, 'a'),
+                "52789b9447fa2d428407e83e44f59e3cfd4ce8861072846c91f217a26a0b781ce8717bcb2490020bb3cea66cd45e35b2");
+    TestBLAKE2b(200, 9, "abc",
+                "52e907446f88b0d5e63e3b2ed93b9cf178cff963d9b89e2a01fe2e42f247b0a58f8f40ccd4471fdadee85d6ab7e69be29285");
+    TestBLAKE2b(200, 9, std::string(128, 'a'),
+                "72948b7c6f54630d44d8fb30d6ba6db5963363499f0b6a044630fe13eeb274d356fd59b889b57d0d794865c735e9507adab6");
+}
+
+BOOST_AUTO_TEST_CASE(blake2b_finalizewords) {
+    unsigned char personal[CBLAKE2b::PERSONAL_BYTES] = {'Z','c','a','s','h','P','o','W'};
+    const uint32_t words[9] = {0, 1, 2, 3, 4, 5, 6, 7, 0xdeadbeef};
+    std::vector<unsigned char> prefix(260);
+    for (size_t i = 0; i < prefix.size(); i++) {
+        prefix[i] = insecure_rand();
+    }
+    // FinalizeWords must agree with finalizing each copy separately, however
+    // much of the last block is already buffered.
+    for (size_t len = 0; len <= prefix.size(); len++) {
+        CBLAKE2b base(48, personal);
+        base.Write(prefix.data(), len);
+        unsigned char out[9 * 48];
+        base.FinalizeWords(words, 9, out);
+        for (int i = 0; i < 9; i++) {
+            unsigned char word[4];
+            WriteLE32(word, words[i]);
+            unsigned char hash[48];
+            CBLAKE2b(base).Write(word, sizeof(word)).Finalize(hash);
+            BOOST_CHECK(std::equal(hash, hash + 48, out + 48 * i));
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(hmac_sha256_testvectors) {
     // test cases 1, 2, 3, 4, 6 and 7 of RFC 4231
     TestHMACSHA256("0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b",
@@ -0,0 +1,100 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "cuckoocache.h"
+#include "random.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstring>
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+namespace {
+
+class TestHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        uint32_t u;
+        std::memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+typedef CuckooCache::cache<uint256, TestHasher> test_cache;
+
+}
+
+/** Test that no values not inserted into the cache are read out of it. */
+BOOST_AUTO_TEST_CASE(cuckoocache_nothing_found)
+{
+    test_cache cc;
+    cc.setup_bytes(32 << 20);
+    for (int x = 0; x < 100000; ++x) {
+        BOOST_CHECK(!cc.contains(GetRandHash(), false));
+    }
+}
+
+/** Fill a cache to its capacity, then check that most of the recently
+ * inserted entries are still there.
+ */
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate)
+{
+    test_cache cc;
+    uint32_t n = cc.setup_bytes(1 << 20);
+
+    std::vector<uint256> hashes;
+    for (uint32_t i = 0; i < n; i++) {
+        hashes.push_back(GetRandHash());
+        cc.insert(hashes.back());
+    }
+
+    // Only the most recent 45% of entries are sure to be kept, by design
+    uint32_t count = 0;
+    for (uint32_t i = n - (45 * n) / 100; i < n; i++) {
+        count += cc.contains(hashes[i], false);
+    }
+    double hit_rate = double(count) / ((45 * n) / 100);
+    BOOST_CHECK(hit_rate > 0.98);
+}
+
+/** Entries marked for erasure are still found until an insert needs their
+ * slot, and erasing them leaves the other entries in place.
+ */
+BOOST_AUTO_TEST_CASE(cuckoocache_erase)
+{
+    test_cache cc;
+    uint32_t n = cc.setup_bytes(1 << 20);
+
+    std::vector<uint256> hashes;
+    for (uint32_t i = 0; i < n / 2; i++) {
+        hashes.push_back(GetRandHash());
+        cc.insert(hashes.back());
+    }
+    // Erase the first half of what was inserted
+    for (uint32_t i = 0; i < n / 4; i++) {
+        BOOST_CHECK(cc.contains(hashes[i], true));
+    }
+    for (uint32_t i = 0; i < n / 4; i++) {
+        BOOST_CHECK(cc.contains(hashes[i], false));
+    }
+
+    // Insert more entries, which may reuse the erased slots
+    for (uint32_t i = 0; i < n / 4; i++) {
+        cc.insert(GetRandHash());
+    }
+    uint32_t count = 0;
+    for (uint32_t i = n / 4; i < n / 2; i++) {
+        count += cc.contains(hashes[i], false);
+    }
+    double hit_rate = double(count) / (n / 4);
+    BOOST_CHECK(hit_rate > 0.99);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,10 +8,14 @@
 #endif
 
 #include "arith_uint256.h"
+#include "chainparams.h"
 #include "crypto/sha256.h"
 #include "crypto/equihash.h"
+#include "primitives/block.h"
+#include "streams.h"
 #include "test/test_bitcoin.h"
 #include "uint256.h"
+#include "version.h"
 
 #include "librustzcash.h"
 
@@ -101,6 +105,11 @@ void TestEquihashValidator(unsigned int n, unsigned int k, const std::string &I,
         V.begin(), V.size(),
         minimal.data(), minimal.size());
     BOOST_CHECK(isValid == expected);
+
+    // The native validator must agree with librustzcash.
+    std::vector<unsigned char> input(I.begin(), I.end());
+    input.insert(input.end(), V.begin(), V.end());
+    BOOST_CHECK(EhIsValidSolutionNative(n, k, "ZcashPoW", input.data(), input.size(), minimal) == expected);
 }
 
 #ifdef ENABLE_MINING
@@ -220,6 +229,10 @@ BOOST_AUTO_TEST_CASE(validator_allbitsmatter) {
         V.begin(), V.size(),
         sol_char.data(), sol_char.size()));
 
+    std::vector<unsigned char> input(I.begin(), I.end());
+    input.insert(input.end(), V.begin(), V.end());
+    BOOST_CHECK(EhIsValidSolutionNative(n, k, "ZcashPoW", input.data(), input.size(), sol_char));
+
     // Changing any single bit of the encoded solution should make it invalid.
     for (size_t i = 0; i < sol_char.size() * 8; i++) {
         std::vector<unsigned char> mutated = sol_char;
@@ -229,6 +242,30 @@ BOOST_AUTO_TEST_CASE(validator_allbitsmatter) {
             (unsigned char*)&I[0], I.size(),
             V.begin(), V.size(),
             mutated.data(), mutated.size()));
+        BOOST_CHECK(!EhIsValidSolutionNative(n, k, "ZcashPoW", input.data(), input.size(), mutated));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(validator_native_genesis) {
+    // The mainnet genesis block carries an Equihash<192,7> solution under the
+    // chain's own personalization, which librustzcash cannot check.
+    const CBlock& genesis = Params(CBaseChainParams::MAIN).GenesisBlock();
+    CEquihashInput I{genesis};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I << genesis.nNonce;
+
+    eh_HashState state;
+    Eh192_7.InitialiseStatePers(state, "ZERO_PoW");
+    state.Update((unsigned char*)&ss[0], ss.size());
+    BOOST_CHECK(Eh192_7.IsValidSolution(state, genesis.nSolution));
+    BOOST_CHECK(EhIsValidSolutionNative(
+        192, 7, "ZERO_PoW", (unsigned char*)&ss[0], ss.size(), genesis.nSolution));
+
+    for (size_t i = 0; i < genesis.nSolution.size() * 8; i++) {
+        std::vector<unsigned char> mutated = genesis.nSolution;
+        mutated.at(i/8) ^= (1 << (i % 8));
+        BOOST_CHECK(!EhIsValidSolutionNative(
+            192, 7, "ZERO_PoW", (unsigned char*)&ss[0], ss.size(), mutated));
     }
 }
 
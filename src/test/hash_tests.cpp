@@ -122,6 +122,16 @@ BOOST_AUTO_TEST_CASE(siphash)
         hasher3.Write(uint64_t(x)|(uint64_t(x+1)<<8)|(uint64_t(x+2)<<16)|(uint64_t(x+3)<<24)|
                      (uint64_t(x+4)<<32)|(uint64_t(x+5)<<40)|(uint64_t(x+6)<<48)|(uint64_t(x+7)<<56));
     }
+
+    // Check that SipHashUint256Extra agrees with hashing the same 36 bytes
+    uint256 val = uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    for (uint32_t extra : {0U, 1U, 0x23222120U, 0xFFFFFFFFU}) {
+        CSipHasher hasher4(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+        hasher4.Write(val.begin(), 32);
+        unsigned char extraBytes[4] = {(unsigned char)extra, (unsigned char)(extra >> 8), (unsigned char)(extra >> 16), (unsigned char)(extra >> 24)};
+        hasher4.Write(extraBytes, 4);
+        BOOST_CHECK_EQUAL(SipHashUint256Extra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val, extra), hasher4.Finalize());
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
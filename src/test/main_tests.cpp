@@ -4,6 +4,8 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "random.h"
+#include "txdb.h"
 
 #include "test/test_bitcoin.h"
 
@@ -30,4 +32,71 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(trimmed_solution_is_read_from_block_index)
+{
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1600000000;
+    header.nBits = 0x1f07ffff;
+    header.nNonce = GetRandHash();
+    header.nSolution.resize(1344);
+    GetRandBytes(header.nSolution.data(), header.nSolution.size());
+    uint256 hash = header.GetHash();
+
+    CBlockIndex index {header};
+    index.phashBlock = &hash;
+    BOOST_CHECK(pblocktree->WriteBatchSync({}, 0, {&index}));
+
+    LOCK(cs_main);
+    index.TrimSolution();
+    BOOST_CHECK(!index.HasSolution());
+    BOOST_CHECK(index.GetBlockHeader().GetHash() == hash);
+
+    // Rewriting the entry once it is trimmed keeps the solution
+    index.nStatus |= BLOCK_FAILED_VALID;
+    BOOST_CHECK(pblocktree->WriteBatchSync({}, 0, {&index}));
+    CDiskBlockIndex dbindex;
+    BOOST_CHECK(pblocktree->ReadDiskBlockIndex(hash, dbindex));
+    BOOST_CHECK(dbindex.GetSolution() == header.nSolution);
+    BOOST_CHECK(dbindex.GetBlockHash() == hash);
+}
+
+BOOST_AUTO_TEST_CASE(trusted_block_index_load)
+{
+    std::map<uint256, std::unique_ptr<CBlockIndex>> mapIndex;
+    auto insertBlockIndex = [&](const uint256& hash) -> CBlockIndex* {
+        if (hash.IsNull())
+            return nullptr;
+        std::unique_ptr<CBlockIndex>& pindex = mapIndex[hash];
+        if (!pindex)
+            pindex.reset(new CBlockIndex());
+        return pindex.get();
+    };
+
+    // The genesis block was written by InitBlockIndex
+    BOOST_CHECK(pblocktree->LoadBlockIndexGuts(insertBlockIndex, Params(), 4, false));
+    BOOST_CHECK_EQUAL(mapIndex.size(), 1U);
+    int nVerifiedHeight = -1;
+    BOOST_CHECK(pblocktree->ReadVerifiedIndexHeight(nVerifiedHeight));
+    BOOST_CHECK_EQUAL(nVerifiedHeight, 0);
+
+    // An entry whose key is not the hash of its header
+    CBlockHeader header = Params().GenesisBlock().GetBlockHeader();
+    header.nNonce = GetRandHash();
+    uint256 hash = GetRandHash();
+    CBlockIndex index {header};
+    index.phashBlock = &hash;
+    BOOST_CHECK(pblocktree->WriteBatchSync({}, 0, {&index}));
+
+    mapIndex.clear();
+    BOOST_CHECK(!pblocktree->LoadBlockIndexGuts(insertBlockIndex, Params(), 4, false));
+
+    // It is below the verified height, so it isn't checked in trusted mode
+    mapIndex.clear();
+    BOOST_CHECK(pblocktree->LoadBlockIndexGuts(insertBlockIndex, Params(), 4, true));
+    BOOST_CHECK_EQUAL(mapIndex.size(), 2U);
+    BOOST_CHECK(mapIndex.count(hash));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
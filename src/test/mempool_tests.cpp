@@ -10,6 +10,7 @@
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <limits>
 #include <list>
 
 BOOST_FIXTURE_TEST_SUITE(mempool_tests, TestingSetup)
@@ -157,6 +158,143 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     BOOST_CHECK(it == pool.mapTx.get<1>().end());
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    /* parent paying no fee */
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 10 * COIN;
+    }
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(0LL).FromTx(txParent));
+
+    /* unrelated, with a fee rate between the child's and its package's */
+    CMutableTransaction tx2;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 2 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(5000LL).FromTx(tx2));
+
+    /* child paying for itself and its parent */
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN - 20000LL;
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(20000LL).FromTx(txChild));
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+
+    CTxMemPool::txiter parent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter child = pool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(parent->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(parent->GetSizeWithDescendants(), parent->GetTxSize() + child->GetTxSize());
+    BOOST_CHECK_EQUAL(parent->GetModFeesWithDescendants(), 20000LL);
+    BOOST_CHECK_EQUAL(child->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(child->GetSizeWithAncestors(), parent->GetTxSize() + child->GetTxSize());
+    BOOST_CHECK_EQUAL(child->GetModFeesWithAncestors(), 20000LL);
+
+    // The fee rate index puts the child first, the ancestor fee rate index
+    // after tx2: tx2, child, parent
+    BOOST_CHECK(pool.mapTx.get<1>().begin()->GetTx().GetHash() == txChild.GetHash());
+    auto it = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), tx2.GetHash().ToString());
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), txChild.GetHash().ToString());
+    BOOST_CHECK_EQUAL(it++->GetTx().GetHash().ToString(), txParent.GetHash().ToString());
+    BOOST_CHECK(it == pool.mapTx.get<ancestor_score>().end());
+
+    // Prioritising the parent raises the fees of the package
+    pool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 0.0, 30000LL);
+    BOOST_CHECK_EQUAL(parent->GetModifiedFee(), 30000LL);
+    BOOST_CHECK_EQUAL(parent->GetModFeesWithDescendants(), 50000LL);
+    BOOST_CHECK_EQUAL(child->GetModFeesWithAncestors(), 50000LL);
+    BOOST_CHECK(pool.mapTx.get<ancestor_score>().begin()->GetTx().GetHash() == txParent.GetHash());
+
+    // Mining the parent leaves the child on its own
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    child = pool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(child->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(child->GetSizeWithAncestors(), child->GetTxSize());
+    BOOST_CHECK_EQUAL(child->GetModFeesWithAncestors(), 20000LL);
+
+    // Disconnecting the block adds the parent back after its child, and keeps
+    // its prioritisation
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(0LL).FromTx(txParent));
+    parent = pool.mapTx.find(txParent.GetHash());
+    child = pool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(parent->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(parent->GetModFeesWithDescendants(), 50000LL);
+    BOOST_CHECK_EQUAL(child->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(child->GetSizeWithAncestors(), parent->GetTxSize() + child->GetTxSize());
+    BOOST_CHECK_EQUAL(child->GetModFeesWithAncestors(), 50000LL);
+
+    // Removing the parent with its descendants empties the pool
+    removed.clear();
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx2.GetHash())->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorLimitsTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A chain of four transactions, each spending the one before it
+    std::vector<CMutableTransaction> vtx(4);
+    for (size_t i = 0; i < vtx.size(); i++) {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].scriptSig = CScript() << OP_11;
+        if (i > 0) {
+            vtx[i].vin[0].prevout.hash = vtx[i - 1].GetHash();
+            vtx[i].vin[0].prevout.n = 0;
+        }
+        vtx[i].vout.resize(1);
+        vtx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vtx[i].vout[0].nValue = 10 * COIN - i * 10000LL;
+    }
+    for (size_t i = 0; i < 3; i++) {
+        pool.addUnchecked(vtx[i].GetHash(), entry.Fee(10000LL).FromTx(vtx[i]));
+    }
+
+    CTxMemPoolEntry last = entry.Fee(10000LL).FromTx(vtx[3]);
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(last, setAncestors, 4, nNoLimit, 4, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+
+    // The last transaction would be the fourth in its package
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(last, setAncestors, 3, nNoLimit, nNoLimit, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(errString, "too many unconfirmed ancestors [limit: 3]");
+
+    // The first transaction would have four descendants including itself
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(last, setAncestors, nNoLimit, nNoLimit, 3, nNoLimit, errString));
+
+    // Size limits count the transaction itself
+    uint64_t nChainSize = 4 * last.GetTxSize();
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(last, setAncestors, nNoLimit, nChainSize, nNoLimit, nChainSize, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(last, setAncestors, nNoLimit, nChainSize - 1, nNoLimit, nNoLimit, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(last, setAncestors, nNoLimit, nNoLimit, nNoLimit, nChainSize - 1, errString));
+}
+
 BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     CTxMemPool pool(CFeeRate(0));
     TestMemPoolEntryHelper entry;
@@ -351,9 +351,55 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     hash = tx.GetHash();
     mempool.addUnchecked(hash, entry.Time(GetTime()).SpendsCoinbase(true).FromTx(tx));
     BOOST_CHECK(pblocktemplate = CreateNewBlock(chainparams, scriptPubKey));
+    {
+        // Same transactions while neither the tip nor the mempool change
+        CBlockTemplate *pblocktemplate2;
+        BOOST_CHECK(pblocktemplate2 = CreateNewBlock(chainparams, scriptPubKey));
+        BOOST_CHECK_EQUAL(pblocktemplate2->block.vtx.size(), pblocktemplate->block.vtx.size());
+        for (size_t i = 1; i < pblocktemplate->block.vtx.size(); i++) {
+            BOOST_CHECK(pblocktemplate2->block.vtx[i].GetHash() == pblocktemplate->block.vtx[i].GetHash());
+        }
+        BOOST_CHECK(pblocktemplate2->vTxFees == pblocktemplate->vTxFees);
+        delete pblocktemplate2;
+    }
     delete pblocktemplate;
     mempool.clear();
 
+    // child paying for its parent
+    mapArgs["-blockprioritysize"] = "0";
+    {
+        CMutableTransaction txParent, txChild;
+        txParent.vin.resize(1);
+        txParent.vin[0].prevout.hash = txFirst[0]->GetHash();
+        txParent.vin[0].prevout.n = 0;
+        txParent.vin[0].scriptSig = CScript() << OP_1;
+        txParent.vout.resize(1);
+        txParent.vout[0].nValue = 49000LL;
+        txParent.vout[0].scriptPubKey = CScript() << OP_1;
+        mempool.addUnchecked(txParent.GetHash(), entry.Fee(0).Time(GetTime()).SpendsCoinbase(true).FromTx(txParent));
+        // On its own, the free parent is left out
+        BOOST_CHECK(pblocktemplate = CreateNewBlock(chainparams, scriptPubKey));
+        BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+        delete pblocktemplate;
+
+        txChild.vin.resize(1);
+        txChild.vin[0].prevout.hash = txParent.GetHash();
+        txChild.vin[0].prevout.n = 0;
+        txChild.vin[0].scriptSig = CScript() << OP_1;
+        txChild.vout.resize(1);
+        txChild.vout[0].nValue = 39000LL;
+        txChild.vout[0].scriptPubKey = CScript() << OP_1;
+        mempool.addUnchecked(txChild.GetHash(), entry.Fee(10000LL).Time(GetTime()).SpendsCoinbase(false).FromTx(txChild));
+        BOOST_CHECK(pblocktemplate = CreateNewBlock(chainparams, scriptPubKey));
+        BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+        BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == txParent.GetHash());
+        BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == txChild.GetHash());
+        delete pblocktemplate;
+    }
+    mapArgs.erase("-blockprioritysize");
+    entry.nFee = 11;
+    mempool.clear();
+
     // coinbase in mempool
     tx.vin.resize(1);
     tx.vin[0].prevout.SetNull();
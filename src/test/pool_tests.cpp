@@ -0,0 +1,73 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "memusage.h"
+#include "support/allocators/pool.h"
+#include "test_random.h"
+
+#include "test/test_bitcoin.h"
+
+#include <unordered_map>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(pool_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(basic_allocations)
+{
+    PoolResource<8, 8> resource(1024);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1);
+    BOOST_CHECK_EQUAL(resource.ChunkSizeBytes(), 1024);
+
+    // Blocks that are freed are handed out again
+    void* block = resource.Allocate(8, 8);
+    resource.Deallocate(block, 8, 8);
+    BOOST_CHECK(resource.Allocate(8, 8) == block);
+
+    // Blocks are carved out of the chunk one after the other
+    void* next = resource.Allocate(8, 8);
+    BOOST_CHECK(static_cast<std::byte*>(next) == static_cast<std::byte*>(block) + 8);
+
+    // Blocks that are too large, or have a larger alignment, bypass the pool
+    void* large = resource.Allocate(16, 8);
+    resource.Deallocate(large, 16, 8);
+    void* aligned = resource.Allocate(8, 16);
+    resource.Deallocate(aligned, 8, 16);
+
+    // Running out of space allocates a new chunk
+    for (int i = 0; i < 1024 / 8; i++) {
+        resource.Allocate(8, 8);
+    }
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(memusage_test)
+{
+    typedef std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                               PoolAllocator<std::pair<const int, int>, sizeof(std::pair<const int, int>) + sizeof(void*) * 4>> Map;
+    Map::allocator_type::ResourceType resource(4096);
+    Map map(0, std::hash<int>(), std::equal_to<int>(), &resource);
+
+    size_t initial = memusage::DynamicUsage(map);
+    BOOST_CHECK(initial >= 4096);
+
+    // Usage is measured in chunks, and grows as the pool does
+    for (int i = 0; i < 10000; i++) {
+        map[insecure_rand()] = i;
+    }
+    BOOST_CHECK(resource.NumAllocatedChunks() > 1);
+    BOOST_CHECK(memusage::DynamicUsage(map) >= resource.NumAllocatedChunks() * resource.ChunkSizeBytes());
+
+    // Freed nodes are reused, so erasing and reinserting does not grow the pool
+    size_t chunks = resource.NumAllocatedChunks();
+    for (int i = 0; i < 10; i++) {
+        Map::iterator it = map.begin();
+        int key = it->first;
+        map.erase(it);
+        map[key] = i;
+    }
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), chunks);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,98 @@
+// Copyright (c) 2021 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+#include "socketevents.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <thread>
+
+#include <boost/test/unit_test.hpp>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+BOOST_FIXTURE_TEST_SUITE(socketevents_tests, BasicTestingSetup)
+
+#ifndef WIN32
+
+BOOST_AUTO_TEST_CASE(socketevents_readiness)
+{
+    int sv[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    CSocketEvents events;
+
+    // Nothing to read yet
+    events.Add(sv[0], CSocketEvents::EVENT_RECV | CSocketEvents::EVENT_ERR, 1);
+    BOOST_CHECK(events.Wait(10));
+    BOOST_CHECK_EQUAL(events.GetEvents(sv[0]), 0);
+
+    char c = 'x';
+    BOOST_REQUIRE(write(sv[1], &c, 1) == 1);
+    events.Clear();
+    events.Add(sv[0], CSocketEvents::EVENT_RECV | CSocketEvents::EVENT_ERR, 1);
+    BOOST_CHECK(events.Wait(1000));
+    BOOST_CHECK(events.GetEvents(sv[0]) & CSocketEvents::EVENT_RECV);
+    BOOST_REQUIRE(read(sv[0], &c, 1) == 1);
+
+    // Interest changes from one Wait() to the next
+    events.Clear();
+    events.Add(sv[0], CSocketEvents::EVENT_SEND | CSocketEvents::EVENT_ERR, 1);
+    BOOST_CHECK(events.Wait(1000));
+    BOOST_CHECK_EQUAL(events.GetEvents(sv[0]), CSocketEvents::EVENT_SEND);
+
+    // A socket that is no longer added is no longer reported
+    events.Clear();
+    BOOST_CHECK(events.Wait(10));
+    BOOST_CHECK_EQUAL(events.GetEvents(sv[0]), 0);
+
+    close(sv[0]);
+    close(sv[1]);
+
+    // The same socket number, reused by another connection
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    BOOST_REQUIRE(write(sv[1], &c, 1) == 1);
+    events.Clear();
+    events.Add(sv[0], CSocketEvents::EVENT_RECV, 2);
+    BOOST_CHECK(events.Wait(1000));
+    BOOST_CHECK(events.GetEvents(sv[0]) & CSocketEvents::EVENT_RECV);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_wakeup)
+{
+    int sv[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    CSocketEvents events;
+    BOOST_REQUIRE(events.CanWakeup());
+
+    // A wakeup before Wait() is not lost
+    events.Wakeup();
+    events.Add(sv[0], CSocketEvents::EVENT_RECV, 1);
+    int64_t nStart = GetTimeMillis();
+    BOOST_CHECK(events.Wait(10000));
+    BOOST_CHECK(GetTimeMillis() - nStart < 5000);
+
+    std::thread waker([&events] {
+        MilliSleep(50);
+        events.Wakeup();
+    });
+    nStart = GetTimeMillis();
+    BOOST_CHECK(events.Wait(10000));
+    BOOST_CHECK(GetTimeMillis() - nStart < 5000);
+    BOOST_CHECK_EQUAL(events.GetEvents(sv[0]), 0);
+    waker.join();
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -12,6 +12,7 @@
 #ifdef ENABLE_MINING
 #include "crypto/equihash.h"
 #endif
+#include "crypto/blake2b.h"
 #include "crypto/sha256.h"
 #include "fs.h"
 #include "key.h"
@@ -24,6 +25,7 @@
 #include "ui_interface.h"
 #include "rpc/server.h"
 #include "rpc/register.h"
+#include "script/sigcache.h"
 
 #include <boost/test/unit_test.hpp>
 #include <boost/thread.hpp>
@@ -73,9 +75,11 @@ BasicTestingSetup::BasicTestingSetup(const std::string& chainName)
 {
     assert(sodium_init() != -1);
     SHA256AutoDetect();
+    BLAKE2bAutoDetect();
     ECC_Start();
     SetupEnvironment();
     SetupNetworking();
+    InitSignatureCache();
     fPrintToDebugLog = false; // don't want to write to debug.log file
     fCheckBlockIndex = true;
     SelectParams(chainName);
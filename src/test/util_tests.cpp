@@ -12,6 +12,7 @@
 #include "utilmoneystr.h"
 #include "test/test_bitcoin.h"
 
+#include <atomic>
 #include <stdint.h>
 #include <vector>
 
@@ -492,4 +493,16 @@ BOOST_AUTO_TEST_CASE(test_ParseFixedPoint)
     BOOST_CHECK(!ParseFixedPoint("1.", 8, &amount));
 }
 
+BOOST_AUTO_TEST_CASE(test_ParallelFor)
+{
+    for (size_t n : {0, 1, 63, 64, 65, 1000}) {
+        for (int nThreads : {1, 4}) {
+            std::vector<std::atomic<int>> vCalls(n);
+            ParallelFor(n, nThreads, [&](size_t i) { vCalls[i]++; });
+            for (size_t i = 0; i < n; i++)
+                BOOST_CHECK_EQUAL(vCalls[i].load(), 1);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -12,9 +12,14 @@
 #include "utilmoneystr.h"
 #include "zcash/Note.hpp"
 
+#include <atomic>
+#include <thread>
+
 #include <librustzcash.h>
 #include <rust/ed25519.h>
 
+int nSaplingProverThreads = 1;
+
 SpendDescriptionInfo::SpendDescriptionInfo(
     libzcash::SaplingExpandedSpendingKey expsk,
     libzcash::SaplingNote note,
@@ -71,6 +76,28 @@ std::optional<OutputDescription> OutputDescriptionInfo::Build(void* ctx) {
     return odesc;
 }
 
+static bool ProveSaplingSpend(void* ctx, const SpendDescriptionInfo& spend, SpendDescription& sdesc)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << spend.witness.path();
+    std::vector<unsigned char> witness(ss.begin(), ss.end());
+
+    uint256 rcm = spend.note.rcm();
+    return librustzcash_sapling_spend_proof(
+        ctx,
+        spend.expsk.full_viewing_key().ak.begin(),
+        spend.expsk.nsk.begin(),
+        spend.note.d.data(),
+        rcm.begin(),
+        spend.alpha.begin(),
+        spend.note.value(),
+        spend.anchor.begin(),
+        witness.data(),
+        sdesc.cv.begin(),
+        sdesc.rk.begin(),
+        sdesc.zkproof.data());
+}
+
 JSDescription JSDescriptionInfo::BuildDeterministic(
     bool computeProof,
     uint256 *esk // payment disclosure
@@ -357,60 +384,85 @@ TransactionBuilderResult TransactionBuilder::Build()
     // Sapling spends and outputs
     //
 
-    auto ctx = librustzcash_sapling_proving_ctx_init();
-
-    // Create Sapling SpendDescriptions
-    for (auto spend : spends) {
-        auto cm = spend.note.cmu();
-        auto nf = spend.note.nullifier(
-            spend.expsk.full_viewing_key(), spend.witness.position());
+    // Check the spends and outputs before creating any proof
+    std::vector<SpendDescription> vSpendDescs(spends.size());
+    for (size_t i = 0; i < spends.size(); i++) {
+        auto cm = spends[i].note.cmu();
+        auto nf = spends[i].note.nullifier(
+            spends[i].expsk.full_viewing_key(), spends[i].witness.position());
         if (!cm || !nf) {
-            librustzcash_sapling_proving_ctx_free(ctx);
             return TransactionBuilderResult("Spend is invalid");
         }
-
-        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-        ss << spend.witness.path();
-        std::vector<unsigned char> witness(ss.begin(), ss.end());
-
-        SpendDescription sdesc;
-        uint256 rcm = spend.note.rcm();
-        if (!librustzcash_sapling_spend_proof(
-                ctx,
-                spend.expsk.full_viewing_key().ak.begin(),
-                spend.expsk.nsk.begin(),
-                spend.note.d.data(),
-                rcm.begin(),
-                spend.alpha.begin(),
-                spend.note.value(),
-                spend.anchor.begin(),
-                witness.data(),
-                sdesc.cv.begin(),
-                sdesc.rk.begin(),
-                sdesc.zkproof.data())) {
-            librustzcash_sapling_proving_ctx_free(ctx);
-            return TransactionBuilderResult("Spend proof failed");
-        }
-
-        sdesc.anchor = spend.anchor;
-        sdesc.nullifier = *nf;
-        mtx.vShieldedSpend.push_back(sdesc);
+        vSpendDescs[i].anchor = spends[i].anchor;
+        vSpendDescs[i].nullifier = *nf;
     }
-
-    // Create Sapling OutputDescriptions
-    for (auto output : outputs) {
+    for (const auto& output : outputs) {
         // Check this out here as well to provide better logging.
         if (!output.note.cmu()) {
-            librustzcash_sapling_proving_ctx_free(ctx);
             return TransactionBuilderResult("Output is invalid");
         }
+    }
+
+    // Create the Spend and Output proofs. Each proof is a job; the jobs are
+    // shared between up to nSaplingProverThreads workers, each accumulating
+    // value commitments into its own proving context. The contexts are then
+    // merged into ctx, which makes the binding signature.
+    auto ctx = librustzcash_sapling_proving_ctx_init();
+
+    size_t nJobs = spends.size() + outputs.size();
+    std::vector<std::optional<OutputDescription>> vOutputDescs(outputs.size());
+    std::vector<char> vJobFailed(nJobs, false);
+    std::atomic<size_t> nNextJob{0};
+    std::atomic<bool> fFailed{false};
+
+    auto runJobs = [&](void* workerCtx) {
+        size_t i;
+        while (!fFailed && (i = nNextJob++) < nJobs) {
+            bool fOk;
+            if (i < spends.size()) {
+                fOk = ProveSaplingSpend(workerCtx, spends[i], vSpendDescs[i]);
+            } else {
+                size_t j = i - spends.size();
+                vOutputDescs[j] = outputs[j].Build(workerCtx);
+                fOk = (bool)vOutputDescs[j];
+            }
+            if (!fOk) {
+                vJobFailed[i] = true;
+                fFailed = true;
+            }
+        }
+    };
+
+    size_t nWorkers = std::min<size_t>(std::max(nSaplingProverThreads, 1), nJobs);
+    if (nWorkers <= 1) {
+        runJobs(ctx);
+    } else {
+        std::vector<void*> vWorkerCtx(nWorkers);
+        std::vector<std::thread> vWorkers;
+        for (size_t w = 0; w < nWorkers; w++) {
+            vWorkerCtx[w] = librustzcash_sapling_proving_ctx_init();
+            vWorkers.emplace_back(runJobs, vWorkerCtx[w]);
+        }
+        for (size_t w = 0; w < nWorkers; w++) {
+            vWorkers[w].join();
+            librustzcash_sapling_proving_ctx_merge(ctx, vWorkerCtx[w]);
+            librustzcash_sapling_proving_ctx_free(vWorkerCtx[w]);
+        }
+    }
 
-        auto odesc = output.Build(ctx);
-        if (!odesc) {
+    // Report the first job that failed, as the sequential loop would have
+    for (size_t i = 0; i < nJobs; i++) {
+        if (vJobFailed[i]) {
             librustzcash_sapling_proving_ctx_free(ctx);
+            if (i < spends.size()) {
+                return TransactionBuilderResult("Spend proof failed");
+            }
             return TransactionBuilderResult("Failed to create output description");
         }
+    }
 
+    mtx.vShieldedSpend.insert(mtx.vShieldedSpend.end(), vSpendDescs.begin(), vSpendDescs.end());
+    for (const auto& odesc : vOutputDescs) {
         mtx.vShieldedOutput.push_back(odesc.value());
     }
 
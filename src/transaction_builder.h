@@ -23,6 +23,14 @@
 
 #define NO_MEMO {{0xF6}}
 
+/** Default for -saplingproverthreads, 0 = one per core */
+static const int DEFAULT_SAPLING_PROVER_THREADS = 0;
+/** Maximum number of threads used to create the Sapling proofs of a transaction */
+static const int MAX_SAPLING_PROVER_THREADS = 16;
+
+/** Number of threads TransactionBuilder::Build uses to create Sapling proofs */
+extern int nSaplingProverThreads;
+
 struct SpendDescriptionInfo {
     libzcash::SaplingExpandedSpendingKey expsk;
     libzcash::SaplingNote note;
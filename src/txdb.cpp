@@ -6,9 +6,12 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "clientversion.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
 #include <stdint.h>
@@ -23,6 +26,7 @@ static const char DB_SPROUT_ANCHOR = 'A';
 static const char DB_SAPLING_ANCHOR = 'Z';
 static const char DB_NULLIFIER = 's';
 static const char DB_SAPLING_NULLIFIER = 'S';
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -34,6 +38,8 @@ static const char DB_BEST_SAPLING_ANCHOR = 'z';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_INTERRUPTED_FLUSH = 'H';
+static const char DB_VERIFIED_INDEX_HEIGHT = 'v';
 
 static const char DB_MMR_LENGTH = 'M';
 static const char DB_MMR_NODE = 'm';
@@ -46,6 +52,30 @@ static const char DB_SPENTINDEX = 'p';
 static const char DB_TIMESTAMPINDEX = 'T';
 static const char DB_BLOCKHASHINDEX = 'h';
 
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+}
+
 CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
 }
 
@@ -53,6 +83,25 @@ CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(Get
 {
 }
 
+CCoinsViewDB::~CCoinsViewDB()
+{
+    {
+        std::lock_guard<std::mutex> lock(csFlush);
+        fFlushShutdown = true;
+        condFlush.notify_all();
+    }
+    // Any pending snapshot is committed before the thread exits
+    if (flushThread.joinable()) {
+        flushThread.join();
+    }
+}
+
+std::shared_ptr<const CCoinsCacheSnapshot> CCoinsViewDB::GetPendingSnapshot() const
+{
+    std::lock_guard<std::mutex> lock(csFlush);
+    return pendingSnapshot;
+}
+
 
 bool CCoinsViewDB::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
     if (rt == SproutMerkleTree::empty_root()) {
@@ -61,6 +110,17 @@ bool CCoinsViewDB::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree)
         return true;
     }
 
+    auto snapshot = GetPendingSnapshot();
+    if (snapshot) {
+        auto it = snapshot->sproutAnchors.find(rt);
+        if (it != snapshot->sproutAnchors.end()) {
+            if (!it->second.entered)
+                return false;
+            tree = it->second.tree;
+            return true;
+        }
+    }
+
     bool read = db.Read(make_pair(DB_SPROUT_ANCHOR, rt), tree);
 
     return read;
@@ -73,6 +133,17 @@ bool CCoinsViewDB::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree
         return true;
     }
 
+    auto snapshot = GetPendingSnapshot();
+    if (snapshot) {
+        auto it = snapshot->saplingAnchors.find(rt);
+        if (it != snapshot->saplingAnchors.end()) {
+            if (!it->second.entered)
+                return false;
+            tree = it->second.tree;
+            return true;
+        }
+    }
+
     bool read = db.Read(make_pair(DB_SAPLING_ANCHOR, rt), tree);
 
     return read;
@@ -81,28 +152,59 @@ bool CCoinsViewDB::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree
 bool CCoinsViewDB::GetNullifier(const uint256 &nf, ShieldedType type) const {
     bool spent = false;
     char dbChar;
+    const CNullifiersMap* pendingNullifiers = NULL;
+    auto snapshot = GetPendingSnapshot();
     switch (type) {
         case SPROUT:
             dbChar = DB_NULLIFIER;
+            if (snapshot)
+                pendingNullifiers = &snapshot->sproutNullifiers;
             break;
         case SAPLING:
             dbChar = DB_SAPLING_NULLIFIER;
+            if (snapshot)
+                pendingNullifiers = &snapshot->saplingNullifiers;
             break;
         default:
             throw runtime_error("Unknown shielded type");
     }
+    if (pendingNullifiers) {
+        CNullifiersMap::const_iterator it = pendingNullifiers->find(nf);
+        if (it != pendingNullifiers->end())
+            return it->second.entered;
+    }
     return db.Read(make_pair(dbChar, nf), spent);
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    auto snapshot = GetPendingSnapshot();
+    if (snapshot) {
+        CCoinsMap::const_iterator it = snapshot->coins.find(outpoint);
+        if (it != snapshot->coins.end()) {
+            if (it->second.coin.IsSpent())
+                return false;
+            coin = it->second.coin;
+            return true;
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    auto snapshot = GetPendingSnapshot();
+    if (snapshot) {
+        CCoinsMap::const_iterator it = snapshot->coins.find(outpoint);
+        if (it != snapshot->coins.end())
+            return !it->second.coin.IsSpent();
+    }
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    auto snapshot = GetPendingSnapshot();
+    if (snapshot && !snapshot->hashBlock.IsNull())
+        return snapshot->hashBlock;
+
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
@@ -111,7 +213,15 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 
 uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     uint256 hashBestAnchor;
-    
+
+    auto snapshot = GetPendingSnapshot();
+    if (snapshot) {
+        if (type == SPROUT && !snapshot->hashSproutAnchor.IsNull())
+            return snapshot->hashSproutAnchor;
+        if (type == SAPLING && !snapshot->hashSaplingAnchor.IsNull())
+            return snapshot->hashSaplingAnchor;
+    }
+
     switch (type) {
         case SPROUT:
             if (!db.Read(DB_BEST_SPROUT_ANCHOR, hashBestAnchor))
@@ -129,6 +239,13 @@ uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
 }
 
 HistoryIndex CCoinsViewDB::GetHistoryLength(uint32_t epochId) const {
+    auto snapshot = GetPendingSnapshot();
+    if (snapshot) {
+        auto it = snapshot->history.find(epochId);
+        if (it != snapshot->history.end())
+            return it->second.length;
+    }
+
     HistoryIndex historyLength;
     if (!db.Read(make_pair(DB_MMR_LENGTH, epochId), historyLength)) {
         // Starting new history
@@ -145,6 +262,14 @@ HistoryNode CCoinsViewDB::GetHistoryAt(uint32_t epochId, HistoryIndex index) con
         throw runtime_error("History data inconsistent - reindex?");
     }
 
+    // Nodes from updateDepth on were rewritten by the pending snapshot
+    auto snapshot = GetPendingSnapshot();
+    if (snapshot) {
+        auto it = snapshot->history.find(epochId);
+        if (it != snapshot->history.end() && index >= it->second.updateDepth)
+            return it->second.appends.at(index);
+    }
+
     // Read mmrNode into tmp std::array
     std::array<unsigned char, NODE_SERIALIZED_LENGTH> tmpMmrNode;
 
@@ -158,6 +283,13 @@ HistoryNode CCoinsViewDB::GetHistoryAt(uint32_t epochId, HistoryIndex index) con
 }
 
 uint256 CCoinsViewDB::GetHistoryRoot(uint32_t epochId) const {
+    auto snapshot = GetPendingSnapshot();
+    if (snapshot) {
+        auto it = snapshot->history.find(epochId);
+        if (it != snapshot->history.end())
+            return it->second.root;
+    }
+
     uint256 root;
     if (!db.Read(make_pair(DB_MMR_ROOT, epochId), root))
     {
@@ -166,9 +298,9 @@ uint256 CCoinsViewDB::GetHistoryRoot(uint32_t epochId) const {
     return root;
 }
 
-void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar)
+void BatchWriteNullifiers(CDBBatch& batch, const CNullifiersMap& mapToUse, const char& dbChar)
 {
-    for (CNullifiersMap::iterator it = mapToUse.begin(); it != mapToUse.end();) {
+    for (CNullifiersMap::const_iterator it = mapToUse.begin(); it != mapToUse.end(); it++) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
@@ -176,14 +308,13 @@ void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char&
                 batch.Write(make_pair(dbChar, it->first), true);
             // TODO: changed++? ... See comment in CCoinsViewDB::BatchWrite. If this is needed we could return an int
         }
-        it = mapToUse.erase(it);
     }
 }
 
 template<typename Map, typename MapIterator, typename MapEntry, typename Tree>
-void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
+void BatchWriteAnchors(CDBBatch& batch, const Map& mapToUse, const char& dbChar)
 {
-    for (MapIterator it = mapToUse.begin(); it != mapToUse.end();) {
+    for (MapIterator it = mapToUse.begin(); it != mapToUse.end(); it++) {
         if (it->second.flags & MapEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
@@ -194,13 +325,12 @@ void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
             }
             // TODO: changed++?
         }
-        it = mapToUse.erase(it);
     }
 }
 
-void BatchWriteHistory(CDBBatch& batch, CHistoryCacheMap& historyCacheMap) {
+void BatchWriteHistory(CDBBatch& batch, const CHistoryCacheMap& historyCacheMap) {
     for (auto nextHistoryCache = historyCacheMap.begin(); nextHistoryCache != historyCacheMap.end(); nextHistoryCache++) {
-        auto historyCache = nextHistoryCache->second;
+        const auto& historyCache = nextHistoryCache->second;
         auto epochId = nextHistoryCache->first;
 
         // delete old entries since updateDepth
@@ -233,26 +363,35 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                               CNullifiersMap &mapSproutNullifiers,
                               CNullifiersMap &mapSaplingNullifiers,
                               CHistoryCacheMap &historyCacheMap) {
+    // Don't let an older snapshot that is still being written land on top of this one
+    if (!WaitForBackgroundWrite())
+        return false;
+
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
         it = mapCoins.erase(it);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::const_iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::const_iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
+    mapSproutAnchors.clear();
+    mapSaplingAnchors.clear();
 
     ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER);
     ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
+    mapSproutNullifiers.clear();
+    mapSaplingNullifiers.clear();
 
     ::BatchWriteHistory(batch, historyCacheMap);
 
@@ -263,10 +402,126 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     if (!hashSaplingAnchor.IsNull())
         batch.Write(DB_BEST_SAPLING_ANCHOR, hashSaplingAnchor);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::WriteSnapshot(const CCoinsCacheSnapshot& snapshot)
+{
+    CDBBatch batch(db);
+    size_t count = 0;
+    size_t changed = 0;
+    for (CCoinsMap::const_iterator it = snapshot.coins.begin(); it != snapshot.coins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
+            else
+                batch.Write(entry, it->second.coin);
+            changed++;
+        }
+        count++;
+    }
+
+    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::const_iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, snapshot.sproutAnchors, DB_SPROUT_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::const_iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, snapshot.saplingAnchors, DB_SAPLING_ANCHOR);
+
+    ::BatchWriteNullifiers(batch, snapshot.sproutNullifiers, DB_NULLIFIER);
+    ::BatchWriteNullifiers(batch, snapshot.saplingNullifiers, DB_SAPLING_NULLIFIER);
+
+    ::BatchWriteHistory(batch, snapshot.history);
+
+    if (!snapshot.hashBlock.IsNull())
+        batch.Write(DB_BEST_BLOCK, snapshot.hashBlock);
+    if (!snapshot.hashSproutAnchor.IsNull())
+        batch.Write(DB_BEST_SPROUT_ANCHOR, snapshot.hashSproutAnchor);
+    if (!snapshot.hashSaplingAnchor.IsNull())
+        batch.Write(DB_BEST_SAPLING_ANCHOR, snapshot.hashSaplingAnchor);
+    // Committed atomically with the data it describes
+    batch.Erase(DB_INTERRUPTED_FLUSH);
+
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database in the background...\n", (unsigned int)changed, (unsigned int)count);
+    int64_t nStart = GetTimeMicros();
+    bool fOk = db.WriteBatch(batch);
+    LogPrint("bench", "Background chainstate write: %.2fms\n", 0.001 * (GetTimeMicros() - nStart));
+    return fOk;
+}
+
+void CCoinsViewDB::ThreadFlush()
+{
+    RenameThread(strprintf("%s-dbflush", COIN_NICKNAME).c_str());
+
+    std::unique_lock<std::mutex> lock(csFlush);
+    while (true) {
+        condFlush.wait(lock, [this] { return fFlushShutdown || (pendingSnapshot && !fFlushFailed); });
+        if (!pendingSnapshot || fFlushFailed) {
+            return;
+        }
+
+        std::shared_ptr<const CCoinsCacheSnapshot> snapshot = pendingSnapshot;
+        lock.unlock();
+        bool fOk = false;
+        try {
+            fOk = WriteSnapshot(*snapshot);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        lock.lock();
+        if (fOk) {
+            pendingSnapshot.reset();
+        } else {
+            // Keep answering reads from the snapshot, so that the view stays
+            // consistent until the node shuts down.
+            LogPrintf("ERROR: %s: failed to write to coin database\n", __func__);
+            fFlushFailed = true;
+        }
+        condFlush.notify_all();
+    }
+}
+
+bool CCoinsViewDB::WriteInBackground(std::shared_ptr<const CCoinsCacheSnapshot> snapshot)
+{
+    std::unique_lock<std::mutex> lock(csFlush);
+    condFlush.wait(lock, [this] { return !pendingSnapshot || fFlushFailed; });
+    if (fFlushFailed)
+        return false;
+
+    // Record where the database is going, so that a write that never
+    // completes can be detected on startup.
+    if (!db.Write(DB_INTERRUPTED_FLUSH, snapshot->hashBlock))
+        return false;
+
+    pendingSnapshot = snapshot;
+    if (!flushThread.joinable()) {
+        flushThread = std::thread(&CCoinsViewDB::ThreadFlush, this);
+    }
+    condFlush.notify_all();
+    return true;
+}
+
+bool CCoinsViewDB::WaitForBackgroundWrite() const
+{
+    std::unique_lock<std::mutex> lock(csFlush);
+    condFlush.wait(lock, [this] { return !pendingSnapshot || fFlushFailed; });
+    return !fFlushFailed;
+}
+
+size_t CCoinsViewDB::PendingMemoryUsage() const
+{
+    std::lock_guard<std::mutex> lock(csFlush);
+    return pendingSnapshot ? pendingSnapshot->nDynamicMemoryUsage : 0;
+}
+
+bool CCoinsViewDB::ReadInterruptedFlush(uint256& hashTarget) const
+{
+    return db.Read(DB_INTERRUPTED_FLUSH, hashTarget);
+}
+
+bool CCoinsViewDB::EraseInterruptedFlush()
+{
+    return db.Erase(DB_INTERRUPTED_FLUSH, true);
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -294,31 +549,41 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
+    if (!WaitForBackgroundWrite())
+        return false;
+
     boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+    pcursor->Seek(DB_COIN);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
+    // Outputs of a transaction are stored under adjacent keys, so they are
+    // hashed as one group per transaction.
+    uint256 prevTxid;
+    bool fFirst = true;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+        COutPoint outpoint;
+        CoinEntry entry(&outpoint);
+        Coin coin;
+        if (pcursor->GetKey(entry) && entry.key == DB_COIN) {
+            if (pcursor->GetValue(coin)) {
+                if (fFirst || outpoint.hash != prevTxid) {
+                    if (!fFirst)
+                        ss << VARINT(0);
+                    ss << outpoint.hash;
+                    ss << VARINT(coin.nHeight * 2 + coin.fCoinBase);
+                    stats.nTransactions++;
+                    prevTxid = outpoint.hash;
+                    fFirst = false;
                 }
-                stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
+                stats.nTransactionOutputs++;
+                ss << VARINT(outpoint.n + 1);
+                ss << coin.out;
+                nTotalAmount += coin.out.nValue;
+                stats.nSerializedSize += pcursor->GetKeySize() + pcursor->GetValueSize();
             } else {
                 return error("CCoinsViewDB::GetStats() : unable to read value");
             }
@@ -327,6 +592,8 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
         }
         pcursor->Next();
     }
+    if (!fFirst)
+        ss << VARINT(0);
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
@@ -336,6 +603,130 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     return true;
 }
 
+namespace {
+
+/** Legacy class to deserialize pre-per-output database entries without reindex. */
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-transaction coins records to one
+ * record per unspent output.
+ */
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<char, uint256> key;
+    std::pair<char, uint256> prev_key = {DB_COINS, uint256()};
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(std::make_pair(DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
@@ -343,11 +734,30 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     }
     batch.Write(DB_LAST_BLOCK, nLastFile);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
-        batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
+        std::pair<char, uint256> key = make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash());
+        try {
+            CDiskBlockIndex dbindex {*it, [this, &key]() {
+                // The entry was written and its solution trimmed before it
+                // became dirty again, so take the solution from the old entry.
+                CDiskBlockIndex dbindexOld;
+                if (!Read(key, dbindexOld)) {
+                    LogPrintf("%s: failed to read index entry of block %s\n", __func__, key.second.ToString());
+                    throw std::runtime_error("Failed to read block index entry");
+                }
+                return dbindexOld.GetSolution();
+            }};
+            batch.Write(key, dbindex);
+        } catch (const std::runtime_error&) {
+            return false;
+        }
     }
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::ReadDiskBlockIndex(const uint256 &blkid, CDiskBlockIndex &dbindex) {
+    return Read(make_pair(DB_BLOCK_INDEX, blkid), dbindex);
+}
+
 bool CBlockTreeDB::EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo) {
     CDBBatch batch(*this);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
@@ -524,93 +934,167 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+namespace {
+
+/** A block index entry read from the database, to be checked on a worker thread. */
+struct BlockIndexLoadEntry
+{
+    uint256 hash;
+    CDataStream ssValue;
+    CDiskBlockIndex diskindex;
+    //! Set by Check() if the entry is not valid
+    std::string strError;
+
+    BlockIndexLoadEntry(const uint256& hashIn, CDataStream&& ssValueIn) :
+        hash(hashIn), ssValue(std::move(ssValueIn)) {}
+
+    void Check(const CChainParams& chainParams, int nTrustedHeight);
+};
+
+/**
+ * Deserializes the entry, and runs the checks that only depend on the entry
+ * itself. Entries at or below nTrustedHeight are not hashed again.
+ */
+void BlockIndexLoadEntry::Check(const CChainParams& chainParams, int nTrustedHeight)
+{
+    try {
+        ssValue >> diskindex;
+    } catch (const std::exception&) {
+        strError = "LoadBlockIndex() : failed to read value";
+        return;
+    }
+    // For ToString() in the errors below
+    diskindex.phashBlock = &hash;
+
+    // Consistency checks
+    if (diskindex.nHeight > nTrustedHeight) {
+        uint256 hashHeader = diskindex.GetBlockHash();
+        if (hashHeader != hash) {
+            strError = strprintf("LoadBlockIndex(): block header inconsistency detected: on-disk = %s, key = %s",
+                hashHeader.ToString(), hash.ToString());
+            return;
+        }
+        if (!CheckProofOfWork(hash, diskindex.nBits, chainParams.GetConsensus())) {
+            strError = strprintf("LoadBlockIndex(): CheckProofOfWork failed: %s", diskindex.ToString());
+            return;
+        }
+    }
+
+    // ZIP 221 consistency checks
+    // These checks should only be performed for block index entries marked
+    // as consensus-valid (at the time they were written).
+    //
+    if (diskindex.IsValid(BLOCK_VALID_CONSENSUS)) {
+        // We assume block index entries on disk that are not at least
+        // CHAIN_HISTORY_ROOT_VERSION were created by nodes that were
+        // not Heartwood aware. Such a node would not see Heartwood block
+        // headers as valid, and so this must *either* be an index entry
+        // for a block header on a non-Heartwood chain, or be marked as
+        // consensus-invalid.
+        //
+        // It can also happen that the block index entry was written
+        // by this node when it was Heartwood-aware (so its version
+        // will be >= CHAIN_HISTORY_ROOT_VERSION), but received from
+        // a non-upgraded peer. However that case the entry will be
+        // marked as consensus-invalid.
+        //
+        if (diskindex.nClientVersion >= CHAIN_HISTORY_ROOT_VERSION &&
+            chainParams.GetConsensus().NetworkUpgradeActive(diskindex.nHeight, Consensus::UPGRADE_HEARTWOOD)) {
+            if (diskindex.hashLightClientRoot != diskindex.hashChainHistoryRoot) {
+                strError = strprintf(
+                    "LoadBlockIndex(): block index inconsistency detected (post-Heartwood; hashLightClientRoot %s != hashChainHistoryRoot %s): %s",
+                    diskindex.hashLightClientRoot.ToString(), diskindex.hashChainHistoryRoot.ToString(), diskindex.ToString());
+            }
+        } else {
+            if (diskindex.hashLightClientRoot != diskindex.hashFinalSaplingRoot) {
+                strError = strprintf(
+                    "LoadBlockIndex(): block index inconsistency detected (pre-Heartwood; hashLightClientRoot %s != hashFinalSaplingRoot %s): %s",
+                    diskindex.hashLightClientRoot.ToString(), diskindex.hashFinalSaplingRoot.ToString(), diskindex.ToString());
+            }
+        }
+    }
+}
+
+}
+
+bool CBlockTreeDB::ReadVerifiedIndexHeight(int& nHeight) {
+    return Read(DB_VERIFIED_INDEX_HEIGHT, nHeight);
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(
     std::function<CBlockIndex*(const uint256&)> insertBlockIndex,
-    const CChainParams& chainParams)
+    const CChainParams& chainParams,
+    int nThreads,
+    bool fTrustVerified)
 {
+    int nVerifiedHeight = -1;
+    ReadVerifiedIndexHeight(nVerifiedHeight);
+    int nTrustedHeight = fTrustVerified ? nVerifiedHeight : -1;
+    int nMaxHeight = -1;
+
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
     pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-            CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->hashLightClientRoot  = diskindex.hashLightClientRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nSolution      = diskindex.nSolution;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
-                pindexNew->nTx            = diskindex.nTx;
-                pindexNew->nSproutValue   = diskindex.nSproutValue;
-                pindexNew->nSaplingValue  = diskindex.nSaplingValue;
-                pindexNew->hashFinalSaplingRoot = diskindex.hashFinalSaplingRoot;
-                pindexNew->hashChainHistoryRoot = diskindex.hashChainHistoryRoot;
-
-                // Consistency checks
-                auto header = pindexNew->GetBlockHeader();
-                if (header.GetHash() != pindexNew->GetBlockHash())
-                    return error("LoadBlockIndex(): block header inconsistency detected: on-disk = %s, in-memory = %s",
-                       diskindex.ToString(),  pindexNew->ToString());
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
-
-                // ZIP 221 consistency checks
-                // These checks should only be performed for block index entries marked
-                // as consensus-valid (at the time they were written).
-                //
-                if (pindexNew->IsValid(BLOCK_VALID_CONSENSUS)) {
-                    // We assume block index entries on disk that are not at least
-                    // CHAIN_HISTORY_ROOT_VERSION were created by nodes that were
-                    // not Heartwood aware. Such a node would not see Heartwood block
-                    // headers as valid, and so this must *either* be an index entry
-                    // for a block header on a non-Heartwood chain, or be marked as
-                    // consensus-invalid.
-                    //
-                    // It can also happen that the block index entry was written
-                    // by this node when it was Heartwood-aware (so its version
-                    // will be >= CHAIN_HISTORY_ROOT_VERSION), but received from
-                    // a non-upgraded peer. However that case the entry will be
-                    // marked as consensus-invalid.
-                    //
-                    if (diskindex.nClientVersion >= CHAIN_HISTORY_ROOT_VERSION &&
-                        chainParams.GetConsensus().NetworkUpgradeActive(pindexNew->nHeight, Consensus::UPGRADE_HEARTWOOD)) {
-                        if (pindexNew->hashLightClientRoot != pindexNew->hashChainHistoryRoot) {
-                            return error(
-                                "LoadBlockIndex(): block index inconsistency detected (post-Heartwood; hashLightClientRoot %s != hashChainHistoryRoot %s): %s",
-                                pindexNew->hashLightClientRoot.ToString(), pindexNew->hashChainHistoryRoot.ToString(), pindexNew->ToString());
-                        }
-                    } else {
-                        if (pindexNew->hashLightClientRoot != pindexNew->hashFinalSaplingRoot) {
-                            return error(
-                                "LoadBlockIndex(): block index inconsistency detected (pre-Heartwood; hashLightClientRoot %s != hashFinalSaplingRoot %s): %s",
-                                pindexNew->hashLightClientRoot.ToString(), pindexNew->hashFinalSaplingRoot.ToString(), pindexNew->ToString());
-                        }
-                    }
-                }
-
-                pcursor->Next();
-            } else {
-                return error("LoadBlockIndex() : failed to read value");
+    // Load mapBlockIndex. The entries are read from the database in batches,
+    // deserialized and checked in parallel, then inserted in order.
+    std::vector<BlockIndexLoadEntry> vBatch;
+    vBatch.reserve(BLOCK_INDEX_LOAD_BATCH_SIZE);
+    bool fDone = false;
+    while (!fDone) {
+        vBatch.clear();
+        while (vBatch.size() < BLOCK_INDEX_LOAD_BATCH_SIZE) {
+            boost::this_thread::interruption_point();
+            std::pair<char, uint256> key;
+            if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX) {
+                fDone = true;
+                break;
             }
-        } else {
-            break;
+            vBatch.emplace_back(key.second, pcursor->GetValueStream());
+            pcursor->Next();
         }
+
+        ParallelFor(vBatch.size(), nThreads, [&](size_t i) {
+            vBatch[i].Check(chainParams, nTrustedHeight);
+        });
+
+        for (const BlockIndexLoadEntry& entry : vBatch) {
+            if (!entry.strError.empty())
+                return error("%s", entry.strError);
+
+            // Construct block index object. The Equihash solution is not
+            // kept in memory; GetBlockHeader() reads it back when needed.
+            const CDiskBlockIndex& diskindex = entry.diskindex;
+            CBlockIndex* pindexNew = insertBlockIndex(entry.hash);
+            pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->hashLightClientRoot  = diskindex.hashLightClientRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
+            pindexNew->nTx            = diskindex.nTx;
+            pindexNew->nSproutValue   = diskindex.nSproutValue;
+            pindexNew->nSaplingValue  = diskindex.nSaplingValue;
+            pindexNew->hashFinalSaplingRoot = diskindex.hashFinalSaplingRoot;
+            pindexNew->hashChainHistoryRoot = diskindex.hashChainHistoryRoot;
+
+            nMaxHeight = std::max(nMaxHeight, diskindex.nHeight);
+        }
+    }
+
+    // The entries have now all been checked, either here, by an earlier
+    // load, or when they were first accepted, so a later load with
+    // fTrustVerified set doesn't need to hash them again.
+    if (nMaxHeight > nVerifiedHeight && !Write(DB_VERIFIED_INDEX_HEIGHT, nMaxHeight)) {
+        LogPrintf("%s: failed to record the verified block index height\n", __func__);
     }
 
     return true;
@@ -10,8 +10,12 @@
 #include "dbwrapper.h"
 #include "chain.h"
 
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -46,6 +50,8 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! Number of block index entries read from the database before they are checked
+static const size_t BLOCK_INDEX_LOAD_BATCH_SIZE = 16384;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -72,20 +78,43 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/**
+ * CCoinsView backed by the coin database (chainstate/)
+ *
+ * Besides BatchWrite(), a cache snapshot can be handed to WriteInBackground(),
+ * which writes it on a separate thread. Until that write has been committed,
+ * reads are answered from the snapshot first, so the view always reflects the
+ * latest state handed to it.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
     CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+private:
+    mutable std::mutex csFlush;
+    //! Signalled when a snapshot is handed over, when its write completes, and on shutdown
+    mutable std::condition_variable condFlush;
+    //! Snapshot that has not been committed to the database yet
+    std::shared_ptr<const CCoinsCacheSnapshot> pendingSnapshot;
+    bool fFlushFailed = false;
+    bool fFlushShutdown = false;
+    std::thread flushThread;
+
+    void ThreadFlush();
+    bool WriteSnapshot(const CCoinsCacheSnapshot& snapshot);
+    std::shared_ptr<const CCoinsCacheSnapshot> GetPendingSnapshot() const;
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
     bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
     bool GetNullifier(const uint256 &nf, ShieldedType type) const;
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     uint256 GetBestAnchor(ShieldedType type) const;
     HistoryIndex GetHistoryLength(uint32_t epochId) const;
@@ -101,6 +130,31 @@ public:
                     CNullifiersMap &mapSaplingNullifiers,
                     CHistoryCacheMap &historyCacheMap);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Attempt to update from an older database format. Returns false if the upgrade failed or was interrupted.
+    bool Upgrade();
+
+    /**
+     * Write a snapshot taken from the cache on top of this view on the
+     * background thread. Waits for the previous snapshot to be committed
+     * first. Returns false if a previous background write failed.
+     */
+    bool WriteInBackground(std::shared_ptr<const CCoinsCacheSnapshot> snapshot);
+
+    //! Wait until any background write has been committed. Returns false if it failed.
+    bool WaitForBackgroundWrite() const;
+
+    //! Memory held by a snapshot that is still being written
+    size_t PendingMemoryUsage() const;
+
+    /**
+     * If a background write was interrupted, e.g. by a crash, return the
+     * block it would have moved the database to. The database itself is
+     * still at GetBestBlock(); the blocks in between have to be connected
+     * again from the block files.
+     */
+    bool ReadInterruptedFlush(uint256& hashTarget) const;
+    bool EraseInterruptedFlush();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -115,6 +169,7 @@ public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &info);
+    bool ReadDiskBlockIndex(const uint256 &blkid, CDiskBlockIndex &dbindex);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindexing);
     bool ReadReindexing(bool &fReindexing);
@@ -139,9 +194,18 @@ public:
 
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    //! The height up to which the block index entries were checked by an earlier load
+    bool ReadVerifiedIndexHeight(int& nHeight);
+    /**
+     * Loads the block index, deserializing and checking the entries on
+     * nThreads threads. If fTrustVerified is set, the entries at or below
+     * the height recorded by ReadVerifiedIndexHeight are not hashed again.
+     */
     bool LoadBlockIndexGuts(
         std::function<CBlockIndex*(const uint256&)> insertBlockIndex,
-        const CChainParams& chainParams);
+        const CChainParams& chainParams,
+        int nThreads,
+        bool fTrustVerified);
 };
 
 #endif // BITCOIN_TXDB_H
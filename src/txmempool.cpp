@@ -23,7 +23,9 @@ using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
     nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0),
-    hadNoDependencies(false), spendsCoinbase(false)
+    hadNoDependencies(false), spendsCoinbase(false), feeDelta(0),
+    nCountWithAncestors(1), nSizeWithAncestors(0), nModFeesWithAncestors(0),
+    nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -34,12 +36,19 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  bool _spendsCoinbase, uint32_t _nBranchId):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
     hadNoDependencies(poolHasNoInputsOf),
-    spendsCoinbase(_spendsCoinbase), nBranchId(_nBranchId)
+    spendsCoinbase(_spendsCoinbase), nBranchId(_nBranchId), feeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
     nModSize = tx.CalculateModifiedSize(nTxSize);
     nUsageSize = RecursiveDynamicUsage(tx);
     feeRate = CFeeRate(nFee, nTxSize);
+
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nModFeesWithAncestors = nFee;
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -56,6 +65,31 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount newFeeDelta)
+{
+    nModFeesWithAncestors += newFeeDelta - feeDelta;
+    nModFeesWithDescendants += newFeeDelta - feeDelta;
+    feeDelta = newFeeDelta;
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithAncestors += modifySize;
+    assert(int64_t(nSizeWithAncestors) > 0);
+    nModFeesWithAncestors += modifyFee;
+    nCountWithAncestors += modifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithDescendants += modifySize;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nModFeesWithDescendants += modifyFee;
+    nCountWithDescendants += modifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
     nTransactionsUpdated(0)
 {
@@ -74,17 +108,10 @@ CTxMemPool::~CTxMemPool()
     delete weightedTxTree;
 }
 
-void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
+bool CTxMemPool::isSpent(const COutPoint& outpoint)
 {
     LOCK(cs);
-
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
-    }
+    return mapNextTx.count(outpoint);
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -100,6 +127,160 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+void CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors) const
+{
+    LOCK(cs);
+    std::vector<const CTransaction*> vStack;
+    vStack.push_back(&entry.GetTx());
+    while (!vStack.empty()) {
+        const CTransaction* ptx = vStack.back();
+        vStack.pop_back();
+        for (const CTxIn& txin : ptx->vin) {
+            txiter piter = mapTx.find(txin.prevout.hash);
+            if (piter != mapTx.end() && setAncestors.insert(piter).second) {
+                vStack.push_back(&piter->GetTx());
+            }
+        }
+    }
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors,
+                                           uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                           uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                           std::string& errString) const
+{
+    LOCK(cs);
+    uint64_t nSizeWithAncestors = entry.GetTxSize();
+    std::vector<const CTransaction*> vStack;
+    vStack.push_back(&entry.GetTx());
+    while (!vStack.empty()) {
+        const CTransaction* ptx = vStack.back();
+        vStack.pop_back();
+        for (const CTxIn& txin : ptx->vin) {
+            txiter piter = mapTx.find(txin.prevout.hash);
+            if (piter == mapTx.end() || !setAncestors.insert(piter).second)
+                continue;
+            if (setAncestors.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                return false;
+            }
+            nSizeWithAncestors += piter->GetTxSize();
+            if (nSizeWithAncestors > limitAncestorSize) {
+                errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+                return false;
+            }
+            if (piter->GetCountWithDescendants() + 1 > limitDescendantCount) {
+                errString = strprintf("too many descendants for tx %s [limit: %u]",
+                                      piter->GetTx().GetHash().ToString(), limitDescendantCount);
+                return false;
+            }
+            if (piter->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+                errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]",
+                                      piter->GetTx().GetHash().ToString(), limitDescendantSize);
+                return false;
+            }
+            vStack.push_back(&piter->GetTx());
+        }
+    }
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(txiter it, setEntries& setDescendants) const
+{
+    LOCK(cs);
+    std::vector<txiter> vStack;
+    vStack.push_back(it);
+    while (!vStack.empty()) {
+        const uint256& hash = vStack.back()->GetTx().GetHash();
+        vStack.pop_back();
+        std::map<COutPoint, CInPoint>::const_iterator nit = mapNextTx.lower_bound(COutPoint(hash, 0));
+        for (; nit != mapNextTx.end() && nit->first.hash == hash; nit++) {
+            txiter citer = mapTx.find(nit->second.ptx->GetHash());
+            assert(citer != mapTx.end());
+            if (setDescendants.insert(citer).second) {
+                vStack.push_back(citer);
+            }
+        }
+    }
+}
+
+void CTxMemPool::RecalculatePackageState(txiter it)
+{
+    setEntries setAncestors, setDescendants;
+    CalculateMemPoolAncestors(*it, setAncestors);
+    CalculateDescendants(it, setDescendants);
+
+    int64_t nSize = it->GetTxSize();
+    CAmount nFees = it->GetModifiedFee();
+    for (txiter aiter : setAncestors) {
+        nSize += aiter->GetTxSize();
+        nFees += aiter->GetModifiedFee();
+    }
+    mapTx.modify(it, update_ancestor_state(
+        nSize - it->GetSizeWithAncestors(),
+        nFees - it->GetModFeesWithAncestors(),
+        int64_t(setAncestors.size() + 1) - it->GetCountWithAncestors()));
+
+    nSize = it->GetTxSize();
+    nFees = it->GetModifiedFee();
+    for (txiter diter : setDescendants) {
+        nSize += diter->GetTxSize();
+        nFees += diter->GetModifiedFee();
+    }
+    mapTx.modify(it, update_descendant_state(
+        nSize - it->GetSizeWithDescendants(),
+        nFees - it->GetModFeesWithDescendants(),
+        int64_t(setDescendants.size() + 1) - it->GetCountWithDescendants()));
+}
+
+void CTxMemPool::UpdateForAdd(txiter newit)
+{
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(*newit, setAncestors);
+
+    const uint256& hash = newit->GetTx().GetHash();
+    std::map<COutPoint, CInPoint>::const_iterator nit = mapNextTx.lower_bound(COutPoint(hash, 0));
+    if (nit != mapNextTx.end() && nit->first.hash == hash) {
+        // The transactions of a disconnected block are added back after
+        // their descendants. Those descendants gain ancestors that may be
+        // related to them in other ways as well, so the state of everything
+        // connected to the new entry is worked out again.
+        setEntries setDescendants;
+        CalculateDescendants(newit, setDescendants);
+        RecalculatePackageState(newit);
+        for (txiter it : setAncestors)
+            RecalculatePackageState(it);
+        for (txiter it : setDescendants)
+            RecalculatePackageState(it);
+        return;
+    }
+
+    int64_t nSize = newit->GetTxSize();
+    CAmount nFee = newit->GetModifiedFee();
+    int64_t nSizeAncestors = 0;
+    CAmount nFeesAncestors = 0;
+    for (txiter it : setAncestors) {
+        mapTx.modify(it, update_descendant_state(nSize, nFee, 1));
+        nSizeAncestors += it->GetTxSize();
+        nFeesAncestors += it->GetModifiedFee();
+    }
+    mapTx.modify(newit, update_ancestor_state(nSizeAncestors, nFeesAncestors, setAncestors.size()));
+}
+
+void CTxMemPool::UpdateForRemove(txiter it)
+{
+    setEntries setAncestors, setDescendants;
+    CalculateMemPoolAncestors(*it, setAncestors);
+    CalculateDescendants(it, setDescendants);
+
+    int64_t nSize = it->GetTxSize();
+    CAmount nFee = it->GetModifiedFee();
+    for (txiter aiter : setAncestors)
+        mapTx.modify(aiter, update_descendant_state(-nSize, -nFee, -1));
+    for (txiter diter : setDescendants)
+        mapTx.modify(diter, update_ancestor_state(-nSize, -nFee, -1));
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
@@ -107,12 +288,20 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // all the appropriate checks.
     LOCK(cs);
     weightedTxTree->add(WeightedTxInfo::from(entry.GetTx(), entry.GetFee()));
-    mapTx.insert(entry);
-    const CTransaction& tx = mapTx.find(hash)->GetTx();
+    indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
+
+    // Apply a prioritisetransaction delta made before the transaction arrived
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos != mapDeltas.end() && pos->second.second != 0) {
+        mapTx.modify(newit, update_fee_delta(pos->second.second));
+    }
+
+    const CTransaction& tx = newit->GetTx();
     mapRecentlyAddedTx[tx.GetHash()] = &tx;
     nRecentlyAddedSequence += 1;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
         mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+    UpdateForAdd(newit);
     for (const JSDescription &joinsplit : tx.vJoinSplit) {
         for (const uint256 &nf : joinsplit.nullifiers) {
             mapSproutNullifiers[nf] = &tx;
@@ -270,6 +459,7 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
                     txToRemove.push_back(it->second.ptx->GetHash());
                 }
             }
+            UpdateForRemove(mapTx.find(hash));
             mapRecentlyAddedTx.erase(hash);
             for (const CTxIn& txin : tx.vin)
                 mapNextTx.erase(txin.prevout);
@@ -314,9 +504,9 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
                 indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
                 if (it2 != mapTx.end())
                     continue;
-                const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
-		if (nCheckFrequency != 0) assert(coins);
-                if (!coins || (coins->IsCoinBase() && ((signed long)nMemPoolHeight) - coins->nHeight < COINBASE_MATURITY)) {
+                const Coin &coin = pcoins->AccessCoin(txin.prevout);
+                if (nCheckFrequency != 0) assert(!coin.IsSpent());
+                if (coin.IsSpent() || (coin.IsCoinBase() && ((signed long)nMemPoolHeight) - coin.nHeight < COINBASE_MATURITY)) {
                     transactionsToRemove.push_back(tx);
                     break;
                 }
@@ -521,8 +711,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
             } else {
-                const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
-                assert(coins && coins->IsAvailable(txin.prevout.n));
+                assert(pcoins->HaveCoin(txin.prevout));
             }
             // Check whether its inputs are marked in mapNextTx.
             std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
@@ -532,6 +721,29 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             i++;
         }
 
+        // Check the cached ancestor and descendant state
+        setEntries setAncestors, setDescendants;
+        CalculateMemPoolAncestors(*it, setAncestors);
+        CalculateDescendants(it, setDescendants);
+        uint64_t nSizeCheck = it->GetTxSize();
+        CAmount nFeesCheck = it->GetModifiedFee();
+        for (txiter aiter : setAncestors) {
+            nSizeCheck += aiter->GetTxSize();
+            nFeesCheck += aiter->GetModifiedFee();
+        }
+        assert(it->GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->GetSizeWithAncestors() == nSizeCheck);
+        assert(it->GetModFeesWithAncestors() == nFeesCheck);
+        nSizeCheck = it->GetTxSize();
+        nFeesCheck = it->GetModifiedFee();
+        for (txiter diter : setDescendants) {
+            nSizeCheck += diter->GetTxSize();
+            nFeesCheck += diter->GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size() + 1);
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
+
         // The SaltedTxidHasher is fine to use here; it salts the map keys automatically
         // with randomness generated on construction.
         boost::unordered_map<uint256, SproutMerkleTree, SaltedTxidHasher> intermediates;
@@ -700,6 +912,19 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const std::string str
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end() && nFeeDelta != 0) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+            setEntries setAncestors, setDescendants;
+            CalculateMemPoolAncestors(*it, setAncestors);
+            CalculateDescendants(it, setDescendants);
+            for (txiter aiter : setAncestors)
+                mapTx.modify(aiter, update_descendant_state(0, nFeeDelta, 0));
+            for (txiter diter : setDescendants)
+                mapTx.modify(diter, update_ancestor_state(0, nFeeDelta, 0));
+        }
+        // The selection of block template transactions may change
+        nTransactionsUpdated++;
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -776,20 +1001,25 @@ bool CCoinsViewMemPool::GetNullifier(const uint256 &nf, ShieldedType type) const
     return mempool.nullifierExists(nf, type) || base->GetNullifier(nf, type);
 }
 
-bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) const {
+bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
     CTransaction tx;
-    if (mempool.lookup(txid, tx)) {
-        coins = CCoins(tx, MEMPOOL_HEIGHT);
-        return true;
+    if (mempool.lookup(outpoint.hash, tx)) {
+        if (outpoint.n < tx.vout.size()) {
+            coin = Coin(tx.vout[outpoint.n], MEMPOOL_HEIGHT, false);
+            return true;
+        } else {
+            return false;
+        }
     }
-    return (base->GetCoins(txid, coins) && !coins.IsPruned());
+    return (base->GetCoin(outpoint, coin) && !coin.IsSpent());
 }
 
-bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
-    return mempool.exists(txid) || base->HaveCoins(txid);
+bool CCoinsViewMemPool::HaveCoin(const COutPoint &outpoint) const {
+    Coin coin;
+    return GetCoin(outpoint, coin);
 }
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
@@ -64,6 +64,8 @@
 #include <sys/prctl.h>
 #endif
 
+#include <thread>
+
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/predicate.hpp> // for startswith() and endswith()
@@ -672,3 +674,30 @@ int GetNumCores()
 {
     return boost::thread::physical_concurrency();
 }
+
+void ParallelFor(size_t n, int nThreads, const std::function<void(size_t)>& fn)
+{
+    // Indexes are handed out in chunks, so that threads don't contend on
+    // the counter when fn is cheap.
+    static const size_t CHUNK_SIZE = 64;
+    std::atomic<size_t> nNext {0};
+    auto work = [&]() {
+        size_t nBegin;
+        while ((nBegin = nNext.fetch_add(CHUNK_SIZE)) < n) {
+            size_t nEnd = std::min(nBegin + CHUNK_SIZE, n);
+            for (size_t i = nBegin; i < nEnd; i++) {
+                fn(i);
+            }
+        }
+    };
+
+    nThreads = std::max(1, (int)std::min<size_t>(nThreads, (n + CHUNK_SIZE - 1) / CHUNK_SIZE));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nThreads; i++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (std::thread& t : threads) {
+        t.join();
+    }
+}
@@ -23,6 +23,7 @@
 
 #include <atomic>
 #include <exception>
+#include <functional>
 #include <map>
 #include <stdint.h>
 #include <string>
@@ -172,6 +173,13 @@ std::string HelpMessageOpt(const std::string& option, const std::string& message
  */
 int GetNumCores();
 
+/**
+ * Call fn(i) for every i in [0, n), spread over nThreads threads including
+ * the calling one, and return once all calls are done. fn must be safe to
+ * call concurrently for different i, and must not throw.
+ */
+void ParallelFor(size_t n, int nThreads, const std::function<void(size_t)>& fn);
+
 void SetThreadPriority(int nPriority);
 void RenameThread(const char* name);
 
@@ -30,6 +30,7 @@ public:
     MOCK_METHOD0(TxnAbort, bool());
 
     MOCK_METHOD1(WriteTx, bool(const CWalletTx& wtx));
+    MOCK_METHOD1(WriteTxWitnesses, bool(const CWalletTx& wtx));
     MOCK_METHOD1(WriteWitnessCacheSize, bool(int64_t nWitnessCacheSize));
     MOCK_METHOD1(WriteBestBlock, bool(const CBlockLocator& loc));
 };
@@ -330,6 +331,59 @@ TEST(WalletTests, FindUnspentSproutNotes) {
 }
 
 
+TEST(WalletTests, GetFilteredSaplingNotesByAddress) {
+    auto consensusParams = RegtestActivateSapling();
+
+    TestWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    auto sk1 = GetTestMasterSaplingSpendingKey();
+    auto sk2 = sk1.Derive(1 | ZIP32_HARDENED_KEY_LIMIT);
+    ASSERT_TRUE(wallet.AddSaplingZKey(sk1));
+    ASSERT_TRUE(wallet.AddSaplingZKey(sk2));
+    auto pa1 = sk1.DefaultAddress();
+    auto pa2 = sk2.DefaultAddress();
+
+    std::vector<std::pair<libzcash::SaplingExtendedSpendingKey, CAmount>> receives {{sk1, 10}, {sk2, 20}, {sk2, 30}};
+    for (const auto& receive : receives) {
+        auto wtx = GetValidSaplingReceive(consensusParams, wallet, receive.first, receive.second);
+        auto noteMap = wallet.FindMySaplingNotes(wtx, 1).first;
+        wtx.SetSaplingNoteData(noteMap);
+        wallet.AddToWallet(wtx, true, NULL);
+        // Adding a transaction again must not duplicate its notes
+        wallet.AddToWallet(wtx, true, NULL);
+    }
+
+    std::vector<SproutNoteEntry> sproutEntries;
+    std::vector<SaplingNoteEntry> saplingEntries;
+    std::set<libzcash::PaymentAddress> noFilter;
+    wallet.GetFilteredNotes(sproutEntries, saplingEntries, noFilter, -1);
+    EXPECT_EQ(3, saplingEntries.size());
+
+    // The notes are returned in outpoint order
+    for (size_t i = 1; i < saplingEntries.size(); i++) {
+        EXPECT_TRUE(saplingEntries[i - 1].op < saplingEntries[i].op);
+    }
+
+    std::set<libzcash::PaymentAddress> filter1 {pa1};
+    saplingEntries.clear();
+    wallet.GetFilteredNotes(sproutEntries, saplingEntries, filter1, -1);
+    ASSERT_EQ(1, saplingEntries.size());
+    EXPECT_EQ(pa1, saplingEntries[0].address);
+    EXPECT_EQ(10, saplingEntries[0].note.value());
+
+    std::set<libzcash::PaymentAddress> filter2 {pa2};
+    saplingEntries.clear();
+    wallet.GetFilteredNotes(sproutEntries, saplingEntries, filter2, -1);
+    ASSERT_EQ(2, saplingEntries.size());
+    EXPECT_EQ(pa2, saplingEntries[0].address);
+    EXPECT_EQ(pa2, saplingEntries[1].address);
+    EXPECT_EQ(0, sproutEntries.size());
+
+    // Revert to default
+    RegtestDeactivateSapling();
+}
+
 TEST(WalletTests, SetSproutNoteAddrsInCWalletTx) {
     auto sk = libzcash::SproutSpendingKey::random();
     auto wtx = GetValidSproutReceive(sk, 10, true);
@@ -1713,6 +1767,59 @@ TEST(WalletTests, SetBestChainIgnoresTxsWithoutShieldedData) {
     wallet.SetBestChain(walletdb, loc);
 }
 
+TEST(WalletTests, SetBestChainWritesOnlyChangedTxs) {
+    TestWallet wallet;
+    LOCK(wallet.cs_wallet);
+    MockWalletDB walletdb;
+    CBlockLocator loc;
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    wallet.AddSproutSpendingKey(sk);
+
+    auto wtx = GetValidSproutReceive(sk, 10, true);
+    auto noteMap = wallet.FindMySproutNotes(wtx);
+    wtx.SetSproutNoteData(noteMap);
+    wallet.AddToWallet(wtx, true, nullptr);
+    auto hash = wtx.GetHash();
+
+    EXPECT_CALL(walletdb, TxnBegin())
+        .WillRepeatedly(Return(true));
+    EXPECT_CALL(walletdb, WriteWitnessCacheSize(0))
+        .WillRepeatedly(Return(true));
+    EXPECT_CALL(walletdb, WriteBestBlock(loc))
+        .WillRepeatedly(Return(true));
+
+    // The new transaction is written in full, but not committed
+    EXPECT_CALL(walletdb, WriteTx(wtx))
+        .WillOnce(Return(true));
+    EXPECT_CALL(walletdb, TxnCommit())
+        .WillOnce(Return(false));
+    wallet.SetBestChain(walletdb, loc);
+    EXPECT_TRUE(wallet.mapWallet[hash].fNoteDataDirty);
+
+    // So it is written again
+    EXPECT_CALL(walletdb, WriteTx(wtx))
+        .WillOnce(Return(true));
+    EXPECT_CALL(walletdb, TxnCommit())
+        .WillRepeatedly(Return(true));
+    wallet.SetBestChain(walletdb, loc);
+    EXPECT_FALSE(wallet.mapWallet[hash].fNoteDataDirty);
+
+    // Nothing changed since
+    EXPECT_CALL(walletdb, WriteTx(wtx))
+        .Times(0);
+    EXPECT_CALL(walletdb, WriteTxWitnesses(wtx))
+        .Times(0);
+    wallet.SetBestChain(walletdb, loc);
+
+    // Only the witnesses changed
+    wallet.ClearNoteWitnessCache();
+    EXPECT_CALL(walletdb, WriteTxWitnesses(wtx))
+        .WillOnce(Return(true));
+    wallet.SetBestChain(walletdb, loc);
+    EXPECT_FALSE(wallet.mapWallet[hash].fWitnessesDirty);
+}
+
 TEST(WalletTests, UpdateSproutNullifierNoteMap) {
     TestWallet wallet;
     LOCK(wallet.cs_wallet);
@@ -2117,3 +2224,23 @@ TEST(WalletTests, SaplingNoteLocking) {
     EXPECT_FALSE(wallet.IsLockedNote(sop1));
     EXPECT_FALSE(wallet.IsLockedNote(sop2));
 }
+
+TEST(WalletTests, RescanReservation) {
+    TestWallet wallet;
+
+    {
+        WalletRescanReserver reserver(&wallet);
+        EXPECT_FALSE(reserver.isReserved());
+        ASSERT_TRUE(reserver.reserve());
+        EXPECT_TRUE(reserver.isReserved());
+
+        // A second rescan is turned away while the first holds the wallet
+        WalletRescanReserver reserver2(&wallet);
+        EXPECT_FALSE(reserver2.reserve());
+        EXPECT_FALSE(reserver2.isReserved());
+    }
+
+    // The reservation is released when the reserver goes out of scope
+    WalletRescanReserver reserver3(&wallet);
+    EXPECT_TRUE(reserver3.reserve());
+}
@@ -2418,6 +2418,9 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
             "  \"paytxfee\": x.xxxx,         (numeric) the transaction fee configuration, set in " + CURRENCY_UNIT + "/kB\n"
             "  \"seedfp\": \"uint256\",        (string) the BLAKE2b-256 hash of the HD seed\n"
+            "  \"rescanning\": true|false,   (boolean) whether a rescan is in progress\n"
+            "  \"rescanprogress\": xx.xx,    (numeric, optional) the progress of the rescan in progress, in percent\n"
+            "  \"rescaneta\": xxx,           (numeric, optional) the estimated number of seconds until the rescan in progress completes\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getwalletinfo", "")
@@ -2442,6 +2445,14 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
     uint256 seedFp = pwalletMain->GetHDChain().seedFp;
     if (!seedFp.IsNull())
          obj.pushKV("seedfp", seedFp.GetHex());
+    {
+        LOCK(pwalletMain->cs_rescan);
+        obj.pushKV("rescanning", (bool)pwalletMain->dRescanProgress);
+        if (pwalletMain->dRescanProgress)
+            obj.pushKV("rescanprogress", pwalletMain->dRescanProgress.value());
+        if (pwalletMain->nRescanSecondsLeft)
+            obj.pushKV("rescaneta", pwalletMain->nRescanSecondsLeft.value());
+    }
     return obj;
 }
 
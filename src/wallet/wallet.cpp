@@ -7,6 +7,7 @@
 
 #include "asyncrpcqueue.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
 #include "core_io.h"
 #include "consensus/upgrades.h"
@@ -33,6 +34,10 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <variant>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -59,6 +64,7 @@ int nDeleteInterval = DEFAULT_TX_DELETE_INTERVAL;
 unsigned int nDeleteTransactionsAfterNBlocks = DEFAULT_TX_RETENTION_BLOCKS;
 unsigned int nKeepLastNTransactions = DEFAULT_TX_RETENTION_LASTTX;
 bool fIgnoreExTx = false;
+int nWalletDecryptThreads = 0;
 
 const char * DEFAULT_WALLET_DAT = RC_COIN_WALLET_FILENAME;
 
@@ -183,6 +189,10 @@ bool CWallet::AddSaplingZKey(const libzcash::SaplingExtendedSpendingKey &sk)
     if (!CCryptoKeyStore::AddSaplingSpendingKey(sk)) {
         return false;
     }
+
+    // Trial decryption results computed so far do not cover the new key
+    nSaplingKeyGeneration++;
+    hashSaplingDecryptedBlock.SetNull();
     
     if (!fFileBacked) {
         return true;
@@ -204,6 +214,9 @@ bool CWallet::AddSaplingFullViewingKey(const libzcash::SaplingExtendedFullViewin
         return false;
     }
 
+    nSaplingKeyGeneration++;
+    hashSaplingDecryptedBlock.SetNull();
+
     if (!fFileBacked) {
         return true;
     }
@@ -1300,6 +1313,43 @@ void CWallet::RemoveFromSifted(const uint256& wtxid)
     setSiftedSapling.erase(wtxid);
 }
 
+void CWallet::AddToNoteIndex(const uint256& wtxid)
+{
+    const CWalletTx& wtx = mapWallet.at(wtxid);
+
+    for (const auto& pair : wtx.mapSproutNoteData)
+        mapSproutNotesByAddress[pair.second.address].insert(pair.first);
+
+    for (const auto& pair : wtx.mapSaplingNoteData)
+        mapSaplingNotesByIvk[pair.second.ivk].emplace(pair.first, std::nullopt);
+}
+
+void CWallet::RemoveFromNoteIndex(const uint256& wtxid)
+{
+    auto itmw = mapWallet.find(wtxid);
+    if (itmw == mapWallet.end())
+        return;
+    const CWalletTx& wtx = itmw->second;
+
+    for (const auto& pair : wtx.mapSproutNoteData) {
+        auto it = mapSproutNotesByAddress.find(pair.second.address);
+        if (it != mapSproutNotesByAddress.end()) {
+            it->second.erase(pair.first);
+            if (it->second.empty())
+                mapSproutNotesByAddress.erase(it);
+        }
+    }
+
+    for (const auto& pair : wtx.mapSaplingNoteData) {
+        auto it = mapSaplingNotesByIvk.find(pair.second.ivk);
+        if (it != mapSaplingNotesByIvk.end()) {
+            it->second.erase(pair.first);
+            if (it->second.empty())
+                mapSaplingNotesByIvk.erase(it);
+        }
+    }
+}
+
 void CWallet::AddToEx(const uint256& wtxid, bool fFromLoadWallet)
 {
     setExWallet.emplace(wtxid);
@@ -1322,6 +1372,7 @@ void CWallet::ClearNoteWitnessCache()
             item.second.witnesses.clear();
             item.second.witnessHeight = -1;
         }
+        wtxItem.second.MarkWitnessesDirty();
     }
     nWitnessCacheSize = 0;
 }
@@ -1478,6 +1529,7 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
         ::UpdateWitnessHeights(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
         ::UpdateWitnessHeights(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
+        wtxItem.second.MarkWitnessesDirty();
     }
 
     // For performance reasons, we write out the witness cache in
@@ -1533,6 +1585,7 @@ void CWallet::DecrementNoteWitnessesOriginal(const CBlockIndex* pindex)
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
         ::DecrementNoteWitnesses(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
         ::DecrementNoteWitnesses(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
+        wtxItem.second.MarkWitnessesDirty();
     }
     nWitnessCacheSize -= 1;
     // TODO: If nWitnessCache is zero, we need to regenerate the caches (#1302)
@@ -1543,51 +1596,101 @@ void CWallet::DecrementNoteWitnessesOriginal(const CBlockIndex* pindex)
     // of the wallet.dat is maintained).
 }
 
+template<typename NoteData>
+void ClearSingleNoteWitnessCache(NoteData* nd)
+{
+    nd->witnesses.clear();
+    nd->witnessHeight = -1;
+    nd->witnessRootValidated = false;
+}
+
+// The commitment trees as of the start of the block at pindex, as recorded in
+// the chainstate. These are the frontiers that the wallet's witnesses are
+// advanced from, and rewound to when the block is disconnected.
+static bool GetSproutFrontier(const CBlockIndex* pindex, SproutMerkleTree& tree)
+{
+    AssertLockHeld(cs_main);
+    return pcoinsTip && pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, tree);
+}
+
+static bool GetSaplingFrontier(const CBlockIndex* pindex, SaplingMerkleTree& tree)
+{
+    AssertLockHeld(cs_main);
+    // Before Sapling activation the last anchor was the empty root
+    if (!pindex->pprev || !Params().GetConsensus().NetworkUpgradeActive(pindex->pprev->nHeight, Consensus::UPGRADE_SAPLING)) {
+        tree = SaplingMerkleTree();
+        return true;
+    }
+    return pcoinsTip && pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, tree);
+}
+
+// Rewinds the witness of a note to the start of the block being disconnected.
+// Only the latest witness is kept for each note: the uncles that the block
+// completed are dropped, and the partially filled one is taken from the shared
+// frontier. If the frontier is no longer in the chainstate, the witness is
+// cleared and rebuilt by VerifyAndSetInitialWitness. Returns true if the
+// witness changed.
+template<typename NoteData, typename Tree>
+static bool RewindNoteWitness(NoteData& nd, const CBlockIndex* pindex, std::optional<Tree>& frontier,
+                              bool (*getFrontier)(const CBlockIndex*, Tree&))
+{
+    // Only rewind witnesses that are at the height of the block being removed
+    if (nd.witnessHeight != pindex->nHeight || nd.witnesses.empty()) {
+        return false;
+    }
+
+    if (!frontier) {
+        Tree tree;
+        if (!getFrontier(pindex, tree)) {
+            ClearSingleNoteWitnessCache(&nd);
+            return true;
+        }
+        frontier = tree;
+    }
+
+    // A note created in the block being removed keeps its witness until the
+    // block is connected again, or the transaction is dropped.
+    if (nd.witnesses.front().position() >= frontier->size()) {
+        return false;
+    }
+
+    if (nd.witnesses.size() > 1) {
+        nd.witnesses.resize(1);
+    }
+    nd.witnesses.front().sync_to(*frontier);
+    nd.witnessHeight = pindex->nHeight - 1;
+    return true;
+}
+
 void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
 {
     LOCK2(cs_main, cs_wallet);
+    // Looked up on first use
+    std::optional<SproutMerkleTree> sproutFrontier;
+    std::optional<SaplingMerkleTree> saplingFrontier;
+
     for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
         //Sprout
         for (auto& item : wtxItem.second.mapSproutNoteData) {
-            auto* nd = &(item.second);
-            if (nd->nullifier && GetSproutSpendDepth(nd->nullifier.value()) <= WITNESS_CACHE_SIZE) {
-              // Only decrement witnesses that are not above the current height
-                if (nd->witnessHeight <= pindex->nHeight) {
-                    if (nd->witnesses.size() > 1) {
-                        // indexHeight is the height of the block being removed, so
-                        // the new witness cache height is one below it.
-                        nd->witnesses.pop_front();
-                        nd->witnessHeight = pindex->nHeight - 1;
-                    }
+            auto& nd = item.second;
+            if (nd.nullifier && GetSproutSpendDepth(nd.nullifier.value()) <= WITNESS_CACHE_SIZE) {
+                if (RewindNoteWitness(nd, pindex, sproutFrontier, GetSproutFrontier)) {
+                    wtxItem.second.MarkWitnessesDirty();
                 }
             }
         }
         //Sapling
         for (auto& item : wtxItem.second.mapSaplingNoteData) {
-            auto* nd = &(item.second);
-            if (nd->nullifier && GetSaplingSpendDepth(nd->nullifier.value()) <= WITNESS_CACHE_SIZE) {
-                // Only decrement witnesses that are not above the current height
-                if (nd->witnessHeight <= pindex->nHeight) {
-                    if (nd->witnesses.size() > 1) {
-                        // indexHeight is the height of the block being removed, so
-                        // the new witness cache height is one below it.
-                        nd->witnesses.pop_front();
-                        nd->witnessHeight = pindex->nHeight - 1;
-                    }
+            auto& nd = item.second;
+            if (nd.nullifier && GetSaplingSpendDepth(nd.nullifier.value()) <= WITNESS_CACHE_SIZE) {
+                if (RewindNoteWitness(nd, pindex, saplingFrontier, GetSaplingFrontier)) {
+                    wtxItem.second.MarkWitnessesDirty();
                 }
             }
         }
     }
 }
 
-template<typename NoteData>
-void ClearSingleNoteWitnessCache(NoteData* nd)
-{
-    nd->witnesses.clear();
-    nd->witnessHeight = -1;
-    nd->witnessRootValidated = false;
-}
-
 int CWallet::SproutWitnessMinimumHeight(const uint256& nullifier, int nWitnessHeight, int nMinimumHeight)
 {
     if (GetSproutSpendDepth(nullifier) <= WITNESS_CACHE_SIZE) {
@@ -1633,6 +1736,10 @@ int CWallet::VerifyAndSetInitialWitness(const CBlockIndex* pindex, bool witnessO
 
                 if (!nd.nullifier)
                 {
+                    if (nd.witnessHeight != -1 || !nd.witnesses.empty())
+                    {
+                        wtx.MarkWitnessesDirty();
+                    }
                     ::ClearSingleNoteWitnessCache(&nd);
                 }
 
@@ -1674,6 +1781,7 @@ int CWallet::VerifyAndSetInitialWitness(const CBlockIndex* pindex, bool witnessO
                 //Clear witness Cache for all other scenarios
                 pblockindex = chainActive[wtxHeight];
                 ::ClearSingleNoteWitnessCache(&nd);
+                wtx.MarkWitnessesDirty();
 
                 LogPrintf("Setting Inital Sprout Witness for tx %s\n", wtxid.ToString());
 
@@ -1755,6 +1863,10 @@ int CWallet::VerifyAndSetInitialWitness(const CBlockIndex* pindex, bool witnessO
 
                 if (!nd.nullifier)
                 {
+                    if (nd.witnessHeight != -1 || !nd.witnesses.empty())
+                    {
+                        wtx.MarkWitnessesDirty();
+                    }
                     ::ClearSingleNoteWitnessCache(&nd);
                 }
 
@@ -1796,6 +1908,7 @@ int CWallet::VerifyAndSetInitialWitness(const CBlockIndex* pindex, bool witnessO
                 // Clear witness Cache for all other scenarios
                 pblockindex = chainActive[wtxHeight];
                 ::ClearSingleNoteWitnessCache(&nd);
+                wtx.MarkWitnessesDirty();
 
                 LogPrintf("Setting Inital Sapling Witness for tx %s\n", wtxid.ToString());
 
@@ -1866,18 +1979,47 @@ int CWallet::VerifyAndSetInitialWitness(const CBlockIndex* pindex, bool witnessO
     return nMinimumHeight;
 }
 
-static SproutWitness AppendSingleSproutCommitment(const SproutWitness& witness, const uint256& commitment)
+// Appends the note commitments of a block to `frontier`, the commitment tree
+// as of the start of the block, and moves the witnesses of vNoteData from the
+// start of the block to its end. Each witness only hashes the uncles that the
+// block completes; the partially filled one is copied from the frontier.
+template<typename Tree, typename NoteData>
+static void AppendBlockCommitments(Tree& frontier, const std::vector<uint256>& vCommitments, const std::vector<NoteData*>& vNoteData)
 {
-    SproutWitness sw(witness);
-    sw.append(commitment);
-    return sw;
-}
+    // Witnesses waiting for an uncle, by the tree size that completes it
+    std::multimap<uint64_t, NoteData*> mapWaiting;
+    std::vector<NoteData*> vOutOfSync;
+    uint64_t nSize = frontier.size();
 
-static SaplingWitness AppendSingleSaplingCommitment(const SaplingWitness& witness, const uint256& commitment)
-{
-    SaplingWitness sw(witness);
-    sw.append(commitment);
-    return sw;
+    for (NoteData* nd : vNoteData) {
+        const auto& witness = nd->witnesses.front();
+        if (witness.position() < nSize && witness.next_filled_size() > nSize) {
+            mapWaiting.emplace(witness.next_filled_size(), nd);
+        } else {
+            // Not at the start of this block, so the frontier can't be used
+            vOutOfSync.push_back(nd);
+        }
+    }
+
+    for (const uint256& commitment : vCommitments) {
+        frontier.append(commitment);
+        nSize++;
+
+        while (!mapWaiting.empty() && mapWaiting.begin()->first == nSize) {
+            NoteData* nd = mapWaiting.begin()->second;
+            mapWaiting.erase(mapWaiting.begin());
+            nd->witnesses.front().fill(frontier);
+            mapWaiting.emplace(nd->witnesses.front().next_filled_size(), nd);
+        }
+
+        for (NoteData* nd : vOutOfSync) {
+            nd->witnesses.front().append(commitment);
+        }
+    }
+
+    for (const auto& item : mapWaiting) {
+        item.second->witnesses.front().sync_to(frontier);
+    }
 }
 
 void CWallet::BuildWitnessCache(const CBlockIndex* pindex, bool witnessOnly, const CBlock* pblockIn)
@@ -1892,20 +2034,40 @@ void CWallet::BuildWitnessCache(const CBlockIndex* pindex, bool witnessOnly, con
 
     const Consensus::Params &consensus_params = Params().GetConsensus();
 
+    CBlockIndex *pblockindex = chainActive[startHeight];
+
+    // The commitment trees as of the start of each block, shared by the
+    // witnesses of all notes
+    SproutMerkleTree sproutFrontier;
+    SaplingMerkleTree saplingFrontier;
+    if (!GetSproutFrontier(pblockindex, sproutFrontier) || !GetSaplingFrontier(pblockindex, saplingFrontier))
+    {
+        LogPrintf("%s: commitment trees at height %d not found\n", __func__, startHeight);
+        return;
+    }
+
     //Disable RPC during IBD
     if (!fInitWitnessesBuilt || IsInitialBlockDownload(consensus_params))
     {
         fBuildingWitnessCache = true;
     }
 
-    CBlockIndex *pblockindex = chainActive[startHeight];
-
     //Show in UI
     bool uiShown = false;
     int64_t nStartUI = GetTimeMillis();
     int64_t nStartLog = nStartUI;
     int nTipHeight = chainActive.Height();
 
+    // Read ahead along the active chain, up to pindex. Most calls, such as
+    // the one for each connected block, only cover a few blocks, which are
+    // cheaper to read directly than to start a pool of reader threads for.
+    std::unique_ptr<CBlockPrefetcher> prefetcher;
+    if (pindex->nHeight - startHeight + 1 >= MIN_BLOCK_PREFETCH_SPAN) {
+        prefetcher = MakeBlockPrefetcher(consensus_params, [pindex](const CBlockIndex* pprev) -> const CBlockIndex* {
+            return pprev == pindex ? nullptr : chainActive.Next(pprev);
+        });
+    }
+
     while (pblockindex)
     {
         // exit loop if trying to shutdown
@@ -1938,22 +2100,19 @@ void CWallet::BuildWitnessCache(const CBlockIndex* pindex, bool witnessOnly, con
         //Cycle through blocks and transactions building Sprout and Sapling tree until the commitment needed is reached
         const CBlock *pblock;
         CBlock block;
+        std::shared_ptr<const CBlock> pblockPrefetched;
 
         if (pblockIn && pblockindex == pindex)
         {
             pblock = pblockIn;
         }
+        else if (prefetcher && (pblockPrefetched = prefetcher->Get(pblockindex)))
+        {
+            pblock = pblockPrefetched.get();
+        }
         else
         {
-            if (fBlockPrefetchEnabled)
-            {
-                ReadBlockFromPrefetch(block, pblockindex, consensus_params);
-            }
-            else
-            {
-                ReadBlockFromDisk(block, pblockindex, consensus_params);
-            }
-
+            ReadBlockFromDisk(block, pblockindex, consensus_params);
             pblock = &block;
         }
 
@@ -1989,39 +2148,22 @@ void CWallet::BuildWitnessCache(const CBlockIndex* pindex, bool witnessOnly, con
                         if (nd.nullifier && nd.witnessHeight == pblockindex->nHeight - 1
                         && GetSproutSpendDepth(nd.nullifier.value()) <= WITNESS_CACHE_SIZE)
                         {
-                            nd.witnesses.push_front(nd.witnesses.front());
-                            if (nd.witnesses.size() > WITNESS_CACHE_SIZE)
+                            // Only the latest witness is kept; see RewindNoteWitness
+                            if (nd.witnesses.size() > 1)
                             {
-                                nd.witnesses.resize(WITNESS_CACHE_SIZE);
+                                nd.witnesses.resize(1);
                             }
 
-                            // for async append of commitments
                             vSproutNoteData.push_back(&nd);
 
                             nd.witnessHeight = pblockindex->nHeight;
+                            wtx.MarkWitnessesDirty();
                         }
                     }
                 }
             }
 
-            // Parallelization with std::async
-            std::vector<std::future<SproutWitness>> vSproutWitnessFutures;
-            for (const auto& commitment : vSproutCommitments)
-            {
-                for (auto pnd : vSproutNoteData)
-                {
-                    vSproutWitnessFutures.emplace_back(std::async(std::launch::async, AppendSingleSproutCommitment, pnd->witnesses.front(), commitment));
-                }
-
-                assert(vSproutWitnessFutures.size() == vSproutNoteData.size());
-
-                for (int i = 0; i < vSproutWitnessFutures.size(); i++)
-                {
-                    vSproutNoteData.at(i)->witnesses.front() = vSproutWitnessFutures.at(i).get();
-                }
-
-                vSproutWitnessFutures.resize(0);
-            }
+            AppendBlockCommitments(sproutFrontier, vSproutCommitments, vSproutNoteData);
 
         }
 
@@ -2048,39 +2190,22 @@ void CWallet::BuildWitnessCache(const CBlockIndex* pindex, bool witnessOnly, con
                         if (nd.nullifier && nd.witnessHeight == pblockindex->nHeight - 1
                         && GetSaplingSpendDepth(nd.nullifier.value()) <= WITNESS_CACHE_SIZE)
                         {
-                            nd.witnesses.push_front(nd.witnesses.front());
-                            if (nd.witnesses.size() > WITNESS_CACHE_SIZE)
+                            // Only the latest witness is kept; see RewindNoteWitness
+                            if (nd.witnesses.size() > 1)
                             {
-                                nd.witnesses.resize(WITNESS_CACHE_SIZE);
+                                nd.witnesses.resize(1);
                             }
 
-                            // for async append of commitments
                             vSaplingNoteData.push_back(&nd);
 
                             nd.witnessHeight = pblockindex->nHeight;
+                            wtx.MarkWitnessesDirty();
                         }
                     }
                 }
             }
 
-            // Parallelization with std::async
-            std::vector<std::future<SaplingWitness>> vSaplingWitnessFutures;
-            for (const auto& commitment : vSaplingCommitments)
-            {
-                for (auto pnd : vSaplingNoteData)
-                {
-                    vSaplingWitnessFutures.emplace_back(std::async(std::launch::async, AppendSingleSaplingCommitment, pnd->witnesses.front(), commitment));
-                }
-
-                assert(vSaplingWitnessFutures.size() == vSaplingNoteData.size());
-
-                for (int i = 0; i < vSaplingWitnessFutures.size(); i++)
-                {
-                    vSaplingNoteData.at(i)->witnesses.front() = vSaplingWitnessFutures.at(i).get();
-                }
-
-                vSaplingWitnessFutures.resize(0);
-            }
+            AppendBlockCommitments(saplingFrontier, vSaplingCommitments, vSaplingNoteData);
         }
 
         if (pblockindex == pindex)
@@ -2091,11 +2216,6 @@ void CWallet::BuildWitnessCache(const CBlockIndex* pindex, bool witnessOnly, con
         pblockindex = chainActive.Next(pblockindex);
     }
 
-    if (fBlockPrefetchEnabled)
-    {
-        ClearBlockPrefetch();
-    }
-
     if (uiShown)
     {
         uiInterface.ShowProgress(_("Witness Cache Complete..."), 100);
@@ -2270,6 +2390,9 @@ bool CWallet::UpdateNullifierNoteMap()
                             dec,
                             hSig,
                             item.first.n);
+                        if (item.second.nullifier) {
+                            wtxItem.second.MarkWitnessesDirty();
+                        }
                     }
                 }
             }
@@ -2343,7 +2466,10 @@ void CWallet::UpdateSproutNullifierNoteMapWithTx(CWalletTx& wtx) {
 
                 uint256 nullifier = optNullifier.value();
                 mapSproutNullifiersToNotes[nullifier] = item.first;
-                item.second.nullifier = nullifier;
+                if (item.second.nullifier != nullifier) {
+                    item.second.nullifier = nullifier;
+                    wtx.MarkWitnessesDirty();
+                }
             }
         }
     }
@@ -2366,6 +2492,7 @@ void CWallet::UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx)
             // If there are no witnesses, erase the nullifier and associated mapping.
             if (item.second.nullifier) {
                 mapSaplingNullifiersToNotes.erase(item.second.nullifier.value());
+                wtx.MarkWitnessesDirty();
             }
             item.second.nullifier = std::nullopt;
         }
@@ -2398,7 +2525,10 @@ void CWallet::UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx)
                 assert(optNullifier != std::nullopt);
                 uint256 nullifier = optNullifier.value();
                 mapSaplingNullifiersToNotes[nullifier] = op;
-                item.second.nullifier = nullifier;
+                if (item.second.nullifier != nullifier) {
+                    item.second.nullifier = nullifier;
+                    wtx.MarkWitnessesDirty();
+                }
             }
         }
     }
@@ -2428,11 +2558,13 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
     if (fFromLoadWallet)
     {
+        RemoveFromNoteIndex(hash);
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         UpdateNullifierNoteMapWithTx(mapWallet[hash]);
         AddToSpends(hash);
         AddToSifted(hash);
+        AddToNoteIndex(hash);
     }
     else
     {
@@ -2499,6 +2631,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         bool fUpdated = false;
         if (!fInsertedNew)
         {
+            RemoveFromNoteIndex(hash);
+
             // Merge
             if (!wtxIn.hashBlock.IsNull() && wtxIn.hashBlock != wtx.hashBlock)
             {
@@ -2533,6 +2667,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
                 return false;
         }
 
+        AddToNoteIndex(hash);
+
         // Break debit/credit balance caches:
         wtx.MarkDirty();
 
@@ -2586,7 +2722,11 @@ bool CWallet::UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx)
         wtx.mapSaplingNoteData = tmp;
     }
 
-    return !unchangedSproutFlag || !unchangedSaplingFlag;
+    if (!unchangedSproutFlag || !unchangedSaplingFlag) {
+        wtx.MarkNoteDataDirty();
+        return true;
+    }
+    return false;
 }
 
 /**
@@ -2622,7 +2762,13 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
         if (fExisted && !fUpdate) return false;
         auto sproutNoteData = FindMySproutNotes(tx);
         std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> saplingNoteDataAndAddressesToAdd;
-        saplingNoteDataAndAddressesToAdd = fAsyncNoteDecryption ? FindMySaplingNotesAsync(tx, nHeight) : FindMySaplingNotes(tx, nHeight);
+        if (pblock && (fAsyncNoteDecryption || pblock->GetHash() == hashSaplingDecryptedBlock)) {
+            saplingNoteDataAndAddressesToAdd = FindMySaplingNotesInBlock(tx, *pblock, nHeight);
+        } else if (fAsyncNoteDecryption) {
+            saplingNoteDataAndAddressesToAdd = FindMySaplingNotesAsync(tx, nHeight);
+        } else {
+            saplingNoteDataAndAddressesToAdd = FindMySaplingNotes(tx, nHeight);
+        }
         auto saplingNoteData = saplingNoteDataAndAddressesToAdd.first;
         auto addressesToAdd = saplingNoteDataAndAddressesToAdd.second;
         for (const auto &addressToAdd : addressesToAdd) {
@@ -2707,6 +2853,7 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
+        RemoveFromNoteIndex(hash);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -2867,29 +3014,52 @@ std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySap
     return std::make_pair(noteData, viewingKeysToAdd);
 }
 
-static std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> DecryptSaplingNoteWorker(const Consensus::Params &consensus_params, const SaplingIncomingViewingKey &ivk, const OutputDescription &outdesc, const int &height, const uint256 &hash, const uint32_t &i)
+/**
+ * Closure representing one Sapling output to be trial-decrypted with every
+ * incoming viewing key of the wallet. The first key that decrypts the output
+ * is recorded in the result slot.
+ */
+class CSaplingTrialDecryptCheck
 {
-    mapSaplingNoteData_t noteData;
-    SaplingIncomingViewingKeyMap viewingKeysToAdd;
-
-    auto result = SaplingNotePlaintext::decrypt(consensus_params, height, outdesc.encCiphertext, ivk, outdesc.ephemeralKey, outdesc.cmu);
-    if (result)
-    {
-        // We don't cache the nullifier here as computing it requires knowledge of the note position
-        // in the commitment tree, which can only be determined when the transaction has been mined.
-        SaplingOutPoint op {hash, i};
-        SaplingNoteData nd;
-        nd.ivk = ivk;
-        noteData.insert(std::make_pair(op, nd));
+private:
+    const Consensus::Params* pconsensus;
+    int height;
+    const OutputDescription* poutput;
+    const std::vector<SaplingIncomingViewingKey>* pivks;
+    std::optional<std::pair<SaplingIncomingViewingKey, std::optional<SaplingPaymentAddress>>>* presult;
 
-        auto address = ivk.address(result.value().d);
-        if (address)
-        {
-            viewingKeysToAdd.insert(make_pair(address.value(), ivk));
+public:
+    CSaplingTrialDecryptCheck(): pconsensus(NULL), height(0), poutput(NULL), pivks(NULL), presult(NULL) {}
+    CSaplingTrialDecryptCheck(const Consensus::Params& consensusIn, int heightIn, const OutputDescription& outputIn,
+                              const std::vector<SaplingIncomingViewingKey>& ivksIn,
+                              std::optional<std::pair<SaplingIncomingViewingKey, std::optional<SaplingPaymentAddress>>>& resultIn) :
+        pconsensus(&consensusIn), height(heightIn), poutput(&outputIn), pivks(&ivksIn), presult(&resultIn) {}
+
+    bool operator()() {
+        for (const SaplingIncomingViewingKey& ivk : *pivks) {
+            auto result = SaplingNotePlaintext::decrypt(*pconsensus, height, poutput->encCiphertext, ivk, poutput->ephemeralKey, poutput->cmu);
+            if (result) {
+                *presult = std::make_pair(ivk, ivk.address(result.value().d));
+                break;
+            }
         }
+        return true;
     }
 
-    return std::make_pair(noteData, viewingKeysToAdd);
+    void swap(CSaplingTrialDecryptCheck& check) {
+        std::swap(pconsensus, check.pconsensus);
+        std::swap(height, check.height);
+        std::swap(poutput, check.poutput);
+        std::swap(pivks, check.pivks);
+        std::swap(presult, check.presult);
+    }
+};
+
+static CCheckQueue<CSaplingTrialDecryptCheck> saplingdecryptqueue(16);
+
+void ThreadSaplingTrialDecryption() {
+    RenameThread(strprintf("%s-decrypt", COIN_NICKNAME).c_str());
+    saplingdecryptqueue.Thread();
 }
 
 /**
@@ -2902,66 +3072,156 @@ static std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> DecryptSapl
  */
 std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotesAsync(const CTransaction &tx, int height) const
 {
-    mapSaplingNoteData_t noteData;
-    SaplingIncomingViewingKeyMap viewingKeysToAdd;
+    return FindMySaplingNotesBatch({&tx}, height)[0];
+}
+
+/**
+ * Trial-decrypts the Sapling outputs of several transactions at once on the
+ * -walletdecryptthreads pool, and returns the FindMySaplingNotes result for
+ * each transaction, in the same order as vtx.
+ */
+std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> CWallet::FindMySaplingNotesBatch(const std::vector<const CTransaction*>& vtx, int height) const
+{
+    std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> vResults(vtx.size());
+
+    size_t nOutputs = 0;
+    for (const CTransaction* ptx : vtx) {
+        nOutputs += ptx->vShieldedOutput.size();
+    }
+    if (nOutputs == 0) {
+        return vResults;
+    }
 
-    if (tx.vShieldedOutput.empty())
+    // Try the keys we hold full viewing keys for first, as FindMySaplingNotes does.
+    // cs_KeyStore is not held while decrypting, so that the wallet stays usable
+    // while a rescan decrypts blocks in the background.
+    std::vector<SaplingIncomingViewingKey> vIvks;
     {
-        return std::make_pair(noteData, viewingKeysToAdd);
+        LOCK(cs_KeyStore);
+        for (const auto& [ivk, fvk] : mapSaplingFullViewingKeys) {
+            vIvks.push_back(ivk);
+        }
+        for (const auto& [address, ivk] : mapSaplingIncomingViewingKeys) {
+            if (mapSaplingFullViewingKeys.count(ivk) == 0 && std::find(vIvks.begin(), vIvks.end(), ivk) == vIvks.end()) {
+                vIvks.push_back(ivk);
+            }
+        }
+    }
+    if (vIvks.empty()) {
+        return vResults;
     }
 
-    LOCK(cs_KeyStore);
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    std::vector<std::optional<std::pair<SaplingIncomingViewingKey, std::optional<SaplingPaymentAddress>>>> vDecrypted(nOutputs);
+    std::vector<CSaplingTrialDecryptCheck> vChecks;
+    vChecks.reserve(nOutputs);
 
-    std::set<SaplingIncomingViewingKey> setSaplingIvkToTest;
+    // Protocol Spec: 4.19 Block Chain Scanning (Sapling)
+    size_t nSlot = 0;
+    for (const CTransaction* ptx : vtx) {
+        for (const OutputDescription& output : ptx->vShieldedOutput) {
+            vChecks.emplace_back(consensusParams, height, output, vIvks, vDecrypted[nSlot++]);
+        }
+    }
 
-    for (const auto& [ivk, fvk] : mapSaplingFullViewingKeys)
-    {
-        setSaplingIvkToTest.insert(ivk);
+    if (fAsyncNoteDecryption && nWalletDecryptThreads > 1 && nOutputs > 1) {
+        CCheckQueueControl<CSaplingTrialDecryptCheck> control(&saplingdecryptqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        for (CSaplingTrialDecryptCheck& check : vChecks) {
+            check();
+        }
     }
 
-    for (const auto& [address, ivk] : mapSaplingIncomingViewingKeys)
-    {
-        setSaplingIvkToTest.insert(ivk);
+    LOCK(cs_KeyStore);
+    nSlot = 0;
+    for (size_t n = 0; n < vtx.size(); n++) {
+        uint256 hash = vtx[n]->GetHash();
+        for (uint32_t i = 0; i < vtx[n]->vShieldedOutput.size(); ++i) {
+            const auto& decrypted = vDecrypted[nSlot++];
+            if (!decrypted) {
+                continue;
+            }
+            const auto& [ivk, address] = decrypted.value();
+
+            // We don't cache the nullifier here as computing it requires knowledge of the note position
+            // in the commitment tree, which can only be determined when the transaction has been mined.
+            SaplingOutPoint op {hash, i};
+            SaplingNoteData nd;
+            nd.ivk = ivk;
+            vResults[n].first.insert(std::make_pair(op, nd));
+
+            if (address && mapSaplingIncomingViewingKeys.count(address.value()) == 0) {
+                vResults[n].second[address.value()] = ivk;
+            }
+        }
     }
 
-    if (setSaplingIvkToTest.empty())
-    {
-        return std::make_pair(noteData, viewingKeysToAdd);
+    return vResults;
+}
+
+/**
+ * Trial-decrypts the Sapling outputs of all the transactions of a block in a
+ * single batch. Transactions dropped by the antispam filter are skipped.
+ */
+SaplingBlockNotes CWallet::FindMySaplingNotesForBlock(const CBlock& block, int height) const
+{
+    std::vector<const CTransaction*> vtx;
+    for (const CTransaction& tx : block.vtx) {
+        if (fIgnoreSpam && tx.vShieldedOutput.size() >= nSpamOutputsMin) {
+            continue;
+        }
+        vtx.push_back(&tx);
     }
 
-    std::vector<std::future<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>>> vDecryptFutures;
-    const Consensus::Params consensus_params = Params().GetConsensus();
-    uint256 hash = tx.GetHash();
+    auto vResults = FindMySaplingNotesBatch(vtx, height);
 
-    // Protocol Spec: 4.19 Block Chain Scanning (Sapling)
-    for (uint32_t i = 0; i < tx.vShieldedOutput.size(); ++i)
-    {
-        const OutputDescription output = tx.vShieldedOutput[i];
-        for (SaplingIncomingViewingKey ivk : setSaplingIvkToTest)
-        {
-            vDecryptFutures.emplace_back(std::async(std::launch::async, DecryptSaplingNoteWorker, consensus_params, ivk, output, height, hash, i));
+    SaplingBlockNotes mapBlockNotes;
+    for (size_t n = 0; n < vtx.size(); n++) {
+        if (!vResults[n].first.empty()) {
+            mapBlockNotes.emplace(vtx[n]->GetHash(), std::move(vResults[n]));
         }
     }
+    return mapBlockNotes;
+}
 
-    for (auto &fut : vDecryptFutures)
-    {
-        auto result_pair = fut.get();
-        if (!result_pair.first.empty())
-        {
-            noteData.insert(result_pair.first.begin(), result_pair.first.end());
+/**
+ * Returns the FindMySaplingNotes result for a transaction of the given block,
+ * trial-decrypting all the transactions of the block in a single batch the
+ * first time one of them is looked up.
+ */
+std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotesInBlock(const CTransaction& tx, const CBlock& block, int height)
+{
+    AssertLockHeld(cs_wallet);
 
-            for (auto [address, ivk] : result_pair.second)
-            {
-                if (mapSaplingIncomingViewingKeys.count(address) == 0)
-                {
-                    viewingKeysToAdd[address] = ivk;
-                }
-            }
+    // Spam transactions are left out of the batch
+    if (fIgnoreSpam && tx.vShieldedOutput.size() >= nSpamOutputsMin) {
+        return FindMySaplingNotesAsync(tx, height);
+    }
 
-        }
+    uint256 hashBlock = block.GetHash();
+    if (hashBlock != hashSaplingDecryptedBlock) {
+        mapSaplingDecryptedBlock = FindMySaplingNotesForBlock(block, height);
+        hashSaplingDecryptedBlock = hashBlock;
     }
 
-    return std::make_pair(noteData, viewingKeysToAdd);
+    auto it = mapSaplingDecryptedBlock.find(tx.GetHash());
+    if (it == mapSaplingDecryptedBlock.end()) {
+        return std::make_pair(mapSaplingNoteData_t(), SaplingIncomingViewingKeyMap());
+    }
+
+    // Drop addresses that were added to the wallet by an earlier transaction of this block
+    auto result = it->second;
+    LOCK(cs_KeyStore);
+    for (auto addrIt = result.second.begin(); addrIt != result.second.end(); ) {
+        if (mapSaplingIncomingViewingKeys.count(addrIt->first) != 0) {
+            addrIt = result.second.erase(addrIt);
+        } else {
+            ++addrIt;
+        }
+    }
+    return result;
 }
 
 bool CWallet::IsSproutNullifierFromMe(const uint256& nullifier) const
@@ -3286,6 +3546,7 @@ void CWalletTx::SetSproutNoteData(mapSproutNoteData_t &noteData)
             throw std::logic_error("CWalletTx::SetSproutNoteData(): Invalid note");
         }
     }
+    MarkNoteDataDirty();
 }
 
 void CWalletTx::SetSaplingNoteData(mapSaplingNoteData_t &noteData)
@@ -3298,6 +3559,23 @@ void CWalletTx::SetSaplingNoteData(mapSaplingNoteData_t &noteData)
             throw std::logic_error("CWalletTx::SetSaplingNoteData(): Invalid note");
         }
     }
+    MarkNoteDataDirty();
+}
+
+CWalletTxWitnesses::CWalletTxWitnesses(const CWalletTx& wtx)
+{
+    for (const auto& [op, nd] : wtx.mapSproutNoteData) {
+        NoteState<SproutWitness>& state = mapSprout[op];
+        state.nullifier = nd.nullifier;
+        state.witnesses = nd.witnesses;
+        state.witnessHeight = nd.witnessHeight;
+    }
+    for (const auto& [op, nd] : wtx.mapSaplingNoteData) {
+        NoteState<SaplingWitness>& state = mapSapling[op];
+        state.nullifier = nd.nullifier;
+        state.witnesses = nd.witnesses;
+        state.witnessHeight = nd.witnessHeight;
+    }
 }
 
 std::pair<SproutNotePlaintext, SproutPaymentAddress> CWalletTx::DecryptSproutNote(
@@ -3834,6 +4112,7 @@ unsigned int CWallet::DeleteTransactions(std::vector<uint256> &removeTxs, std::v
         auto itmw = mapWallet.find(txid_to_delete);
         assert (itmw != mapWallet.end());
         bool fRemoveFromSpends = !(itmw->second.IsCoinBase());
+        RemoveFromNoteIndex(txid_to_delete);
         if (mapWallet.erase(txid_to_delete))
         {
             if (fRemoveFromSpends)
@@ -3863,6 +4142,7 @@ unsigned int CWallet::DeleteTransactions(std::vector<uint256> &removeTxs, std::v
     // Old enough, with all outputs spent
     for (const uint256& txid_to_delete : removeTxs)
     {
+        RemoveFromNoteIndex(txid_to_delete);
         if (mapWallet.erase(txid_to_delete))
         {
             RemoveFromSifted(txid_to_delete);
@@ -4198,13 +4478,272 @@ void CWallet::DeleteWalletTransactions(const CBlockIndex* pindex)
     }
 }
 
+/** A block handed between the stages of the wallet rescan pipeline. */
+struct CRescanBlock
+{
+    CBlockIndex* pindex = NULL;
+    //! The block read from disk, or null if it could not be read without cs_main
+    std::shared_ptr<const CBlock> pblock;
+    bool fDecrypted = false;
+    //! Value of CWallet::GetSaplingKeyGeneration() mapSaplingNotes was computed for
+    uint64_t nKeyGeneration = 0;
+    SaplingBlockNotes mapSaplingNotes;
+};
+
+/** Bounded queue connecting two stages of the wallet rescan pipeline. */
+class CRescanQueue
+{
+private:
+    std::mutex mutex;
+    std::condition_variable condNotFull;
+    std::condition_variable condNotEmpty;
+    std::deque<CRescanBlock> queue;
+    const size_t nMaxSize;
+    //! The producer will not add any more blocks
+    bool fFinished = false;
+    //! The consumer will not take any more blocks
+    bool fAborted = false;
+
+public:
+    explicit CRescanQueue(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn) {}
+
+    //! Waits for room in the queue. Returns false if the consumer went away.
+    bool Push(CRescanBlock&& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condNotFull.wait(lock, [this] { return fAborted || queue.size() < nMaxSize; });
+        if (fAborted) {
+            return false;
+        }
+        queue.push_back(std::move(item));
+        condNotEmpty.notify_one();
+        return true;
+    }
+
+    //! Takes the next block, waiting for one if fWait is set. Returns false
+    //! if no block is available and (unless fWait is false) none will come.
+    bool Pop(CRescanBlock& item, bool fWait)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (fWait) {
+            condNotEmpty.wait(lock, [this] { return fFinished || fAborted || !queue.empty(); });
+        }
+        if (fAborted || queue.empty()) {
+            return false;
+        }
+        item = std::move(queue.front());
+        queue.pop_front();
+        condNotFull.notify_one();
+        return true;
+    }
+
+    void Finish()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fFinished = true;
+        condNotEmpty.notify_all();
+    }
+
+    void Abort()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fAborted = true;
+        queue.clear();
+        condNotFull.notify_all();
+        condNotEmpty.notify_all();
+    }
+};
+
+/**
+ * The first two stages of a wallet rescan, each running on its own thread:
+ * a reader that loads blocks from disk, and a decryptor that trial-decrypts
+ * the Sapling outputs of each block. The final stage, applying the blocks to
+ * the wallet, is done by the caller of Next().
+ *
+ * The blocks to read are a snapshot of the active chain taken by Extend(),
+ * which the caller runs in its own short cs_main windows, so that neither
+ * worker thread ever needs cs_main.
+ */
+class CRescanPipeline
+{
+private:
+    const CWallet* pwallet;
+
+    std::mutex mutexSnapshot;
+    std::condition_variable condSnapshot;
+    //! Blocks of the active chain the reader has not read yet
+    std::deque<std::pair<CBlockIndex*, CDiskBlockPos>> snapshot;
+    //! The snapshot has reached the tip and will not be extended again
+    bool fSnapshotComplete = false;
+    bool fAborted = false;
+    //! Last block added to the snapshot
+    CBlockIndex* pindexLastSnapshot = NULL;
+    //! Reads the snapshot ahead of the reader when -blockprefetch is enabled
+    std::unique_ptr<CBlockPrefetcher> prefetcher;
+
+    CRescanQueue queueRead;
+    CRescanQueue queueDecrypted;
+    std::thread threadRead;
+    std::thread threadDecrypt;
+
+    void ReadBlocks()
+    {
+        const Consensus::Params& consensusParams = Params().GetConsensus();
+
+        while (true) {
+            std::pair<CBlockIndex*, CDiskBlockPos> next;
+            {
+                std::unique_lock<std::mutex> lock(mutexSnapshot);
+                condSnapshot.wait(lock, [this] { return fAborted || fSnapshotComplete || !snapshot.empty(); });
+                if (fAborted || snapshot.empty()) {
+                    return;
+                }
+                next = snapshot.front();
+                snapshot.pop_front();
+            }
+
+            CRescanBlock item;
+            item.pindex = next.first;
+            if (prefetcher) {
+                item.pblock = prefetcher->Get(item.pindex);
+            } else {
+                auto pblock = std::make_shared<CBlock>();
+                if (ReadBlockFromDisk(*pblock, next.second, consensusParams) && pblock->GetHash() == item.pindex->GetBlockHash()) {
+                    item.pblock = pblock;
+                }
+            }
+            if (!queueRead.Push(std::move(item))) {
+                return;
+            }
+        }
+    }
+
+    void DecryptBlocks()
+    {
+        CRescanBlock item;
+        while (queueRead.Pop(item, true)) {
+            if (item.pblock) {
+                item.nKeyGeneration = pwallet->GetSaplingKeyGeneration();
+                item.mapSaplingNotes = pwallet->FindMySaplingNotesForBlock(*item.pblock, item.pindex->nHeight);
+                item.fDecrypted = true;
+            }
+            if (!queueDecrypted.Push(std::move(item))) {
+                queueRead.Abort();
+                return;
+            }
+        }
+    }
+
+    template <typename Callable>
+    static void RunStage(const char* name, Callable func, CRescanQueue& queueOut)
+    {
+        RenameThread(strprintf("%s-%s", COIN_NICKNAME, name).c_str());
+        try {
+            func();
+        } catch (const std::exception& e) {
+            PrintExceptionContinue(&e, name);
+        } catch (...) {
+            PrintExceptionContinue(NULL, name);
+        }
+        queueOut.Finish();
+    }
+
+public:
+    CRescanPipeline(const CWallet* pwalletIn) :
+        pwallet(pwalletIn), prefetcher(MakeBlockPrefetcher(Params().GetConsensus())),
+        queueRead(RESCAN_QUEUE_BLOCKS), queueDecrypted(RESCAN_QUEUE_BLOCKS)
+    {
+        threadRead = std::thread([this] { RunStage("rescanrd", [this] { ReadBlocks(); }, queueRead); });
+        threadDecrypt = std::thread([this] { RunStage("rescandec", [this] { DecryptBlocks(); }, queueDecrypted); });
+    }
+
+    ~CRescanPipeline()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutexSnapshot);
+            fAborted = true;
+            condSnapshot.notify_all();
+        }
+        queueRead.Abort();
+        queueDecrypted.Abort();
+        threadRead.join();
+        threadDecrypt.join();
+    }
+
+    /**
+     * Tops the snapshot of blocks to read back up to RESCAN_SNAPSHOT_BLOCKS,
+     * starting at pindexStart the first time. If the blocks taken so far
+     * have been reorganized out of the active chain, the unread ones are
+     * dropped and the snapshot resumes at the fork point; Next() still
+     * returns the stale blocks that were already read, which the caller
+     * has to skip.
+     */
+    void Extend(CBlockIndex* pindexStart)
+    {
+        AssertLockHeld(cs_main);
+
+        std::lock_guard<std::mutex> lock(mutexSnapshot);
+        if (fSnapshotComplete) {
+            return;
+        }
+
+        CBlockIndex* pindex = pindexStart;
+        if (pindexLastSnapshot) {
+            if (chainActive.Contains(pindexLastSnapshot)) {
+                pindex = chainActive.Next(pindexLastSnapshot);
+            } else {
+                const CBlockIndex* pfork = chainActive.FindFork(pindexLastSnapshot);
+                LogPrintf("ScanForWalletTransactions(): Reorganization below height %i, resuming at height %i\n",
+                          pindexLastSnapshot->nHeight, pfork ? pfork->nHeight + 1 : 0);
+                snapshot.clear();
+                if (prefetcher) {
+                    prefetcher->Clear();
+                }
+                pindex = pfork ? chainActive.Next(pfork) : chainActive.Genesis();
+            }
+        }
+
+        if (!pindex) {
+            fSnapshotComplete = true;
+        }
+        while (pindex && snapshot.size() < RESCAN_SNAPSHOT_BLOCKS) {
+            snapshot.emplace_back(pindex, pindex->GetBlockPos());
+            if (prefetcher) {
+                prefetcher->Schedule(pindex);
+            }
+            pindexLastSnapshot = pindex;
+            pindex = chainActive.Next(pindex);
+        }
+        condSnapshot.notify_all();
+    }
+
+    /**
+     * Takes the next block, waiting for one if fWait is set. Callers must
+     * run Extend() before waiting, or the reader may run out of blocks.
+     */
+    bool Next(CRescanBlock& item, bool fWait)
+    {
+        return queueDecrypted.Pop(item, fWait);
+    }
+};
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read and trial-decrypted ahead of time by a CRescanPipeline,
+ * and applied to the wallet in windows of RESCAN_LOCK_WINDOW_MS, so that
+ * cs_main and cs_wallet are not held for the whole scan when the caller
+ * does not hold them. The witnesses and the best chain locator are only
+ * updated once the scan is done, so that they never fall behind what
+ * ChainTip applied in between windows. The caller must have reserved the
+ * wallet with `reserver`, so that concurrent rescans do not interleave.
  */
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, bool fIgnoreBirthday)
+int CWallet::ScanForWalletTransactions(const WalletRescanReserver& reserver, CBlockIndex* pindexStart, bool fUpdate, bool fIgnoreBirthday)
 {
+    assert(reserver.isReserved());
+
     int ret = 0;
     int64_t nNow = GetTime();
     int64_t nRescanStart = nNow;
@@ -4212,6 +4751,7 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, b
     const Consensus::Params &consensus_params = Params().GetConsensus();
     CBlockIndex* pindex = pindexStart;
     int64_t nRealBirthday = 0;
+    int nStartHeight = 0;
 
     std::set<uint256> txList;
     std::set<uint256> txListOriginal;
@@ -4219,6 +4759,7 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, b
     {
         LOCK(cs_rescan);
         dRescanProgress = 0.0;
+        nRescanSecondsLeft = std::nullopt;
     }
 
     {
@@ -4241,91 +4782,116 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, b
             pindex = chainActive.Next(pindex);
         }
 
-        int tip_height = chainActive.Tip()->nHeight;
         ShowProgress(_("Rescanning..."), 0);
 
         if (pindex)
         {
+            nStartHeight = pindex->nHeight;
             LogPrintf("ScanForWalletTransactions(): Actual scanning started at height %i\n", pindex->nHeight);
         }
+    }
 
-        SproutMerkleTree sproutTree;
-        SaplingMerkleTree saplingTree;
+    if (pindex)
+    {
+        CBlockIndex* pindexFirst = pindex;
+        CRescanPipeline pipeline(this);
+        CRescanBlock item;
 
-        while (pindex)
+        while (!ShutdownRequested())
         {
-            if (GetTimeMillis() - nStartUI >= 2000 && tip_height >= pindex->nHeight)
+            if (!pipeline.Next(item, false))
             {
-                LOCK(cs_rescan);
-
-                dRescanProgress = (float)pindex->nHeight * 100 / tip_height;
-                ShowProgress(_("Rescanning..."), (int)(dRescanProgress.value()));
-                uiInterface.ShowProgress(_("Rescanning..."), (int)(dRescanProgress.value()));
-                uiInterface.InitMessage(_("Rescanning...") + strprintf(" [%.2f %%]", dRescanProgress.value()).c_str());
-                nStartUI = GetTimeMillis();
+                {
+                    LOCK(cs_main);
+                    pipeline.Extend(pindexFirst);
+                }
+                if (!pipeline.Next(item, true))
+                    break;
             }
 
-            CBlock block;
-            bool blockInvolvesMe = false;
-
-            if (fBlockPrefetchEnabled)
-            {
-                ReadBlockFromPrefetch(block, pindex, consensus_params);
-            }
-            else
-            {
-                ReadBlockFromDisk(block, pindex, consensus_params);
-            }
+            LOCK2(cs_main, cs_wallet);
+            pipeline.Extend(pindexFirst);
+            int64_t nWindowStart = GetTimeMillis();
+            int tip_height = chainActive.Height();
+
+            do {
+                // Blocks that were reorganized out of the active chain since
+                // they were read are skipped; the reader resumes at the fork.
+                if (!chainActive.Contains(item.pindex)) {
+                    continue;
+                }
+                pindex = item.pindex;
 
-            for (const CTransaction& tx : block.vtx)
-            {
-                uint256 txid = tx.GetHash();
+                CBlock blockOnDisk;
+                const CBlock* pblock = item.pblock.get();
+                if (!pblock) {
+                    ReadBlockFromDisk(blockOnDisk, pindex, consensus_params);
+                    pblock = &blockOnDisk;
+                }
 
-                if (fIgnoreExTx && (setExWallet.find(txid) != setExWallet.end()))
-                {
-                    LogPrint("deletetx", "Transaction %s rescan skipped, tagged as ex (previously deleted)\n", txid.ToString());
-                    continue;
+                if (item.fDecrypted && item.nKeyGeneration == nSaplingKeyGeneration) {
+                    hashSaplingDecryptedBlock = pindex->GetBlockHash();
+                    mapSaplingDecryptedBlock = std::move(item.mapSaplingNotes);
                 }
 
-                if (AddToWalletIfInvolvingMe(tx, &block, pindex->nHeight, fUpdate))
+                for (const CTransaction& tx : pblock->vtx)
                 {
-                    blockInvolvesMe = true;
-                    txList.insert(txid);
-                    ret++;
-                    if (GetBoolArg("-rescan", false) && !nRealBirthday)
+                    uint256 txid = tx.GetHash();
+
+                    if (fIgnoreExTx && (setExWallet.find(txid) != setExWallet.end()))
                     {
-                        nRealBirthday = pindex->GetBlockTime();
-                        LogPrintf("ScanForWalletTransactions(): The first significant wtx appeared at height %i. Appropriate \"wallet birthday\" would be %u\n", pindex->nHeight, nRealBirthday);
+                        LogPrint("deletetx", "Transaction %s rescan skipped, tagged as ex (previously deleted)\n", txid.ToString());
+                        continue;
+                    }
+
+                    if (AddToWalletIfInvolvingMe(tx, pblock, pindex->nHeight, fUpdate))
+                    {
+                        txList.insert(txid);
+                        ret++;
+                        if (GetBoolArg("-rescan", false) && !nRealBirthday)
+                        {
+                            nRealBirthday = pindex->GetBlockTime();
+                            LogPrintf("ScanForWalletTransactions(): The first significant wtx appeared at height %i. Appropriate \"wallet birthday\" would be %u\n", pindex->nHeight, nRealBirthday);
+                        }
                     }
                 }
-            }
 
-            // Build inital witness caches
-            if (blockInvolvesMe)
-                BuildWitnessCache(pindex, true, &block);
+                //Delete Transactions
+                if (fTxDeleteEnabled && (pindex->nHeight % nDeleteInterval == 0))
+                    DeleteWalletTransactions(pindex);
+            } while (GetTimeMillis() - nWindowStart < RESCAN_LOCK_WINDOW_MS && pipeline.Next(item, false));
 
-            // Check SetBestChain trigger 
-            ChainTipAdded(pindex, &block, sproutTree, saplingTree);
+            if (GetTimeMillis() - nStartUI >= 2000 && tip_height >= pindex->nHeight)
+            {
+                LOCK(cs_rescan);
 
-            //Delete Transactions
-            if (fTxDeleteEnabled && (pindex->nHeight % nDeleteInterval == 0))
-                DeleteWalletTransactions(pindex);
+                dRescanProgress = (float)pindex->nHeight * 100 / tip_height;
+                int nDone = std::max(1, pindex->nHeight - nStartHeight + 1);
+                nRescanSecondsLeft = (GetTime() - nRescanStart) * (tip_height - pindex->nHeight) / nDone;
+                ShowProgress(_("Rescanning..."), (int)(dRescanProgress.value()));
+                uiInterface.ShowProgress(_("Rescanning..."), (int)(dRescanProgress.value()));
+                uiInterface.InitMessage(_("Rescanning...") + strprintf(" [%.2f %%]", dRescanProgress.value()).c_str());
+                nStartUI = GetTimeMillis();
+            }
 
-            pindex = chainActive.Next(pindex);
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%.2f [ %i wallet transactions ]\n", pindex->nHeight, (double)pindex->nHeight / tip_height, mapWallet.size());
             }
         }
+    }
 
-        if (fBlockPrefetchEnabled)
-        {
-            ClearBlockPrefetch();
-        }
+    {
+        LOCK2(cs_main, cs_wallet);
 
+        // The witnesses and the best chain locator are only brought up to
+        // date here, at the tip, as ChainTip may have moved them past the
+        // blocks scanned above while the locks were released.
         int64_t nBwcStart = GetTime();
         //Update all witness caches
         BuildWitnessCache(chainActive.Tip(), false, nullptr);
+        if (!ShutdownRequested())
+            SetBestChain(chainActive.GetLocator());
         int64_t nBwcFinish = GetTime();
 
         LogPrintf("Wallet rescan report: rescanning: %u sec, witness cache building: %u sec, total: %u sec\n", nBwcStart - nRescanStart, nBwcFinish - nBwcStart, nBwcFinish - nRescanStart);
@@ -4334,6 +4900,7 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, b
         {
             LOCK(cs_rescan);
             dRescanProgress = std::nullopt;
+            nRescanSecondsLeft = std::nullopt;
         }
     }
 
@@ -6321,6 +6888,40 @@ bool CWallet::LoadDestData(const CTxDestination &dest, const std::string &key, c
     return true;
 }
 
+template<typename NoteDataMap, typename NoteStateMap, typename NullifierMap>
+static void LoadNoteStates(NoteDataMap& noteDataMap, const NoteStateMap& noteStates, NullifierMap& nullifiersToNotes)
+{
+    for (const auto& [op, state] : noteStates) {
+        auto it = noteDataMap.find(op);
+        if (it == noteDataMap.end()) {
+            continue;
+        }
+        auto& nd = it->second;
+        if (nd.nullifier) {
+            nullifiersToNotes.erase(nd.nullifier.value());
+        }
+        nd.nullifier = state.nullifier;
+        if (nd.nullifier) {
+            nullifiersToNotes[nd.nullifier.value()] = op;
+        }
+        nd.witnesses = state.witnesses;
+        nd.witnessHeight = state.witnessHeight;
+        nd.witnessRootValidated = false;
+    }
+}
+
+bool CWallet::LoadTxWitnesses(const uint256& hash, const CWalletTxWitnesses& witnesses)
+{
+    LOCK(cs_wallet);
+    auto it = mapWallet.find(hash);
+    if (it == mapWallet.end()) {
+        return false;
+    }
+    LoadNoteStates(it->second.mapSproutNoteData, witnesses.mapSprout, mapSproutNullifiersToNotes);
+    LoadNoteStates(it->second.mapSaplingNoteData, witnesses.mapSapling, mapSaplingNullifiersToNotes);
+    return true;
+}
+
 bool CWallet::GetDestData(const CTxDestination &dest, const std::string &key, std::string *value) const
 {
     std::map<CTxDestination, CAddressBookData>::const_iterator i = mapAddressBook.find(dest);
@@ -6367,6 +6968,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-txexpirydelta", strprintf(_("Set the number of blocks after which a transaction that has not been mined will become invalid (min: %u, default: %u )"), TX_EXPIRING_SOON_THRESHOLD + 1, DEFAULT_TX_EXPIRY_DELTA));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format on startup"));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file absolute path or a path relative to the data directory") + " " + strprintf(_("(default: %s)"), DEFAULT_WALLET_DAT));
+    strUsage += HelpMessageOpt("-walletdecryptthreads=<n>", strprintf(_("Set the number of threads used to trial-decrypt Sapling outputs when -asyncnotedecryption is enabled (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), 1, MAX_WALLET_DECRYPT_THREADS, DEFAULT_WALLET_DECRYPT_THREADS));
     strUsage += HelpMessageOpt("-walletbroadcast", _("Make the wallet broadcast transactions") + " " + strprintf(_("(default: %u)"), DEFAULT_WALLETBROADCAST));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
     strUsage += HelpMessageOpt("-zapwallettxes=<mode>", _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") +
@@ -6552,7 +7154,13 @@ bool CWallet::InitLoadWallet(bool clearWitnessCaches)
         uiInterface.InitMessage(_("Rescanning..."));
         LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
         nStart = GetTimeMillis();
-        walletInstance->ScanForWalletTransactions(pindexRescan, true);
+        {
+            WalletRescanReserver reserver(walletInstance);
+            if (!reserver.reserve()) {
+                return UIError(_("Failed to rescan the wallet during initialization"));
+            }
+            walletInstance->ScanForWalletTransactions(reserver, pindexRescan, true);
+        }
         LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
         walletInstance->SetBestChain(chainActive.GetLocator());
         CWalletDB::IncrementUpdateCounter();
@@ -6638,6 +7246,15 @@ bool CWallet::ParameterInteraction()
     bSpendZeroConfChange = GetBoolArg("-spendzeroconfchange", DEFAULT_SPEND_ZEROCONF_CHANGE);
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", DEFAULT_SEND_FREE_TRANSACTIONS);
 
+    // -walletdecryptthreads=0 means autodetect, but nWalletDecryptThreads==0 means no concurrency
+    nWalletDecryptThreads = GetArg("-walletdecryptthreads", DEFAULT_WALLET_DECRYPT_THREADS);
+    if (nWalletDecryptThreads <= 0)
+        nWalletDecryptThreads += GetNumCores();
+    if (nWalletDecryptThreads <= 1)
+        nWalletDecryptThreads = 0;
+    else if (nWalletDecryptThreads > MAX_WALLET_DECRYPT_THREADS)
+        nWalletDecryptThreads = MAX_WALLET_DECRYPT_THREADS;
+
     KeyIO keyIO(Params());
     // Check Sapling migration address if set and is a valid Sapling address
     if (mapArgs.count("-migrationdestaddress")) {
@@ -6779,120 +7396,173 @@ void CWallet::GetFilteredNotes(
 {
     LOCK2(cs_main, cs_wallet);
 
+    // Look up the candidate notes in the note index. Sorting them visits
+    // them in the same order as walking mapWallet would.
+    std::vector<JSOutPoint> sproutNotes;
+    std::vector<std::pair<SaplingOutPoint, std::optional<SaplingPaymentAddress>*>> saplingNotes;
+    auto addSaplingNotes = [&](std::map<SaplingOutPoint, std::optional<SaplingPaymentAddress>>& notes) {
+        for (auto& entry : notes)
+            saplingNotes.emplace_back(entry.first, &entry.second);
+    };
+    std::set<SaplingPaymentAddress> saplingFilter;
+    bool fAllSapling = filterAddresses.empty();
+    if (filterAddresses.empty()) {
+        for (const auto& entry : mapSproutNotesByAddress)
+            sproutNotes.insert(sproutNotes.end(), entry.second.begin(), entry.second.end());
+    }
+    for (const auto& addr : filterAddresses) {
+        if (auto sproutAddr = std::get_if<SproutPaymentAddress>(&addr)) {
+            auto it = mapSproutNotesByAddress.find(*sproutAddr);
+            if (it != mapSproutNotesByAddress.end())
+                sproutNotes.insert(sproutNotes.end(), it->second.begin(), it->second.end());
+        } else if (auto saplingAddr = std::get_if<SaplingPaymentAddress>(&addr)) {
+            saplingFilter.insert(*saplingAddr);
+            SaplingIncomingViewingKey ivk;
+            if (!GetSaplingIncomingViewingKey(*saplingAddr, ivk)) {
+                // The notes of an address we do not know the ivk of can
+                // only be found by checking all of them
+                fAllSapling = true;
+                continue;
+            }
+            auto it = mapSaplingNotesByIvk.find(ivk);
+            if (it != mapSaplingNotesByIvk.end())
+                addSaplingNotes(it->second);
+        }
+    }
+    if (fAllSapling) {
+        saplingNotes.clear();
+        for (auto& entry : mapSaplingNotesByIvk)
+            addSaplingNotes(entry.second);
+    }
+    std::sort(sproutNotes.begin(), sproutNotes.end());
+    sproutNotes.erase(std::unique(sproutNotes.begin(), sproutNotes.end()), sproutNotes.end());
+    auto outPointLess = [](const auto& a, const auto& b) { return a.first < b.first; };
+    auto outPointEqual = [](const auto& a, const auto& b) { return a.first == b.first; };
+    std::sort(saplingNotes.begin(), saplingNotes.end(), outPointLess);
+    saplingNotes.erase(std::unique(saplingNotes.begin(), saplingNotes.end(), outPointEqual), saplingNotes.end());
+
+    // Filter the transactions before checking for notes
+    auto checkDepth = [&](const CWalletTx& wtx, int& nDepth) {
+        if (!CheckFinalTx(wtx))
+            return false;
+        nDepth = wtx.GetDepthInMainChain();
+        return nDepth >= minDepth && nDepth <= maxDepth;
+    };
+
     KeyIO keyIO(Params());
-    for (auto & p : mapWallet) {
-        CWalletTx wtx = p.second;
+    for (const JSOutPoint& jsop : sproutNotes) {
+        const CWalletTx& wtx = mapWallet.at(jsop.hash);
+        const SproutNoteData& nd = wtx.mapSproutNoteData.at(jsop);
+        SproutPaymentAddress pa = nd.address;
 
-        // Filter the transactions before checking for notes
-        if (!CheckFinalTx(wtx) ||
-            wtx.GetDepthInMainChain() < minDepth ||
-            wtx.GetDepthInMainChain() > maxDepth) {
+        int nDepth;
+        if (!checkDepth(wtx, nDepth)) {
             continue;
         }
 
-        // Filter coinbase transactions that don't have Sapling outputs
-        if (wtx.IsCoinBase() && wtx.mapSaplingNoteData.empty()) {
+        // skip note which has been spent
+        if (ignoreSpent && nd.nullifier && IsSproutSpent(*nd.nullifier)) {
             continue;
         }
 
-        for (auto & pair : wtx.mapSproutNoteData) {
-            JSOutPoint jsop = pair.first;
-            SproutNoteData nd = pair.second;
-            SproutPaymentAddress pa = nd.address;
+        // skip notes which cannot be spent
+        if (requireSpendingKey && !HaveSproutSpendingKey(pa)) {
+            continue;
+        }
 
-            // skip notes which belong to a different payment address in the wallet
-            if (!(filterAddresses.empty() || filterAddresses.count(pa))) {
-                continue;
-            }
+        // skip locked notes
+        if (ignoreLocked && IsLockedNote(jsop)) {
+            continue;
+        }
 
-            // skip note which has been spent
-            if (ignoreSpent && nd.nullifier && IsSproutSpent(*nd.nullifier)) {
-                continue;
-            }
+        int i = jsop.js; // Index into CTransaction.vJoinSplit
+        int j = jsop.n; // Index into JSDescription.ciphertexts
 
-            // skip notes which cannot be spent
-            if (requireSpendingKey && !HaveSproutSpendingKey(pa)) {
-                continue;
-            }
+        // Get cached decryptor
+        ZCNoteDecryption decryptor;
+        if (!GetNoteDecryptor(pa, decryptor)) {
+            // Note decryptors are created when the wallet is loaded, so it should always exist
+            throw std::runtime_error(strprintf("Could not find note decryptor for payment address %s", keyIO.EncodePaymentAddress(pa)));
+        }
 
-            // skip locked notes
-            if (ignoreLocked && IsLockedNote(jsop)) {
-                continue;
-            }
+        // determine amount of funds in the note
+        auto hSig = ZCJoinSplit::h_sig(
+            wtx.vJoinSplit[i].randomSeed,
+            wtx.vJoinSplit[i].nullifiers,
+            wtx.joinSplitPubKey);
+        try {
+            SproutNotePlaintext plaintext = SproutNotePlaintext::decrypt(
+                    decryptor,
+                    wtx.vJoinSplit[i].ciphertexts[j],
+                    wtx.vJoinSplit[i].ephemeralKey,
+                    hSig,
+                    (unsigned char) j);
 
-            int i = jsop.js; // Index into CTransaction.vJoinSplit
-            int j = jsop.n; // Index into JSDescription.ciphertexts
+            sproutEntries.push_back(SproutNoteEntry {
+                jsop, pa, plaintext.note(pa), plaintext.memo(), nDepth });
 
-            // Get cached decryptor
-            ZCNoteDecryption decryptor;
-            if (!GetNoteDecryptor(pa, decryptor)) {
-                // Note decryptors are created when the wallet is loaded, so it should always exist
-                throw std::runtime_error(strprintf("Could not find note decryptor for payment address %s", keyIO.EncodePaymentAddress(pa)));
-            }
+        } catch (const note_decryption_failed &err) {
+            // Couldn't decrypt with this spending key
+            throw std::runtime_error(strprintf("Could not decrypt note for payment address %s", keyIO.EncodePaymentAddress(pa)));
+        } catch (const std::exception &exc) {
+            // Unexpected failure
+            throw std::runtime_error(strprintf("Error while decrypting note for payment address %s: %s", keyIO.EncodePaymentAddress(pa), exc.what()));
+        }
+    }
 
-            // determine amount of funds in the note
-            auto hSig = ZCJoinSplit::h_sig(
-                wtx.vJoinSplit[i].randomSeed,
-                wtx.vJoinSplit[i].nullifiers,
-                wtx.joinSplitPubKey);
-            try {
-                SproutNotePlaintext plaintext = SproutNotePlaintext::decrypt(
-                        decryptor,
-                        wtx.vJoinSplit[i].ciphertexts[j],
-                        wtx.vJoinSplit[i].ephemeralKey,
-                        hSig,
-                        (unsigned char) j);
-
-                sproutEntries.push_back(SproutNoteEntry {
-                    jsop, pa, plaintext.note(pa), plaintext.memo(), wtx.GetDepthInMainChain() });
-
-            } catch (const note_decryption_failed &err) {
-                // Couldn't decrypt with this spending key
-                throw std::runtime_error(strprintf("Could not decrypt note for payment address %s", keyIO.EncodePaymentAddress(pa)));
-            } catch (const std::exception &exc) {
-                // Unexpected failure
-                throw std::runtime_error(strprintf("Error while decrypting note for payment address %s: %s", keyIO.EncodePaymentAddress(pa), exc.what()));
-            }
+    for (const auto& [op, pAddress] : saplingNotes) {
+        const CWalletTx& wtx = mapWallet.at(op.hash);
+        const SaplingNoteData& nd = wtx.mapSaplingNoteData.at(op);
+
+        int nDepth;
+        if (!checkDepth(wtx, nDepth)) {
+            continue;
         }
 
-        for (auto & pair : wtx.mapSaplingNoteData) {
-            SaplingOutPoint op = pair.first;
-            SaplingNoteData nd = pair.second;
+        // skip note which has been spent
+        if (ignoreSpent && nd.nullifier && IsSaplingSpent(*nd.nullifier)) {
+            continue;
+        }
 
-            auto optDeserialized = SaplingNotePlaintext::attempt_sapling_enc_decryption_deserialization(wtx.vShieldedOutput[op.n].encCiphertext, nd.ivk, wtx.vShieldedOutput[op.n].ephemeralKey);
+        // skip locked notes
+        if (ignoreLocked && IsLockedNote(op)) {
+            continue;
+        }
+
+        std::optional<SaplingNotePlaintext> optNotePt;
+        auto decryptNote = [&]() {
+            optNotePt = SaplingNotePlaintext::attempt_sapling_enc_decryption_deserialization(wtx.vShieldedOutput[op.n].encCiphertext, nd.ivk, wtx.vShieldedOutput[op.n].ephemeralKey);
 
             // The transaction would not have entered the wallet unless
             // its plaintext had been successfully decrypted previously.
-            assert(optDeserialized != std::nullopt);
+            assert(optNotePt != std::nullopt);
+        };
 
-            auto notePt = optDeserialized.value();
-            auto maybe_pa = nd.ivk.address(notePt.d);
+        // The address of a note is only decrypted once, then kept in the index
+        if (!*pAddress) {
+            decryptNote();
+            auto maybe_pa = nd.ivk.address(optNotePt->d);
             assert(static_cast<bool>(maybe_pa));
-            auto pa = maybe_pa.value();
-
-            // skip notes which belong to a different payment address in the wallet
-            if (!(filterAddresses.empty() || filterAddresses.count(pa))) {
-                continue;
-            }
-
-            if (ignoreSpent && nd.nullifier && IsSaplingSpent(*nd.nullifier)) {
-                continue;
-            }
+            *pAddress = maybe_pa.value();
+        }
+        const SaplingPaymentAddress& pa = pAddress->value();
 
-            // skip notes which cannot be spent
-            if (requireSpendingKey && !HaveSpendingKeyForPaymentAddress(this)(pa)) {
-                continue;
-            }
+        // skip notes which belong to a different payment address in the wallet
+        if (!(filterAddresses.empty() || saplingFilter.count(pa))) {
+            continue;
+        }
 
-            // skip locked notes
-            if (ignoreLocked && IsLockedNote(op)) {
-                continue;
-            }
+        // skip notes which cannot be spent
+        if (requireSpendingKey && !HaveSpendingKeyForPaymentAddress(this)(pa)) {
+            continue;
+        }
 
-            auto note = notePt.note(nd.ivk).value();
-            saplingEntries.push_back(SaplingNoteEntry {
-                op, pa, note, notePt.memo(), wtx.GetDepthInMainChain() });
+        if (!optNotePt) {
+            decryptNote();
         }
+        auto note = optNotePt->note(nd.ivk).value();
+        saplingEntries.push_back(SaplingNoteEntry {
+            op, pa, note, optNotePt->memo(), nDepth });
     }
 }
 
@@ -28,6 +28,7 @@
 #include "base58.h"
 
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <optional>
 #include <set>
@@ -55,6 +56,7 @@ extern int nDeleteInterval;
 extern unsigned int nDeleteTransactionsAfterNBlocks;
 extern unsigned int nKeepLastNTransactions;
 extern bool fIgnoreExTx;
+extern int nWalletDecryptThreads;
 
 static const unsigned int DEFAULT_KEYPOOL_SIZE = 100;
 //! -paytxfee default
@@ -94,8 +96,23 @@ static const unsigned int DEFAULT_TX_RETENTION_LASTTX = 200;
 //Amount of transactions to delete per run while syncing
 static const int MAX_DELETE_TX_SIZE = 50000;
 
+//! Number of blocks the rescan reader takes from the active chain per cs_main window
+static const size_t RESCAN_SNAPSHOT_BLOCKS = 100;
+//! Number of blocks queued between the stages of a rescan
+static const size_t RESCAN_QUEUE_BLOCKS = 32;
+//! Time a rescan applies blocks for before releasing cs_main and cs_wallet
+static const int64_t RESCAN_LOCK_WINDOW_MS = 100;
+
+//! -walletdecryptthreads default (number of Sapling trial decryption threads, 0 = auto)
+static const int DEFAULT_WALLET_DECRYPT_THREADS = 0;
+//! Maximum number of Sapling trial decryption threads allowed
+static const int MAX_WALLET_DECRYPT_THREADS = 16;
+
 extern const char * DEFAULT_WALLET_DAT;
 
+/** Run an instance of the Sapling trial decryption thread */
+void ThreadSaplingTrialDecryption();
+
 class CBlockIndex;
 class CCoinControl;
 class COutput;
@@ -103,6 +120,7 @@ class CReserveKey;
 class CScript;
 class CTxMemPool;
 class CWalletTx;
+class WalletRescanReserver;
 
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
@@ -253,7 +271,9 @@ public:
 
     /**
      * Cached incremental witnesses for spendable Notes.
-     * Beginning of the list is the most recent witness.
+     * Beginning of the list is the most recent witness. Only that one is
+     * kept: on a reorg it is rewound to the commitment tree of the previous
+     * block, which is shared with the chainstate.
      */
     std::list<SproutWitness> witnesses;
 
@@ -345,6 +365,8 @@ public:
 
 typedef std::map<JSOutPoint, SproutNoteData> mapSproutNoteData_t;
 typedef std::map<SaplingOutPoint, SaplingNoteData> mapSaplingNoteData_t;
+/** Sapling trial decryption results of the transactions of a block that have notes for this wallet, by txid. */
+typedef std::map<uint256, std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> SaplingBlockNotes;
 
 /** Sprout note, its location in a transaction, and number of confirmations. */
 struct SproutNoteEntry
@@ -465,6 +487,10 @@ public:
     mutable CAmount nImmatureWatchCreditCached;
     mutable CAmount nAvailableWatchCreditCached;
     mutable CAmount nChangeCached;
+    //! Note data changed since the transaction was last written.
+    bool fNoteDataDirty;
+    //! Nullifiers or witnesses of notes changed since they were last written.
+    bool fWitnessesDirty;
 
     CWalletTx()
     {
@@ -516,6 +542,8 @@ public:
         nAvailableWatchCreditCached = 0;
         nImmatureWatchCreditCached = 0;
         nChangeCached = 0;
+        fNoteDataDirty = false;
+        fWitnessesDirty = false;
         nOrderPos = -1;
     }
 
@@ -587,6 +615,18 @@ public:
         MarkDirty();
     }
 
+    //! make sure CWallet::SetBestChain writes the transaction
+    void MarkNoteDataDirty()
+    {
+        fNoteDataDirty = true;
+    }
+
+    //! make sure CWallet::SetBestChain writes the nullifiers and witnesses of the notes
+    void MarkWitnessesDirty()
+    {
+        fWitnessesDirty = true;
+    }
+
     void SetSproutNoteData(mapSproutNoteData_t &noteData);
     void SetSaplingNoteData(mapSaplingNoteData_t &noteData);
 
@@ -636,6 +676,57 @@ public:
     std::set<uint256> GetConflicts() const;
 };
 
+/**
+ * The part of the note data of a wallet transaction that changes as blocks
+ * are connected and disconnected: the nullifiers, witnesses and witness
+ * heights of its notes. CWallet::SetBestChain writes only this record for
+ * transactions whose notes changed in no other way, rather than the whole
+ * transaction. Database key is witnesses<txid>.
+ *
+ * The record is applied over the transaction when the wallet is loaded, and
+ * erased whenever the whole transaction is written.
+ */
+class CWalletTxWitnesses
+{
+public:
+    template <typename Witness>
+    struct NoteState
+    {
+        std::optional<uint256> nullifier;
+        std::list<Witness> witnesses;
+        int witnessHeight;
+
+        NoteState() : witnessHeight {-1} { }
+
+        ADD_SERIALIZE_METHODS;
+
+        template <typename Stream, typename Operation>
+        inline void SerializationOp(Stream& s, Operation ser_action) {
+            READWRITE(nullifier);
+            READWRITE(witnesses);
+            READWRITE(witnessHeight);
+        }
+    };
+
+    std::map<JSOutPoint, NoteState<SproutWitness>> mapSprout;
+    std::map<SaplingOutPoint, NoteState<SaplingWitness>> mapSapling;
+
+    CWalletTxWitnesses() { }
+    explicit CWalletTxWitnesses(const CWalletTx& wtx);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        int nVersion = s.GetVersion();
+        if (!(s.GetType() & SER_GETHASH)) {
+            READWRITE(nVersion);
+        }
+        READWRITE(mapSprout);
+        READWRITE(mapSapling);
+    }
+};
+
 
 
 
@@ -820,6 +911,18 @@ private:
     std::vector<CTransaction> pendingSaplingConsolidationTxs;
     AsyncRPCOperationId saplingConsolidationOperationId;
 
+    /**
+     * Sapling trial decryption results for the transactions of the block
+     * most recently passed to AddToWalletIfInvolvingMe, keyed by the hash of
+     * that block, so that the whole block is decrypted at once.
+     */
+    uint256 hashSaplingDecryptedBlock;
+    SaplingBlockNotes mapSaplingDecryptedBlock;
+    //! Incremented whenever a Sapling key is added, to invalidate decryption results computed earlier
+    std::atomic<uint64_t> nSaplingKeyGeneration{0};
+
+    std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotesInBlock(const CTransaction& tx, const CBlock& block, int height);
+
     void AddToTransparentSpends(const COutPoint& outpoint, const uint256& wtxid);
     void AddToSproutSpends(const uint256& nullifier, const uint256& wtxid);
     void AddToSaplingSpends(const uint256& nullifier, const uint256& wtxid);
@@ -868,26 +971,39 @@ protected:
 
     template <typename WalletDB>
     void SetBestChainINTERNAL(WalletDB& walletdb, const CBlockLocator& loc) {
+        // Held until the commit, so that no transaction is marked dirty
+        // between being written and being marked clean.
+        LOCK(cs_wallet);
         if (!walletdb.TxnBegin()) {
             // This needs to be done atomically, so don't do it at all
             LogPrintf("SetBestChain(): Couldn't start atomic write\n");
             return;
         }
+        std::vector<CWalletTx*> vWritten;
         try {
-            LOCK(cs_wallet);
             for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                auto wtx = wtxItem.second;
+                CWalletTx& wtx = wtxItem.second;
+
+                // Only the transactions whose note data changed since they
+                // were last written are written again.
+                if (!wtx.fNoteDataDirty && !wtx.fWitnessesDirty) {
+                    continue;
+                }
 
                 // We skip transactions for which mapSproutNoteData and mapSaplingNoteData
                 // are empty. This covers transactions that have no Sprout or Sapling data
                 // (i.e. are purely transparent), as well as shielding and unshielding
                 // transactions in which we only have transparent addresses involved.
                 if (!(wtx.mapSproutNoteData.empty() && wtx.mapSaplingNoteData.empty())) {
-                    if (!walletdb.WriteTx(wtx)) {
+                    // If only the nullifiers and witnesses changed, the
+                    // much smaller CWalletTxWitnesses record is enough.
+                    bool fWritten = wtx.fNoteDataDirty ? walletdb.WriteTx(wtx) : walletdb.WriteTxWitnesses(wtx);
+                    if (!fWritten) {
                         LogPrintf("SetBestChain(): Failed to write CWalletTx, aborting atomic write\n");
                         walletdb.TxnAbort();
                         return;
                     }
+                    vWritten.push_back(&wtx);
                 }
             }
             if (!walletdb.WriteWitnessCacheSize(nWitnessCacheSize)) {
@@ -912,6 +1028,10 @@ protected:
             LogPrintf("SetBestChain(): Couldn't commit atomic write\n");
             return;
         }
+        for (CWalletTx* pwtx : vWritten) {
+            pwtx->fNoteDataDirty = false;
+            pwtx->fWitnessesDirty = false;
+        }
     }
 
 private:
@@ -941,6 +1061,10 @@ public:
     */
     mutable CCriticalSection cs_rescan;
     std::optional<float> dRescanProgress = std::nullopt;
+    //! Estimated number of seconds until the rescan in progress completes
+    std::optional<int64_t> nRescanSecondsLeft = std::nullopt;
+    //! Set while a rescan is reserved, see WalletRescanReserver
+    std::atomic<bool> fScanningWallet{false};
 
     bool fFileBacked;
     std::string strWalletFile;
@@ -1052,6 +1176,20 @@ public:
     void AddToSifted(const uint256& wtxid);
     void RemoveFromSifted(const uint256& wtxid);
 
+    /**
+     * The wallet's notes by Sprout payment address and by Sapling incoming
+     * viewing key, so that GetFilteredNotes only visits the notes it may
+     * return instead of every transaction in the wallet. Sapling notes are
+     * indexed by ivk because the diversified address of a note is only known
+     * once it is decrypted; GetFilteredNotes stores it next to the note the
+     * first time it does so. Maintained alongside the sifted sets; call
+     * RemoveFromNoteIndex before erasing a transaction from mapWallet.
+     */
+    std::map<libzcash::SproutPaymentAddress, std::set<JSOutPoint>> mapSproutNotesByAddress;
+    std::map<libzcash::SaplingIncomingViewingKey, std::map<SaplingOutPoint, std::optional<libzcash::SaplingPaymentAddress>>> mapSaplingNotesByIvk;
+    void AddToNoteIndex(const uint256& wtxid);
+    void RemoveFromNoteIndex(const uint256& wtxid);
+
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -1142,6 +1280,8 @@ public:
     bool EraseDestData(const CTxDestination &dest, const std::string &key);
     //! Adds a destination data tuple to the store, without saving it to disk
     bool LoadDestData(const CTxDestination &dest, const std::string &key, const std::string &value);
+    //! Applies a witnesses record to the transaction it belongs to (used by LoadWallet)
+    bool LoadTxWitnesses(const uint256& hash, const CWalletTxWitnesses& witnesses);
     //! Look up a destination data tuple in the store, return true if found false otherwise
     bool GetDestData(const CTxDestination &dest, const std::string &key, std::string *value) const;
 
@@ -1251,7 +1391,7 @@ public:
     void UpdateWalletTransactionOrder(std::map<std::pair<int,int>, const uint256> &mapSorted, bool resetOrder);
     unsigned int DeleteTransactions(std::vector<uint256> &removeTxs, std::vector<uint256> &removeExpiredTxs);
     void DeleteWalletTransactions(const CBlockIndex* pindex);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, bool fIgnoreBirthday = false);
+    int ScanForWalletTransactions(const WalletRescanReserver& reserver, CBlockIndex* pindexStart, bool fUpdate = false, bool fIgnoreBirthday = false);
     void ReacceptWalletTransactions();
     void CheckWalletSanity(const std::string &tag);
     void ResendWalletTransactions(int64_t nBestBlockTime);
@@ -1313,6 +1453,9 @@ public:
     mapSproutNoteData_t FindMySproutNotes(const CTransaction& tx) const;
     std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotes(const CTransaction& tx, int height) const;
     std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotesAsync(const CTransaction& tx, int height) const;
+    std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> FindMySaplingNotesBatch(const std::vector<const CTransaction*>& vtx, int height) const;
+    SaplingBlockNotes FindMySaplingNotesForBlock(const CBlock& block, int height) const;
+    uint64_t GetSaplingKeyGeneration() const { return nSaplingKeyGeneration; }
     bool IsSproutNullifierFromMe(const uint256& nullifier) const;
     bool IsSaplingNullifierFromMe(const uint256& nullifier) const;
 
@@ -1483,6 +1626,36 @@ public:
     static bool ParameterInteraction();
 };
 
+/**
+ * Reserves the wallet for a rescan, so that only one rescan runs at a time.
+ * The reservation is released when the reserver goes out of scope.
+ */
+class WalletRescanReserver
+{
+private:
+    CWallet* pwallet;
+    bool fReserved;
+public:
+    explicit WalletRescanReserver(CWallet* pwalletIn) : pwallet(pwalletIn), fReserved(false) {}
+
+    ~WalletRescanReserver()
+    {
+        if (fReserved)
+            pwallet->fScanningWallet = false;
+    }
+
+    /** Returns false if another rescan holds the reservation. */
+    bool reserve()
+    {
+        assert(!fReserved);
+        bool fExpected = false;
+        fReserved = pwallet->fScanningWallet.compare_exchange_strong(fExpected, true);
+        return fReserved;
+    }
+
+    bool isReserved() const { return fReserved; }
+};
+
 /** A key allocated from the key pool. */
 class CReserveKey : public CReserveScript
 {
@@ -93,12 +93,24 @@ bool CWalletDB::EraseExTx(uint256 hash)
 bool CWalletDB::WriteTx(const CWalletTx& wtx)
 {
     nWalletDBUpdateCounter++;
+    // The transaction carries its own witnesses, so any older witnesses
+    // record would overwrite them when the wallet is loaded.
+    if (!Erase(std::make_pair(std::string("witnesses"), wtx.GetHash())))
+        return false;
     return Write(std::make_pair(std::string("tx"), wtx.GetHash()), wtx);
 }
 
+bool CWalletDB::WriteTxWitnesses(const CWalletTx& wtx)
+{
+    nWalletDBUpdateCounter++;
+    return Write(std::make_pair(std::string("witnesses"), wtx.GetHash()), CWalletTxWitnesses(wtx));
+}
+
 bool CWalletDB::EraseTx(uint256 hash)
 {
     nWalletDBUpdateCounter++;
+    if (!Erase(std::make_pair(std::string("witnesses"), hash)))
+        return false;
     return Erase(std::make_pair(std::string("tx"), hash));
 }
 
@@ -479,6 +491,7 @@ public:
     bool fAnyUnordered;
     int nFileVersion;
     vector<uint256> vWalletUpgrade;
+    vector<pair<uint256, CWalletTxWitnesses>> vTxWitnesses;
 
     CWalletScanState() {
         nKeys = nCKeys = nKeyMeta = nZKeys = nCZKeys = nZKeyMeta = nSapZAddrs = 0;
@@ -547,8 +560,28 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
 
+            // Only the latest witness of each note is kept; older wallets
+            // stored one for each block that could be reorganized.
+            for (auto& item : wtx.mapSproutNoteData) {
+                if (item.second.witnesses.size() > 1)
+                    item.second.witnesses.resize(1);
+            }
+            for (auto& item : wtx.mapSaplingNoteData) {
+                if (item.second.witnesses.size() > 1)
+                    item.second.witnesses.resize(1);
+            }
+
             pwallet->AddToWallet(wtx, true, NULL);
         }
+        else if (strType == "witnesses")
+        {
+            // Applied once all of the transactions have been loaded
+            uint256 hash;
+            ssKey >> hash;
+            CWalletTxWitnesses witnesses;
+            ssValue >> witnesses;
+            wss.vTxWitnesses.emplace_back(hash, witnesses);
+        }
         else if (strType == "extx")
         {
             uint256 hash;
@@ -1011,6 +1044,11 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         result = DB_CORRUPT;
     }
 
+    for (const auto& [hash, witnesses] : wss.vTxWitnesses) {
+        if (!pwallet->LoadTxWitnesses(hash, witnesses))
+            LogPrintf("LoadWallet(): witnesses record for unknown transaction %s\n", hash.ToString());
+    }
+
     if (fNoncriticalErrors && result == DB_LOAD_OK)
         result = DB_NONCRITICAL_ERROR;
 
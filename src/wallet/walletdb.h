@@ -143,6 +143,7 @@ public:
     bool EraseExTx(uint256 hash);
 
     bool WriteTx(const CWalletTx& wtx);
+    bool WriteTxWitnesses(const CWalletTx& wtx);
     bool EraseTx(uint256 hash);
 
     bool WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata &keyMeta);
@@ -1,3 +1,4 @@
+#include <limits>
 #include <stdexcept>
 
 
@@ -1011,6 +1012,31 @@ size_t IncrementalMerkleTree<Depth, Hash>::next_depth(size_t skip) const {
     return d + skip;
 }
 
+// This finds the root of the complete subtree of the given depth that ends
+// with the last leaf. Its left subtrees have not been collapsed any further
+// than `parents[depth - 2]` yet, so it can be read off the tree.
+template<size_t Depth, typename Hash>
+Hash IncrementalMerkleTree<Depth, Hash>::last_subtree_root(size_t depth) const {
+    if (depth == 0) {
+        return last();
+    }
+
+    if (!left || !right || parents.size() < depth - 1) {
+        throw std::runtime_error("last subtree is not complete");
+    }
+
+    Hash root = Hash::combine(*left, *right, 0);
+
+    for (size_t d = 1; d < depth; d++) {
+        if (!parents[d-1]) {
+            throw std::runtime_error("last subtree is not complete");
+        }
+        root = Hash::combine(*parents[d-1], root, d);
+    }
+
+    return root;
+}
+
 // This calculates the root of the tree.
 template<size_t Depth, typename Hash>
 Hash IncrementalMerkleTree<Depth, Hash>::root(size_t depth,
@@ -1135,6 +1161,79 @@ void IncrementalWitness<Depth, Hash>::append(Hash obj) {
     }
 }
 
+// The uncle at depth d is the subtree of 2^d leaves next to the subtree of
+// the witnessed commitment; it starts at the position of that commitment
+// rounded up to the next multiple of 2^d.
+template<size_t Depth, typename Hash>
+uint64_t IncrementalWitness<Depth, Hash>::next_filled_size() const {
+    size_t depth = tree.next_depth(filled.size());
+
+    if (depth >= Depth) {
+        // Every uncle has been filled
+        return std::numeric_limits<uint64_t>::max();
+    }
+
+    uint64_t start = ((position() >> depth) + 1) << depth;
+    return start + (uint64_t(1) << depth);
+}
+
+template<size_t Depth, typename Hash>
+void IncrementalWitness<Depth, Hash>::fill(const IncrementalMerkleTree<Depth, Hash>& frontier) {
+    cursor_depth = tree.next_depth(filled.size());
+
+    if (cursor_depth >= Depth) {
+        throw std::runtime_error("tree is full");
+    }
+
+    filled.push_back(frontier.last_subtree_root(cursor_depth));
+    cursor = std::nullopt;
+}
+
+template<size_t Depth, typename Hash>
+void IncrementalWitness<Depth, Hash>::sync_to(const IncrementalMerkleTree<Depth, Hash>& frontier) {
+    uint64_t size = frontier.size();
+    uint64_t pos = position();
+
+    if (size <= pos) {
+        throw std::runtime_error("frontier does not contain the witnessed commitment");
+    }
+
+    // Count the uncles that are complete in the frontier
+    size_t nfilled = 0;
+    size_t depth;
+    uint64_t start = 0;
+    while ((depth = tree.next_depth(nfilled)) < Depth) {
+        start = ((pos >> depth) + 1) << depth;
+        if (start + (uint64_t(1) << depth) > size) {
+            break;
+        }
+        nfilled++;
+    }
+
+    if (nfilled > filled.size()) {
+        throw std::runtime_error("witness is missing uncles of the frontier");
+    }
+    filled.resize(nfilled);
+
+    // The leaves of the next uncle seen so far are the last ones of the
+    // frontier. As the uncle starts at a multiple of 2^depth, the frontier
+    // holds them the way the cursor would: in its leaves and in the parents
+    // below the uncle, which end at the last one that is set.
+    cursor = std::nullopt;
+    cursor_depth = depth;
+    if (depth < Depth && size > start) {
+        IncrementalMerkleTree<Depth, Hash> partial;
+        partial.left = frontier.left;
+        partial.right = frontier.right;
+        size_t nparents = std::min(frontier.parents.size(), depth - 1);
+        partial.parents.assign(frontier.parents.begin(), frontier.parents.begin() + nparents);
+        while (!partial.parents.empty() && !partial.parents.back()) {
+            partial.parents.pop_back();
+        }
+        cursor = partial;
+    }
+}
+
 template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH, SHA256Compress>;
 template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, SHA256Compress>;
 
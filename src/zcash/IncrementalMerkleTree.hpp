@@ -134,6 +134,7 @@ private:
     Hash root(size_t depth, std::deque<Hash> filler_hashes = std::deque<Hash>()) const;
     bool is_complete(size_t depth = Depth) const;
     size_t next_depth(size_t skip) const;
+    Hash last_subtree_root(size_t depth) const;
     void wfcheck() const;
 };
 
@@ -174,6 +175,20 @@ public:
 
     void append(Hash obj);
 
+    // The size of the commitment tree once the next uncle of the
+    // witnessed commitment is complete.
+    uint64_t next_filled_size() const;
+
+    // Fills the next uncle from `frontier`, the commitment tree when
+    // it has reached next_filled_size().
+    void fill(const IncrementalMerkleTree<Depth, Hash>& frontier);
+
+    // Moves the witness to the commitment tree `frontier`, which must
+    // contain the witnessed commitment, and takes the partially filled
+    // uncle from it. Uncles that are not complete in `frontier` are
+    // dropped, so this also rewinds the witness to an earlier tree.
+    void sync_to(const IncrementalMerkleTree<Depth, Hash>& frontier);
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
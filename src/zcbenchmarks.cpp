@@ -460,11 +460,25 @@ double benchmark_increment_sapling_note_witnesses(size_t nTxs)
 
 // Fake the input of a given block
 // This class is based on the class CCoinsViewDB, but with limited functionality.
-// The constructor and the functions `GetCoins` and `HaveCoins` come directly from
+// The constructor and the functions `GetCoin` and `HaveCoin` come directly from
 // CCoinsViewDB, but the rest are either mocks and/or don't really do anything.
+// The input database must use the per-output chainstate format.
 
-// The following constant is a duplicate of the one found in txdb.cpp
-static const char DB_COINS = 'c';
+// The following constant and key type are duplicates of the ones found in txdb.cpp
+static const char DB_COIN = 'C';
+
+struct FakeCoinEntry {
+    COutPoint* outpoint;
+    char key;
+    FakeCoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+};
 
 class FakeCoinsViewDB : public CCoinsView {
 
@@ -497,12 +511,12 @@ public:
         return false;
     }
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
-        return db.Read(std::make_pair(DB_COINS, txid), coins);
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
+        return db.Read(FakeCoinEntry(&outpoint), coin);
     }
 
-    bool HaveCoins(const uint256 &txid) const {
-        return db.Exists(std::make_pair(DB_COINS, txid));
+    bool HaveCoin(const COutPoint &outpoint) const {
+        return db.Exists(FakeCoinEntry(&outpoint));
     }
 
     uint256 GetBestBlock() const {